@@ -7,6 +7,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <sys/io.h>
+#endif
+
+// mini-kvm hypercall port and the "clone point" request (see --clone)
+#define MINI_KVM_HC_PORT 0x500
+#define MINI_KVM_HC_CLONE_POINT 0x10
 
 static void write_all(int fd, const char *s)
 {
@@ -47,6 +54,17 @@ static void mount_early_fs(void)
     (void)mount("sysfs", "/sys", "sysfs", 0, "");
 }
 
+static void signal_clone_point(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // Harmless on other hypervisors: nothing listens on this port.
+    if (ioperm(MINI_KVM_HC_PORT, 1, 1) == 0) {
+        outb(MINI_KVM_HC_CLONE_POINT, MINI_KVM_HC_PORT);
+        (void)ioperm(MINI_KVM_HC_PORT, 1, 0);
+    }
+#endif
+}
+
 static void setup_console_stdio(void)
 {
     int fd = open("/dev/console", O_RDWR);
@@ -74,6 +92,7 @@ int main(int argc, char **argv)
     setenv("PATH", "/bin:/usr/bin:/usr/local/bin", 1);
 
     log_console("\n[mini-kvm] userspace init started\n");
+    signal_clone_point();
     log_console("[mini-kvm] starting /bin/sh -i (type 'exit' to respawn)\n\n");
 
     for (;;)
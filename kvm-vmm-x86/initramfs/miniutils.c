@@ -2,12 +2,20 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
 #include <sys/reboot.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 
 static int cmd_uname(int argc, char **argv)
@@ -110,6 +118,178 @@ static int cmd_halt(int argc, char **argv)
     return 0;
 }
 
+// netbench: UDP echo benchmark between a guest and the host (tools/net-bench.sh)
+#define NETBENCH_PAYLOAD 1400
+#define NETBENCH_WINDOW  32
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Give ifname address/24 and bring it up
+static int if_up(const char *ifname, const char *address)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct ifreq ifr;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ifr.ifr_addr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    sin->sin_family = AF_INET;
+    if (fd < 0 || inet_pton(AF_INET, address, &sin->sin_addr) != 1 || ioctl(fd, SIOCSIFADDR, &ifr) < 0) {
+        perror("netbench: address");
+        return -1;
+    }
+    inet_pton(AF_INET, "255.255.255.0", &sin->sin_addr);
+    if (ioctl(fd, SIOCSIFNETMASK, &ifr) < 0 || ioctl(fd, SIOCGIFFLAGS, &ifr) < 0) {
+        perror("netbench: netmask");
+        return -1;
+    }
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) {
+        perror("netbench: up");
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int udp_socket(const char *host, int port, struct sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)port);
+    if (fd < 0 || inet_pton(AF_INET, host, &addr->sin_addr) != 1) {
+        perror("netbench: socket");
+        return -1;
+    }
+    return fd;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int netbench_serve(const char *address, int port)
+{
+    struct sockaddr_in addr, peer;
+    char buf[2048];
+
+    if (if_up("eth0", address) < 0) {
+        return 1;
+    }
+    int fd = udp_socket("0.0.0.0", port, &addr);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("netbench: bind");
+        return 1;
+    }
+    printf("netbench: echoing on %s:%d\n", address, port);
+    fflush(stdout);
+    for (;;) {
+        socklen_t len = sizeof(peer);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&peer, &len);
+        if (n > 0) {
+            (void)sendto(fd, buf, (size_t)n, 0, (struct sockaddr *)&peer, len);
+        }
+    }
+}
+
+// Round-trip latency of one 64-byte datagram at a time
+static int netbench_ping(const char *host, int port, int count)
+{
+    struct sockaddr_in addr;
+    struct timeval tv = { .tv_sec = 1 };
+    char buf[64] = "netbench";
+    double *rtt = calloc((size_t)count, sizeof(double));
+    int done = 0;
+
+    int fd = udp_socket(host, port, &addr);
+    if (fd < 0 || !rtt) {
+        return 1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    for (int i = 0; i < count; i++) {
+        double start = now_us();
+        if (sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            recv(fd, buf, sizeof(buf), 0) < 0) {
+            continue;
+        }
+        rtt[done++] = now_us() - start;
+    }
+    if (done == 0) {
+        fprintf(stderr, "netbench: no replies from %s:%d\n", host, port);
+        return 1;
+    }
+    qsort(rtt, (size_t)done, sizeof(double), cmp_double);
+    double sum = 0;
+    for (int i = 0; i < done; i++) {
+        sum += rtt[i];
+    }
+    printf("latency: %d/%d replies, avg %.1f us, p50 %.1f us, p99 %.1f us\n", done, count, sum / done,
+           rtt[done / 2], rtt[(done * 99) / 100]);
+    free(rtt);
+    return 0;
+}
+
+// Echo throughput with a window of datagrams in flight
+static int netbench_stream(const char *host, int port, int seconds)
+{
+    struct sockaddr_in addr;
+    struct timeval tv = { .tv_usec = 100000 };
+    char buf[NETBENCH_PAYLOAD];
+    long received = 0;
+    int inflight = 0;
+
+    int fd = udp_socket(host, port, &addr);
+    if (fd < 0) {
+        return 1;
+    }
+    memset(buf, 'x', sizeof(buf));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    double start = now_us();
+    double end = start + seconds * 1e6;
+    while (now_us() < end) {
+        while (inflight < NETBENCH_WINDOW) {
+            if (sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                break;
+            }
+            inflight++;
+        }
+        if (recv(fd, buf, sizeof(buf), 0) > 0) {
+            received++;
+            inflight--;
+        } else {
+            inflight = 0; // Assume the window was lost
+        }
+    }
+    double secs = (now_us() - start) / 1e6;
+    printf("throughput: %.0f datagrams/s, %.1f Mbit/s echoed (%d-byte payloads)\n", received / secs,
+           received * NETBENCH_PAYLOAD * 8 / secs / 1e6, NETBENCH_PAYLOAD);
+    return 0;
+}
+
+static int cmd_netbench(int argc, char **argv)
+{
+    if (argc == 4 && strcmp(argv[1], "serve") == 0) {
+        return netbench_serve(argv[2], atoi(argv[3]));
+    }
+    if (argc == 5 && strcmp(argv[1], "ping") == 0) {
+        return netbench_ping(argv[2], atoi(argv[3]), atoi(argv[4]));
+    }
+    if (argc == 5 && strcmp(argv[1], "stream") == 0) {
+        return netbench_stream(argv[2], atoi(argv[3]), atoi(argv[4]));
+    }
+    fprintf(stderr, "usage: netbench serve ADDR PORT | ping HOST PORT COUNT | stream HOST PORT SECONDS\n");
+    return 1;
+}
+
 int main(int argc, char **argv)
 {
     const char *name = strrchr(argv[0], '/');
@@ -127,6 +307,9 @@ int main(int argc, char **argv)
     if (strcmp(name, "halt") == 0 || strcmp(name, "poweroff") == 0) {
         return cmd_halt(argc, argv);
     }
+    if (strcmp(name, "netbench") == 0) {
+        return cmd_netbench(argc, argv);
+    }
 
     fprintf(stderr, "miniutils: unknown applet '%s'\n", name);
     return 127;
@@ -93,32 +93,79 @@ void putchar(char ch) {
 }
 
 /* Timer counter (incremented by timer interrupt handler) */
-static volatile int timer_ticks = 0;
+static volatile uint32_t timer_ticks = 0;
 
 /*
- * Timer interrupt handler (IRQ 0 / Vector 0x20)
- * Called every 10ms by VMM timer thread
- * Increments tick counter for timing operations
+ * Interrupt stack shared by the timer and yield entries.
+ * Both are interrupt gates (IF cleared), so they never nest. The stack lives
+ * in the kernel half, which is mapped identically in every page table, so
+ * CR3 can be switched while running on it.
  */
-__attribute__((naked))
-void timer_interrupt_handler(void) {
-    __asm__ volatile(
-        // Increment timer_ticks
-        "leal timer_ticks, %%eax\n\t"
-        "addl $1, (%%eax)\n\t"
+__attribute__((used)) static uint8_t irq_stack[4096] __attribute__((aligned(16)));
 
-        // Send EOI to PIC
-        "movb $0x20, %%al\n\t"
-        "movw $0x20, %%dx\n\t"
-        "outb %%al, %%dx\n\t"
+struct irq_frame *handle_timer(struct irq_frame *f);
+struct irq_frame *handle_yield(struct irq_frame *f);
 
-        // IRET
-        "iret\n\t"
+/*
+ * Interrupt entry: save the interrupted context on its own stack, run the
+ * C handler on irq_stack, then resume whichever frame the handler returns
+ * (the same one, or the next process's after a context switch).
+ *
+ * Only for ring-0 interrupt gates on KERNEL_CS taken from ring-0 code on
+ * the flat kernel segments: irq_return reloads neither CS nor SS:ESP, so
+ * a frame from another privilege level or code segment cannot be resumed
+ * this way.
+ */
+#define IRQ_ENTRY(name, handler)                                               \
+    __attribute__((naked)) void name(void) {                                   \
+        __asm__ volatile(                                                      \
+            "pushal\n\t"                                                       \
+            "movl %%esp, %%eax\n\t"                                            \
+            "movl $irq_stack + 4096, %%esp\n\t"                                \
+            "pushl %%eax\n\t"                                                  \
+            "call " #handler "\n\t"                                            \
+            "movl %%eax, %%esp\n\t"                                            \
+            "jmp irq_return\n\t"                                               \
+            : : : "memory"                                                     \
+        );                                                                     \
+    }
 
-        : : : "eax", "edx", "memory"
+/*
+ * Resume the irq_frame ESP points at.
+ * Every context runs at ring 0, so CS never changes and no IRET is needed:
+ * the CPU frame is rearranged into EFLAGS/EIP and left through POPF+RET.
+ * An interrupt taken between the two nests one frame on the same stack.
+ * Hosts that run KVM on software-virtualized CPUs (e.g. nested PVM) fail
+ * the IRET with KVM_INTERNAL_ERROR_EMULATION; build with IRQ_RETURN_IRET=1
+ * to return through IRET instead (and to reproduce that failure).
+ */
+__attribute__((naked, used)) static void irq_return(void) {
+    __asm__ volatile(
+        "popal\n\t"
+#ifdef IRQ_RETURN_IRET
+        "iretl\n\t"
+#endif
+        "pushl %%eax\n\t"              // [eax][eip][cs][eflags]
+        "movl 4(%%esp), %%eax\n\t"
+        "xchgl %%eax, 12(%%esp)\n\t"   // [eax][eip][cs][eip], eax = eflags
+        "movl %%eax, 8(%%esp)\n\t"     // [eax][eip][eflags][eip]
+        "popl %%eax\n\t"
+        "addl $4, %%esp\n\t"
+        "popfl\n\t"
+        "ret\n\t"
+        : : : "memory"
     );
 }
 
+/*
+ * Timer interrupt handler (IRQ 0 / Vector 0x20)
+ * Fires every 10ms (PIT at TIMER_HZ) and drives preemption
+ */
+IRQ_ENTRY(timer_interrupt_handler, handle_timer)
+
+/* Vector 0x81: give up the rest of the time slice */
+IRQ_ENTRY(yield_interrupt_handler, handle_yield)
+
 long getchar(void) {
     // Blocking getchar using HC_GETCHAR hypercall
     // VMM will return character from keyboard buffer in RAX
@@ -264,47 +311,12 @@ __attribute__((naked)) void user_entry(void) {
     );
 }
 
-/*
- * Context switch between processes
- * Saves current context and loads next context
- * 
- * prev_sp: Pointer to save current ESP
- * next_sp: Pointer to load new ESP from
- */
-__attribute__((naked)) void switch_context(uint32_t *prev_sp __attribute__((unused)), uint32_t *next_sp __attribute__((unused))) {
-    __asm__ volatile(
-        // Save callee-saved registers
-        "pushl %%ebx\n\t"
-        "pushl %%esi\n\t"
-        "pushl %%edi\n\t"
-        "pushl %%ebp\n\t"
-        
-        // Save current ESP to *prev_sp
-        "movl 20(%%esp), %%eax\n\t"    // prev_sp (after 4 pushes)
-        "movl %%esp, (%%eax)\n\t"
-        
-        // Load new ESP from *next_sp
-        "movl 24(%%esp), %%eax\n\t"    // next_sp
-        "movl (%%eax), %%esp\n\t"
-        
-        // Restore callee-saved registers
-        "popl %%ebp\n\t"
-        "popl %%edi\n\t"
-        "popl %%esi\n\t"
-        "popl %%ebx\n\t"
-        
-        "ret\n\t"
-        :
-        :
-        : "memory"
-    );
-}
-
 /*
  * Create a new process
- * Allocates page table, maps kernel and user pages, sets up stack
+ * Allocates page table, maps kernel and user pages, sets up stack.
+ * The process starts at entry (in the kernel half) on its kernel stack.
  */
-struct process *create_process(const void *image, size_t image_size) {
+struct process *create_process(const void *image, size_t image_size, void (*entry)(void)) {
     struct process *proc = NULL;
     int i;
     
@@ -319,13 +331,15 @@ struct process *create_process(const void *image, size_t image_size) {
     if (!proc)
         PANIC("no free process slots");
 
-    /* Setup initial stack frame for context switch */
-    uint32_t *sp = (uint32_t *) &proc->stack[sizeof(proc->stack)];
-    *--sp = 0;                      // EBP
-    *--sp = 0;                      // EDI
-    *--sp = 0;                      // ESI
-    *--sp = 0;                      // EBX
-    *--sp = (uint32_t) user_entry;  // Return address (will jump to user_entry)
+    /* Setup initial frame as if the process had been preempted at entry;
+     * resuming it leaves ESP at the top of the kernel stack with interrupts on.
+     * IOPL=3 lets user code issue hypercalls with OUT.
+     */
+    struct irq_frame *frame = (struct irq_frame *) &proc->stack[sizeof(proc->stack)] - 1;
+    memset(frame, 0, sizeof(*frame));
+    frame->iret.eip = (uint32_t) entry;
+    frame->iret.cs = KERNEL_CS;
+    frame->iret.eflags = EFLAGS_FIXED | EFLAGS_IF | EFLAGS_IOPL3;
 
     /* Allocate page directory - alloc_pages returns VIRTUAL address */
     uint32_t *page_table = (uint32_t *) alloc_pages(1);
@@ -372,7 +386,10 @@ struct process *create_process(const void *image, size_t image_size) {
 
     proc->pid = i + 1;
     proc->state = PROC_RUNNABLE;
-    proc->sp = (uint32_t) sp;
+    proc->sp = (uint32_t) frame;
+    proc->ticks = 0;
+    proc->slice = TIME_SLICE;
+    proc->switches = 0;
     /* Convert page table virtual address to physical for CR3 */
     proc->page_table = (uint32_t *) ((uint32_t) page_table - 0x80000000);
     
@@ -380,37 +397,100 @@ struct process *create_process(const void *image, size_t image_size) {
 }
 
 /*
- * Yield CPU to another process
- * Simple round-robin scheduler
+ * Pick the next process: round-robin over the process table after the
+ * current one, falling back to the idle process
  */
-void yield(void) {
-    struct process *next = idle_proc;
-    
-    /* Find next runnable process */
+static struct process *pick_next(void) {
+    for (int i = 1; i <= PROCS_MAX; i++) {
+        struct process *proc = &procs[(current_proc - procs + i) % PROCS_MAX];
+        if (proc->state == PROC_RUNNABLE && proc != idle_proc)
+            return proc;
+    }
+    return idle_proc;
+}
+
+/*
+ * Scheduler: park the interrupted context in current_proc and return the
+ * frame to resume. Runs on irq_stack with interrupts disabled.
+ */
+static struct irq_frame *schedule(struct irq_frame *f) {
+    struct process *next = pick_next();
+
+    current_proc->sp = (vaddr_t) f;
+    if (next != current_proc) {
+        current_proc = next;
+        next->switches++;
+
+        /* Switch page directory (CR3) */
+        __asm__ volatile(
+            "movl %0, %%cr3\n\t"
+            :
+            : "r" ((uint32_t) next->page_table)
+            : "memory"
+        );
+    }
+    next->slice = TIME_SLICE;
+    return (struct irq_frame *) next->sp;
+}
+
+/*
+ * Print how the CPU was shared since boot
+ */
+static void sched_report(void) {
+    printf("[sched] %d ticks:", timer_ticks);
     for (int i = 0; i < PROCS_MAX; i++) {
-        struct process *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-        if (proc->state == PROC_RUNNABLE && proc->pid > 0) {
-            next = proc;
-            break;
-        }
+        struct process *proc = &procs[i];
+        if (proc->state != PROC_RUNNABLE)
+            continue;
+        printf(" pid%d=%d/%d", proc->pid, proc->ticks, proc->switches);
     }
+    printf("\n");
+}
 
-    if (next == current_proc)
-        return;
+struct irq_frame *handle_timer(struct irq_frame *f) {
+    timer_ticks++;
+    outb(PIC1_CMD, PIC_EOI);
 
-    struct process *prev = current_proc;
-    current_proc = next;
+    /* Charge the tick to whoever was running */
+    current_proc->ticks++;
+    if (current_proc->slice > 0)
+        current_proc->slice--;
 
-    /* Switch page directory (CR3) */
-    __asm__ volatile(
-        "movl %0, %%cr3\n\t"
-        :
-        : "r" ((uint32_t) next->page_table)
-        : "memory"
-    );
+    if (BENCH_WORKERS > 0 && timer_ticks % SCHED_REPORT_TICKS == 0)
+        sched_report();
+
+    if (current_proc->slice > 0 && current_proc->state == PROC_RUNNABLE)
+        return f;
+    return schedule(f);
+}
+
+struct irq_frame *handle_yield(struct irq_frame *f) {
+    return schedule(f);
+}
 
-    /* Switch context */
-    switch_context(&prev->sp, &next->sp);
+/*
+ * Yield CPU to another process
+ * Enters the scheduler through the same frame layout as a preemption
+ */
+void yield(void) {
+    __asm__ volatile("int $0x81" ::: "memory");
+}
+
+/*
+ * Idle process: sleep until the next interrupt
+ */
+__attribute__((noreturn)) static void idle_main(void) {
+    for (;;)
+        __asm__ volatile("sti; hlt");
+}
+
+/*
+ * Benchmark worker: pure CPU load that only leaves the CPU when preempted
+ */
+__attribute__((noreturn, unused)) static void worker_main(void) {
+    volatile uint32_t spins = 0;
+    for (;;)
+        spins++;
 }
 
 /*
@@ -499,15 +579,42 @@ static void setup_idt_entry(int vector, void *handler, int dpl) {
     uint32_t handler_addr = (uint32_t)handler;
 
     // IDT gate descriptor format (32-bit):
-    // Dword 0: [offset 15:0] [selector 15:0]
+    // Dword 0: [selector 31:16] [offset 15:0]
     // Dword 1: [offset 31:16] [flags 15:0]
     // Flags: P=1, DPL=dpl, S=0 (system), Type=0xE (32-bit interrupt gate)
     uint32_t flags = 0x8E00 | ((dpl & 0x3) << 13);  // P=1, DPL=dpl, Type=0xE
-    idt[vector * 2 + 0] = ((handler_addr & 0xFFFF) << 16) | 0x0008;  // Selector = 0x08 (kernel code)
+    idt[vector * 2 + 0] = (0x0008 << 16) | (handler_addr & 0xFFFF);  // Selector = 0x08 (kernel code)
     idt[vector * 2 + 1] = (handler_addr & 0xFFFF0000) | flags;
 }
 #pragma GCC diagnostic pop
 
+/*
+ * Remap the 8259A pair to vectors 0x20-0x2F and unmask only IRQ 0
+ */
+static void pic_init(void) {
+    outb(PIC1_CMD, 0x11);            // ICW1: edge triggered, cascade, ICW4
+    outb(PIC2_CMD, 0x11);
+    outb(PIC1_DATA, VECTOR_TIMER);   // ICW2: master base vector
+    outb(PIC2_DATA, VECTOR_TIMER + 8);
+    outb(PIC1_DATA, 1 << 2);         // ICW3: slave on IRQ 2
+    outb(PIC2_DATA, 2);
+    outb(PIC1_DATA, 0x01);           // ICW4: 8086 mode
+    outb(PIC2_DATA, 0x01);
+    outb(PIC1_DATA, 0xFE);           // OCW1: timer only
+    outb(PIC2_DATA, 0xFF);
+}
+
+/*
+ * Program PIT channel 0 as a rate generator at hz
+ */
+static void pit_init(uint32_t hz) {
+    uint32_t divisor = PIT_FREQ / hz;
+
+    outb(PIT_CMD, 0x34);             // Channel 0, lobyte/hibyte, mode 2
+    outb(PIT_CH0, divisor & 0xFF);
+    outb(PIT_CH0, (divisor >> 8) & 0xFF);
+}
+
 void kernel_main(void) {
     /* Clear BSS */
     memset(__bss, 0, (size_t) __bss_end - (size_t) __bss);
@@ -517,9 +624,10 @@ void kernel_main(void) {
     printf("Booting in Protected Mode with Paging...\n\n");
 
     /* Setup interrupt handlers */
-    setup_idt_entry(0x20, timer_interrupt_handler, 0);  // IRQ 0 / Vector 0x20, DPL=0 (kernel only)
+    setup_idt_entry(VECTOR_TIMER, timer_interrupt_handler, 0);  // IRQ 0, DPL=0 (kernel only)
+    setup_idt_entry(VECTOR_YIELD, yield_interrupt_handler, 0);
     printf("Interrupt handlers registered\n");
-    printf("  Timer (IRQ 0, vector 0x20)\n");
+    printf("  Timer (IRQ 0, vector 0x20), %d Hz, %d tick time slice\n", TIMER_HZ, TIME_SLICE);
     printf("  Syscalls via hypercall (port 0x500, IOPL=3 allows user I/O)\n");
 
     /* Initialize filesystem */
@@ -527,45 +635,44 @@ void kernel_main(void) {
     printf("Filesystem initialized\n");
 
     /* Create idle process */
-    idle_proc = create_process(NULL, 0);
+    idle_proc = create_process(NULL, 0, idle_main);
     idle_proc->pid = 0;
     printf("Created idle process (pid=0)\n");
 
     /* Create shell process */
-    struct process *shell_proc = create_process(_binary_shell_bin_start, (size_t) _binary_shell_bin_size);
+    struct process *shell_proc = create_process(_binary_shell_bin_start, (size_t) _binary_shell_bin_size,
+                                                user_entry);
     printf("Created shell process (pid=%d)\n", shell_proc->pid);
-    
+
+    for (int i = 0; i < BENCH_WORKERS; i++) {
+        struct process *worker = create_process(NULL, 0, worker_main);
+        printf("Created worker process (pid=%d)\n", worker->pid);
+    }
+
     printf("\n=== Kernel Initialization Complete ===\n");
     printf("Starting shell process (PID %d)...\n\n", shell_proc->pid);
-    
+
     /* Bootstrap into shell process
-     * This is a special case - we're not doing a normal context switch,
-     * but rather jumping from kernel initialization into the first user process.
-     * We load the shell's page table, set ESP to shell's stack, and jump to user_entry.
+     * This is a special case - there is no current context to save. Load
+     * the shell's page table and resume its initial frame; restoring its
+     * EFLAGS turns on interrupts (and IOPL=3), after which the timer preempts it.
      */
     current_proc = shell_proc;
-    
-    /* Set IOPL=3 in EFLAGS to allow user space to use OUT instruction for hypercalls
-     * IOPL (I/O Privilege Level) is bits 12-13 of EFLAGS
-     * Setting IOPL=3 allows all code to execute I/O instructions
-     */
-    __asm__ volatile(
-        "pushfl\n\t"                // Push EFLAGS
-        "orl $0x3000, (%%esp)\n\t"  // Set IOPL=3 (bits 12-13)
-        "popfl\n\t"                 // Pop EFLAGS
-        ::: "memory"
-    );
-    
+    shell_proc->switches++;
+
+    pic_init();
+    pit_init(TIMER_HZ);
+
     __asm__ volatile(
         "movl %0, %%cr3\n\t"        // Load shell's page table
-        "movl %1, %%esp\n\t"        // Set stack to shell's stack
-        "jmp user_entry\n\t"        // Jump to user_entry (which jumps to USER_BASE)
+        "movl %1, %%esp\n\t"        // Point at shell's initial frame
+        "jmp irq_return\n\t"
         :
         : "r" ((uint32_t) shell_proc->page_table),
           "r" (shell_proc->sp)
         : "memory"
     );
-    
+
     /* Should never reach here */
     PANIC("Returned from shell process");
 }
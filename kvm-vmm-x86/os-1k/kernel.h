@@ -7,6 +7,33 @@
 #define PROC_RUNNABLE 1
 #define PROC_EXITED   2
 
+/* Preemptive scheduling */
+#define TIMER_HZ      100   // PIT rate (one tick = 10ms)
+#define TIME_SLICE    5     // Ticks a process runs before it is preempted
+#ifndef BENCH_WORKERS
+#define BENCH_WORKERS 0     // CPU-bound worker processes started at boot
+#endif
+#define SCHED_REPORT_TICKS (5 * TIMER_HZ)  // Per-process accounting printout
+
+/* Interrupt vectors */
+#define VECTOR_TIMER  0x20  // IRQ 0 after PIC remap
+#define VECTOR_YIELD  0x81  // Software yield into the scheduler
+
+/* 8259A PIC / 8253 PIT ports */
+#define PIC1_CMD      0x20
+#define PIC1_DATA     0x21
+#define PIC2_CMD      0xA0
+#define PIC2_DATA     0xA1
+#define PIC_EOI       0x20
+#define PIT_CH0       0x40
+#define PIT_CMD       0x43
+#define PIT_FREQ      1193182
+
+#define KERNEL_CS     0x08
+#define EFLAGS_IF     (1 << 9)
+#define EFLAGS_IOPL3  (3 << 12)
+#define EFLAGS_FIXED  (1 << 1)
+
 /* x86 32-bit paging flags */
 #define PAGE_P    (1 << 0)  // Present
 #define PAGE_RW   (1 << 1)  // Read/Write
@@ -24,8 +51,11 @@
 struct process {
     int pid;
     int state;
-    vaddr_t sp;
+    vaddr_t sp;             // Saved struct irq_frame while not running
     uint32_t *page_table;
+    uint32_t ticks;         // Timer ticks charged to this process
+    uint32_t slice;         // Ticks left in the current time slice
+    uint32_t switches;      // Times the scheduler switched to this process
     uint8_t stack[8192];
 };
 
@@ -72,6 +102,16 @@ struct interrupt_frame {
     uint32_t eflags;
 } __attribute__((packed));
 
+/*
+ * Saved context of a preempted process: PUSHA on top of the CPU's frame.
+ * Everything runs at ring 0, so the CPU pushes no ESP/SS and the frame sits
+ * on whatever stack the process was using.
+ */
+struct irq_frame {
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;  // PUSHA order
+    struct interrupt_frame iret;
+} __attribute__((packed));
+
 /* I/O port functions for keyboard and PIC */
 static inline uint8_t inb(uint16_t port) {
     uint8_t result;
@@ -0,0 +1,453 @@
+/*
+ * ACPI tables for Mini-KVM
+ *
+ * Tables are laid out one after another from ACPI_TABLES_ADDR, each
+ * 16-byte aligned (the FACS 64-byte), and checksummed once complete.
+ */
+
+#include "acpi.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+
+#define ACPI_OEM_ID         "MINKVM"
+#define ACPI_OEM_TABLE_ID   "MINIKVM "
+#define ACPI_CREATOR_ID     "MKVM"
+
+// MADT flags and entry types
+#define MADT_PCAT_COMPAT    1
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_OVERRIDE       2
+#define MADT_LAPIC_NMI      4
+#define MADT_ENABLED        1
+
+// MPS INTI flags: polarity in bits 0-1, trigger mode in bits 2-3
+#define INTI_ACTIVE_HIGH    0x1
+#define INTI_LEVEL          (0x3 << 2)
+
+// FADT fixed feature flags
+#define FADT_WBINVD         (1 << 0)
+#define FADT_PROC_C1        (1 << 2)
+#define FADT_PWR_BUTTON     (1 << 4)    // No fixed power button
+#define FADT_SLP_BUTTON     (1 << 5)    // No fixed sleep button
+#define FADT_RESET_REG_SUP  (1 << 10)
+
+// C2/C3 latencies above these limits mean "not supported"
+#define FADT_C2_DISABLED    101
+#define FADT_C3_DISABLED    1001
+
+// Generic Address Structure
+#define GAS_SYSTEM_IO       1
+#define GAS_ACCESS_BYTE     1
+#define GAS_ACCESS_WORD     2
+#define GAS_ACCESS_DWORD    3
+
+// AML opcodes used by the DSDT
+#define AML_ZERO            0x00
+#define AML_NAME            0x08
+#define AML_BYTE_PREFIX     0x0a
+#define AML_PACKAGE         0x12
+
+#define ISA_IRQS            16
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    char creator_id[4];
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_lapic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_override {
+    uint8_t type;
+    uint8_t length;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+struct madt_lapic_nmi {
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor_id;
+    uint16_t flags;
+    uint8_t lint;
+} __attribute__((packed));
+
+struct acpi_gas {
+    uint8_t space_id;
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+} __attribute__((packed));
+
+// FADT revision 3 (ACPI 2.0 layout)
+struct acpi_fadt {
+    struct acpi_header header;
+    uint32_t firmware_ctrl;
+    uint32_t dsdt;
+    uint8_t reserved0;
+    uint8_t preferred_pm_profile;
+    uint16_t sci_int;
+    uint32_t smi_cmd;
+    uint8_t acpi_enable;
+    uint8_t acpi_disable;
+    uint8_t s4bios_req;
+    uint8_t pstate_cnt;
+    uint32_t pm1a_evt_blk;
+    uint32_t pm1b_evt_blk;
+    uint32_t pm1a_cnt_blk;
+    uint32_t pm1b_cnt_blk;
+    uint32_t pm2_cnt_blk;
+    uint32_t pm_tmr_blk;
+    uint32_t gpe0_blk;
+    uint32_t gpe1_blk;
+    uint8_t pm1_evt_len;
+    uint8_t pm1_cnt_len;
+    uint8_t pm2_cnt_len;
+    uint8_t pm_tmr_len;
+    uint8_t gpe0_blk_len;
+    uint8_t gpe1_blk_len;
+    uint8_t gpe1_base;
+    uint8_t cst_cnt;
+    uint16_t p_lvl2_lat;
+    uint16_t p_lvl3_lat;
+    uint16_t flush_size;
+    uint16_t flush_stride;
+    uint8_t duty_offset;
+    uint8_t duty_width;
+    uint8_t day_alrm;
+    uint8_t mon_alrm;
+    uint8_t century;
+    uint16_t iapc_boot_arch;
+    uint8_t reserved1;
+    uint32_t flags;
+    struct acpi_gas reset_reg;
+    uint8_t reset_value;
+    uint8_t reserved2[3];
+    uint64_t x_firmware_ctrl;
+    uint64_t x_dsdt;
+    struct acpi_gas x_pm1a_evt_blk;
+    struct acpi_gas x_pm1b_evt_blk;
+    struct acpi_gas x_pm1a_cnt_blk;
+    struct acpi_gas x_pm1b_cnt_blk;
+    struct acpi_gas x_pm2_cnt_blk;
+    struct acpi_gas x_pm_tmr_blk;
+    struct acpi_gas x_gpe0_blk;
+    struct acpi_gas x_gpe1_blk;
+} __attribute__((packed));
+
+struct acpi_facs {
+    char signature[4];
+    uint32_t length;
+    uint32_t hardware_signature;
+    uint32_t firmware_waking_vector;
+    uint32_t global_lock;
+    uint32_t flags;
+    uint64_t x_firmware_waking_vector;
+    uint8_t version;
+    uint8_t reserved[31];
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct acpi_rsdp) == 36, "RSDP size mismatch");
+_Static_assert(sizeof(struct acpi_header) == 36, "ACPI header size mismatch");
+_Static_assert(sizeof(struct madt_override) == 10, "MADT override size mismatch");
+_Static_assert(sizeof(struct acpi_fadt) == 244, "FADT size mismatch");
+_Static_assert(sizeof(struct acpi_facs) == 64, "FACS size mismatch");
+
+// Bump allocator over the table area
+typedef struct {
+    uint8_t *mem;
+    uint32_t next;          // Guest address of the next table
+} acpi_builder_t;
+
+static void *table_alloc(acpi_builder_t *b, uint32_t size, uint32_t align, uint32_t *gpa) {
+    uint32_t addr = (b->next + align - 1) & ~(align - 1);
+
+    if (addr + size > ACPI_TABLES_ADDR + ACPI_TABLES_SIZE) {
+        fprintf(stderr, "ACPI: tables do not fit below 0x%x\n", ACPI_TABLES_ADDR + ACPI_TABLES_SIZE);
+        return NULL;
+    }
+    b->next = addr + size;
+    *gpa = addr;
+    memset(b->mem + addr, 0, size);
+    return b->mem + addr;
+}
+
+static uint8_t checksum(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        sum += p[i];
+    }
+    return (uint8_t)-sum;
+}
+
+static void init_header(struct acpi_header *h, const char *signature, uint32_t length, uint8_t revision) {
+    memcpy(h->signature, signature, 4);
+    h->length = length;
+    h->revision = revision;
+    memcpy(h->oem_id, ACPI_OEM_ID, 6);
+    memcpy(h->oem_table_id, ACPI_OEM_TABLE_ID, 8);
+    h->oem_revision = 1;
+    memcpy(h->creator_id, ACPI_CREATOR_ID, 4);
+    h->creator_revision = 1;
+}
+
+static void finish_table(struct acpi_header *h) {
+    h->checksum = 0;
+    h->checksum = checksum(h, h->length);
+}
+
+static uint32_t build_madt(acpi_builder_t *b, const acpi_config_t *cfg) {
+    // The SCI is level-triggered; active high, so an idle line is deasserted
+    uint32_t level_irqs = cfg->level_irqs | (1u << ACPI_SCI_IRQ);
+    int overrides = 1;
+    for (int irq = 1; irq < ISA_IRQS; irq++) {
+        overrides += (level_irqs >> irq) & 1;
+    }
+    uint32_t length = sizeof(struct acpi_madt) + cfg->num_cpus * sizeof(struct madt_lapic) +
+                      sizeof(struct madt_ioapic) + overrides * sizeof(struct madt_override) +
+                      sizeof(struct madt_lapic_nmi);
+    uint32_t gpa;
+    struct acpi_madt *madt = table_alloc(b, length, 16, &gpa);
+    if (!madt) {
+        return 0;
+    }
+
+    init_header(&madt->header, "APIC", length, 3);
+    madt->lapic_address = ACPI_LAPIC_ADDR;
+    madt->flags = cfg->pic ? MADT_PCAT_COMPAT : 0;
+
+    uint8_t *p = (uint8_t *)(madt + 1);
+    for (int i = 0; i < cfg->num_cpus; i++) {
+        struct madt_lapic *lapic = (struct madt_lapic *)p;
+        lapic->type = MADT_LAPIC;
+        lapic->length = sizeof(*lapic);
+        lapic->processor_id = (uint8_t)i;
+        lapic->apic_id = (uint8_t)i;
+        lapic->flags = MADT_ENABLED;
+        p += sizeof(*lapic);
+    }
+
+    struct madt_ioapic *ioapic = (struct madt_ioapic *)p;
+    ioapic->type = MADT_IOAPIC;
+    ioapic->length = sizeof(*ioapic);
+    ioapic->ioapic_id = 0;
+    ioapic->address = ACPI_IOAPIC_ADDR;
+    ioapic->gsi_base = 0;
+    p += sizeof(*ioapic);
+
+    // The PIT's IRQ0 is wired to IOAPIC pin 2 (see irq.h)
+    struct madt_override *ovr = (struct madt_override *)p;
+    ovr->type = MADT_OVERRIDE;
+    ovr->length = sizeof(*ovr);
+    ovr->source = 0;
+    ovr->gsi = 2;
+    ovr->flags = 0; // Conforms to the bus: edge, active high
+    p += sizeof(*ovr);
+
+    // ISA lines default to edge; the VMM's resampled lines are levels
+    for (int irq = 1; irq < ISA_IRQS; irq++) {
+        if (!((level_irqs >> irq) & 1)) {
+            continue;
+        }
+        ovr = (struct madt_override *)p;
+        ovr->type = MADT_OVERRIDE;
+        ovr->length = sizeof(*ovr);
+        ovr->source = (uint8_t)irq;
+        ovr->gsi = (uint32_t)irq;
+        ovr->flags = INTI_ACTIVE_HIGH | INTI_LEVEL;
+        p += sizeof(*ovr);
+    }
+
+    // LINT1 of every CPU is the NMI input
+    struct madt_lapic_nmi *nmi = (struct madt_lapic_nmi *)p;
+    nmi->type = MADT_LAPIC_NMI;
+    nmi->length = sizeof(*nmi);
+    nmi->processor_id = 0xff;
+    nmi->flags = 0;
+    nmi->lint = 1;
+
+    finish_table(&madt->header);
+    return gpa;
+}
+
+// DSDT: the only object is _S5, the SLP_TYP values for soft-off
+static uint32_t build_dsdt(acpi_builder_t *b) {
+    static const uint8_t aml[] = {
+        AML_NAME, '_', 'S', '5', '_',
+        AML_PACKAGE, 0x08, 0x04,            // PkgLength, 4 elements
+        AML_BYTE_PREFIX, ACPI_SLP_TYP_S5,   // PM1a_CNT.SLP_TYP
+        AML_BYTE_PREFIX, ACPI_SLP_TYP_S5,   // PM1b_CNT.SLP_TYP (no PM1b block)
+        AML_ZERO, AML_ZERO,                 // Reserved
+    };
+    uint32_t length = sizeof(struct acpi_header) + sizeof(aml);
+    uint32_t gpa;
+    struct acpi_header *dsdt = table_alloc(b, length, 16, &gpa);
+    if (!dsdt) {
+        return 0;
+    }
+
+    init_header(dsdt, "DSDT", length, 2);
+    memcpy(dsdt + 1, aml, sizeof(aml));
+    finish_table(dsdt);
+    return gpa;
+}
+
+static void set_gas_io(struct acpi_gas *gas, uint16_t port, uint8_t bits, uint8_t access) {
+    gas->space_id = GAS_SYSTEM_IO;
+    gas->bit_width = bits;
+    gas->bit_offset = 0;
+    gas->access_size = access;
+    gas->address = port;
+}
+
+/*
+ * FADT: ACPI is always enabled (no SMI command port), the SCI is ACPI_SCI_IRQ,
+ * PM1a has an event and a control block, and the reset register is 0xCF9.
+ * There is no PM timer, GPE block or C2/C3.
+ */
+static uint32_t build_fadt(acpi_builder_t *b) {
+    uint32_t facs_gpa, dsdt_gpa, gpa;
+
+    struct acpi_facs *facs = table_alloc(b, sizeof(*facs), 64, &facs_gpa);
+    if (!facs) {
+        return 0;
+    }
+    memcpy(facs->signature, "FACS", 4);
+    facs->length = sizeof(*facs);
+    facs->version = 1;
+
+    if ((dsdt_gpa = build_dsdt(b)) == 0) {
+        return 0;
+    }
+
+    struct acpi_fadt *fadt = table_alloc(b, sizeof(*fadt), 16, &gpa);
+    if (!fadt) {
+        return 0;
+    }
+    init_header(&fadt->header, "FACP", sizeof(*fadt), 3);
+    fadt->firmware_ctrl = facs_gpa;
+    fadt->dsdt = dsdt_gpa;
+    fadt->sci_int = ACPI_SCI_IRQ;
+    fadt->pm1a_evt_blk = ACPI_PM1A_EVT_ADDR;
+    fadt->pm1a_cnt_blk = ACPI_PM1A_CNT_ADDR;
+    fadt->pm1_evt_len = ACPI_PM1_EVT_LEN;
+    fadt->pm1_cnt_len = ACPI_PM1_CNT_LEN;
+    fadt->p_lvl2_lat = FADT_C2_DISABLED;
+    fadt->p_lvl3_lat = FADT_C3_DISABLED;
+    fadt->iapc_boot_arch = 0;       // No 8042 for the kernel to probe
+    fadt->flags = FADT_WBINVD | FADT_PROC_C1 | FADT_PWR_BUTTON | FADT_SLP_BUTTON |
+                  FADT_RESET_REG_SUP;
+    set_gas_io(&fadt->reset_reg, ACPI_RESET_PORT, 8, GAS_ACCESS_BYTE);
+    fadt->reset_value = ACPI_RESET_VALUE;
+    fadt->x_firmware_ctrl = facs_gpa;
+    fadt->x_dsdt = dsdt_gpa;
+    set_gas_io(&fadt->x_pm1a_evt_blk, ACPI_PM1A_EVT_ADDR, ACPI_PM1_EVT_LEN * 8, GAS_ACCESS_WORD);
+    set_gas_io(&fadt->x_pm1a_cnt_blk, ACPI_PM1A_CNT_ADDR, ACPI_PM1_CNT_LEN * 8, GAS_ACCESS_WORD);
+
+    finish_table(&fadt->header);
+    return gpa;
+}
+
+uint32_t acpi_build_tables(void *guest_mem, size_t mem_size, const acpi_config_t *cfg) {
+    acpi_builder_t b = { .mem = guest_mem, .next = ACPI_TABLES_ADDR };
+    uint32_t tables[2];
+    int count = 0;
+    uint32_t rsdp_gpa, rsdt_gpa, xsdt_gpa;
+
+    if (mem_size < ACPI_TABLES_ADDR + ACPI_TABLES_SIZE) {
+        fprintf(stderr, "ACPI: guest RAM does not cover the BIOS area\n");
+        return 0;
+    }
+    if (cfg->num_cpus < 1 || cfg->num_cpus > ACPI_MAX_CPUS) {
+        fprintf(stderr, "ACPI: invalid CPU count %d\n", cfg->num_cpus);
+        return 0;
+    }
+
+    // The RSDP must sit on a 16-byte boundary inside the scanned area
+    struct acpi_rsdp *rsdp = table_alloc(&b, sizeof(*rsdp), 16, &rsdp_gpa);
+    if (!rsdp) {
+        return 0;
+    }
+
+    if ((tables[count++] = build_fadt(&b)) == 0 ||
+        (tables[count++] = build_madt(&b, cfg)) == 0) {
+        return 0;
+    }
+
+    uint32_t rsdt_len = sizeof(struct acpi_header) + count * sizeof(uint32_t);
+    struct acpi_header *rsdt = table_alloc(&b, rsdt_len, 16, &rsdt_gpa);
+    uint32_t xsdt_len = sizeof(struct acpi_header) + count * sizeof(uint64_t);
+    struct acpi_header *xsdt = table_alloc(&b, xsdt_len, 16, &xsdt_gpa);
+    if (!rsdt || !xsdt) {
+        return 0;
+    }
+    init_header(rsdt, "RSDT", rsdt_len, 1);
+    init_header(xsdt, "XSDT", xsdt_len, 1);
+    for (int i = 0; i < count; i++) {
+        uint32_t entry32 = tables[i];
+        uint64_t entry64 = tables[i];
+        memcpy((uint8_t *)(rsdt + 1) + i * sizeof(entry32), &entry32, sizeof(entry32));
+        memcpy((uint8_t *)(xsdt + 1) + i * sizeof(entry64), &entry64, sizeof(entry64));
+    }
+    finish_table(rsdt);
+    finish_table(xsdt);
+
+    memcpy(rsdp->signature, "RSD PTR ", 8);
+    memcpy(rsdp->oem_id, ACPI_OEM_ID, 6);
+    rsdp->revision = 2;
+    rsdp->rsdt_address = rsdt_gpa;
+    rsdp->length = sizeof(*rsdp);
+    rsdp->xsdt_address = xsdt_gpa;
+    rsdp->checksum = checksum(rsdp, 20);
+    rsdp->extended_checksum = checksum(rsdp, sizeof(*rsdp));
+
+    DEBUG_PRINT(DEBUG_BASIC, "ACPI: RSDP at 0x%x, FADT/DSDT, MADT with %d CPU(s), %u bytes of tables",
+                rsdp_gpa, cfg->num_cpus, b.next - ACPI_TABLES_ADDR);
+    return rsdp_gpa;
+}
@@ -0,0 +1,54 @@
+/*
+ * ACPI tables for Linux guests
+ *
+ * The tables are written into the BIOS area of guest RAM (0xE0000-0xFFFFF,
+ * E820-reserved), where the kernel scans for the RSDP. The RSDP points to an
+ * XSDT (and an RSDT for ACPI 1.0 parsers) listing one MADT, which names the
+ * local APIC of every vCPU, the IOAPIC and the ISA interrupt overrides:
+ * IRQ0 (PIT) arrives on GSI 2, and the lines the VMM drives as levels
+ * (resampling irqfds) are declared level-triggered, active high.
+ *
+ * The FADT describes the fixed power management hardware that misc_port_out()
+ * emulates: a PM1a event/control block for S5 (soft-off, SLP_TYP from the
+ * DSDT's _S5 object) and the 0xCF9 reset register. The SCI is never raised.
+ */
+
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ACPI_TABLES_ADDR    0xE0000
+#define ACPI_TABLES_SIZE    0x20000
+#define ACPI_MAX_CPUS       255     // xAPIC IDs; 0xFF is the broadcast ID
+
+#define ACPI_LAPIC_ADDR     0xFEE00000
+#define ACPI_IOAPIC_ADDR    0xFEC00000
+
+// Fixed hardware (I/O ports)
+#define ACPI_PM1A_EVT_ADDR  0x600   // PM1a_STS (16 bits), PM1a_EN (16 bits)
+#define ACPI_PM1A_CNT_ADDR  0x604
+#define ACPI_PM1_EVT_LEN    4
+#define ACPI_PM1_CNT_LEN    2
+#define ACPI_SCI_IRQ        9
+#define ACPI_RESET_PORT     0xCF9
+#define ACPI_RESET_VALUE    0x06    // Reset CPU, hard reset
+
+// PM1 control register
+#define ACPI_PM1_CNT_SCI_EN     (1 << 0)
+#define ACPI_PM1_CNT_SLP_TYP(v) (((v) >> 10) & 7)
+#define ACPI_PM1_CNT_SLP_EN     (1 << 13)
+#define ACPI_SLP_TYP_S5         5
+
+typedef struct {
+    int num_cpus;           // Local APIC IDs 0 .. num_cpus - 1 (the BSP is 0)
+    bool pic;               // A dual 8259 is present (in-kernel irqchip)
+    uint32_t level_irqs;    // ISA IRQs wired as level-triggered, active-high lines
+} acpi_config_t;
+
+// Write the tables into guest RAM; returns the RSDP address, or 0 on error
+uint32_t acpi_build_tables(void *guest_mem, size_t mem_size, const acpi_config_t *cfg);
+
+#endif // ACPI_H
@@ -14,16 +14,145 @@
 #include <linux/kvm.h>
 #include <sys/ioctl.h>
 
+// Paravirtual feature bits requested for leaf 0x40000001
+static uint32_t pv_features = CPUID_PV_DEFAULT;
+
+// CPUs in the guest's package (0: topology leaves as KVM reports them)
+static uint32_t topology_cpus = 0;
+
+// Leaf 0xB subleaves we report: SMT, core and the terminating invalid level
+#define TOPOLOGY_SUBLEAVES 3
+
+static const struct {
+    const char *name;
+    int bit;
+} pv_feature_names[] = {
+    { "clocksource",     KVM_FEATURE_CLOCKSOURCE },
+    { "nopiodelay",      KVM_FEATURE_NOP_IO_DELAY },
+    { "clocksource2",    KVM_FEATURE_CLOCKSOURCE2 },
+    { "async-pf",        KVM_FEATURE_ASYNC_PF },
+    { "steal-time",      KVM_FEATURE_STEAL_TIME },
+    { "pv-eoi",          KVM_FEATURE_PV_EOI },
+    { "pv-unhalt",       KVM_FEATURE_PV_UNHALT },
+    { "pv-tlb-flush",    KVM_FEATURE_PV_TLB_FLUSH },
+    { "async-pf-vmexit", KVM_FEATURE_ASYNC_PF_VMEXIT },
+    { "pv-ipi",          KVM_FEATURE_PV_SEND_IPI },
+    { "poll-control",    KVM_FEATURE_POLL_CONTROL },
+    { "pv-sched-yield",  KVM_FEATURE_PV_SCHED_YIELD },
+    { "async-pf-int",    KVM_FEATURE_ASYNC_PF_INT },
+    { "msi-ext-dest-id", KVM_FEATURE_MSI_EXT_DEST_ID },
+    { "stable-clock",    KVM_FEATURE_CLOCKSOURCE_STABLE_BIT },
+};
+
+int cpuid_parse_pv_features(const char *spec, uint32_t *features) {
+    char buf[256];
+
+    if (strcmp(spec, "none") == 0) {
+        *features = CPUID_PV_NONE;
+        return 0;
+    }
+    if (strcmp(spec, "default") == 0) {
+        *features = CPUID_PV_DEFAULT;
+        return 0;
+    }
+    if (strcmp(spec, "all") == 0) {
+        *features = CPUID_PV_ALL;
+        return 0;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    *features = 0;
+    for (char *save = NULL, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        size_t i;
+        for (i = 0; i < sizeof(pv_feature_names) / sizeof(pv_feature_names[0]); i++) {
+            if (strcmp(tok, pv_feature_names[i].name) == 0) {
+                *features |= 1u << pv_feature_names[i].bit;
+                break;
+            }
+        }
+        if (i == sizeof(pv_feature_names) / sizeof(pv_feature_names[0])) {
+            fprintf(stderr, "Unknown paravirtual feature '%s'\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void cpuid_set_pv_features(uint32_t features) {
+    pv_features = features;
+}
+
+uint32_t cpuid_get_pv_features(void) {
+    return pv_features;
+}
+
+void cpuid_set_topology(uint32_t cpus) {
+    topology_cpus = cpus;
+}
+
+// Bits of the APIC ID that number cores within the package
+static uint32_t topology_core_bits(void) {
+    uint32_t bits = 0;
+    while ((1u << bits) < topology_cpus) {
+        bits++;
+    }
+    return bits;
+}
+
+/*
+ * Replace the extended topology leaves with one package of single-threaded
+ * cores. Leaf 0x1F goes away so that the guest falls back to leaf 0xB.
+ */
+static void set_topology_leaves(struct kvm_cpuid2 *cpuid, uint32_t apic_id) {
+    uint32_t max_leaf = 0;
+    unsigned int n = 0;
+
+    for (unsigned int i = 0; i < cpuid->nent; i++) {
+        uint32_t fn = cpuid->entries[i].function;
+        if (fn == 0x0) {
+            max_leaf = cpuid->entries[i].eax;
+        }
+        if (fn != 0xB && fn != 0x1F) {
+            cpuid->entries[n++] = cpuid->entries[i];
+        }
+    }
+    cpuid->nent = n;
+    if (max_leaf < 0xB) {
+        return;
+    }
+
+    for (uint32_t level = 0; level < TOPOLOGY_SUBLEAVES; level++) {
+        struct kvm_cpuid_entry2 *entry = &cpuid->entries[cpuid->nent++];
+        memset(entry, 0, sizeof(*entry));
+        entry->function = 0xB;
+        entry->index = level;
+        entry->flags = KVM_CPUID_FLAG_SIGNIFCANT_INDEX;
+        entry->edx = apic_id;
+        if (level == 0) {        // SMT: one thread per core
+            entry->eax = 0;
+            entry->ebx = 1;
+            entry->ecx = (1 << 8) | level;
+        } else if (level == 1) { // Core: every CPU of the package
+            entry->eax = topology_core_bits();
+            entry->ebx = topology_cpus;
+            entry->ecx = (2 << 8) | level;
+        } else {                 // Invalid level ends the enumeration
+            entry->ecx = level;
+        }
+    }
+}
+
 // Setup CPUID entries for a vCPU
 // kvm_fd: /dev/kvm file descriptor for KVM_GET_SUPPORTED_CPUID
 // vcpu_fd: vCPU file descriptor for KVM_SET_CPUID2
 // Returns number of entries set, or -1 on error
-int setup_cpuid(int kvm_fd, int vcpu_fd) {
+int setup_cpuid(int kvm_fd, int vcpu_fd, uint32_t apic_id) {
     struct kvm_cpuid2 *cpuid;
     int nent = 100; // Maximum number of CPUID entries
+    uint32_t core_mask = (1u << topology_core_bits()) - 1;
     
-    // Allocate CPUID structure
-    size_t size = sizeof(*cpuid) + nent * sizeof(cpuid->entries[0]);
+    // Allocate CPUID structure (with room for the topology subleaves)
+    size_t size = sizeof(*cpuid) + (nent + TOPOLOGY_SUBLEAVES) * sizeof(cpuid->entries[0]);
     cpuid = calloc(1, size);
     if (!cpuid) {
         perror("Failed to allocate CPUID structure");
@@ -77,6 +206,16 @@ int setup_cpuid(int kvm_fd, int vcpu_fd) {
                 entry->ecx |= CPUID_FEAT_SSE41;  // SSE4.1
                 entry->ecx |= CPUID_FEAT_SSE42;  // SSE4.2
                 entry->ecx |= CPUID_FEAT_POPCNT; // POPCNT
+
+                // EBX: initial APIC ID and logical processors per package
+                if (topology_cpus) {
+                    entry->ebx = (entry->ebx & 0xffff) | (apic_id << 24) | ((core_mask + 1) << 16);
+                    if (topology_cpus > 1) {
+                        entry->edx |= CPUID_FEAT_HTT;
+                    } else {
+                        entry->edx &= ~CPUID_FEAT_HTT;
+                    }
+                }
                 
                 DEBUG_PRINT(DEBUG_DETAILED, "CPUID[0x1]: EDX=0x%x ECX=0x%x", 
                            entry->edx, entry->ecx);
@@ -87,7 +226,11 @@ int setup_cpuid(int kvm_fd, int vcpu_fd) {
                 break;
                 
             case 0x4: // Deterministic Cache Parameters
-                // Leave as-is
+                // Cores per package; L1/L2 are per core, L3 is shared by all
+                if (topology_cpus && (entry->eax & 0x1f)) {
+                    uint32_t sharing = ((entry->eax >> 5) & 7) >= 3 ? core_mask : 0;
+                    entry->eax = (entry->eax & 0x3fff) | (sharing << 14) | (core_mask << 26);
+                }
                 break;
                 
             case 0x6: // Thermal and Power Management
@@ -131,8 +274,38 @@ int setup_cpuid(int kvm_fd, int vcpu_fd) {
             case 0x80000008: // Virtual and Physical Address Sizes
                 // Leave as-is (reports 48-bit virtual, 40-bit physical typically)
                 DEBUG_PRINT(DEBUG_ALL, "CPUID[0x80000008]: Addr sizes = 0x%x", entry->eax);
+                // ECX: core count and APIC ID core bits (AMD)
+                if (topology_cpus) {
+                    entry->ecx = (entry->ecx & ~0xf0ffu) | (topology_core_bits() << 12) | (topology_cpus - 1);
+                }
+                break;
+
+            case KVM_CPUID_SIGNATURE: // "KVMKVMKVM\0\0\0", highest PV leaf
+                entry->eax = KVM_CPUID_FEATURES;
                 break;
+
+            case KVM_CPUID_FEATURES: // Paravirtual features (EAX) and hints (EDX)
+                entry->eax &= pv_features;
+                entry->edx = 0; // No realtime hint: vCPUs may be preempted
+                DEBUG_PRINT(DEBUG_DETAILED, "CPUID[0x40000001]: PV features = 0x%x", entry->eax);
+                break;
+        }
+    }
+
+    // Profile "none": the guest sees no KVM signature and stays unparavirtualized
+    if (pv_features == CPUID_PV_NONE) {
+        unsigned int n = 0;
+        for (unsigned int i = 0; i < cpuid->nent; i++) {
+            if (cpuid->entries[i].function != KVM_CPUID_SIGNATURE &&
+                cpuid->entries[i].function != KVM_CPUID_FEATURES) {
+                cpuid->entries[n++] = cpuid->entries[i];
+            }
         }
+        cpuid->nent = n;
+    }
+
+    if (topology_cpus) {
+        set_topology_leaves(cpuid, apic_id);
     }
     
     // Set CPUID for this vCPU
@@ -142,6 +315,15 @@ int setup_cpuid(int kvm_fd, int vcpu_fd) {
         return -1;
     }
     
+    // Guest writes to PV MSRs of features outside the profile now #GP
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_ENFORCE_PV_FEATURE_CPUID,
+        .args[0] = 1,
+    };
+    if (ioctl(vcpu_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        DEBUG_PRINT(DEBUG_DETAILED, "KVM_CAP_ENFORCE_PV_FEATURE_CPUID unavailable");
+    }
+
     int nent_set = cpuid->nent;
     free(cpuid);
     
@@ -7,12 +7,46 @@
 
 #include <stdint.h>
 #include <linux/kvm.h>
+#include <asm/kvm_para.h>
+
+// KVM paravirtual features advertised in leaf 0x40000001 EAX by default:
+// kvmclock (stable), steal time, PV EOI, PV spinlocks (unhalt), PV TLB flush,
+// PV IPIs, directed yield and guest halt-poll control. NOP_IO_DELAY tells
+// Linux to skip its port 0x80 delay writes, each of which would otherwise
+// be a PIO exit to the VMM for a port that does nothing.
+#define CPUID_PV_DEFAULT ((1u << KVM_FEATURE_CLOCKSOURCE) | \
+                          (1u << KVM_FEATURE_NOP_IO_DELAY) | \
+                          (1u << KVM_FEATURE_CLOCKSOURCE2) | \
+                          (1u << KVM_FEATURE_STEAL_TIME) | \
+                          (1u << KVM_FEATURE_PV_EOI) | \
+                          (1u << KVM_FEATURE_PV_UNHALT) | \
+                          (1u << KVM_FEATURE_PV_TLB_FLUSH) | \
+                          (1u << KVM_FEATURE_PV_SEND_IPI) | \
+                          (1u << KVM_FEATURE_POLL_CONTROL) | \
+                          (1u << KVM_FEATURE_PV_SCHED_YIELD) | \
+                          (1u << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT))
+#define CPUID_PV_ALL     0xffffffffu
+#define CPUID_PV_NONE    0u // Hide the KVM leaves altogether
 
 // Setup CPUID for a vCPU
 // kvm_fd: /dev/kvm file descriptor for KVM_GET_SUPPORTED_CPUID
 // vcpu_fd: vCPU file descriptor for KVM_SET_CPUID2
+// apic_id: the vCPU's initial APIC ID (its KVM vCPU id)
 // Returns number of entries set, or -1 on error
-int setup_cpuid(int kvm_fd, int vcpu_fd);
+int setup_cpuid(int kvm_fd, int vcpu_fd, uint32_t apic_id);
+
+// Describe one package of cpus single-threaded cores to later setup_cpuid()
+// calls (leaves 0x1, 0x4, 0xB and 0x80000008); 0 keeps KVM's topology leaves
+void cpuid_set_topology(uint32_t cpus);
+
+// Select the paravirtual profile: "none", "default", "all" or a comma
+// separated list of feature names (e.g. "clocksource2,steal-time,pv-eoi").
+// Returns 0, or -1 for an unknown name.
+int cpuid_parse_pv_features(const char *spec, uint32_t *features);
+
+// Profile used by later setup_cpuid() calls (masked by what KVM supports)
+void cpuid_set_pv_features(uint32_t features);
+uint32_t cpuid_get_pv_features(void);
 
 // Print CPUID entry (for debugging)
 void print_cpuid_entry(struct kvm_cpuid_entry2 *entry);
@@ -0,0 +1,204 @@
+/*
+ * Host event loop for Mini-KVM
+ *
+ * Handlers live in a fixed table; each epoll registration points at its
+ * slot. An internal eventfd wakes the thread for shutdown.
+ */
+
+#include "event_loop.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+struct event_slot {
+    int fd;
+    event_handler_t handler;
+    void *opaque;
+};
+
+static struct {
+    int epoll_fd;
+    int stop_fd;
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    struct event_slot slots[EVENT_LOOP_MAX_HANDLERS];
+} loop = { .epoll_fd = -1, .stop_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void *event_loop_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[16];
+
+    for (;;) {
+        int n = epoll_wait(loop.epoll_fd, events, 16, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct event_slot *slot = events[i].data.ptr;
+            if (slot == NULL) {
+                return NULL; // stop_fd
+            }
+            if (slot->handler) {
+                slot->handler(slot->fd, events[i].events, slot->opaque);
+            }
+        }
+    }
+    return NULL;
+}
+
+int event_loop_init(void) {
+    if (loop.epoll_fd >= 0) {
+        return 0;
+    }
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        loop.slots[i].fd = -1;
+    }
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    loop.stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop.stop_fd < 0) {
+        perror("eventfd");
+        event_loop_stop();
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.stop_fd, &ev) < 0) {
+        perror("epoll_ctl stop_fd");
+        event_loop_stop();
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_add(int fd, uint32_t events, event_handler_t handler, void *opaque) {
+    struct event_slot *slot = NULL;
+
+    if (loop.epoll_fd < 0 && event_loop_init() < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&loop.lock);
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        if (loop.slots[i].fd < 0) {
+            slot = &loop.slots[i];
+            break;
+        }
+    }
+    if (!slot) {
+        pthread_mutex_unlock(&loop.lock);
+        fprintf(stderr, "Event loop: too many handlers\n");
+        return -1;
+    }
+    slot->fd = fd;
+    slot->handler = handler;
+    slot->opaque = opaque;
+    pthread_mutex_unlock(&loop.lock);
+
+    struct epoll_event ev = { .events = events, .data.ptr = slot };
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl add");
+        pthread_mutex_lock(&loop.lock);
+        slot->fd = -1;
+        pthread_mutex_unlock(&loop.lock);
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_mod(int fd, uint32_t events) {
+    struct event_slot *slot = NULL;
+
+    pthread_mutex_lock(&loop.lock);
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        if (loop.slots[i].fd == fd) {
+            slot = &loop.slots[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loop.lock);
+    if (!slot || loop.epoll_fd < 0) {
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = events, .data.ptr = slot };
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        perror("epoll_ctl mod");
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_del(int fd) {
+    if (loop.epoll_fd < 0) {
+        return -1;
+    }
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != ENOENT) {
+        perror("epoll_ctl del");
+    }
+
+    pthread_mutex_lock(&loop.lock);
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        if (loop.slots[i].fd == fd) {
+            loop.slots[i].fd = -1;
+            loop.slots[i].handler = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loop.lock);
+    return 0;
+}
+
+int event_loop_start(void) {
+    if (loop.running) {
+        return 0;
+    }
+    if (loop.epoll_fd < 0 && event_loop_init() < 0) {
+        return -1;
+    }
+    if (pthread_create(&loop.thread, NULL, event_loop_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to create event loop thread\n");
+        return -1;
+    }
+    loop.running = true;
+    DEBUG_PRINT(DEBUG_BASIC, "Event loop started");
+    return 0;
+}
+
+bool event_loop_running(void) {
+    return loop.running;
+}
+
+void event_loop_stop(void) {
+    uint64_t one = 1;
+
+    if (loop.running) {
+        if (write(loop.stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write event loop stop");
+        }
+        pthread_join(loop.thread, NULL);
+        loop.running = false;
+    }
+    if (loop.stop_fd >= 0) {
+        close(loop.stop_fd);
+        loop.stop_fd = -1;
+    }
+    if (loop.epoll_fd >= 0) {
+        close(loop.epoll_fd);
+        loop.epoll_fd = -1;
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * Host event loop for Mini-KVM
+ *
+ * A single epoll thread dispatches host-side device events (timer expiry,
+ * interrupt resamples, queue notifications), so device models need neither a
+ * thread of their own nor a vCPU exit to make progress.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define EVENT_LOOP_MAX_HANDLERS 64
+
+// Called on the event loop thread with the epoll event mask
+typedef void (*event_handler_t)(int fd, uint32_t events, void *opaque);
+
+int event_loop_init(void);
+
+// Watch fd (EPOLLIN etc.); safe before and after event_loop_start()
+int event_loop_add(int fd, uint32_t events, event_handler_t handler, void *opaque);
+
+// Change the events a watched fd is polled for (0 pauses it)
+int event_loop_mod(int fd, uint32_t events);
+
+// Stop watching fd (from the loop thread itself or while it is stopped)
+int event_loop_del(int fd);
+
+int event_loop_start(void);
+bool event_loop_running(void);
+
+// Stop the thread and release the epoll instance
+void event_loop_stop(void);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,234 @@
+/*
+ * Userspace IOAPIC for the split irqchip
+ *
+ * Register accesses arrive on vCPU threads; one mutex protects the state.
+ * Routes are only recommitted when a redirection entry changes in a way the
+ * MSI translation can see, so mask/unmask bursts cost one ioctl each.
+ */
+
+#include "ioapic.h"
+#include "irq.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+// Redirection entry fields
+#define REDIR_VECTOR_MASK    0xffULL
+#define REDIR_DELIVERY_SHIFT 8
+#define REDIR_DEST_LOGICAL   (1ULL << 11)
+#define REDIR_REMOTE_IRR     (1ULL << 14)
+#define REDIR_LEVEL          (1ULL << 15)
+#define REDIR_MASKED         (1ULL << 16)
+#define REDIR_DEST_SHIFT     56
+#define REDIR_RO_BITS        ((1ULL << 12) | REDIR_REMOTE_IRR) // Delivery status, remote IRR
+
+#define MSI_ADDR_BASE        0xFEE00000ULL
+#define MSI_DATA_LEVEL       ((1u << 15) | (1u << 14)) // Level triggered, asserted
+
+#define NO_GSI               UINT32_MAX
+
+static struct {
+    ioapic_state_t st;
+    uint64_t routed[IOAPIC_NUM_PINS]; // Entry the current route was built from
+    void (*resample[IOAPIC_NUM_PINS])(void *opaque);
+    void *resample_opaque[IOAPIC_NUM_PINS];
+    pthread_mutex_t lock;
+    int vm_fd;
+} ioapic = { .lock = PTHREAD_MUTEX_INITIALIZER, .vm_fd = -1 };
+
+// GSI feeding a pin (inverse of irq_ioapic_pin; pin 0 has none)
+static uint32_t pin_gsi(uint32_t pin) {
+    if (pin == 0) {
+        return NO_GSI;
+    }
+    return pin == 2 ? 0 : pin;
+}
+
+// Bits that change the MSI a pin is translated to
+static uint64_t route_bits(uint64_t entry) {
+    return entry & ~REDIR_RO_BITS;
+}
+
+static int route_pin(uint32_t pin) {
+    uint64_t entry = ioapic.st.redtbl[pin];
+    uint32_t gsi = pin_gsi(pin);
+
+    if (gsi == NO_GSI) {
+        return 0;
+    }
+    irq_route_remove(gsi);
+    if (!(entry & REDIR_MASKED) && (entry & REDIR_VECTOR_MASK) != 0) {
+        uint64_t address = MSI_ADDR_BASE | (((entry >> REDIR_DEST_SHIFT) & 0xff) << 12) |
+                           ((entry & REDIR_DEST_LOGICAL) ? (1u << 2) : 0);
+        uint32_t data = (uint32_t)(entry & REDIR_VECTOR_MASK) |
+                        (uint32_t)(((entry >> REDIR_DELIVERY_SHIFT) & 7) << 8) |
+                        ((entry & REDIR_LEVEL) ? MSI_DATA_LEVEL : 0);
+        if (irq_route_msi(gsi, address, data) < 0) {
+            return -1;
+        }
+    }
+    ioapic.routed[pin] = route_bits(entry);
+    return 0;
+}
+
+// Rebuild every pin's route and push the table (lock held)
+static int route_all(void) {
+    irq_routing_reset();
+    for (uint32_t pin = 0; pin < IOAPIC_NUM_PINS; pin++) {
+        if (route_pin(pin) < 0) {
+            return -1;
+        }
+    }
+    return irq_routing_commit(ioapic.vm_fd);
+}
+
+int ioapic_init(int vm_fd) {
+    pthread_mutex_lock(&ioapic.lock);
+    ioapic.vm_fd = vm_fd;
+    memset(&ioapic.st, 0, sizeof(ioapic.st));
+    for (uint32_t pin = 0; pin < IOAPIC_NUM_PINS; pin++) {
+        ioapic.st.redtbl[pin] = REDIR_MASKED;
+    }
+    int ret = route_all();
+    pthread_mutex_unlock(&ioapic.lock);
+    return ret;
+}
+
+bool ioapic_is_mmio(uint64_t gpa) {
+    return gpa >= IOAPIC_BASE_ADDR && gpa < IOAPIC_BASE_ADDR + IOAPIC_MMIO_SIZE;
+}
+
+static uint32_t read_reg(uint32_t reg) {
+    switch (reg) {
+    case IOAPIC_REG_ID:
+    case IOAPIC_REG_ARB:
+        return ioapic.st.id << 24;
+    case IOAPIC_REG_VER:
+        return ((IOAPIC_NUM_PINS - 1) << 16) | IOAPIC_VERSION;
+    default:
+        if (reg >= IOAPIC_REG_REDTBL && reg < IOAPIC_REG_REDTBL + 2 * IOAPIC_NUM_PINS) {
+            uint64_t entry = ioapic.st.redtbl[(reg - IOAPIC_REG_REDTBL) / 2];
+            return (reg & 1) ? (uint32_t)(entry >> 32) : (uint32_t)entry;
+        }
+        return 0;
+    }
+}
+
+static void write_reg(uint32_t reg, uint32_t val) {
+    if (reg == IOAPIC_REG_ID) {
+        ioapic.st.id = (val >> 24) & 0x0f;
+        return;
+    }
+    if (reg < IOAPIC_REG_REDTBL || reg >= IOAPIC_REG_REDTBL + 2 * IOAPIC_NUM_PINS) {
+        return;
+    }
+
+    uint32_t pin = (reg - IOAPIC_REG_REDTBL) / 2;
+    uint64_t entry = ioapic.st.redtbl[pin];
+    if (reg & 1) {
+        entry = (entry & 0xffffffffULL) | ((uint64_t)val << 32);
+    } else {
+        entry = (entry & ~0xffffffffULL) | (val & ~REDIR_RO_BITS) | (entry & REDIR_RO_BITS);
+    }
+    ioapic.st.redtbl[pin] = entry;
+
+    if (route_bits(entry) != ioapic.routed[pin]) {
+        DEBUG_PRINT(DEBUG_DETAILED, "IOAPIC: pin %u -> 0x%016llx", pin, (unsigned long long)entry);
+        if (route_pin(pin) == 0) {
+            irq_routing_commit(ioapic.vm_fd);
+        }
+    }
+}
+
+void ioapic_mmio_read(uint64_t gpa, uint8_t *data, uint32_t len) {
+    uint32_t offset = (uint32_t)(gpa - IOAPIC_BASE_ADDR);
+    uint32_t val = 0;
+
+    pthread_mutex_lock(&ioapic.lock);
+    if (offset == IOAPIC_REGSEL) {
+        val = ioapic.st.regsel;
+    } else if (offset == IOAPIC_IOWIN) {
+        val = read_reg(ioapic.st.regsel);
+    }
+    pthread_mutex_unlock(&ioapic.lock);
+
+    memset(data, 0, len);
+    memcpy(data, &val, len < sizeof(val) ? len : sizeof(val));
+}
+
+void ioapic_mmio_write(uint64_t gpa, const uint8_t *data, uint32_t len) {
+    uint32_t offset = (uint32_t)(gpa - IOAPIC_BASE_ADDR);
+    uint32_t val = 0;
+
+    memcpy(&val, data, len < sizeof(val) ? len : sizeof(val));
+    if (offset == IOAPIC_EOI) {
+        ioapic_eoi((uint8_t)val);
+        return;
+    }
+
+    pthread_mutex_lock(&ioapic.lock);
+    if (offset == IOAPIC_REGSEL) {
+        ioapic.st.regsel = val & 0xff;
+    } else if (offset == IOAPIC_IOWIN) {
+        write_reg(ioapic.st.regsel, val);
+    }
+    pthread_mutex_unlock(&ioapic.lock);
+}
+
+void ioapic_eoi(uint8_t vector) {
+    void (*fn[IOAPIC_NUM_PINS])(void *opaque);
+    void *opaque[IOAPIC_NUM_PINS];
+    int n = 0;
+
+    pthread_mutex_lock(&ioapic.lock);
+    for (uint32_t pin = 0; pin < IOAPIC_NUM_PINS; pin++) {
+        uint64_t entry = ioapic.st.redtbl[pin];
+        if ((entry & REDIR_LEVEL) && (entry & REDIR_VECTOR_MASK) == vector && ioapic.resample[pin]) {
+            fn[n] = ioapic.resample[pin];
+            opaque[n++] = ioapic.resample_opaque[pin];
+        }
+    }
+    pthread_mutex_unlock(&ioapic.lock);
+
+    // The callbacks may raise their irqfd again
+    for (int i = 0; i < n; i++) {
+        fn[i](opaque[i]);
+    }
+}
+
+void ioapic_set_resample(uint32_t pin, void (*fn)(void *opaque), void *opaque) {
+    if (pin >= IOAPIC_NUM_PINS) {
+        return;
+    }
+    pthread_mutex_lock(&ioapic.lock);
+    ioapic.resample[pin] = fn;
+    ioapic.resample_opaque[pin] = opaque;
+    pthread_mutex_unlock(&ioapic.lock);
+}
+
+bool ioapic_pin_ready(uint32_t pin) {
+    bool ready;
+
+    if (pin >= IOAPIC_NUM_PINS) {
+        return false;
+    }
+    pthread_mutex_lock(&ioapic.lock);
+    ready = !(ioapic.st.redtbl[pin] & REDIR_MASKED) && (ioapic.st.redtbl[pin] & REDIR_VECTOR_MASK) != 0;
+    pthread_mutex_unlock(&ioapic.lock);
+    return ready;
+}
+
+void ioapic_get_state(ioapic_state_t *st) {
+    pthread_mutex_lock(&ioapic.lock);
+    *st = ioapic.st;
+    pthread_mutex_unlock(&ioapic.lock);
+}
+
+int ioapic_set_state(const ioapic_state_t *st) {
+    pthread_mutex_lock(&ioapic.lock);
+    ioapic.st = *st;
+    int ret = route_all();
+    pthread_mutex_unlock(&ioapic.lock);
+    return ret;
+}
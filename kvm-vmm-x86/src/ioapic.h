@@ -0,0 +1,63 @@
+/*
+ * Userspace IOAPIC for the split irqchip (--irqchip split)
+ *
+ * With KVM_CAP_SPLIT_IRQCHIP only the local APICs live in the kernel. This
+ * model emulates the IOAPIC register window at 0xFEC00000 and turns every
+ * unmasked redirection entry into an MSI route for the pin's GSI, so irqfds
+ * bound to legacy GSIs still inject without leaving the kernel. Only guest
+ * reprogramming of the redirection table exits to userspace.
+ *
+ * Level-triggered pins are routed as level MSIs; KVM then reports the
+ * guest's EOI of their vector (KVM_EXIT_IOAPIC_EOI) and the pin's resample
+ * callback decides whether to raise the line again.
+ */
+
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IOAPIC_BASE_ADDR   0xFEC00000ULL
+#define IOAPIC_MMIO_SIZE   0x1000
+#define IOAPIC_NUM_PINS    24
+
+// Register window
+#define IOAPIC_REGSEL      0x00
+#define IOAPIC_IOWIN       0x10
+#define IOAPIC_EOI         0x40
+
+// Indirect registers
+#define IOAPIC_REG_ID      0x00
+#define IOAPIC_REG_VER     0x01
+#define IOAPIC_REG_ARB     0x02
+#define IOAPIC_REG_REDTBL  0x10
+
+#define IOAPIC_VERSION     0x20 // 82093AA-compatible, with the EOI register
+
+typedef struct {
+    uint32_t id;
+    uint32_t regsel;
+    uint64_t redtbl[IOAPIC_NUM_PINS];
+} ioapic_state_t;
+
+// Reset (all pins masked) and install the (empty) MSI routes
+int ioapic_init(int vm_fd);
+
+bool ioapic_is_mmio(uint64_t gpa);
+void ioapic_mmio_read(uint64_t gpa, uint8_t *data, uint32_t len);
+void ioapic_mmio_write(uint64_t gpa, const uint8_t *data, uint32_t len);
+
+// The guest EOI'd a level-triggered vector (KVM_EXIT_IOAPIC_EOI)
+void ioapic_eoi(uint8_t vector);
+
+// Called on the vCPU thread after the guest EOIs a level-triggered pin
+void ioapic_set_resample(uint32_t pin, void (*fn)(void *opaque), void *opaque);
+
+// Unmasked with a vector programmed
+bool ioapic_pin_ready(uint32_t pin);
+
+void ioapic_get_state(ioapic_state_t *st);
+int ioapic_set_state(const ioapic_state_t *st);
+
+#endif // IOAPIC_H
@@ -0,0 +1,210 @@
+/*
+ * Interrupt delivery helpers for Mini-KVM
+ */
+
+#include "irq.h"
+#include "ioapic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+
+// Routing table; edited from vCPU threads (IOAPIC programming) and main
+static struct {
+    struct kvm_irq_routing_entry entries[IRQ_MAX_ROUTES];
+    uint32_t nr;
+    pthread_mutex_t lock;
+} routing = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int irqfd_assign(int vm_fd, uint32_t gsi, int *resample_fd) {
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    struct kvm_irqfd irqfd;
+    memset(&irqfd, 0, sizeof(irqfd));
+    irqfd.fd = (uint32_t)fd;
+    irqfd.gsi = gsi;
+    if (resample_fd) {
+        *resample_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (*resample_fd < 0) {
+            perror("eventfd");
+            close(fd);
+            return -1;
+        }
+        irqfd.flags = KVM_IRQFD_FLAG_RESAMPLE;
+        irqfd.resamplefd = (uint32_t)*resample_fd;
+    }
+    if (ioctl(vm_fd, KVM_IRQFD, &irqfd) < 0) {
+        perror("KVM_IRQFD");
+        close(fd);
+        if (resample_fd) {
+            close(*resample_fd);
+            *resample_fd = -1;
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int irq_irqfd_create(int vm_fd, uint32_t gsi) {
+    return irqfd_assign(vm_fd, gsi, NULL);
+}
+
+int irq_irqfd_create_resample(int vm_fd, uint32_t gsi, int *resample_fd) {
+    return irqfd_assign(vm_fd, gsi, resample_fd);
+}
+
+void irq_irqfd_release(int vm_fd, int fd, int resample_fd, uint32_t gsi) {
+    if (fd >= 0) {
+        struct kvm_irqfd irqfd;
+        memset(&irqfd, 0, sizeof(irqfd));
+        irqfd.fd = (uint32_t)fd;
+        irqfd.gsi = gsi;
+        irqfd.flags = KVM_IRQFD_FLAG_DEASSIGN;
+        if (vm_fd >= 0 && ioctl(vm_fd, KVM_IRQFD, &irqfd) < 0) {
+            perror("KVM_IRQFD deassign");
+        }
+        close(fd);
+    }
+    if (resample_fd >= 0) {
+        close(resample_fd);
+    }
+}
+
+int irq_irqfd_raise(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+        perror("irqfd write");
+        return -1;
+    }
+    return 0;
+}
+
+bool irq_guest_ready(int vm_fd, uint32_t irq) {
+    struct kvm_irqchip chip;
+    uint32_t pin = irq_ioapic_pin(irq);
+
+    memset(&chip, 0, sizeof(chip));
+    chip.chip_id = irq < 8 ? KVM_IRQCHIP_PIC_MASTER : KVM_IRQCHIP_PIC_SLAVE;
+    if (ioctl(vm_fd, KVM_GET_IRQCHIP, &chip) == 0 && chip.chip.pic.irq_base != 0 &&
+        !(chip.chip.pic.imr & (1u << (irq & 7)))) {
+        return true;
+    }
+
+    memset(&chip, 0, sizeof(chip));
+    chip.chip_id = KVM_IRQCHIP_IOAPIC;
+    if (ioctl(vm_fd, KVM_GET_IRQCHIP, &chip) == 0) {
+        return pin < KVM_IOAPIC_NUM_PINS && !chip.chip.ioapic.redirtbl[pin].fields.mask &&
+               chip.chip.ioapic.redirtbl[pin].fields.vector != 0;
+    }
+    // Split irqchip: the IOAPIC is ours
+    return ioapic_pin_ready(pin);
+}
+
+uint32_t irq_ioapic_pin(uint32_t irq) {
+    return irq == 0 ? 2 : irq;
+}
+
+void irq_routing_reset(void) {
+    pthread_mutex_lock(&routing.lock);
+    routing.nr = 0;
+    pthread_mutex_unlock(&routing.lock);
+}
+
+static int route_add(const struct kvm_irq_routing_entry *e) {
+    int ret = 0;
+
+    pthread_mutex_lock(&routing.lock);
+    if (routing.nr >= IRQ_MAX_ROUTES) {
+        fprintf(stderr, "IRQ routing table full (GSI %u)\n", e->gsi);
+        ret = -1;
+    } else {
+        routing.entries[routing.nr++] = *e;
+    }
+    pthread_mutex_unlock(&routing.lock);
+    return ret;
+}
+
+int irq_route_irqchip(uint32_t gsi, uint32_t irqchip, uint32_t pin) {
+    struct kvm_irq_routing_entry e;
+
+    memset(&e, 0, sizeof(e));
+    e.gsi = gsi;
+    e.type = KVM_IRQ_ROUTING_IRQCHIP;
+    e.u.irqchip.irqchip = irqchip;
+    e.u.irqchip.pin = pin;
+    return route_add(&e);
+}
+
+int irq_route_msi(uint32_t gsi, uint64_t address, uint32_t data) {
+    struct kvm_irq_routing_entry e;
+
+    memset(&e, 0, sizeof(e));
+    e.gsi = gsi;
+    e.type = KVM_IRQ_ROUTING_MSI;
+    e.u.msi.address_lo = (uint32_t)address;
+    e.u.msi.address_hi = (uint32_t)(address >> 32);
+    e.u.msi.data = data;
+    return route_add(&e);
+}
+
+void irq_route_remove(uint32_t gsi) {
+    pthread_mutex_lock(&routing.lock);
+    for (uint32_t i = 0; i < routing.nr;) {
+        if (routing.entries[i].gsi == gsi) {
+            routing.entries[i] = routing.entries[--routing.nr];
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&routing.lock);
+}
+
+int irq_routing_commit(int vm_fd) {
+    struct kvm_irq_routing *table;
+    int ret = 0;
+
+    table = calloc(1, sizeof(*table) + IRQ_MAX_ROUTES * sizeof(struct kvm_irq_routing_entry));
+    if (!table) {
+        perror("calloc");
+        return -1;
+    }
+    pthread_mutex_lock(&routing.lock);
+    table->nr = routing.nr;
+    memcpy(table->entries, routing.entries, routing.nr * sizeof(routing.entries[0]));
+    if (ioctl(vm_fd, KVM_SET_GSI_ROUTING, table) < 0) {
+        perror("KVM_SET_GSI_ROUTING");
+        ret = -1;
+    }
+    pthread_mutex_unlock(&routing.lock);
+    free(table);
+    return ret;
+}
+
+int irq_routing_setup_legacy(int vm_fd) {
+    irq_routing_reset();
+    for (uint32_t gsi = 0; gsi < IRQ_IOAPIC_PINS; gsi++) {
+        int ret = 0;
+
+        if (gsi < 16 && gsi != 2) {
+            ret |= irq_route_irqchip(gsi, gsi < 8 ? KVM_IRQCHIP_PIC_MASTER : KVM_IRQCHIP_PIC_SLAVE,
+                                     gsi & 7);
+        }
+        // IOAPIC pin 2 belongs to IRQ0; GSI 2 (the PIC cascade) goes nowhere
+        if (gsi != 2) {
+            ret |= irq_route_irqchip(gsi, KVM_IRQCHIP_IOAPIC, irq_ioapic_pin(gsi));
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    return irq_routing_commit(vm_fd);
+}
@@ -0,0 +1,56 @@
+/*
+ * Interrupt delivery helpers for Mini-KVM
+ *
+ * An irqfd is an eventfd bound to a GSI of the in-kernel irqchip: a write to
+ * it injects an edge (assert + deassert) without any ioctl or vCPU exit.
+ *
+ * A resampling irqfd models a level-triggered line instead: a write asserts
+ * the GSI and it stays asserted until the guest EOIs the interrupt. KVM then
+ * deasserts it and signals the resamplefd, and the device re-raises the
+ * line if its interrupt condition still holds.
+ *
+ * GSIs reach the interrupt controllers through a routing table that lives
+ * here and is pushed to KVM as a whole (KVM_SET_GSI_ROUTING replaces the
+ * table). The PC layout follows the MP/ACPI convention: ISA IRQ n is PIC pin
+ * n and IOAPIC pin n, except IRQ0 (PIT), which is wired to IOAPIC pin 2.
+ */
+
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IRQ_MAX_ROUTES   256
+#define IRQ_IOAPIC_PINS  24
+
+// Create an eventfd and bind it to gsi; returns the eventfd or -1
+int irq_irqfd_create(int vm_fd, uint32_t gsi);
+
+// Level-triggered variant; *resample_fd receives the EOI notification eventfd
+int irq_irqfd_create_resample(int vm_fd, uint32_t gsi, int *resample_fd);
+
+// Unbind and close an irqfd (resample_fd may be -1)
+void irq_irqfd_release(int vm_fd, int fd, int resample_fd, uint32_t gsi);
+
+// Signal an irqfd (one eventfd write)
+int irq_irqfd_raise(int fd);
+
+// True once the guest has set up the PIC (vector base programmed) or
+// unmasked the IOAPIC pin for the given legacy IRQ
+bool irq_guest_ready(int vm_fd, uint32_t irq);
+
+// IOAPIC pin an ISA IRQ / legacy GSI is wired to
+uint32_t irq_ioapic_pin(uint32_t irq);
+
+// Routing table edits (applied by irq_routing_commit)
+void irq_routing_reset(void);
+int irq_route_irqchip(uint32_t gsi, uint32_t irqchip, uint32_t pin);
+int irq_route_msi(uint32_t gsi, uint64_t address, uint32_t data);
+void irq_route_remove(uint32_t gsi);
+int irq_routing_commit(int vm_fd);
+
+// PC routing for the in-kernel PIC + IOAPIC
+int irq_routing_setup_legacy(int vm_fd);
+
+#endif // IRQ_H
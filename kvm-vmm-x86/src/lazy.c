@@ -0,0 +1,619 @@
+/*
+ * Lazy (post-copy) snapshot restore for Mini-KVM
+ *
+ * Pages are installed with UFFDIO_COPY, which also wakes every thread (vCPU
+ * in KVM_RUN or VMM) blocked on them. The fault and prefetch threads may race
+ * for the same page; the loser gets EEXIST and only has to wake waiters.
+ *
+ * Working-set recording holds the prefetcher back for the recording window so
+ * that every page the guest touches arrives as a fault, in access order.
+ */
+
+#include "lazy.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#define LAZY_PAGE_SIZE 4096
+
+struct lazy_region {
+    uint32_t slot;
+    uint8_t *hva;
+    uint64_t size;
+    uint64_t file_offset;
+    uint8_t *present; // One byte per page, set once the page is installed
+    uint32_t *hints;
+    size_t nhints;
+};
+
+static struct {
+    int uffd;
+    int file_fd;
+    int stop_fd;
+    struct lazy_region regions[LAZY_MAX_REGIONS];
+    int nregions;
+    pthread_t fault_thread;
+    pthread_t prefetch_thread;
+    bool fault_started;
+    bool prefetch_started;
+    volatile bool stopping;
+    uint64_t faults;     // Pages served on demand
+    uint64_t prefetched; // Pages installed ahead of the guest
+    struct timespec start;
+
+    // Working-set recording (fault order during the first record_ms)
+    pthread_mutex_t wss_lock;
+    volatile bool recording;
+    int record_ms;
+    char wss_path[PATH_MAX];
+    struct lazy_wss_entry *wss;
+    size_t nwss;
+    size_t wss_cap;
+} lazy = { .uffd = -1, .file_fd = -1, .stop_fd = -1, .wss_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static double lazy_elapsed_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - lazy.start.tv_sec) * 1e3 + (now.tv_nsec - lazy.start.tv_nsec) / 1e6;
+}
+
+static int open_userfaultfd(void) {
+    int fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef USERFAULTFD_IOC_NEW
+    // Without vm.unprivileged_userfaultfd the device node may still be usable
+    if (fd < 0 && errno == EPERM) {
+        int dev = open("/dev/userfaultfd", O_RDWR | O_CLOEXEC);
+        if (dev >= 0) {
+            fd = ioctl(dev, USERFAULTFD_IOC_NEW, O_CLOEXEC | O_NONBLOCK);
+            close(dev);
+        }
+    }
+#endif
+    if (fd < 0) {
+        perror("userfaultfd");
+        return -1;
+    }
+
+    struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+    if (ioctl(fd, UFFDIO_API, &api) < 0) {
+        perror("UFFDIO_API");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static struct lazy_region *find_region(uint64_t addr) {
+    for (int i = 0; i < lazy.nregions; i++) {
+        struct lazy_region *reg = &lazy.regions[i];
+        if (addr >= (uint64_t)(uintptr_t)reg->hva && addr < (uint64_t)(uintptr_t)reg->hva + reg->size) {
+            return reg;
+        }
+    }
+    return NULL;
+}
+
+static bool page_present(const struct lazy_region *reg, uint64_t page) {
+    return __atomic_load_n(&reg->present[page], __ATOMIC_ACQUIRE) != 0;
+}
+
+// Read npages from the snapshot file; holes past EOF read as zeros
+static void read_pages(const struct lazy_region *reg, uint64_t page, uint64_t npages, uint8_t *buf) {
+    size_t len = npages * LAZY_PAGE_SIZE;
+    off_t off = (off_t)(reg->file_offset + page * LAZY_PAGE_SIZE);
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(lazy.file_fd, buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                perror("lazy restore pread");
+            }
+            memset(buf + done, 0, len - done);
+            break;
+        }
+        done += (size_t)n;
+    }
+}
+
+static void record_fault(const struct lazy_region *reg, uint64_t page) {
+    pthread_mutex_lock(&lazy.wss_lock);
+    if (lazy.recording) {
+        if (lazy.nwss == lazy.wss_cap) {
+            size_t cap = lazy.wss_cap ? lazy.wss_cap * 2 : 1024;
+            struct lazy_wss_entry *wss = realloc(lazy.wss, cap * sizeof(*wss));
+            if (!wss) {
+                perror("realloc working set");
+                lazy.recording = false;
+                pthread_mutex_unlock(&lazy.wss_lock);
+                return;
+            }
+            lazy.wss = wss;
+            lazy.wss_cap = cap;
+        }
+        lazy.wss[lazy.nwss].slot = reg->slot;
+        lazy.wss[lazy.nwss].page = (uint32_t)page;
+        lazy.nwss++;
+    }
+    pthread_mutex_unlock(&lazy.wss_lock);
+}
+
+static void wake_pages(const struct lazy_region *reg, uint64_t page, uint64_t npages) {
+    struct uffdio_range range = {
+        .start = (uint64_t)(uintptr_t)(reg->hva + page * LAZY_PAGE_SIZE),
+        .len = npages * LAZY_PAGE_SIZE,
+    };
+    ioctl(lazy.uffd, UFFDIO_WAKE, &range);
+}
+
+/*
+ * Install npages starting at page from buf
+ * Returns the number of pages this call installed (pages that were already
+ * present are skipped)
+ */
+static uint64_t install_pages(struct lazy_region *reg, uint64_t page, uint64_t npages, const uint8_t *buf) {
+    uint64_t installed = 0;
+
+    while (npages > 0) {
+        struct uffdio_copy copy = {
+            .dst = (uint64_t)(uintptr_t)(reg->hva + page * LAZY_PAGE_SIZE),
+            .src = (uint64_t)(uintptr_t)buf,
+            .len = npages * LAZY_PAGE_SIZE,
+            .mode = 0,
+        };
+        uint64_t done = 0;
+
+        if (ioctl(lazy.uffd, UFFDIO_COPY, &copy) == 0) {
+            done = npages;
+        } else if (copy.copy > 0) {
+            done = (uint64_t)copy.copy / LAZY_PAGE_SIZE; // Partial copy, retry the rest
+        } else if (errno == EEXIST || copy.copy == -EEXIST) {
+            // Somebody else installed the first page: skip it
+            __atomic_store_n(&reg->present[page], 1, __ATOMIC_RELEASE);
+            wake_pages(reg, page, 1);
+            page++;
+            npages--;
+            buf += LAZY_PAGE_SIZE;
+            continue;
+        } else if (errno == EAGAIN || errno == EINTR) {
+            continue;
+        } else {
+            perror("UFFDIO_COPY");
+            return installed;
+        }
+
+        for (uint64_t i = 0; i < done; i++) {
+            __atomic_store_n(&reg->present[page + i], 1, __ATOMIC_RELEASE);
+        }
+        installed += done;
+        page += done;
+        npages -= done;
+        buf += done * LAZY_PAGE_SIZE;
+    }
+    return installed;
+}
+
+static void *fault_thread_func(void *arg) {
+    (void)arg;
+    uint8_t *buf = aligned_alloc(LAZY_PAGE_SIZE, LAZY_PAGE_SIZE);
+    struct pollfd pfd[2] = {
+        { .fd = lazy.uffd, .events = POLLIN },
+        { .fd = lazy.stop_fd, .events = POLLIN },
+    };
+
+    if (!buf) {
+        perror("aligned_alloc fault buffer");
+        return NULL;
+    }
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll userfaultfd");
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        struct uffd_msg msg;
+        ssize_t n = read(lazy.uffd, &msg, sizeof(msg));
+        if (n != (ssize_t)sizeof(msg)) {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            perror("read userfaultfd");
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        struct lazy_region *reg = find_region(msg.arg.pagefault.address);
+        if (!reg) {
+            continue;
+        }
+        uint64_t page = (msg.arg.pagefault.address - (uint64_t)(uintptr_t)reg->hva) / LAZY_PAGE_SIZE;
+        if (page_present(reg, page)) {
+            wake_pages(reg, page, 1);
+            continue;
+        }
+        record_fault(reg, page);
+        read_pages(reg, page, 1, buf);
+        if (install_pages(reg, page, 1, buf) > 0) {
+            __atomic_add_fetch(&lazy.faults, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Prefetch the missing pages of [first, first + count) with one read
+ * (count <= LAZY_PREFETCH_RUN); present pages at either end are not read
+ */
+static void prefetch_range(struct lazy_region *reg, uint64_t first, uint64_t count, uint8_t *buf) {
+    uint64_t npages = reg->size / LAZY_PAGE_SIZE;
+    uint64_t end;
+
+    if (first + count > npages) {
+        count = first < npages ? npages - first : 0;
+    }
+    end = first + count;
+    while (first < end && page_present(reg, first)) {
+        first++;
+    }
+    while (end > first && page_present(reg, end - 1)) {
+        end--;
+    }
+    if (first == end) {
+        return;
+    }
+
+    read_pages(reg, first, end - first, buf);
+    for (uint64_t page = first; page < end;) {
+        if (page_present(reg, page)) {
+            page++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (page + run < end && !page_present(reg, page + run)) {
+            run++;
+        }
+        __atomic_add_fetch(&lazy.prefetched,
+                           install_pages(reg, page, run, buf + (page - first) * LAZY_PAGE_SIZE),
+                           __ATOMIC_RELAXED);
+        page += run;
+    }
+}
+
+static int compare_pages(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Replay the hints in windows of LAZY_HINT_BATCH pages: each window is
+ * sorted and merged into sequential reads (bridging gaps of up to
+ * LAZY_HINT_GAP pages), so the access order is kept at window granularity
+ * while the file is read in large sequential chunks
+ */
+static void prefetch_hints(struct lazy_region *reg, uint8_t *buf) {
+    uint32_t batch[LAZY_HINT_BATCH];
+
+    for (size_t h = 0; h < reg->nhints && !lazy.stopping; h += LAZY_HINT_BATCH) {
+        size_t n = reg->nhints - h < LAZY_HINT_BATCH ? reg->nhints - h : LAZY_HINT_BATCH;
+        memcpy(batch, reg->hints + h, n * sizeof(batch[0]));
+        qsort(batch, n, sizeof(batch[0]), compare_pages);
+
+        for (size_t k = 0; k < n;) {
+            uint32_t first = batch[k];
+            uint32_t last = first;
+            while (k < n && batch[k] - last <= LAZY_HINT_GAP && batch[k] - first < LAZY_PREFETCH_RUN) {
+                last = batch[k++];
+            }
+            prefetch_range(reg, first, last - first + 1, buf);
+        }
+    }
+}
+
+static int save_wss(void) {
+    struct lazy_wss_header hdr = { .magic = LAZY_WSS_MAGIC, .version = LAZY_WSS_VERSION };
+    int fd = open(lazy.wss_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ret = -1;
+
+    if (fd < 0) {
+        perror("open working set file");
+        return -1;
+    }
+    hdr.count = (uint32_t)lazy.nwss;
+    size_t len = lazy.nwss * sizeof(*lazy.wss);
+    if (write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+        (len == 0 || write(fd, lazy.wss, len) == (ssize_t)len)) {
+        ret = 0;
+    } else {
+        perror("write working set file");
+    }
+    close(fd);
+    return ret;
+}
+
+// Let the guest run unassisted for the recording window, then save its fault order
+static void finish_recording(void) {
+    struct pollfd pfd = { .fd = lazy.stop_fd, .events = POLLIN };
+    double left;
+
+    while (!lazy.stopping && (left = lazy.record_ms - lazy_elapsed_ms()) > 0) {
+        poll(&pfd, 1, (int)left + 1);
+    }
+
+    pthread_mutex_lock(&lazy.wss_lock);
+    lazy.recording = false;
+    pthread_mutex_unlock(&lazy.wss_lock);
+
+    if (save_wss() == 0) {
+        fprintf(stderr, "\n[WSS] Recorded %zu page(s) touched in the first %d ms to %s\n",
+                lazy.nwss, lazy.record_ms, lazy.wss_path);
+    }
+}
+
+static void *prefetch_thread_func(void *arg) {
+    (void)arg;
+    uint8_t *buf = aligned_alloc(LAZY_PAGE_SIZE, LAZY_PREFETCH_RUN * LAZY_PAGE_SIZE);
+
+    if (!buf) {
+        perror("aligned_alloc prefetch buffer");
+        return NULL;
+    }
+    if (lazy.recording) {
+        finish_recording();
+    }
+
+    // Hinted pages of every slot first, then everything else sequentially
+    for (int i = 0; i < lazy.nregions && !lazy.stopping; i++) {
+        prefetch_hints(&lazy.regions[i], buf);
+    }
+    for (int i = 0; i < lazy.nregions && !lazy.stopping; i++) {
+        struct lazy_region *reg = &lazy.regions[i];
+        uint64_t npages = reg->size / LAZY_PAGE_SIZE;
+
+        for (uint64_t page = 0; page < npages && !lazy.stopping; page += LAZY_PREFETCH_RUN) {
+            prefetch_range(reg, page, LAZY_PREFETCH_RUN, buf);
+        }
+    }
+    free(buf);
+
+    // Every page is present (or the VM is gone): no more faults can arrive
+    for (int i = 0; i < lazy.nregions; i++) {
+        struct uffdio_range range = {
+            .start = (uint64_t)(uintptr_t)lazy.regions[i].hva,
+            .len = lazy.regions[i].size,
+        };
+        if (ioctl(lazy.uffd, UFFDIO_UNREGISTER, &range) < 0) {
+            perror("UFFDIO_UNREGISTER");
+        }
+    }
+    DEBUG_PRINT(DEBUG_BASIC, "Lazy restore complete after %.3f ms: %llu page(s) on fault, %llu prefetched",
+                lazy_elapsed_ms(), (unsigned long long)lazy.faults, (unsigned long long)lazy.prefetched);
+    return NULL;
+}
+
+int lazy_restore_open(const char *snapshot_path) {
+    lazy.file_fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (lazy.file_fd < 0) {
+        perror("open snapshot for lazy restore");
+        return -1;
+    }
+    lazy.uffd = open_userfaultfd();
+    lazy.stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (lazy.uffd < 0 || lazy.stop_fd < 0) {
+        if (lazy.stop_fd < 0) {
+            perror("eventfd");
+        }
+        lazy_restore_close();
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &lazy.start);
+    if (pthread_create(&lazy.fault_thread, NULL, fault_thread_func, NULL) != 0) {
+        fprintf(stderr, "Failed to create lazy restore fault thread\n");
+        lazy_restore_close();
+        return -1;
+    }
+    lazy.fault_started = true;
+    return 0;
+}
+
+int lazy_restore_add_region(uint32_t slot, void *hva, uint64_t size, uint64_t file_offset) {
+    if (lazy.nregions >= LAZY_MAX_REGIONS || size % LAZY_PAGE_SIZE != 0) {
+        fprintf(stderr, "Lazy restore cannot track memory slot %u\n", slot);
+        return -1;
+    }
+
+    struct lazy_region *reg = &lazy.regions[lazy.nregions];
+    memset(reg, 0, sizeof(*reg));
+    reg->present = calloc(size / LAZY_PAGE_SIZE, 1);
+    if (!reg->present) {
+        perror("calloc lazy restore page map");
+        return -1;
+    }
+
+    struct uffdio_register reg_args = {
+        .range = { .start = (uint64_t)(uintptr_t)hva, .len = size },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (ioctl(lazy.uffd, UFFDIO_REGISTER, &reg_args) < 0) {
+        perror("UFFDIO_REGISTER");
+        free(reg->present);
+        return -1;
+    }
+
+    reg->slot = slot;
+    reg->hva = hva;
+    reg->size = size;
+    reg->file_offset = file_offset;
+    lazy.nregions++;
+    return 0;
+}
+
+int lazy_restore_set_hints(uint32_t slot, const uint32_t *pages, size_t npages) {
+    for (int i = 0; i < lazy.nregions; i++) {
+        struct lazy_region *reg = &lazy.regions[i];
+        if (reg->slot != slot) {
+            continue;
+        }
+
+        uint64_t slot_pages = reg->size / LAZY_PAGE_SIZE;
+        free(reg->hints);
+        reg->hints = NULL;
+        reg->nhints = 0;
+        if (npages == 0) {
+            return 0;
+        }
+        reg->hints = malloc(npages * sizeof(*pages));
+        if (!reg->hints) {
+            perror("malloc lazy restore hints");
+            return -1;
+        }
+        for (size_t h = 0; h < npages; h++) {
+            if (pages[h] < slot_pages) {
+                reg->hints[reg->nhints++] = pages[h];
+            }
+        }
+        return 0;
+    }
+    return 0; // Slot restored eagerly: hints are not needed
+}
+
+int lazy_restore_record(const char *wss_path, int record_ms) {
+    if (snprintf(lazy.wss_path, sizeof(lazy.wss_path), "%s", wss_path) >= (int)sizeof(lazy.wss_path)) {
+        fprintf(stderr, "Working set path too long\n");
+        return -1;
+    }
+    lazy.record_ms = record_ms;
+    lazy.recording = true;
+    return 0;
+}
+
+int lazy_restore_load_wss(const char *wss_path, size_t *npages) {
+    struct lazy_wss_header hdr;
+    struct lazy_wss_entry *wss = NULL;
+    uint32_t *pages = NULL;
+    int ret = -1;
+
+    *npages = 0;
+    int fd = open(wss_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != LAZY_WSS_MAGIC || hdr.version != LAZY_WSS_VERSION) {
+        fprintf(stderr, "%s is not a working set file\n", wss_path);
+        goto out;
+    }
+    if (hdr.count == 0) {
+        ret = 0;
+        goto out;
+    }
+
+    size_t len = (size_t)hdr.count * sizeof(*wss);
+    wss = malloc(len);
+    pages = malloc((size_t)hdr.count * sizeof(*pages));
+    if (!wss || !pages || read(fd, wss, len) != (ssize_t)len) {
+        fprintf(stderr, "Failed to read working set %s\n", wss_path);
+        goto out;
+    }
+
+    // Recorded entries interleave slots: split them per region, keeping order
+    for (int i = 0; i < lazy.nregions; i++) {
+        size_t n = 0;
+        for (uint32_t e = 0; e < hdr.count; e++) {
+            if (wss[e].slot == lazy.regions[i].slot) {
+                pages[n++] = wss[e].page;
+            }
+        }
+        if (n > 0 && lazy_restore_set_hints(lazy.regions[i].slot, pages, n) < 0) {
+            goto out;
+        }
+        *npages += n;
+    }
+    ret = 0;
+
+out:
+    free(wss);
+    free(pages);
+    close(fd);
+    return ret;
+}
+
+int lazy_restore_start(void) {
+    if (pthread_create(&lazy.prefetch_thread, NULL, prefetch_thread_func, NULL) != 0) {
+        fprintf(stderr, "Failed to create lazy restore prefetch thread\n");
+        return -1;
+    }
+    lazy.prefetch_started = true;
+    return 0;
+}
+
+bool lazy_restore_active(void) {
+    return lazy.uffd >= 0;
+}
+
+void lazy_restore_close(void) {
+    uint64_t one = 1;
+
+    lazy.stopping = true;
+    if (lazy.stop_fd >= 0 && write(lazy.stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write lazy restore stop");
+    }
+    if (lazy.prefetch_started) {
+        pthread_join(lazy.prefetch_thread, NULL);
+        lazy.prefetch_started = false;
+    }
+    if (lazy.fault_started) {
+        pthread_join(lazy.fault_thread, NULL);
+        lazy.fault_started = false;
+    }
+
+    for (int i = 0; i < lazy.nregions; i++) {
+        free(lazy.regions[i].present);
+        free(lazy.regions[i].hints);
+    }
+    lazy.nregions = 0;
+    free(lazy.wss);
+    lazy.wss = NULL;
+    lazy.nwss = lazy.wss_cap = 0;
+    lazy.recording = false;
+    if (lazy.uffd >= 0) {
+        close(lazy.uffd);
+        lazy.uffd = -1;
+    }
+    if (lazy.stop_fd >= 0) {
+        close(lazy.stop_fd);
+        lazy.stop_fd = -1;
+    }
+    if (lazy.file_fd >= 0) {
+        close(lazy.file_fd);
+        lazy.file_fd = -1;
+    }
+    lazy.stopping = false;
+}
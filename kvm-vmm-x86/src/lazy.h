@@ -0,0 +1,70 @@
+/*
+ * Lazy (post-copy) snapshot restore for Mini-KVM
+ *
+ * Instead of reading guest RAM before the first instruction, the memory
+ * slots are left empty and registered with userfaultfd. A fault thread
+ * serves every missing page the guest (or the VMM) touches straight from
+ * the snapshot file, while a prefetch thread populates the rest in the
+ * background: first in the access order hinted by the snapshot, then
+ * sequentially in large reads. Once every page is present the regions are
+ * unregistered and both threads exit.
+ *
+ * A restore can also record its working set: the order in which pages were
+ * faulted in during the first milliseconds after resume. The result is kept
+ * next to the snapshot (<snapshot>.wss) and replaces the snapshot's own hints
+ * on later lazy restores.
+ */
+
+#ifndef LAZY_H
+#define LAZY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LAZY_MAX_REGIONS   32
+#define LAZY_PREFETCH_RUN  64  // Pages per prefetch read (256 KB)
+#define LAZY_HINT_BATCH    256 // Hints sorted together into sequential reads
+#define LAZY_HINT_GAP      8   // Missing pages bridged between hinted pages
+
+#define LAZY_WSS_MAGIC     0x315353574d564b4dULL // "MKVMWSS1"
+#define LAZY_WSS_VERSION   1
+
+// Working set file: header followed by `count` entries in access order
+struct lazy_wss_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t count;
+};
+
+struct lazy_wss_entry {
+    uint32_t slot;
+    uint32_t page;
+};
+
+// Open the snapshot file and a userfaultfd; the fault thread starts here
+int lazy_restore_open(const char *snapshot_path);
+
+// Register an empty guest memory slot whose pages live at file_offset
+int lazy_restore_add_region(uint32_t slot, void *hva, uint64_t size, uint64_t file_offset);
+
+// Prefetch order for a slot (page indices, copied)
+int lazy_restore_set_hints(uint32_t slot, const uint32_t *pages, size_t npages);
+
+// Record the fault order for the first record_ms into wss_path; the
+// prefetcher waits until the window closes (call before lazy_restore_start)
+int lazy_restore_record(const char *wss_path, int record_ms);
+
+// Use a recorded working set as prefetch hints (a missing file is not an
+// error); npages receives the number of hinted pages
+int lazy_restore_load_wss(const char *wss_path, size_t *npages);
+
+// Start the background prefetch (call once all regions are added)
+int lazy_restore_start(void);
+
+bool lazy_restore_active(void);
+
+// Stop both threads and release the userfaultfd (vCPUs must be stopped)
+void lazy_restore_close(void);
+
+#endif // LAZY_H
@@ -17,6 +17,7 @@
 // Boot protocol versions
 #define BOOT_PROTOCOL_2_00      0x0200
 #define BOOT_PROTOCOL_2_02      0x0202
+#define BOOT_PROTOCOL_2_06      0x0206      // cmdline_size field
 #define BOOT_PROTOCOL_2_10      0x0210
 
 // Loader type IDs (we use 0xFF for "undefined")
@@ -26,6 +27,7 @@
 #define KERNEL_LOAD_ADDR        0x100000    // 1MB (protected mode kernel)
 #define REAL_MODE_KERNEL_ADDR   0x10000     // Real-mode kernel setup
 #define COMMAND_LINE_ADDR       0x20000     // Command line location
+#define COMMAND_LINE_MAX        2048        // Bytes reserved at COMMAND_LINE_ADDR
 #define INITRD_ADDR_MAX         0x37FFFFFF  // Max initrd address (<896MB)
 #define INITRD_LOAD_ADDR        0x04000000  // 64MB default initrd load address
 #define LINUX_BOOT_PARAMS_ADDR  0x90000     // traditional "zero page" location
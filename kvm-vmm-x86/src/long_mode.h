@@ -168,6 +168,7 @@ typedef struct __attribute__((packed)) {
 #define CPUID_FEAT_FXSR         (1 << 24)  // FXSAVE/FXRSTOR
 #define CPUID_FEAT_SSE          (1 << 25)  // SSE
 #define CPUID_FEAT_SSE2         (1 << 26)  // SSE2
+#define CPUID_FEAT_HTT          (1 << 28)  // Multiple logical processors per package
 
 // CPUID.01H:ECX - Additional Feature Bits
 #define CPUID_FEAT_SSE3         (1 << 0)   // SSE3
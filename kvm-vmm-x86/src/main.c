@@ -4,6 +4,8 @@
  * This VMM creates a VM using Linux KVM API and runs a simple guest in Real Mode or Protected Mode.
  */
 
+#define _GNU_SOURCE // memfd_create
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +19,16 @@
 #include <errno.h>
 #include <pthread.h>
 #include <termios.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <limits.h>
 #include "protected_mode.h"
 #include "long_mode.h"
 #include "debug.h"
@@ -24,6 +36,23 @@
 #include "msr.h"
 #include "paging_64.h"
 #include "linux_boot.h"
+#include "snapshot.h"
+#include "lazy.h"
+#include "event_loop.h"
+#include "pit.h"
+#include "irq.h"
+#include "ioapic.h"
+#include "virtio_mmio.h"
+#include "virtio_console.h"
+#include "virtio_blk.h"
+#include "virtio_net.h"
+#include "virtio_vsock.h"
+#include "virtio_rng.h"
+#include "virtio_pmem.h"
+#include "virtio_fs.h"
+#include "pci.h"
+#include "acpi.h"
+#include "net_switch.h"
 
 // Guest memory configuration
 #define GUEST_MEM_SIZE (4 << 20) // 4MB (expandable for Protected Mode)
@@ -38,8 +67,27 @@
 #define HC_PUTCHAR 0x01 // Output character (BL = char)
 #define HC_GETCHAR 0x02 // Input character (returns in AL)
 
+// VMM-only hypercalls (0x03/0x04 are taken by 1K OS file syscalls)
+#define HC_CLONE_POINT 0x10 // Template reached the clone point (--clone)
+
 // Multi-vCPU configuration
-#define MAX_VCPUS 4 // Maximum number of vCPUs
+#define MAX_VCPUS 16 // Maximum number of vCPUs (an SMP Linux guest, --smp)
+#define MAX_GUESTS 4 // Maximum number of guest binaries (Real Mode guests share the first 1MB)
+
+// Pre-warmed VM pool (server mode)
+#define POOL_DEFAULT_SIZE 4 // Warm VMs kept ready by --serve
+#define POOL_MAX_SIZE 64    // Upper bound for --pool
+
+// Copy-on-write cloning from a template guest
+#define CLONE_MAX 64 // Upper bound for --clone
+
+// Incremental checkpoints
+#define CHECKPOINT_DEFAULT_INTERVAL_MS 1000
+
+// Pre-copy live migration
+#define MIGRATE_DEFAULT_DELAY_MS 1000
+#define MIGRATE_MAX_ROUNDS 30
+#define MIGRATE_DIRTY_THRESHOLD 64 // Dirty pages per round that trigger stop-and-copy
 
 typedef enum
 {
@@ -83,10 +131,52 @@ static bool stdin_thread_running = false;
 static struct termios orig_termios;
 static bool termios_saved = false;
 
-// Timer thread
-static pthread_t timer_thread;
-static bool timer_thread_running = false;
-static volatile int timer_ticks = 0;
+// PIT tick rate override (--timer-hz, 0 = guest-programmed rate)
+static int timer_hz = 0;
+
+// Interrupt controller profile (--irqchip)
+typedef enum
+{
+    IRQCHIP_NONE,   // No interrupt controller: HLT and port I/O exit to the VMM
+    IRQCHIP_KERNEL, // In-kernel PIC + IOAPIC + LAPIC and PIT
+    IRQCHIP_SPLIT,  // In-kernel LAPIC, IOAPIC in userspace, no PIC
+} irqchip_mode_t;
+
+static const char *const irqchip_names[] = {"none", "kernel", "split"};
+static int irqchip_request = -1; // --irqchip value, -1 = per-guest default
+
+// What a guest HLT means (--hlt)
+typedef enum
+{
+    HLT_EXIT, // The guest is done (hypercall guests that end with HLT)
+    HLT_IDLE, // Sleep until something can wake the guest, then resume
+} hlt_policy_t;
+
+static const char *const hlt_names[] = {"exit", "idle"};
+static int hlt_request = -1;      // --hlt value, -1 = per-guest default
+static long halt_poll_ns = -1;    // --halt-poll-ns, -1 = KVM default
+
+// virtio-mmio devices for Linux guests
+static bool virtio_console_enabled = false; // --virtio-console
+static bool virtio_pci = false;             // --virtio-pci: devices on a PCI bus with MSI-X
+static const char *virtio_blk_paths[VIRTIO_BLK_MAX_DISKS]; // --virtio-blk images
+static bool virtio_blk_read_only[VIRTIO_BLK_MAX_DISKS];
+static int virtio_blk_count = 0;
+static const char *virtio_pmem_paths[VIRTIO_PMEM_MAX_DEVICES]; // --virtio-pmem images
+static bool virtio_pmem_cow[VIRTIO_PMEM_MAX_DEVICES];
+static int virtio_pmem_count = 0;
+static const char *virtio_fs_dir = NULL;    // --virtiofs: shared host directory
+static const char *virtio_fs_tag = VIRTIO_FS_DEFAULT_TAG;
+static uint32_t virtio_fs_queues = 1;
+static uint64_t virtio_fs_dax_mib = 0;      // --virtiofs-dax: DAX window size
+static int virtio_net_count = 0;            // --virtio-net NICs
+static const char *net_listen_path = NULL;  // --net-listen: peers join this switch
+static const char *net_connect_path = NULL; // --net-connect: join another switch
+static const char *net_tap_name = NULL;     // --net-tap: host tap as a switch port
+static const char *vsock_path = NULL;       // --vsock: host AF_UNIX socket prefix
+static uint64_t vsock_guest_cid = VSOCK_DEFAULT_GUEST_CID;
+static bool virtio_rng_enabled = false;     // --virtio-rng
+static uint64_t virtio_rng_rate = VIRTIO_RNG_DEFAULT_RATE;
 
 // Per-vCPU context structure
 typedef struct
@@ -95,12 +185,15 @@ typedef struct
     int vcpu_fd;              // KVM vCPU file descriptor
     struct kvm_run *kvm_run;  // Per-vCPU run structure
     void *guest_mem;          // Per-guest memory region
+    bool shared_mem;          // guest_mem belongs to vCPU 0 (APs of an SMP Linux guest)
+    int mem_fd;               // memfd backing guest_mem (-1 if none)
     size_t mem_size;          // Memory size (4MB default)
     size_t kvm_run_mmap_size; // Size of kvm_run mmap region
     const char *guest_binary; // Binary filename
     char name[256];           // Display name (e.g., "multiplication")
     int exit_count;           // VM exit counter
     bool running;             // Execution state
+    hlt_policy_t hlt_policy;  // KVM_EXIT_HLT handling
     bool use_paging;          // Enable Protected Mode with paging (for 1K OS)
     bool long_mode;           // Enable 64-bit Long Mode
     uint32_t entry_point;     // Entry point address (EIP)
@@ -128,11 +221,17 @@ typedef struct
     uint64_t last_idt_base;
     uint16_t last_idt_limit;
     uint8_t last_bytes[4];
+    pthread_t thread;         // Thread running vcpu_thread()
 } vcpu_context_t;
 
 // Global KVM state (shared across vCPUs)
 static int kvm_fd = -1; // /dev/kvm file descriptor
 static int vm_fd = -1;  // VM instance (one VM, multiple vCPUs)
+static irqchip_mode_t irqchip_mode = IRQCHIP_NONE; // Profile the VM was created with
+static bool kernel_pit = false;      // In-kernel PIT (ports 0x40-0x43 never exit)
+static bool dirty_logging = false;   // Memslots registered with KVM_MEM_LOG_DIRTY_PAGES
+static bool lazy_restore = false;    // --lazy: serve restored RAM through userfaultfd
+static int record_wss_ms = 0;        // --record-wss: working-set window after a lazy restore
 
 // vCPU array
 static vcpu_context_t vcpus[MAX_VCPUS];
@@ -147,6 +246,30 @@ static bool verbose = false;
 // Dynamic color codes for vCPUs (ANSI 256-color)
 static int vcpu_colors[MAX_VCPUS];
 
+// Clone point detection (--clone): console text match or HC_CLONE_POINT
+static int clone_count = 0;
+static const char *clone_marker = NULL;
+static size_t clone_marker_matched = 0;
+static bool clone_point_reached = false;
+
+// Guest-initiated poweroff or reset (ACPI S5, 0xCF9, 8042)
+typedef enum
+{
+    POWER_EVENT_NONE,
+    POWER_EVENT_OFF,
+    POWER_EVENT_RESET,
+} power_event_t;
+
+static power_event_t power_event = POWER_EVENT_NONE;
+
+// Exit status after a guest reset (reboot): the VM is not restarted
+#define GUEST_RESET_EXIT_STATUS 2
+
+static void request_clone_point(void);
+static void uart_update_irq(void);
+static void wake_idle_vcpus(void);
+static void stop_vcpus(void);
+
 /*
  * Get ANSI 256-color code from hue (0-360)
  * Uses the 6x6x6 color cube (codes 16-231)
@@ -204,6 +327,31 @@ static int set_guest_singlestep(vcpu_context_t *ctx, bool enable)
     return 0;
 }
 
+/*
+ * Match guest console output against --clone-marker
+ */
+static void clone_marker_feed(char ch)
+{
+    if (!clone_marker || clone_point_reached)
+    {
+        return;
+    }
+
+    if (ch == clone_marker[clone_marker_matched])
+    {
+        clone_marker_matched++;
+    }
+    else
+    {
+        clone_marker_matched = (ch == clone_marker[0]) ? 1 : 0;
+    }
+
+    if (clone_marker[clone_marker_matched] == '\0')
+    {
+        request_clone_point();
+    }
+}
+
 /*
  * Thread-safe output functions with vCPU identification
  */
@@ -257,6 +405,8 @@ static void vcpu_putchar(vcpu_context_t *ctx, char ch)
     fflush(stdout);
 
     pthread_mutex_unlock(&stdout_mutex);
+
+    clone_marker_feed(ch);
 }
 
 /*
@@ -339,6 +489,7 @@ static void keyboard_buffer_push(char ch)
         keyboard_buffer.head = next_head;
     }
     pthread_mutex_unlock(&keyboard_buffer.lock);
+    wake_idle_vcpus();
 }
 
 static int keyboard_buffer_pop(void)
@@ -363,61 +514,49 @@ static bool keyboard_buffer_has_data(void)
     return has;
 }
 
-static void pulse_irq_line(uint32_t irq)
+/*
+ * Idle HLT without an in-kernel irqchip
+ * KVM returns every HLT to us. A vCPU with HLT_IDLE sleeps here until input
+ * arrives, it is kicked (pause, snapshot, clone) or it stops running, and
+ * then re-enters the guest after the HLT. With an irqchip KVM halts the vCPU
+ * itself and wakes it on interrupts, so this path is never taken.
+ */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t idle_generation = 0;
+
+static void wake_idle_vcpus(void)
+{
+    pthread_mutex_lock(&idle_lock);
+    idle_generation++;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+static void vcpu_idle(vcpu_context_t *ctx)
 {
-    if (vm_fd < 0) {
-        return;
+    pthread_mutex_lock(&idle_lock);
+    uint64_t seen = idle_generation;
+    // immediate_exit is set by kick_vcpus_locked() before it wakes us
+    while (ctx->running && !ctx->kvm_run->immediate_exit && seen == idle_generation &&
+           !keyboard_buffer_has_data())
+    {
+        pthread_cond_wait(&idle_cond, &idle_lock);
     }
-
-    struct kvm_irq_level level = {
-        .irq = irq,
-        .level = 1,
-    };
-    (void)ioctl(vm_fd, KVM_IRQ_LINE, &level);
-    level.level = 0;
-    (void)ioctl(vm_fd, KVM_IRQ_LINE, &level);
+    pthread_mutex_unlock(&idle_lock);
 }
 
 /*
- * Timer thread - generates periodic timer interrupts
- * Injects IRQ0 every 10ms to all vCPUs
- * Currently disabled - causes triple faults before guest IDT setup
+ * HLT policy for a guest: --hlt wins; otherwise HLT ends hypercall guests
+ * and idles anything with an interrupt controller
  */
-__attribute__((unused))
-static void *timer_thread_func(void *arg)
+static hlt_policy_t default_hlt_policy(void)
 {
-    (void)arg;
-
-    printf("[Timer] Timer thread started (10ms period)\n");
-
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    while (timer_thread_running)
+    if (hlt_request >= 0)
     {
-        // Sleep for 100ms (reduced frequency to allow more interactive use)
-        usleep(100000);
-
-        timer_ticks++;
-
-        // Inject timer interrupt (IRQ0) to all vCPUs
-        for (int i = 0; i < num_vcpus; i++)
-        {
-            if (vcpus[i].running)
-            {
-                struct kvm_interrupt irq;
-                irq.irq = 0x20; // Vector 0x20 = timer interrupt (IRQ0)
-
-                if (ioctl(vcpus[i].vcpu_fd, KVM_INTERRUPT, &irq) < 0)
-                {
-                    // Interrupt might fail - just continue
-                }
-            }
-        }
+        return (hlt_policy_t)hlt_request;
     }
-
-    printf("[Timer] Timer thread stopped\n");
-    return NULL;
+    return irqchip_mode != IRQCHIP_NONE ? HLT_IDLE : HLT_EXIT;
 }
 
 /*
@@ -516,16 +655,20 @@ static void *stdin_monitor_thread_func(void *arg)
             ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
             if (n > 0)
             {
-                for (ssize_t i = 0; i < n; i++)
+                // Once the guest drives hvc0, input goes to the virtio console
+                if (virtio_console_ready())
                 {
-                    keyboard_buffer_push(buf[i]);
+                    virtio_console_input(buf, (size_t)n);
+                    continue;
                 }
 
-                // For Linux, wake the serial driver by pulsing COM1 IRQ4.
-                if (linux_serial_input_enabled)
+                for (ssize_t i = 0; i < n; i++)
                 {
-                    pulse_irq_line(4);
+                    keyboard_buffer_push(buf[i]);
                 }
+
+                // For Linux, wake the serial driver through COM1 IRQ4
+                uart_update_irq();
             }
         }
     }
@@ -540,12 +683,83 @@ static void *stdin_monitor_thread_func(void *arg)
     return NULL;
 }
 
+/*
+ * Interrupt controller profile for a guest type
+ * --irqchip wins; otherwise Linux gets the full in-kernel PC irqchip and the
+ * hypercall-driven guests none, so their HLT still ends the run.
+ */
+static irqchip_mode_t default_irqchip_mode(bool linux_boot)
+{
+    if (irqchip_request >= 0)
+    {
+        return (irqchip_mode_t)irqchip_request;
+    }
+    return linux_boot ? IRQCHIP_KERNEL : IRQCHIP_NONE;
+}
+
+/*
+ * Create the interrupt controller(s) for the chosen profile
+ * Must run before any vCPU exists. On failure the VM continues without one.
+ */
+static int create_irqchip(irqchip_mode_t mode)
+{
+    if (mode == IRQCHIP_KERNEL)
+    {
+        if (ioctl(vm_fd, KVM_CREATE_IRQCHIP) < 0)
+        {
+            perror("KVM_CREATE_IRQCHIP");
+            return -1;
+        }
+        irqchip_mode = IRQCHIP_KERNEL;
+        if (irq_routing_setup_legacy(vm_fd) < 0)
+        {
+            fprintf(stderr, "Warning: Using KVM's default GSI routing\n");
+        }
+
+        // The in-kernel PIT cannot follow --timer-hz; the userspace one can
+        if (timer_hz == 0)
+        {
+            struct kvm_pit_config pit_config = {.flags = KVM_PIT_SPEAKER_DUMMY};
+            if (ioctl(vm_fd, KVM_CREATE_PIT2, &pit_config) < 0)
+            {
+                perror("KVM_CREATE_PIT2");
+            }
+            else
+            {
+                kernel_pit = true;
+            }
+        }
+        printf("Created interrupt controller (PIC + IOAPIC%s)\n", kernel_pit ? " + PIT" : "");
+        return 0;
+    }
+
+    if (mode == IRQCHIP_SPLIT)
+    {
+        struct kvm_enable_cap cap;
+        memset(&cap, 0, sizeof(cap));
+        cap.cap = KVM_CAP_SPLIT_IRQCHIP;
+        cap.args[0] = IOAPIC_NUM_PINS; // GSIs reserved for the userspace IOAPIC
+        if (ioctl(vm_fd, KVM_ENABLE_CAP, &cap) < 0)
+        {
+            perror("KVM_CAP_SPLIT_IRQCHIP");
+            return -1;
+        }
+        irqchip_mode = IRQCHIP_SPLIT;
+        if (ioapic_init(vm_fd) < 0)
+        {
+            return -1;
+        }
+        printf("Created interrupt controller (split: LAPIC in kernel, IOAPIC at 0x%llx)\n",
+               IOAPIC_BASE_ADDR);
+    }
+    return 0;
+}
+
 /*
  * Initialize KVM and create VM
- * need_irqchip: true for Protected Mode (needs interrupts), false for Real Mode
- * force_irqchip: override to always create IRQCHIP (Linux mode)
+ * irqchip: interrupt controller profile (see default_irqchip_mode())
  */
-static int init_kvm(bool need_irqchip, bool force_irqchip)
+static int init_kvm(irqchip_mode_t irqchip)
 {
     int api_version;
 
@@ -585,41 +799,105 @@ static int init_kvm(bool need_irqchip, bool force_irqchip)
 
     printf("Created VM (fd=%d)\n", vm_fd);
 
-    // 3.5. Set TSS address (required on Intel platforms for Protected Mode)
-    // This must be called before creating vCPUs
-    // Use an address in guest memory that won't conflict with kernel/page tables
-    if (need_irqchip || 1)
-    { // Always set TSS for protected mode
-        // TSS at 0x200000 (2MB) - well above kernel and page directory
-        if (ioctl(vm_fd, KVM_SET_TSS_ADDR, (unsigned long)0x200000) < 0)
-        {
-            // May fail on AMD - that is OK, only strictly required on Intel
-            if (verbose)
-            {
-                perror("KVM_SET_TSS_ADDR (may be OK on AMD)");
-            }
-        }
-        else
+    // 3.5. Set TSS address (must precede vCPU creation)
+    // Intel needs it to run real mode and task switches without unrestricted
+    // guest; the three pages at 2MB are above the kernel and page directory.
+    if (ioctl(vm_fd, KVM_SET_TSS_ADDR, (unsigned long)0x200000) < 0)
+    {
+        // May fail on AMD - that is OK, only strictly required on Intel
+        if (verbose)
         {
-            printf("Set TSS address to 0x200000\n");
+            perror("KVM_SET_TSS_ADDR (may be OK on AMD)");
         }
     }
+    else
+    {
+        printf("Set TSS address to 0x200000\n");
+    }
 
-    // 4. Create interrupt controller (IRQCHIP) only if needed
-    // Linux boot requires PIT/IRQ routing; keep disabled for legacy Real Mode guests.
-    if (force_irqchip)
+    // 3.6. Halt polling: how long KVM spins before sleeping a halted vCPU
+    if (halt_poll_ns >= 0)
     {
-        if (ioctl(vm_fd, KVM_CREATE_IRQCHIP) < 0)
+        struct kvm_enable_cap cap;
+        memset(&cap, 0, sizeof(cap));
+        cap.cap = KVM_CAP_HALT_POLL;
+        cap.args[0] = (uint64_t)halt_poll_ns;
+        if (ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) <= 0 ||
+            ioctl(vm_fd, KVM_ENABLE_CAP, &cap) < 0)
         {
-            perror("KVM_CREATE_IRQCHIP");
-            fprintf(stderr, "Warning: Interrupt controller creation failed. Interrupts disabled.\n");
+            perror("KVM_CAP_HALT_POLL");
         }
         else
         {
-            printf("Created interrupt controller (IRQCHIP)\n");
+            printf("Halt polling limited to %ld ns\n", halt_poll_ns);
         }
     }
 
+    // 4. Create interrupt controller for the requested profile
+    if (create_irqchip(irqchip) < 0)
+    {
+        fprintf(stderr, "Warning: Interrupt controller creation failed. Interrupts disabled.\n");
+    }
+
+    return 0;
+}
+
+/*
+ * Register a vCPU's guest memory with KVM
+ * Each vCPU uses different GPA range: vCPU 0 at 0x0, vCPU 1 at 0x400000 (4MB), etc.
+ */
+static int register_guest_memory(vcpu_context_t *ctx)
+{
+    struct kvm_userspace_memory_region mem_region;
+
+    mem_region.slot = ctx->vcpu_id; // Use vCPU ID as slot number
+    mem_region.flags = dirty_logging ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+    mem_region.guest_phys_addr = ctx->vcpu_id * ctx->mem_size; // Offset by 4MB
+    mem_region.memory_size = ctx->mem_size;
+    mem_region.userspace_addr = (unsigned long)ctx->guest_mem;
+
+    if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &mem_region) < 0)
+    {
+        perror("KVM_SET_USER_MEMORY_REGION");
+        return -1;
+    }
+
+    if (verbose)
+    {
+        vcpu_printf(ctx, "Mapped to slot %d: GPA 0x%lx -> HVA %p (%zu bytes)\n",
+                    ctx->vcpu_id, mem_region.guest_phys_addr, ctx->guest_mem, ctx->mem_size);
+    }
+
+    return 0;
+}
+
+/*
+ * Allocate ctx->mem_size bytes of zeroed guest memory
+ * Backed by a memfd so clones can map the same pages copy-on-write
+ */
+static int alloc_guest_memory(vcpu_context_t *ctx)
+{
+    ctx->mem_fd = memfd_create("mini-kvm-guest", MFD_CLOEXEC);
+    if (ctx->mem_fd < 0)
+    {
+        perror("memfd_create");
+        return -1;
+    }
+    if (ftruncate(ctx->mem_fd, ctx->mem_size) < 0)
+    {
+        perror("ftruncate guest memfd");
+        return -1;
+    }
+
+    ctx->guest_mem = mmap(NULL, ctx->mem_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED, ctx->mem_fd, 0);
+    if (ctx->guest_mem == MAP_FAILED)
+    {
+        perror("mmap vcpu guest_mem");
+        ctx->guest_mem = NULL;
+        return -1;
+    }
     return 0;
 }
 
@@ -630,8 +908,6 @@ static int init_kvm(bool need_irqchip, bool force_irqchip)
  */
 static int setup_vcpu_memory(vcpu_context_t *ctx)
 {
-    struct kvm_userspace_memory_region mem_region;
-
     // Linux guests need larger RAM; keep legacy defaults for other paths.
     if (ctx->linux_guest)
     {
@@ -647,13 +923,8 @@ static int setup_vcpu_memory(vcpu_context_t *ctx)
         ctx->mem_size = 256 * 1024; // 256KB for Real Mode (fits in 64K segment)
     }
 
-    // Allocate memory for this vCPU's guest
-    ctx->guest_mem = mmap(NULL, ctx->mem_size,
-                          PROT_READ | PROT_WRITE,
-                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (ctx->guest_mem == MAP_FAILED)
+    if (alloc_guest_memory(ctx) < 0)
     {
-        perror("mmap vcpu guest_mem");
         return -1;
     }
 
@@ -663,27 +934,7 @@ static int setup_vcpu_memory(vcpu_context_t *ctx)
                     ctx->mem_size / 1024, ctx->guest_mem);
     }
 
-    // Tell KVM about this memory region
-    // Each vCPU uses different GPA range: vCPU 0 at 0x0, vCPU 1 at 0x400000 (4MB), etc.
-    mem_region.slot = ctx->vcpu_id; // Use vCPU ID as slot number
-    mem_region.flags = 0;
-    mem_region.guest_phys_addr = ctx->vcpu_id * ctx->mem_size; // Offset by 4MB
-    mem_region.memory_size = ctx->mem_size;
-    mem_region.userspace_addr = (unsigned long)ctx->guest_mem;
-
-    if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &mem_region) < 0)
-    {
-        perror("KVM_SET_USER_MEMORY_REGION");
-        return -1;
-    }
-
-    if (verbose)
-    {
-        vcpu_printf(ctx, "Mapped to slot %d: GPA 0x%lx -> HVA %p (%zu bytes)\n",
-                    ctx->vcpu_id, mem_region.guest_phys_addr, ctx->guest_mem, ctx->mem_size);
-    }
-
-    return 0;
+    return register_guest_memory(ctx);
 }
 
 /*
@@ -887,7 +1138,7 @@ static int setup_vcpu_longmode(int kvm_fd, vcpu_context_t *ctx)
     setup_gdt_64bit(ctx->guest_mem, gdt_base);
     
     // Setup CPUID
-    if (setup_cpuid(kvm_fd, ctx->vcpu_fd) < 0) {
+    if (setup_cpuid(kvm_fd, ctx->vcpu_fd, (uint32_t)ctx->vcpu_id) < 0) {
         fprintf(stderr, "[vCPU %d] Failed to setup CPUID\n", ctx->vcpu_id);
         return -1;
     }
@@ -1561,7 +1812,7 @@ static int configure_linux_code32_entry(vcpu_context_t *ctx, uint32_t boot_param
         return -1;
     }
 
-    if (setup_cpuid(kvm_fd, ctx->vcpu_fd) < 0)
+    if (setup_cpuid(kvm_fd, ctx->vcpu_fd, (uint32_t)ctx->vcpu_id) < 0)
     {
         return -1;
     }
@@ -1620,7 +1871,7 @@ static int configure_linux_boot64_entry(vcpu_context_t *ctx)
     const uint64_t gdt_base = 0x5000;
     setup_linux_boot_gdt_64bit(ctx->guest_mem, gdt_base);
 
-    if (setup_cpuid(kvm_fd, ctx->vcpu_fd) < 0)
+    if (setup_cpuid(kvm_fd, ctx->vcpu_fd, (uint32_t)ctx->vcpu_id) < 0)
     {
         return -1;
     }
@@ -1708,12 +1959,10 @@ static int configure_linux_boot64_entry(vcpu_context_t *ctx)
 }
 
 /*
- * Setup vCPU context (multi-vCPU version)
+ * Create a vCPU and map its kvm_run structure
  */
-static int setup_vcpu_context(vcpu_context_t *ctx)
+static int create_vcpu(vcpu_context_t *ctx)
 {
-    struct kvm_sregs sregs;
-    struct kvm_regs regs;
     int mmap_size_ret;
 
     // Create vCPU
@@ -1751,6 +2000,41 @@ static int setup_vcpu_context(vcpu_context_t *ctx)
         vcpu_printf(ctx, "Mapped kvm_run structure: %zu bytes\n", ctx->kvm_run_mmap_size);
     }
 
+    return 0;
+}
+
+/*
+ * Setup vCPU context (multi-vCPU version)
+ */
+/*
+ * Build the page tables and GDT of a paging or long-mode guest in its
+ * memory and switch the vCPU into that mode (nothing to do in real mode)
+ */
+static int setup_guest_mode(vcpu_context_t *ctx)
+{
+    // If long mode is enabled, use 64-bit setup
+    if (ctx->long_mode)
+    {
+        return setup_vcpu_longmode(kvm_fd, ctx);
+    }
+    // Otherwise, if paging is enabled, switch to Protected Mode (32-bit)
+    if (ctx->use_paging)
+    {
+        return configure_protected_mode(ctx);
+    }
+    return 0;
+}
+
+static int setup_vcpu_context(vcpu_context_t *ctx)
+{
+    struct kvm_sregs sregs;
+    struct kvm_regs regs;
+
+    if (create_vcpu(ctx) < 0)
+    {
+        return -1;
+    }
+
     // Get current segment registers
     if (ioctl(ctx->vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
     {
@@ -1790,7 +2074,7 @@ static int setup_vcpu_context(vcpu_context_t *ctx)
                 return -1;
             }
 
-            if (setup_cpuid(kvm_fd, ctx->vcpu_fd) < 0)
+            if (setup_cpuid(kvm_fd, ctx->vcpu_fd, (uint32_t)ctx->vcpu_id) < 0)
             {
                 return -1;
             }
@@ -1817,6 +2101,12 @@ static int setup_vcpu_context(vcpu_context_t *ctx)
             }
         }
 
+        // kvmclock, steal time and PV EOI stay off until the kernel registers its areas
+        if (setup_pv_msrs(ctx->vcpu_fd, cpuid_get_pv_features()) < 0)
+        {
+            return -1;
+        }
+
         ctx->running = true;
         ctx->exit_count = 0;
         return 0;
@@ -1832,7 +2122,7 @@ static int setup_vcpu_context(vcpu_context_t *ctx)
     }
 
     // Set CPUID entries (required for Linux to see LM/PAE/etc.)
-    if (setup_cpuid(kvm_fd, ctx->vcpu_fd) < 0)
+    if (setup_cpuid(kvm_fd, ctx->vcpu_fd, (uint32_t)ctx->vcpu_id) < 0)
     {
         return -1;
     }
@@ -1868,25 +2158,9 @@ static int setup_vcpu_context(vcpu_context_t *ctx)
     }
 
     // Skip paging/long-mode setup for Linux real-mode entry
-    if (!ctx->linux_guest)
+    if (!ctx->linux_guest && setup_guest_mode(ctx) < 0)
     {
-        // If long mode is enabled, use 64-bit setup
-        if (ctx->long_mode)
-        {
-            extern int kvm_fd; // Access global KVM fd
-            if (setup_vcpu_longmode(kvm_fd, ctx) < 0)
-            {
-                return -1;
-            }
-        }
-        // Otherwise, if paging is enabled, switch to Protected Mode (32-bit)
-        else if (ctx->use_paging)
-        {
-            if (configure_protected_mode(ctx) < 0)
-            {
-                return -1;
-            }
-        }
+        return -1;
     }
 
     ctx->running = true;
@@ -1896,28 +2170,72 @@ static int setup_vcpu_context(vcpu_context_t *ctx)
 }
 
 /*
- * Handle hypercall OUT request
+ * Application processor of an SMP Linux guest: shares the BSP's memory and
+ * waits for SIPI, so it first runs when the kernel starts it with
+ * INIT-SIPI-SIPI through its local APIC
  */
-static int handle_hypercall_out(vcpu_context_t *ctx, struct kvm_regs *regs)
+static int setup_linux_ap(vcpu_context_t *ctx, const vcpu_context_t *bsp, int id)
 {
-    unsigned char hc_num = regs->rax & 0xFF;
-
-    // Log hypercalls if verbose mode is enabled
-    if (verbose)
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->vcpu_id = id;
+    ctx->guest_binary = bsp->guest_binary;
+    snprintf(ctx->name, sizeof(ctx->name), "CPU%d", id);
+    ctx->vcpu_fd = -1;
+    ctx->mem_fd = -1;
+    ctx->guest_mem = bsp->guest_mem;
+    ctx->mem_size = bsp->mem_size;
+    ctx->shared_mem = true;
+    ctx->long_mode = bsp->long_mode;
+    ctx->linux_guest = true;
+    ctx->hlt_policy = bsp->hlt_policy;
+    ctx->linux_entry = bsp->linux_entry;
+    ctx->linux_rsi = bsp->linux_rsi;
+
+    if (create_vcpu(ctx) < 0)
     {
-        static int hc_count = 0;
-        if (hc_count++ < 100)
-        {
-            vcpu_printf(ctx, "HC[%d] type=0x%02x RAX=0x%llx RBX=0x%llx\n",
-                        hc_count, hc_num, regs->rax, regs->rbx);
-        }
+        return -1;
     }
-
-    switch (hc_num)
+    if (setup_cpuid(kvm_fd, ctx->vcpu_fd, (uint32_t)id) < 0 ||
+        setup_pv_msrs(ctx->vcpu_fd, cpuid_get_pv_features()) < 0)
     {
-    case HC_EXIT:
-        if (verbose)
-        {
+        return -1;
+    }
+
+    struct kvm_mp_state mp_state;
+    mp_state.mp_state = KVM_MP_STATE_INIT_RECEIVED;
+    if (ioctl(ctx->vcpu_fd, KVM_SET_MP_STATE, &mp_state) < 0)
+    {
+        perror("KVM_SET_MP_STATE (AP)");
+        return -1;
+    }
+
+    ctx->running = true;
+    return 0;
+}
+
+/*
+ * Handle hypercall OUT request
+ */
+static int handle_hypercall_out(vcpu_context_t *ctx, struct kvm_regs *regs)
+{
+    unsigned char hc_num = regs->rax & 0xFF;
+
+    // Log hypercalls if verbose mode is enabled
+    if (verbose)
+    {
+        static int hc_count = 0;
+        if (hc_count++ < 100)
+        {
+            vcpu_printf(ctx, "HC[%d] type=0x%02x RAX=0x%llx RBX=0x%llx\n",
+                        hc_count, hc_num, regs->rax, regs->rbx);
+        }
+    }
+
+    switch (hc_num)
+    {
+    case HC_EXIT:
+        if (verbose)
+        {
             vcpu_printf(ctx, "Exit request\n");
         }
         ctx->running = false;
@@ -1938,6 +2256,14 @@ static int handle_hypercall_out(vcpu_context_t *ctx, struct kvm_regs *regs)
         break;
     }
 
+    case HC_CLONE_POINT:
+        if (verbose)
+        {
+            vcpu_printf(ctx, "Clone point hypercall\n");
+        }
+        request_clone_point();
+        break;
+
     default:
         if (verbose)
         {
@@ -1983,7 +2309,26 @@ static void handle_hypercall_in(vcpu_context_t *ctx, char *data)
     }
 }
 
-// Minimal 16550 UART emulation for COM1 (0x3f8-0x3ff)
+/*
+ * 16550A UART for COM1 (0x3f8-0x3ff)
+ * With FCR bit 0 set the receiver buffers up to 16 bytes and interrupts only
+ * when the RX trigger level is reached, or when bytes sit below it for four
+ * character times (the timeout interrupt), so the guest drains input in
+ * bursts. IIR reports the FIFOs, and Linux then loads the transmitter 16
+ * bytes per THRE interrupt. Setting FCR bit 5 with DLAB set selects the
+ * 16750's 64-byte FIFOs. Bytes leave the transmitter at once, so the TX FIFO
+ * is always empty by the time the guest looks at it.
+ */
+#define UART_FIFO_SIZE 64
+
+#define UART_FCR_ENABLE   0x01
+#define UART_FCR_CLEAR_RX 0x02
+#define UART_FCR_64BYTE   0x20 // 16750: writable with DLAB set only
+
+#define UART_MCR_LOOP     0x10
+
+#define UART_CLOCK_HZ     115200 // Baud rate at divisor 1
+
 typedef struct
 {
     uint8_t ier;
@@ -1991,6 +2336,13 @@ typedef struct
     uint8_t mcr;
     uint8_t dll;
     uint8_t dlh;
+    uint8_t thre_pending; // THR empty interrupt not yet acknowledged by an IIR read
+    uint8_t fcr;          // FIFO enable, 64-byte mode and RX trigger bits
+    uint8_t scr;
+    uint8_t rx_timeout;   // Character timeout interrupt pending until RBR is read
+    uint8_t rx_head;
+    uint8_t rx_count;
+    uint8_t rx_fifo[UART_FIFO_SIZE];
 } uart16550_t;
 
 static uart16550_t uart0 = {
@@ -1999,16 +2351,319 @@ static uart16550_t uart0 = {
     .mcr = 0x00,
     .dll = 0x01,
     .dlh = 0x00,
+    .thre_pending = 0,
 };
 
+/*
+ * COM1 IRQ4 is a level-triggered line on a resampling irqfd: raising it is
+ * one eventfd write, and KVM lowers it at the guest's EOI and signals the
+ * resamplefd, where the line is raised again if the UART still has an
+ * interrupt pending. With the split irqchip KVM cannot resample; the
+ * userspace IOAPIC reports the EOI instead.
+ *
+ * uart_lock covers the registers and the line: vCPUs, the stdin thread and
+ * the event loop (resamples, RX timeouts) all reach the UART.
+ */
+#define UART_GSI 4
+
+static int uart_irq_fd = -1;
+static int uart_resample_fd = -1;
+static int uart_timer_fd = -1;
+static bool uart_irq_asserted = false;
+static pthread_mutex_t uart_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool uart_fifo_enabled(void)
+{
+    return (uart0.fcr & UART_FCR_ENABLE) != 0;
+}
+
+static uint8_t uart_fifo_depth(void)
+{
+    if (!uart_fifo_enabled())
+    {
+        return 1;
+    }
+    return (uart0.fcr & UART_FCR_64BYTE) ? 64 : 16;
+}
+
+// Bytes in the RX FIFO that raise the data available interrupt
+static uint8_t uart_rx_trigger(void)
+{
+    static const uint8_t levels16[4] = {1, 4, 8, 14};
+    static const uint8_t levels64[4] = {1, 16, 32, 56};
+
+    if (!uart_fifo_enabled())
+    {
+        return 1;
+    }
+    return (uart0.fcr & UART_FCR_64BYTE) ? levels64[uart0.fcr >> 6] : levels16[uart0.fcr >> 6];
+}
+
+// (Re)start the character timeout: four character times at the current line settings
+static void uart_rx_arm_timeout(void)
+{
+    struct itimerspec its;
+
+    if (uart_timer_fd < 0)
+    {
+        return;
+    }
+    memset(&its, 0, sizeof(its));
+    if (uart_fifo_enabled() && uart0.rx_count > 0 && !uart0.rx_timeout)
+    {
+        uint32_t divisor = ((uint32_t)uart0.dlh << 8) | uart0.dll;
+        // Start bit, 5-8 data bits, optional parity, 1 or 2 stop bits
+        uint32_t bits = 1 + 5 + (uart0.lcr & 0x03) + ((uart0.lcr & 0x08) ? 1 : 0) + ((uart0.lcr & 0x04) ? 2 : 1);
+        uint64_t ns = 4ULL * bits * (divisor ? divisor : 65536) * 1000000000ULL / UART_CLOCK_HZ;
+        its.it_value.tv_sec = (time_t)(ns / 1000000000ULL);
+        its.it_value.tv_nsec = (long)(ns % 1000000000ULL);
+    }
+    if (timerfd_settime(uart_timer_fd, 0, &its, NULL) < 0)
+    {
+        perror("timerfd_settime");
+    }
+}
+
+static bool uart_rx_push(uint8_t ch)
+{
+    if (uart0.rx_count >= uart_fifo_depth())
+    {
+        return false;
+    }
+    uart0.rx_fifo[(uart0.rx_head + uart0.rx_count) % UART_FIFO_SIZE] = ch;
+    uart0.rx_count++;
+    return true;
+}
+
+static void uart_rx_clear(void)
+{
+    uart0.rx_head = 0;
+    uart0.rx_count = 0;
+    uart0.rx_timeout = 0;
+}
+
+/*
+ * Move host input into the RX FIFO. The keyboard buffer is the far end of
+ * the line and is flow-controlled, so bytes wait there instead of overrunning
+ * a full FIFO. Not in loopback mode, where the line is disconnected.
+ */
+static void uart_rx_fill(void)
+{
+    bool received = false;
+
+    if (uart0.mcr & UART_MCR_LOOP)
+    {
+        return;
+    }
+    while (uart0.rx_count < uart_fifo_depth())
+    {
+        int ch = keyboard_buffer_pop();
+        if (ch < 0)
+        {
+            break;
+        }
+        uart_rx_push((uint8_t)ch);
+        received = true;
+    }
+    if (received)
+    {
+        uart_rx_arm_timeout();
+    }
+}
+
+static bool uart_irq_pending(void)
+{
+    return ((uart0.ier & 0x01) && (uart0.rx_timeout || uart0.rx_count >= uart_rx_trigger())) ||
+           ((uart0.ier & 0x02) && uart0.thre_pending);
+}
+
+// Raise IRQ4 if an interrupt is pending and the line is low (uart_lock held)
+static void uart_raise_irq(void)
+{
+    if (uart_irq_fd < 0)
+    {
+        return;
+    }
+    if (!uart_irq_asserted && uart_irq_pending())
+    {
+        uart_irq_asserted = (irq_irqfd_raise(uart_irq_fd) == 0);
+    }
+}
+
+// Host input arrived or the line was lowered: receive and interrupt
+static void uart_update_irq(void)
+{
+    if (!linux_serial_input_enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&uart_lock);
+    uart_rx_fill();
+    uart_raise_irq();
+    pthread_mutex_unlock(&uart_lock);
+}
+
+// The guest EOI'd IRQ4 and the line is low again
+static void uart_irq_resampled(void *opaque)
+{
+    (void)opaque;
+    pthread_mutex_lock(&uart_lock);
+    uart_irq_asserted = false;
+    pthread_mutex_unlock(&uart_lock);
+    uart_update_irq();
+}
+
+// Event loop: KVM lowered the line at the EOI
+static void uart_resample_event(int fd, uint32_t events, void *opaque)
+{
+    (void)events;
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+    {
+        return;
+    }
+    uart_irq_resampled(opaque);
+}
+
+// Event loop: bytes sat in the RX FIFO for four character times
+static void uart_timer_event(int fd, uint32_t events, void *opaque)
+{
+    (void)events;
+    (void)opaque;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        return;
+    }
+    pthread_mutex_lock(&uart_lock);
+    if (uart_fifo_enabled() && uart0.rx_count > 0)
+    {
+        uart0.rx_timeout = 1;
+        uart_raise_irq();
+    }
+    pthread_mutex_unlock(&uart_lock);
+}
+
+static int uart_timer_init(void)
+{
+    uart_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (uart_timer_fd < 0)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+    if (event_loop_add(uart_timer_fd, EPOLLIN, uart_timer_event, NULL) < 0)
+    {
+        close(uart_timer_fd);
+        uart_timer_fd = -1;
+        return -1;
+    }
+
+    // A restored FIFO may hold bytes waiting for their timeout
+    pthread_mutex_lock(&uart_lock);
+    uart_rx_arm_timeout();
+    pthread_mutex_unlock(&uart_lock);
+    return 0;
+}
+
+static void uart_irq_cleanup(void);
+
+static int uart_irq_init(void)
+{
+    uart_irq_asserted = false;
+    if (irqchip_mode == IRQCHIP_SPLIT)
+    {
+        uart_irq_fd = irq_irqfd_create(vm_fd, UART_GSI);
+        if (uart_irq_fd < 0)
+        {
+            return -1;
+        }
+        ioapic_set_resample(irq_ioapic_pin(UART_GSI), uart_irq_resampled, NULL);
+    }
+    else
+    {
+        uart_irq_fd = irq_irqfd_create_resample(vm_fd, UART_GSI, &uart_resample_fd);
+        if (uart_irq_fd < 0)
+        {
+            return -1;
+        }
+        if (event_loop_add(uart_resample_fd, EPOLLIN, uart_resample_event, NULL) < 0)
+        {
+            irq_irqfd_release(vm_fd, uart_irq_fd, uart_resample_fd, UART_GSI);
+            uart_irq_fd = uart_resample_fd = -1;
+            return -1;
+        }
+    }
+    if (uart_timer_init() < 0)
+    {
+        uart_irq_cleanup();
+        return -1;
+    }
+    return 0;
+}
+
+static void uart_irq_cleanup(void)
+{
+    if (uart_timer_fd >= 0)
+    {
+        event_loop_del(uart_timer_fd);
+        close(uart_timer_fd);
+        uart_timer_fd = -1;
+    }
+    if (irqchip_mode == IRQCHIP_SPLIT)
+    {
+        ioapic_set_resample(irq_ioapic_pin(UART_GSI), NULL, NULL);
+    }
+    if (uart_irq_fd >= 0)
+    {
+        if (uart_resample_fd >= 0)
+        {
+            event_loop_del(uart_resample_fd);
+        }
+        irq_irqfd_release(vm_fd, uart_irq_fd, uart_resample_fd, UART_GSI);
+        uart_irq_fd = uart_resample_fd = -1;
+    }
+}
+
 static bool is_uart_port(uint16_t port)
 {
     return port >= 0x3f8 && port <= 0x3ff;
 }
 
+static void uart_write_fcr(uint8_t val, bool dlab)
+{
+    uint8_t fcr = val & 0xe1;
+
+    // The 16750's 64-byte mode is set with DLAB set and cleared by any other write
+    if (!dlab)
+    {
+        fcr &= ~UART_FCR_64BYTE;
+    }
+    if (!(fcr & UART_FCR_ENABLE))
+    {
+        fcr = 0;
+    }
+    // Switching the FIFOs on, off or to another size empties them
+    if ((fcr ^ uart0.fcr) & (UART_FCR_ENABLE | UART_FCR_64BYTE))
+    {
+        val |= UART_FCR_CLEAR_RX;
+    }
+    uart0.fcr = fcr;
+    if (val & UART_FCR_CLEAR_RX)
+    {
+        uart_rx_clear();
+    }
+    uart_rx_fill();
+    uart_rx_arm_timeout();
+}
+
 static void uart_write(uint16_t port, const char *data)
 {
     uint16_t offset = port - 0x3f8;
+
+    pthread_mutex_lock(&uart_lock);
     bool dlab = (uart0.lcr & 0x80) != 0;
 
     switch (offset)
@@ -2020,13 +2675,23 @@ static void uart_write(uint16_t port, const char *data)
         }
         else
         {
-            putchar(data[0]);
-            fflush(stdout);
-            if (linux_serial_input_enabled && (uart0.ier & 0x02))
+            if (uart0.mcr & UART_MCR_LOOP)
+            {
+                // Loopback: the transmitter feeds the receiver (overruns are dropped)
+                if (uart_rx_push((uint8_t)data[0]))
+                {
+                    uart_rx_arm_timeout();
+                }
+            }
+            else
             {
-                // THR empty interrupt (TX) to drain kernel/userland buffers.
-                pulse_irq_line(4);
+                putchar(data[0]);
+                fflush(stdout);
+                clone_marker_feed(data[0]);
             }
+            // The byte leaves at once, so the transmitter is empty again (TX interrupt)
+            uart0.thre_pending = 1;
+            uart_raise_irq();
         }
         break;
     case 1: // IER or DLH
@@ -2036,28 +2701,40 @@ static void uart_write(uint16_t port, const char *data)
         }
         else
         {
-            uart0.ier = data[0];
-            if (linux_serial_input_enabled && (uart0.ier & 0x02))
+            // On real 16550, enabling THRE while THR is empty triggers an IRQ immediately.
+            if ((data[0] & 0x02) && !(uart0.ier & 0x02))
             {
-                // On real 16550, enabling THRE while THR is empty triggers an IRQ immediately.
-                pulse_irq_line(4);
+                uart0.thre_pending = 1;
             }
+            uart0.ier = data[0];
+            uart_raise_irq();
         }
         break;
+    case 2: // FCR
+        uart_write_fcr((uint8_t)data[0], dlab);
+        uart_raise_irq();
+        break;
     case 3: // LCR
         uart0.lcr = data[0];
         break;
     case 4: // MCR
         uart0.mcr = data[0];
+        uart_rx_fill();
+        break;
+    case 7: // SCR
+        uart0.scr = data[0];
         break;
     default:
         break;
     }
+    pthread_mutex_unlock(&uart_lock);
 }
 
 static void uart_read(uint16_t port, char *data)
 {
     uint16_t offset = port - 0x3f8;
+
+    pthread_mutex_lock(&uart_lock);
     bool dlab = (uart0.lcr & 0x80) != 0;
 
     switch (offset)
@@ -2069,26 +2746,49 @@ static void uart_read(uint16_t port, char *data)
         }
         else
         {
-            int ch = keyboard_buffer_pop();
-            data[0] = (ch < 0) ? 0x00 : (char)ch;
+            uart_rx_fill();
+            if (uart0.rx_count > 0)
+            {
+                data[0] = (char)uart0.rx_fifo[uart0.rx_head];
+                uart0.rx_head = (uart0.rx_head + 1) % UART_FIFO_SIZE;
+                uart0.rx_count--;
+            }
+            else
+            {
+                data[0] = 0x00;
+            }
+            // Reading RBR acknowledges a timeout and restarts the timer
+            uart0.rx_timeout = 0;
+            uart_rx_fill();
+            uart_rx_arm_timeout();
         }
         break;
     case 1: // IER or DLH
         data[0] = dlab ? uart0.dlh : uart0.ier;
         break;
     case 2: // IIR
-        if (keyboard_buffer_has_data() && (uart0.ier & 0x01))
+        uart_rx_fill();
+        if ((uart0.ier & 0x01) && uart0.rx_timeout)
+        {
+            data[0] = 0x0c; // Character Timeout
+        }
+        else if ((uart0.ier & 0x01) && uart0.rx_count >= uart_rx_trigger())
         {
             data[0] = 0x04; // Received Data Available
         }
-        else if (uart0.ier & 0x02)
+        else if ((uart0.ier & 0x02) && uart0.thre_pending)
         {
-            data[0] = 0x02; // THR Empty
+            data[0] = 0x02; // THR Empty (reading IIR acknowledges it)
+            uart0.thre_pending = 0;
         }
         else
         {
             data[0] = 0x01; // No pending interrupts
         }
+        if (uart_fifo_enabled())
+        {
+            data[0] |= 0xc0 | (uart0.fcr & UART_FCR_64BYTE);
+        }
         break;
     case 3: // LCR
         data[0] = uart0.lcr;
@@ -2097,22 +2797,33 @@ static void uart_read(uint16_t port, char *data)
         data[0] = uart0.mcr;
         break;
     case 5: // LSR
+        uart_rx_fill();
         data[0] = 0x60; // THR empty | TEMT
-        if (keyboard_buffer_has_data())
+        if (uart0.rx_count > 0)
         {
             data[0] |= 0x01; // Data Ready
         }
         break;
     case 6: // MSR
-        data[0] = 0x00;
+        if (uart0.mcr & UART_MCR_LOOP)
+        {
+            // Loopback: DTR->DSR, RTS->CTS, OUT1->RI, OUT2->DCD
+            data[0] = (char)(((uart0.mcr & 0x01) << 5) | ((uart0.mcr & 0x02) << 3) |
+                             ((uart0.mcr & 0x0c) << 4));
+        }
+        else
+        {
+            data[0] = 0x00;
+        }
         break;
     case 7: // SCR
-        data[0] = 0x00;
+        data[0] = uart0.scr;
         break;
     default:
         data[0] = 0x00;
         break;
     }
+    pthread_mutex_unlock(&uart_lock);
 }
 
 static void setup_linux_ivt(void *guest_mem)
@@ -2207,11 +2918,59 @@ static void setup_linux_prot_idt(void *guest_mem)
 static uint8_t cmos_index = 0;
 static uint8_t port92 = 0x02; // A20 enabled bit set by default
 
+// ACPI fixed hardware (see acpi.h); ACPI is always enabled
+static uint16_t pm1_enable = 0;
+static uint16_t pm1_control = ACPI_PM1_CNT_SCI_EN;
+static uint8_t reset_control = 0; // 0xCF9
+
+#define RESET_CONTROL_RST_CPU 0x04 // 0xCF9: 0 -> 1 resets the machine
+#define I8042_CMD_RESET       0xFE // Pulse the CPU reset line
+
+/*
+ * The guest powered off (S5) or reset the machine. There is nothing left to
+ * run, so every vCPU stops now instead of spinning until it is killed;
+ * main() turns the event into the exit status.
+ */
+static void guest_power_event(power_event_t event)
+{
+    if (power_event != POWER_EVENT_NONE)
+    {
+        return;
+    }
+    power_event = event;
+    printf("\nGuest %s, stopping the VM\n", event == POWER_EVENT_OFF ? "powered off" : "requested a reset");
+    fflush(stdout);
+    stop_vcpus();
+}
+
+static void pm1_control_write(uint16_t value)
+{
+    pm1_control = (uint16_t)((value & ~ACPI_PM1_CNT_SLP_EN) | ACPI_PM1_CNT_SCI_EN);
+    if ((value & ACPI_PM1_CNT_SLP_EN) && ACPI_PM1_CNT_SLP_TYP(value) == ACPI_SLP_TYP_S5)
+    {
+        guest_power_event(POWER_EVENT_OFF);
+    }
+}
+
 static void misc_port_out(uint16_t port, const char *data, int size)
 {
-    (void)size;
     uint8_t value = (uint8_t)data[0];
 
+    // Byte access to 0xCF9 is the reset control register, not PCI config
+    if (port == ACPI_RESET_PORT && size == 1)
+    {
+        reset_control = value & ~RESET_CONTROL_RST_CPU;
+        if (value & RESET_CONTROL_RST_CPU)
+        {
+            guest_power_event(POWER_EVENT_RESET);
+        }
+        return;
+    }
+    if (pci_is_port(port))
+    {
+        pci_port_write(port, (const uint8_t *)data, (uint32_t)size);
+        return;
+    }
     switch (port)
     {
     case 0x92: // Fast A20 gate
@@ -2220,13 +2979,31 @@ static void misc_port_out(uint16_t port, const char *data, int size)
     case 0x70: // CMOS index
         cmos_index = value;
         break;
+    case 0x40: // PIT channel 0
+    case 0x41: // PIT channel 1
+    case 0x42: // PIT channel 2
+    case 0x43: // PIT control
+        pit_port_out(port, value);
+        break;
+    case 0x64: // 8042 status/command
+        if (value == I8042_CMD_RESET)
+        {
+            guest_power_event(POWER_EVENT_RESET);
+        }
+        break;
+    case ACPI_PM1A_EVT_ADDR + 2: // PM1a_EN
+        pm1_enable = size >= 2 ? (uint16_t)((uint8_t)data[0] | ((uint8_t)data[1] << 8)) : value;
+        break;
+    case ACPI_PM1A_CNT_ADDR:
+        pm1_control_write(size >= 2 ? (uint16_t)((uint8_t)data[0] | ((uint8_t)data[1] << 8)) : value);
+        break;
     case 0x20: // PIC1 command
     case 0x21: // PIC1 data
     case 0xA0: // PIC2 command
     case 0xA1: // PIC2 data
     case 0x80: // POST delay port
     case 0x60: // 8042 data
-    case 0x64: // 8042 status/command
+    case ACPI_PM1A_EVT_ADDR: // PM1a_STS: no event is ever raised
         break;
     default:
         break;
@@ -2238,6 +3015,17 @@ static void misc_port_in(uint16_t port, char *data, int size)
     // Default: return 0 for unknown ports so polling loops can progress
     memset(data, 0, (size_t)size);
 
+    if (port == ACPI_RESET_PORT && size == 1)
+    {
+        data[0] = (char)reset_control;
+        return;
+    }
+    if (pci_is_port(port))
+    {
+        pci_port_read(port, (uint8_t *)data, (uint32_t)size);
+        return;
+    }
+
     switch (port)
     {
     case 0x92:
@@ -2254,6 +3042,26 @@ static void misc_port_in(uint16_t port, char *data, int size)
         // CMOS data - return 0
         data[0] = 0x00;
         break;
+    case ACPI_PM1A_EVT_ADDR + 2:
+        data[0] = (char)(pm1_enable & 0xff);
+        if (size >= 2)
+        {
+            data[1] = (char)(pm1_enable >> 8);
+        }
+        break;
+    case ACPI_PM1A_CNT_ADDR:
+        data[0] = (char)(pm1_control & 0xff);
+        if (size >= 2)
+        {
+            data[1] = (char)(pm1_control >> 8);
+        }
+        break;
+    case 0x40:
+    case 0x41:
+    case 0x42:
+    case 0x43:
+        data[0] = pit_port_in(port);
+        break;
     case 0x20:
     case 0x21:
     case 0xA0:
@@ -2292,6 +3100,11 @@ static int handle_io(vcpu_context_t *ctx)
         {
             if (ctx->linux_guest)
             {
+                // Only the clone point is available to Linux userspace (outb via ioperm)
+                if ((uint8_t)data[0] == HC_CLONE_POINT)
+                {
+                    request_clone_point();
+                }
                 return 0;
             }
             struct kvm_regs regs;
@@ -2377,6 +3190,11 @@ static int handle_vm_exit(vcpu_context_t *ctx)
     switch (ctx->kvm_run->exit_reason)
     {
     case KVM_EXIT_HLT:
+        if (ctx->hlt_policy == HLT_IDLE)
+        {
+            vcpu_idle(ctx);
+            return 0;
+        }
         if (verbose)
         {
             vcpu_printf(ctx, "Guest halted after %d exits\n", ctx->exit_count);
@@ -2480,6 +3298,46 @@ static int handle_vm_exit(vcpu_context_t *ctx)
                             ctx->kvm_run->mmio.len);
             }
         }
+        if (irqchip_mode == IRQCHIP_SPLIT && ioapic_is_mmio(ctx->kvm_run->mmio.phys_addr))
+        {
+            if (ctx->kvm_run->mmio.is_write)
+            {
+                ioapic_mmio_write(ctx->kvm_run->mmio.phys_addr, ctx->kvm_run->mmio.data,
+                                  ctx->kvm_run->mmio.len);
+            }
+            else
+            {
+                ioapic_mmio_read(ctx->kvm_run->mmio.phys_addr, ctx->kvm_run->mmio.data,
+                                 ctx->kvm_run->mmio.len);
+            }
+            return 0;
+        }
+        if (virtio_mmio_is_mmio(ctx->kvm_run->mmio.phys_addr))
+        {
+            if (ctx->kvm_run->mmio.is_write)
+            {
+                virtio_mmio_write(ctx->kvm_run->mmio.phys_addr, ctx->kvm_run->mmio.data,
+                                  ctx->kvm_run->mmio.len);
+            }
+            else
+            {
+                virtio_mmio_read(ctx->kvm_run->mmio.phys_addr, ctx->kvm_run->mmio.data,
+                                 ctx->kvm_run->mmio.len);
+            }
+            return 0;
+        }
+        if (pci_is_mmio(ctx->kvm_run->mmio.phys_addr))
+        {
+            if (ctx->kvm_run->mmio.is_write)
+            {
+                pci_mmio_write(ctx->kvm_run->mmio.phys_addr, ctx->kvm_run->mmio.data, ctx->kvm_run->mmio.len);
+            }
+            else
+            {
+                pci_mmio_read(ctx->kvm_run->mmio.phys_addr, ctx->kvm_run->mmio.data, ctx->kvm_run->mmio.len);
+            }
+            return 0;
+        }
         if (!ctx->kvm_run->mmio.is_write)
         {
             // Return zeroed data
@@ -2487,6 +3345,11 @@ static int handle_vm_exit(vcpu_context_t *ctx)
         }
         return 0;
 
+    case KVM_EXIT_IOAPIC_EOI:
+        // Split irqchip: the guest EOI'd a level-triggered IOAPIC vector
+        ioapic_eoi(ctx->kvm_run->eoi.vector);
+        return 0;
+
     case KVM_EXIT_IRQ_WINDOW_OPEN:
         // Interrupt window opened; just continue
         return 0;
@@ -2591,6 +3454,127 @@ static int handle_vm_exit(vcpu_context_t *ctx)
     return 0;
 }
 
+/*
+ * vCPU pause/resume (used to capture a consistent snapshot)
+ *
+ * pause_vcpus() sets immediate_exit and kicks every vCPU thread out of KVM_RUN
+ * with VCPU_KICK_SIGNAL. Each thread then parks in vcpu_park() until
+ * resume_vcpus() is called. vcpus_active counts threads still in their loop.
+ */
+#define VCPU_KICK_SIGNAL SIGRTMIN
+
+static volatile bool vcpu_pause_requested = false;
+static int vcpus_active = 0;
+static int vcpus_paused = 0;
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+
+static void vcpu_kick_handler(int sig)
+{
+    (void)sig; // Only needed to interrupt KVM_RUN with EINTR
+}
+
+static void install_vcpu_kick_handler(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = vcpu_kick_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(VCPU_KICK_SIGNAL, &sa, NULL);
+}
+
+static void vcpu_park(vcpu_context_t *ctx)
+{
+    // Let KVM complete a pending PIO/MMIO read so the saved state is consistent
+    ctx->kvm_run->immediate_exit = 1;
+    if (ioctl(ctx->vcpu_fd, KVM_RUN, 0) < 0 && errno != EINTR)
+    {
+        vcpu_printf(ctx, "KVM_RUN (park) failed: %s\n", strerror(errno));
+    }
+
+    pthread_mutex_lock(&pause_lock);
+    vcpus_paused++;
+    pthread_cond_broadcast(&pause_cond);
+    while (vcpu_pause_requested)
+    {
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    }
+    vcpus_paused--;
+    ctx->kvm_run->immediate_exit = 0;
+    pthread_mutex_unlock(&pause_lock);
+}
+
+// Caller must hold pause_lock
+static void kick_vcpus_locked(void)
+{
+    vcpu_pause_requested = true;
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        if (vcpus[i].running && vcpus[i].kvm_run)
+        {
+            vcpus[i].kvm_run->immediate_exit = 1;
+            pthread_kill(vcpus[i].thread, VCPU_KICK_SIGNAL);
+        }
+    }
+    wake_idle_vcpus();
+}
+
+static void pause_vcpus(void)
+{
+    pthread_mutex_lock(&pause_lock);
+    kick_vcpus_locked();
+    while (vcpus_paused < vcpus_active)
+    {
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    }
+    pthread_mutex_unlock(&pause_lock);
+}
+
+static void resume_vcpus(void)
+{
+    pthread_mutex_lock(&pause_lock);
+    vcpu_pause_requested = false;
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+// Make every vCPU thread leave its run loop (no parking: they are done)
+static void stop_vcpus(void)
+{
+    pthread_mutex_lock(&pause_lock);
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        if (vcpus[i].running && vcpus[i].kvm_run)
+        {
+            vcpus[i].running = false;
+            vcpus[i].kvm_run->immediate_exit = 1;
+            pthread_kill(vcpus[i].thread, VCPU_KICK_SIGNAL);
+        }
+    }
+    pthread_mutex_unlock(&pause_lock);
+    wake_idle_vcpus();
+}
+
+/*
+ * Called from a vCPU thread when the template reaches its clone point.
+ * Every vCPU parks before re-entering the guest; monitor_vcpus() then
+ * freezes the VM and hands it to the clones (SIGUSR2).
+ */
+static void request_clone_point(void)
+{
+    pthread_mutex_lock(&pause_lock);
+    if (clone_count == 0 || clone_point_reached)
+    {
+        pthread_mutex_unlock(&pause_lock);
+        return;
+    }
+    clone_point_reached = true;
+    kick_vcpus_locked();
+    pthread_mutex_unlock(&pause_lock);
+
+    kill(getpid(), SIGUSR2);
+}
+
 /*
  * vCPU thread entry point
  */
@@ -2636,9 +3620,19 @@ static void *vcpu_thread(void *arg)
 
     while (ctx->running)
     {
+        if (vcpu_pause_requested)
+        {
+            vcpu_park(ctx);
+            continue;
+        }
+
         ret = ioctl(ctx->vcpu_fd, KVM_RUN, 0);
         if (ret < 0)
         {
+            if (errno == EINTR)
+            {
+                continue; // Kicked by pause_vcpus()
+            }
             vcpu_printf(ctx, "KVM_RUN failed: %s\n", strerror(errno));
             break;
         }
@@ -2649,6 +3643,17 @@ static void *vcpu_thread(void *arg)
         }
     }
 
+    // An SMP Linux guest is one machine: when one of its CPUs stops, all do
+    if (ctx->linux_guest && num_vcpus > 1)
+    {
+        stop_vcpus();
+    }
+
+    pthread_mutex_lock(&pause_lock);
+    vcpus_active--;
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+
     if (verbose)
     {
         vcpu_printf(ctx, "Thread exiting (total exits: %d)\n", ctx->exit_count);
@@ -2665,7 +3670,7 @@ static void cleanup_vcpu(vcpu_context_t *ctx)
     {
         munmap(ctx->kvm_run, ctx->kvm_run_mmap_size);
     }
-    if (ctx->guest_mem != NULL && ctx->guest_mem != MAP_FAILED)
+    if (ctx->guest_mem != NULL && ctx->guest_mem != MAP_FAILED && !ctx->shared_mem)
     {
         munmap(ctx->guest_mem, ctx->mem_size);
     }
@@ -2673,242 +3678,2753 @@ static void cleanup_vcpu(vcpu_context_t *ctx)
     {
         close(ctx->vcpu_fd);
     }
+    if (ctx->mem_fd >= 0)
+    {
+        close(ctx->mem_fd);
+    }
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+           (now.tv_nsec - start->tv_nsec) / 1000000.0;
 }
 
-#if 0  // OLD SINGLE-VCPU CLEANUP (disabled)
 /*
- * Cleanup resources
+ * VM snapshots (see snapshot.h for the file format)
+ *
+ * The CONFIG and DEVICES sections are private to this file: CONFIG carries
+ * what is needed to rebuild the VM before any KVM state is restored, DEVICES
+ * carries the userspace device models.
  */
-static void cleanup(void) {
-    if (kvm_run != NULL && kvm_run != MAP_FAILED) {
-        munmap(kvm_run, sizeof(*kvm_run));
-    }
-    if (guest_mem != NULL && guest_mem != MAP_FAILED) {
-        munmap(guest_mem, GUEST_MEM_SIZE);
+#define SNAP_CFG_INTERACTIVE  (1 << 0) // stdin thread + raw terminal
+#define SNAP_CFG_LINUX_SERIAL (1 << 1) // stdin routed to COM1 (IRQ4)
+#define SNAP_CFG_PV_FEATURES  (1 << 2) // pv_features is valid
+
+typedef struct
+{
+    char name[64];
+    uint64_t mem_size;
+    uint32_t entry_point;
+    uint32_t load_offset;
+    int32_t pending_getchar;
+    int32_t getchar_result;
+    uint8_t running;
+    uint8_t use_paging;
+    uint8_t long_mode;
+    uint8_t linux_guest;
+    uint32_t hlt_policy;
+} snapshot_vcpu_config_t;
+
+typedef struct
+{
+    uint32_t num_vcpus;
+    uint32_t flags;
+    uint32_t irqchip;
+    uint32_t pv_features; // Paravirtual CPUID profile (leaf 0x40000001 mask)
+    snapshot_vcpu_config_t vcpu[MAX_VCPUS];
+} snapshot_config_t;
+
+typedef struct
+{
+    uart16550_t uart;
+    uint8_t cmos_index;
+    uint8_t port92;
+    uint8_t reset_control; // 0xCF9
+    uint16_t pm1_enable;   // ACPI PM1a_EN
+    uint16_t pm1_control;  // ACPI PM1a_CNT
+    int32_t kbd_head;
+    int32_t kbd_tail;
+    char kbd_buffer[KEYBOARD_BUFFER_SIZE];
+    pit_state_t pit;
+    ioapic_state_t ioapic; // Split irqchip only
+} snapshot_devices_t;
+
+// How guest memory is written by write_vm_snapshot()
+typedef enum
+{
+    MEM_IMAGE_FULL,   // Every page of every slot
+    MEM_IMAGE_SHARED, // Slot descriptors only; the reader gets the pages elsewhere
+    MEM_IMAGE_DIRTY,  // Pages set in dirty_bitmaps[slot], relative to a parent
+} memory_image_t;
+
+static int write_snapshot_config(snapshot_writer_t *w)
+{
+    snapshot_config_t cfg;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.num_vcpus = num_vcpus;
+    cfg.irqchip = irqchip_mode;
+    cfg.flags = (stdin_thread_running ? SNAP_CFG_INTERACTIVE : 0) |
+                (linux_serial_input_enabled ? SNAP_CFG_LINUX_SERIAL : 0) | SNAP_CFG_PV_FEATURES;
+    cfg.pv_features = cpuid_get_pv_features();
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        vcpu_context_t *ctx = &vcpus[i];
+        snapshot_vcpu_config_t *vc = &cfg.vcpu[i];
+        snprintf(vc->name, sizeof(vc->name), "%s", ctx->name);
+        vc->mem_size = ctx->mem_size;
+        vc->entry_point = ctx->entry_point;
+        vc->load_offset = ctx->load_offset;
+        vc->pending_getchar = ctx->pending_getchar;
+        vc->getchar_result = ctx->getchar_result;
+        vc->running = ctx->running;
+        vc->use_paging = ctx->use_paging;
+        vc->long_mode = ctx->long_mode;
+        vc->linux_guest = ctx->linux_guest;
+        vc->hlt_policy = ctx->hlt_policy;
+    }
+
+    return snapshot_write_section(w, SNAP_SEC_CONFIG, 0, &cfg, sizeof(cfg));
+}
+
+static int write_snapshot_memory(snapshot_writer_t *w, memory_image_t image,
+                                 uint64_t *const *dirty_bitmaps)
+{
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        vcpu_context_t *ctx = &vcpus[i];
+        uint64_t gpa = ctx->vcpu_id * ctx->mem_size;
+        int err;
+
+        switch (image)
+        {
+        case MEM_IMAGE_SHARED:
+            err = snapshot_write_memory_ref(w, ctx->vcpu_id, gpa, ctx->mem_size);
+            break;
+        case MEM_IMAGE_DIRTY:
+            err = snapshot_write_memory_delta(w, ctx->vcpu_id, gpa, ctx->guest_mem, ctx->mem_size,
+                                              dirty_bitmaps[i]);
+            break;
+        default:
+            err = snapshot_write_memory(w, ctx->vcpu_id, gpa, ctx->guest_mem, ctx->mem_size);
+            break;
+        }
+        if (err < 0)
+        {
+            return -1;
+        }
     }
-    if (vcpu_fd >= 0) close(vcpu_fd);
-    if (vm_fd >= 0) close(vm_fd);
-    if (kvm_fd >= 0) close(kvm_fd);
+    return 0;
 }
-#endif // OLD SINGLE-VCPU CLEANUP
 
 /*
- * Extract guest name from binary filename
+ * VM, vCPU and device sections (vCPUs must be paused)
  */
-static const char *extract_guest_name(const char *filename)
+static int write_snapshot_state(snapshot_writer_t *w)
 {
-    const char *name = strrchr(filename, '/');
-    if (name)
+    snapshot_devices_t dev;
+    struct snapshot_vm_state vm_state;
+    struct snapshot_vcpu_state *vcpu_state;
+    int ret = -1;
+
+    memset(&dev, 0, sizeof(dev));
+    pthread_mutex_lock(&uart_lock);
+    dev.uart = uart0;
+    pthread_mutex_unlock(&uart_lock);
+    dev.cmos_index = cmos_index;
+    dev.port92 = port92;
+    dev.reset_control = reset_control;
+    dev.pm1_enable = pm1_enable;
+    dev.pm1_control = pm1_control;
+    pthread_mutex_lock(&keyboard_buffer.lock);
+    dev.kbd_head = keyboard_buffer.head;
+    dev.kbd_tail = keyboard_buffer.tail;
+    memcpy(dev.kbd_buffer, keyboard_buffer.buffer, sizeof(dev.kbd_buffer));
+    pthread_mutex_unlock(&keyboard_buffer.lock);
+    pit_get_state(&dev.pit);
+    if (irqchip_mode == IRQCHIP_SPLIT)
     {
-        name++; // Skip '/'
+        ioapic_get_state(&dev.ioapic);
     }
-    else
+
+    vcpu_state = malloc(sizeof(*vcpu_state));
+    if (!vcpu_state)
     {
-        name = filename;
+        perror("malloc snapshot_vcpu_state");
+        return -1;
     }
 
-    // Remove .bin extension if present
-    static char name_buf[256];
-    snprintf(name_buf, sizeof(name_buf), "%s", name);
+    if (snapshot_save_vm(vm_fd, &vm_state) < 0 ||
+        snapshot_write_section(w, SNAP_SEC_VM, 0, &vm_state, sizeof(vm_state)) < 0)
+    {
+        goto out;
+    }
 
-    char *dot = strrchr(name_buf, '.');
-    if (dot && strcmp(dot, ".bin") == 0)
+    for (int i = 0; i < num_vcpus; i++)
     {
-        *dot = '\0';
+        if (snapshot_save_vcpu(kvm_fd, vcpus[i].vcpu_fd, vcpu_state) < 0 ||
+            snapshot_write_section(w, SNAP_SEC_VCPU, i, vcpu_state, sizeof(*vcpu_state)) < 0)
+        {
+            goto out;
+        }
     }
 
-    return name_buf;
+    if (snapshot_write_section(w, SNAP_SEC_DEVICES, 0, &dev, sizeof(dev)) < 0)
+    {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(vcpu_state);
+    return ret;
 }
 
-int main(int argc, char **argv)
+static void hint_add(uint32_t *order, size_t *n, uint8_t *seen, uint64_t npages, uint64_t page)
 {
-    int ret = 0;
-    pthread_t threads[MAX_VCPUS];
-    bool enable_paging = false;
-    bool enable_long_mode = false;
-    bool linux_boot = false;
-    linux_entry_mode_t linux_entry = LINUX_ENTRY_CODE32;
-    linux_rsi_mode_t linux_rsi = LINUX_RSI_BASE;
-    const char *linux_cmdline = NULL;
-    const char *initrd_path = NULL;
-    const char *bzimage_path = NULL;
-    uint32_t entry_point = 0x80001000; // Default entry point for paging mode
-    uint32_t load_offset = 0x1000;     // Default load offset for paging mode
-    int guest_arg_start = 1;
+    if (page < npages && !seen[page])
+    {
+        seen[page] = 1;
+        order[(*n)++] = (uint32_t)page;
+    }
+}
 
-    // Parse command line arguments
-    if (argc < 2)
+/*
+ * Prefetch hints for lazy restore, one HINTS section per slot: the pages the
+ * vCPUs touch first on resume (code at RIP, stack, descriptor tables, page
+ * directory), then the pages dirtied since the last dirty log harvest.
+ */
+static int write_snapshot_hints(snapshot_writer_t *w, uint64_t *const *dirty_bitmaps)
+{
+    uint64_t hot[MAX_VCPUS * 7];
+    int nhot = 0;
+
+    for (int v = 0; v < num_vcpus; v++)
     {
-        fprintf(stderr, "Usage: %s [OPTIONS] <guest_binary> | --linux <bzImage> [--linux-entry setup|code32|boot64] [--linux-rsi base|hdr] [--cmdline \"...\"] [--initrd <file>]\n", argv[0]);
-        fprintf(stderr, "  Run 1-4 guests simultaneously in separate vCPUs or boot Linux kernel\n");
-        fprintf(stderr, "\nOptions:\n");
-        fprintf(stderr, "  --paging            Enable Protected Mode with paging\n");
-        fprintf(stderr, "  --long-mode         Enable 64-bit Long Mode\n");
-        fprintf(stderr, "  --linux <bzImage>   Boot Linux kernel (bzImage format)\n");
-        fprintf(stderr, "  --linux-entry MODE  Linux entry (setup|code32|boot64, default: code32)\n");
-        fprintf(stderr, "  --linux-rsi MODE    Linux RSI base (base|hdr, default: base)\n");
-        fprintf(stderr, "  --cmdline \"...\"     Kernel command line (for --linux)\n");
-        fprintf(stderr, "  --initrd <file>     Initrd image to load (for --linux)\n");
-        fprintf(stderr, "  --entry ADDR        Set entry point (default: 0x80001000)\n");
-        fprintf(stderr, "  --load OFFSET       Set load offset (default: 0x1000)\n");
-        fprintf(stderr, "  --verbose, -v       Enable basic debug logging (VM exits, hypercalls)\n");
-        fprintf(stderr, "  --debug LEVEL       Set debug verbosity (0=none, 1=basic, 2=detailed, 3=all)\n");
-        fprintf(stderr, "  --dump-regs         Dump all registers on each VM exit\n");
-        fprintf(stderr, "  --dump-mem FILE     Dump guest memory to file on exit\n");
-        fprintf(stderr, "\nExamples:\n");
-        fprintf(stderr, "  %s guest/multiplication.bin guest/counter.bin\n", argv[0]);
-        fprintf(stderr, "  %s --paging --verbose os-1k/kernel.bin\n", argv[0]);
-        fprintf(stderr, "  %s --linux bzImage --cmdline \"console=ttyS0\"\n", argv[0]);
-        return 1;
+        struct kvm_regs regs;
+        struct kvm_sregs sregs;
+        uint64_t linear[6];
+
+        if (ioctl(vcpus[v].vcpu_fd, KVM_GET_REGS, &regs) < 0 ||
+            ioctl(vcpus[v].vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
+        {
+            continue;
+        }
+        linear[0] = sregs.cs.base + regs.rip;
+        linear[1] = linear[0] + 4096;
+        linear[2] = sregs.ss.base + regs.rsp;
+        linear[3] = linear[2] - 4096;
+        linear[4] = sregs.gdt.base;
+        linear[5] = sregs.idt.base;
+        for (int j = 0; j < 6; j++)
+        {
+            struct kvm_translation tr = {.linear_address = linear[j]};
+            if (!(sregs.cr0 & 0x80000000))
+            {
+                hot[nhot++] = linear[j];
+            }
+            else if (ioctl(vcpus[v].vcpu_fd, KVM_TRANSLATE, &tr) == 0 && tr.valid)
+            {
+                hot[nhot++] = tr.physical_address;
+            }
+        }
+        if (sregs.cr0 & 0x80000000)
+        {
+            hot[nhot++] = sregs.cr3 & ~0xfffULL;
+        }
     }
 
-    // Parse flags
-    int i;
-    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    for (int i = 0; i < num_vcpus; i++)
     {
-        if (strcmp(argv[i], "--paging") == 0)
+        vcpu_context_t *ctx = &vcpus[i];
+        uint64_t gpa = ctx->vcpu_id * ctx->mem_size;
+        uint64_t npages = ctx->mem_size / SNAPSHOT_PAGE_SIZE;
+        uint32_t *order = malloc(npages * sizeof(*order));
+        uint8_t *seen = calloc(npages, 1);
+        size_t n = 0;
+        int err;
+
+        if (!order || !seen)
         {
-            enable_paging = true;
+            perror("malloc snapshot hints");
+            free(order);
+            free(seen);
+            return -1;
         }
-        else if (strcmp(argv[i], "--long-mode") == 0)
+        for (int j = 0; j < nhot; j++)
         {
-            enable_long_mode = true;
-            enable_paging = true; // Long mode requires paging
+            if (hot[j] >= gpa && hot[j] < gpa + ctx->mem_size)
+            {
+                hint_add(order, &n, seen, npages, (hot[j] - gpa) / SNAPSHOT_PAGE_SIZE);
+            }
+        }
+        if (dirty_bitmaps && dirty_bitmaps[i])
+        {
+            for (uint64_t page = 0; page < npages; page++)
+            {
+                if (dirty_bitmaps[i][page / 64] & (1ULL << (page % 64)))
+                {
+                    hint_add(order, &n, seen, npages, page);
+                }
+            }
+        }
+
+        err = snapshot_write_section(w, SNAP_SEC_HINTS, ctx->vcpu_id, order, n * sizeof(*order));
+        free(order);
+        free(seen);
+        if (err < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write the complete VM to a snapshot stream (vCPUs must be paused)
+ * parent: snapshot this one is relative to (MEM_IMAGE_DIRTY), or NULL
+ */
+static int write_vm_snapshot(snapshot_writer_t *w, memory_image_t image, const char *parent,
+                             uint64_t *const *dirty_bitmaps)
+{
+    if (snapshot_write_header(w, 0) < 0 || write_snapshot_config(w) < 0)
+    {
+        return -1;
+    }
+    if (parent && snapshot_write_parent(w, parent) < 0)
+    {
+        return -1;
+    }
+    if (write_snapshot_memory(w, image, dirty_bitmaps) < 0 ||
+        (image == MEM_IMAGE_FULL && write_snapshot_hints(w, dirty_bitmaps) < 0) ||
+        write_snapshot_state(w) < 0 ||
+        snapshot_write_end(w) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Pause the guest, save it to a file and let it continue
+ */
+static int save_vm_snapshot(const char *path)
+{
+    snapshot_writer_t w;
+    struct timespec start, paused;
+    int ret = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pause_vcpus();
+    clock_gettime(CLOCK_MONOTONIC, &paused);
+
+    if (snapshot_writer_open(&w, path) == 0)
+    {
+        ret = write_vm_snapshot(&w, MEM_IMAGE_FULL, NULL, NULL);
+        if (snapshot_writer_close(&w) < 0)
+        {
+            perror("close snapshot");
+            ret = -1;
+        }
+    }
+
+    resume_vcpus();
+
+    if (ret == 0)
+    {
+        fprintf(stderr, "\n[Snapshot] Saved to %s (paused %.3f ms, downtime %.3f ms)\n", path,
+                (paused.tv_sec - start.tv_sec) * 1e3 + (paused.tv_nsec - start.tv_nsec) / 1e6,
+                elapsed_ms(&start));
+    }
+    else
+    {
+        fprintf(stderr, "\n[Snapshot] Failed to save %s\n", path);
+    }
+    return ret;
+}
+
+/*
+ * Incremental checkpoints (--checkpoint DIR)
+ *
+ * The first checkpoint is a full snapshot. Each later one holds only the
+ * pages KVM logged as dirty since the previous checkpoint, the complete CPU
+ * and device state and a PARENT link to its predecessor. Guest memory written
+ * by the VMM itself is not dirty-logged; it is only captured by a base.
+ */
+static const char *checkpoint_dir = NULL;
+static int checkpoint_interval_ms = CHECKPOINT_DEFAULT_INTERVAL_MS;
+static int checkpoint_index = 0;
+static bool checkpoint_need_base = true;
+static char checkpoint_parent[64];
+
+static int get_dirty_log(vcpu_context_t *ctx, uint64_t *bitmap)
+{
+    struct kvm_dirty_log log;
+
+    memset(&log, 0, sizeof(log));
+    log.slot = ctx->vcpu_id;
+    log.dirty_bitmap = bitmap;
+    if (ioctl(vm_fd, KVM_GET_DIRTY_LOG, &log) < 0)
+    {
+        perror("KVM_GET_DIRTY_LOG");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fetch (and reset) the dirty log of every slot into bitmaps[], allocating
+ * them on first use; dirty_pages receives the total count
+ */
+static int collect_dirty_logs(uint64_t **bitmaps, unsigned long long *dirty_pages)
+{
+    *dirty_pages = 0;
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        size_t bytes = snapshot_bitmap_bytes(vcpus[i].mem_size);
+        if (!bitmaps[i])
+        {
+            bitmaps[i] = malloc(bytes);
+            if (!bitmaps[i])
+            {
+                perror("malloc dirty bitmap");
+                return -1;
+            }
+        }
+        memset(bitmaps[i], 0, bytes);
+        if (get_dirty_log(&vcpus[i], bitmaps[i]) < 0)
+        {
+            return -1;
+        }
+        for (size_t j = 0; j < bytes / sizeof(uint64_t); j++)
+        {
+            *dirty_pages += __builtin_popcountll(bitmaps[i][j]);
+        }
+    }
+    return 0;
+}
+
+static int write_checkpoint(void)
+{
+    char name[sizeof(checkpoint_parent)];
+    char path[PATH_MAX];
+    uint64_t *bitmaps[MAX_VCPUS] = {NULL};
+    snapshot_writer_t w;
+    struct timespec start;
+    unsigned long long dirty_pages = 0;
+    bool base = checkpoint_need_base;
+    double paused_ms;
+    int ret = -1;
+
+    snprintf(name, sizeof(name), "ckpt-%04d.snap", checkpoint_index);
+    snprintf(path, sizeof(path), "%s/%s", checkpoint_dir, name);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pause_vcpus();
+
+    // Fetching the log also clears it, so a base starts the next interval clean
+    if (collect_dirty_logs(bitmaps, &dirty_pages) < 0)
+    {
+        goto out;
+    }
+
+    if (snapshot_writer_open(&w, path) == 0)
+    {
+        ret = write_vm_snapshot(&w, base ? MEM_IMAGE_FULL : MEM_IMAGE_DIRTY,
+                                base ? NULL : checkpoint_parent, bitmaps);
+        if (snapshot_writer_close(&w) < 0)
+        {
+            perror("close checkpoint");
+            ret = -1;
+        }
+    }
+
+out:
+    paused_ms = elapsed_ms(&start);
+    resume_vcpus();
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        free(bitmaps[i]);
+    }
+
+    if (ret == 0)
+    {
+        if (verbose)
+        {
+            fprintf(stderr, "\n[Checkpoint] %s: %s, %llu dirty page(s), paused %.3f ms\n",
+                    path, base ? "base" : "delta", dirty_pages, paused_ms);
+        }
+        snprintf(checkpoint_parent, sizeof(checkpoint_parent), "%s", name);
+        checkpoint_index++;
+        checkpoint_need_base = false;
+    }
+    else
+    {
+        // The dirty log may already be consumed: restart the chain with a base
+        fprintf(stderr, "\n[Checkpoint] Failed to write %s\n", path);
+        checkpoint_need_base = true;
+    }
+    return ret;
+}
+
+/*
+ * Pre-copy live migration (--migrate-to SOCK / --incoming SOCK)
+ *
+ * The migration stream is an ordinary snapshot stream on a UNIX socket.
+ * CONFIG and a full memory image go out while the guest keeps running,
+ * followed by rounds of dirty-page deltas. Once a round is small enough (or
+ * MIGRATE_MAX_ROUNDS is reached) the vCPUs are paused and the last dirty
+ * pages, a refreshed CONFIG and the CPU/VM/device state are sent. The
+ * receiver acknowledges with one byte right before it starts its vCPUs.
+ */
+static const char *migrate_path = NULL;
+static int migrate_delay_ms = MIGRATE_DEFAULT_DELAY_MS;
+
+static int migrate_vm(const char *path)
+{
+    struct sockaddr_un addr;
+    uint64_t *bitmaps[MAX_VCPUS] = {NULL};
+    unsigned long long dirty_pages = 0;
+    snapshot_writer_t w;
+    struct timespec start, paused;
+    double downtime_ms = 0;
+    bool vcpus_paused_here = false;
+    struct sigaction ignore_pipe, old_pipe;
+    int rounds = 0;
+    int ret = -1;
+    char ack;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "\n[Migration] Cannot connect to %s: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    // A receiver that goes away must fail the next write with EPIPE, not
+    // kill this process along with the guest
+    memset(&ignore_pipe, 0, sizeof(ignore_pipe));
+    ignore_pipe.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore_pipe, &old_pipe);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snapshot_writer_init_fd(&w, sock);
+
+    // Reset the dirty log first: every page written after this point is resent
+    if (collect_dirty_logs(bitmaps, &dirty_pages) < 0 ||
+        snapshot_write_header(&w, 0) < 0 ||
+        write_snapshot_config(&w) < 0 ||
+        write_snapshot_memory(&w, MEM_IMAGE_FULL, NULL) < 0)
+    {
+        goto out;
+    }
+
+    // Iterative pre-copy while the guest runs
+    while (rounds < MIGRATE_MAX_ROUNDS)
+    {
+        if (collect_dirty_logs(bitmaps, &dirty_pages) < 0 ||
+            write_snapshot_memory(&w, MEM_IMAGE_DIRTY, bitmaps) < 0)
+        {
+            goto out;
+        }
+        rounds++;
+        DEBUG_PRINT(DEBUG_BASIC, "Migration round %d: %llu dirty page(s)", rounds, dirty_pages);
+        if (dirty_pages <= MIGRATE_DIRTY_THRESHOLD)
+        {
+            break;
+        }
+    }
+
+    // Stop-and-copy
+    pause_vcpus();
+    vcpus_paused_here = true;
+    clock_gettime(CLOCK_MONOTONIC, &paused);
+    if (collect_dirty_logs(bitmaps, &dirty_pages) < 0 ||
+        write_snapshot_memory(&w, MEM_IMAGE_DIRTY, bitmaps) < 0 ||
+        write_snapshot_config(&w) < 0 ||
+        write_snapshot_state(&w) < 0 ||
+        snapshot_write_end(&w) < 0)
+    {
+        goto out;
+    }
+    if (read(sock, &ack, 1) != 1)
+    {
+        fprintf(stderr, "\n[Migration] Receiver did not resume the guest\n");
+        goto out;
+    }
+    downtime_ms = elapsed_ms(&paused);
+
+    // The guest now lives in the receiver
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        vcpus[i].running = false;
+    }
+    ret = 0;
+
+out:
+    if (vcpus_paused_here)
+    {
+        resume_vcpus();
+    }
+    close(sock);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        free(bitmaps[i]);
+    }
+
+    if (ret == 0)
+    {
+        fprintf(stderr, "\n[Migration] Sent %.2f MB in %d pre-copy round(s) + final (%llu page(s)), "
+                        "total %.3f ms, downtime %.3f ms\n",
+                w.offset / (1024.0 * 1024.0), rounds, dirty_pages, elapsed_ms(&start), downtime_ms);
+    }
+    else
+    {
+        fprintf(stderr, "\n[Migration] Failed; guest continues here\n");
+    }
+    return ret;
+}
+
+/*
+ * Rebuild the VM shell (KVM VM, vCPU contexts) from a CONFIG section
+ * A pre-warmed VM (vm_fd already open, e.g. a clone) is reused if it matches.
+ */
+static int apply_snapshot_config(const snapshot_config_t *cfg)
+{
+    bool prewarmed = (vm_fd >= 0);
+
+    if (cfg->num_vcpus < 1 || cfg->num_vcpus > MAX_VCPUS)
+    {
+        fprintf(stderr, "Snapshot has invalid vCPU count %u\n", cfg->num_vcpus);
+        return -1;
+    }
+    if (cfg->irqchip > IRQCHIP_SPLIT)
+    {
+        fprintf(stderr, "Snapshot has unknown irqchip profile %u\n", cfg->irqchip);
+        return -1;
+    }
+    if (prewarmed && (cfg->num_vcpus != (uint32_t)num_vcpus || cfg->irqchip != (uint32_t)irqchip_mode))
+    {
+        fprintf(stderr, "Snapshot does not match the pre-warmed VM\n");
+        return -1;
+    }
+
+    // The guest may already use PV features; restored vCPUs must keep them.
+    // A pre-warmed VM's vCPUs already have their CPUID, so it must agree.
+    if (cfg->flags & SNAP_CFG_PV_FEATURES)
+    {
+        if (prewarmed && cfg->pv_features != cpuid_get_pv_features())
+        {
+            fprintf(stderr, "Snapshot PV profile 0x%x does not match the pre-warmed VM's 0x%x\n",
+                    cfg->pv_features, cpuid_get_pv_features());
+            return -1;
+        }
+        cpuid_set_pv_features(cfg->pv_features);
+    }
+
+    num_vcpus = cfg->num_vcpus;
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        vcpu_context_t *ctx = &vcpus[i];
+        const snapshot_vcpu_config_t *vc = &cfg->vcpu[i];
+
+        if (!prewarmed)
+        {
+            memset(ctx, 0, sizeof(*ctx));
+            ctx->vcpu_id = i;
+            ctx->vcpu_fd = -1;
+            ctx->mem_fd = -1;
+        }
+        snprintf(ctx->name, sizeof(ctx->name), "%.*s", (int)sizeof(vc->name), vc->name);
+        ctx->guest_binary = ctx->name;
+        ctx->mem_size = vc->mem_size;
+        ctx->entry_point = vc->entry_point;
+        ctx->load_offset = vc->load_offset;
+        ctx->pending_getchar = vc->pending_getchar;
+        ctx->getchar_result = vc->getchar_result;
+        ctx->running = vc->running;
+        ctx->use_paging = vc->use_paging;
+        ctx->long_mode = vc->long_mode;
+        ctx->linux_guest = vc->linux_guest;
+        ctx->hlt_policy = vc->hlt_policy == HLT_IDLE ? HLT_IDLE : HLT_EXIT;
+    }
+
+    return prewarmed ? 0 : init_kvm((irqchip_mode_t)cfg->irqchip);
+}
+
+static int restore_snapshot_memory(snapshot_reader_t *r, const struct snapshot_section *sec, bool lazy)
+{
+    struct snapshot_mem_desc desc;
+
+    if (snapshot_read_memory_desc(r, sec, &desc) < 0)
+    {
+        return -1;
+    }
+    if (desc.slot >= (uint32_t)num_vcpus || desc.size != vcpus[desc.slot].mem_size ||
+        desc.gpa != desc.slot * desc.size)
+    {
+        fprintf(stderr, "Snapshot memory slot %u does not match its configuration\n", desc.slot);
+        return -1;
+    }
+
+    vcpu_context_t *ctx = &vcpus[desc.slot];
+
+    // Incremental snapshot: dirty pages on top of the memory restored from the parent
+    if (desc.flags & SNAP_MEM_DELTA)
+    {
+        if (ctx->guest_mem == NULL)
+        {
+            fprintf(stderr, "Snapshot delta for slot %u has no parent memory\n", desc.slot);
+            return -1;
+        }
+        return snapshot_read_memory_delta(r, sec, &desc, ctx->guest_mem);
+    }
+    if (ctx->guest_mem != NULL)
+    {
+        fprintf(stderr, "Snapshot has duplicate memory slot %u\n", desc.slot);
+        return -1;
+    }
+
+    // Pages shared out of band (clones): private COW mapping of the template memfd
+    if (desc.flags & SNAP_MEM_EXTERNAL)
+    {
+        if (ctx->mem_fd < 0)
+        {
+            fprintf(stderr, "Snapshot memory slot %u has no backing memfd\n", desc.slot);
+            return -1;
+        }
+        ctx->guest_mem = mmap(NULL, ctx->mem_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE, ctx->mem_fd, 0);
+        if (ctx->guest_mem == MAP_FAILED)
+        {
+            perror("mmap template memfd");
+            ctx->guest_mem = NULL;
+            return -1;
+        }
+        return register_guest_memory(ctx);
+    }
+
+    // Lazy restore: empty memory now, pages arrive through userfaultfd
+    if (lazy && r->seekable)
+    {
+        if (alloc_guest_memory(ctx) < 0 ||
+            lazy_restore_add_region(desc.slot, ctx->guest_mem, ctx->mem_size, desc.data_offset) < 0 ||
+            snapshot_skip(r, desc.size) < 0)
+        {
+            return -1;
+        }
+        return register_guest_memory(ctx);
+    }
+
+    // Map the image copy-on-write; fall back to reading it for pipes/sockets
+    ctx->guest_mem = snapshot_map_memory(r, &desc);
+    if (ctx->guest_mem == MAP_FAILED)
+    {
+        if (r->seekable)
+        {
+            ctx->guest_mem = NULL;
+            return -1;
+        }
+        ctx->guest_mem = NULL;
+        if (alloc_guest_memory(ctx) < 0 || snapshot_read_memory(r, &desc, ctx->guest_mem) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return register_guest_memory(ctx);
+}
+
+static int restore_snapshot_vcpu(const struct snapshot_section *sec,
+                                 const struct snapshot_vcpu_state *st)
+{
+    if (sec->id >= (uint32_t)num_vcpus)
+    {
+        fprintf(stderr, "Snapshot has unexpected vCPU section %u\n", sec->id);
+        return -1;
+    }
+
+    // Pre-warmed vCPUs already exist with CPUID set
+    vcpu_context_t *ctx = &vcpus[sec->id];
+    if (ctx->vcpu_fd < 0)
+    {
+        if (create_vcpu(ctx) < 0)
+        {
+            return -1;
+        }
+        // CPUID decides which MSRs and XSAVE features KVM accepts, so set it first
+        if (setup_cpuid(kvm_fd, ctx->vcpu_fd, (uint32_t)ctx->vcpu_id) < 0)
+        {
+            return -1;
+        }
+    }
+    return snapshot_restore_vcpu(ctx->vcpu_fd, st);
+}
+
+static void restore_snapshot_devices(const snapshot_devices_t *dev)
+{
+    pthread_mutex_lock(&uart_lock);
+    uart0 = dev->uart;
+    uart0.rx_head %= UART_FIFO_SIZE;
+    if (uart0.rx_count > UART_FIFO_SIZE)
+    {
+        uart0.rx_count = UART_FIFO_SIZE;
+    }
+    pthread_mutex_unlock(&uart_lock);
+    cmos_index = dev->cmos_index;
+    port92 = dev->port92;
+    reset_control = dev->reset_control & ~RESET_CONTROL_RST_CPU;
+    pm1_enable = dev->pm1_enable;
+    pm1_control = (uint16_t)((dev->pm1_control & ~ACPI_PM1_CNT_SLP_EN) | ACPI_PM1_CNT_SCI_EN);
+    pthread_mutex_lock(&keyboard_buffer.lock);
+    keyboard_buffer.head = dev->kbd_head % KEYBOARD_BUFFER_SIZE;
+    keyboard_buffer.tail = dev->kbd_tail % KEYBOARD_BUFFER_SIZE;
+    memcpy(keyboard_buffer.buffer, dev->kbd_buffer, sizeof(keyboard_buffer.buffer));
+    pthread_mutex_unlock(&keyboard_buffer.lock);
+    pit_set_state(&dev->pit);
+    if (irqchip_mode == IRQCHIP_SPLIT)
+    {
+        ioapic_set_state(&dev->ioapic);
+    }
+}
+
+/*
+ * Restore the memory of an incremental snapshot's ancestors (base first)
+ */
+static int load_snapshot_parent(const char *path, int depth)
+{
+    snapshot_reader_t r;
+    struct snapshot_header hdr;
+    struct snapshot_section sec;
+    char *parent = NULL;
+    int ret = -1;
+
+    if (depth >= SNAPSHOT_MAX_CHAIN)
+    {
+        fprintf(stderr, "Snapshot chain longer than %d\n", SNAPSHOT_MAX_CHAIN);
+        return -1;
+    }
+    if (snapshot_reader_open(&r, path) < 0)
+    {
+        return -1;
+    }
+    if (snapshot_read_header(&r, &hdr) < 0)
+    {
+        goto out;
+    }
+
+    for (;;)
+    {
+        if (snapshot_next_section(&r, &sec) < 0)
+        {
+            goto out;
+        }
+        if (sec.type == SNAP_SEC_END)
+        {
+            break;
+        }
+
+        if (sec.type == SNAP_SEC_PARENT)
+        {
+            parent = malloc(PATH_MAX);
+            if (!parent || snapshot_read_parent(&r, &sec, path, parent, PATH_MAX) < 0 ||
+                load_snapshot_parent(parent, depth + 1) < 0)
+            {
+                goto out;
+            }
+        }
+        else if (sec.type == SNAP_SEC_MEMORY)
+        {
+            if (restore_snapshot_memory(&r, &sec, false) < 0)
+            {
+                goto out;
+            }
+        }
+        else if (snapshot_skip(&r, sec.size) < 0)
+        {
+            goto out;
+        }
+    }
+    DEBUG_PRINT(DEBUG_BASIC, "Restored memory from %s", path);
+    ret = 0;
+
+out:
+    free(parent);
+    snapshot_reader_close(&r);
+    return ret;
+}
+
+/*
+ * Rebuild the VM from a snapshot stream
+ * path: file the stream comes from (resolves PARENT sections), or NULL
+ * cfg_flags receives SNAP_CFG_* so the caller can restart the host threads
+ */
+static int read_vm_snapshot(snapshot_reader_t *r, const char *path, uint32_t *cfg_flags)
+{
+    struct snapshot_header hdr;
+    struct snapshot_section sec;
+    snapshot_config_t cfg;
+    snapshot_devices_t dev;
+    struct snapshot_vm_state vm_state;
+    struct snapshot_vcpu_state *vcpu_state;
+    bool have_config = false;
+    int ret = -1;
+
+    if (snapshot_read_header(r, &hdr) < 0)
+    {
+        return -1;
+    }
+
+    vcpu_state = malloc(sizeof(*vcpu_state));
+    if (!vcpu_state)
+    {
+        perror("malloc snapshot_vcpu_state");
+        return -1;
+    }
+
+    for (;;)
+    {
+        if (snapshot_next_section(r, &sec) < 0)
+        {
+            goto out;
+        }
+        if (sec.type == SNAP_SEC_END)
+        {
+            break;
+        }
+        if (!have_config && sec.type != SNAP_SEC_CONFIG)
+        {
+            fprintf(stderr, "Snapshot does not start with a CONFIG section\n");
+            goto out;
+        }
+
+        switch (sec.type)
+        {
+        case SNAP_SEC_CONFIG:
+            // A repeated CONFIG (end of a migration stream) refreshes the vCPU fields
+            if (sec.size != sizeof(cfg) ||
+                snapshot_read_payload(r, &cfg, sizeof(cfg)) < 0 ||
+                apply_snapshot_config(&cfg) < 0)
+            {
+                goto out;
+            }
+            *cfg_flags = cfg.flags;
+            have_config = true;
+            break;
+
+        case SNAP_SEC_PARENT:
+        {
+            char parent[PATH_MAX];
+            if (lazy_restore_active())
+            {
+                printf("Lazy restore needs a full snapshot; restoring the chain eagerly\n");
+                lazy_restore_close();
+            }
+            if (!path || snapshot_read_parent(r, &sec, path, parent, sizeof(parent)) < 0 ||
+                load_snapshot_parent(parent, 1) < 0)
+            {
+                fprintf(stderr, "Failed to restore the parent of this incremental snapshot\n");
+                goto out;
+            }
+            break;
+        }
+
+        case SNAP_SEC_MEMORY:
+            if (restore_snapshot_memory(r, &sec, lazy_restore_active()) < 0)
+            {
+                goto out;
+            }
+            break;
+
+        case SNAP_SEC_VM:
+            if (sec.size != sizeof(vm_state) ||
+                snapshot_read_payload(r, &vm_state, sizeof(vm_state)) < 0 ||
+                snapshot_restore_vm(vm_fd, &vm_state) < 0)
+            {
+                goto out;
+            }
+            // Restoring an in-kernel PIT creates it if this VM had none
+            kernel_pit = kernel_pit || (vm_state.flags & SNAP_VM_PIT);
+            break;
+
+        case SNAP_SEC_VCPU:
+            if (sec.size != sizeof(*vcpu_state) ||
+                snapshot_read_payload(r, vcpu_state, sizeof(*vcpu_state)) < 0 ||
+                restore_snapshot_vcpu(&sec, vcpu_state) < 0)
+            {
+                goto out;
+            }
+            break;
+
+        case SNAP_SEC_HINTS:
+        {
+            if (!lazy_restore_active() || sec.size % sizeof(uint32_t) != 0)
+            {
+                if (snapshot_skip(r, sec.size) < 0)
+                {
+                    goto out;
+                }
+                break;
+            }
+            uint32_t *hints = malloc(sec.size + sizeof(uint32_t));
+            if (!hints || snapshot_read_payload(r, hints, sec.size) < 0 ||
+                lazy_restore_set_hints(sec.id, hints, sec.size / sizeof(uint32_t)) < 0)
+            {
+                free(hints);
+                goto out;
+            }
+            free(hints);
+            break;
+        }
+
+        case SNAP_SEC_DEVICES:
+            if (sec.size != sizeof(dev) || snapshot_read_payload(r, &dev, sizeof(dev)) < 0)
+            {
+                goto out;
+            }
+            restore_snapshot_devices(&dev);
+            break;
+
+        default:
+            DEBUG_PRINT(DEBUG_BASIC, "Skipping unknown snapshot section %u", sec.type);
+            if (snapshot_skip(r, sec.size) < 0)
+            {
+                goto out;
+            }
+            break;
+        }
+    }
+
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        if (vcpus[i].guest_mem == NULL || vcpus[i].vcpu_fd < 0)
+        {
+            fprintf(stderr, "Snapshot is missing state for vCPU %d\n", i);
+            goto out;
+        }
+    }
+    ret = have_config ? 0 : -1;
+
+out:
+    free(vcpu_state);
+    return ret;
+}
+
+static int restore_vm_snapshot(const char *path, uint32_t *cfg_flags)
+{
+    snapshot_reader_t r;
+    struct timespec start;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (snapshot_reader_open(&r, path) < 0)
+    {
+        return -1;
+    }
+    if (lazy_restore && lazy_restore_open(path) < 0)
+    {
+        printf("Lazy restore unavailable; restoring eagerly\n");
+    }
+    ret = read_vm_snapshot(&r, path, cfg_flags);
+    snapshot_reader_close(&r);
+    if (ret == 0 && lazy_restore_active())
+    {
+        // The working set sidecar (<snapshot>.wss) is either recorded now or replayed
+        char wss_path[PATH_MAX];
+        size_t wss_pages = 0;
+
+        snprintf(wss_path, sizeof(wss_path), "%s.wss", path);
+        if (record_wss_ms > 0)
+        {
+            ret = lazy_restore_record(wss_path, record_wss_ms);
+        }
+        else if (lazy_restore_load_wss(wss_path, &wss_pages) == 0 && wss_pages > 0)
+        {
+            printf("Prefetching %zu page(s) in recorded working-set order (%s)\n", wss_pages, wss_path);
+        }
+        if (ret == 0 && lazy_restore_start() < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        printf("Restored %d vCPU(s) from %s in %.3f ms%s\n", num_vcpus, path, elapsed_ms(&start),
+               lazy_restore_active() ? " (lazy)" : "");
+    }
+    else
+    {
+        fprintf(stderr, "Error: Failed to restore snapshot %s\n", path);
+    }
+    return ret;
+}
+
+/*
+ * Remove a socket an earlier run left at path so bind() can reuse it.
+ * Anything else there is kept, and bind() then reports the path as taken.
+ */
+static void unlink_stale_socket(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+}
+
+/*
+ * Receive a migrating VM on a UNIX socket
+ */
+static int incoming_vm_snapshot(const char *path, uint32_t *cfg_flags)
+{
+    struct sockaddr_un addr;
+    snapshot_reader_t r;
+    struct timespec start;
+    int ret;
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink_stale_socket(path);
+
+    // Whoever connects first replaces the guest, so keep the socket 0600
+    mode_t old_umask = umask(0077);
+    int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound < 0 || listen(listen_fd, 1) < 0)
+    {
+        perror("bind/listen incoming socket");
+        close(listen_fd);
+        return -1;
+    }
+
+    printf("Waiting for incoming migration on %s\n", path);
+    fflush(stdout);
+    int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    close(listen_fd);
+    unlink(path);
+    if (conn < 0)
+    {
+        perror("accept");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snapshot_reader_init_fd(&r, conn);
+    ret = read_vm_snapshot(&r, NULL, cfg_flags);
+    if (ret == 0)
+    {
+        char ack = 'R';
+        if (write(conn, &ack, 1) != 1)
+        {
+            perror("write migration ack");
+            ret = -1;
+        }
+    }
+    close(conn);
+
+    if (ret == 0)
+    {
+        printf("Incoming migration: %.2f MB received in %.3f ms\n",
+               r.offset / (1024.0 * 1024.0), elapsed_ms(&start));
+    }
+    else
+    {
+        fprintf(stderr, "Error: Incoming migration failed\n");
+    }
+    return ret;
+}
+
+/*
+ * Host-side device backends driven by the event loop
+ * They inject through irqfds, so they need an in-kernel irqchip. The
+ * userspace PIT only runs when the kernel has none (split, --timer-hz).
+ */
+static int start_host_devices(void)
+{
+    if (irqchip_mode == IRQCHIP_NONE)
+    {
+        return 0;
+    }
+    if ((!kernel_pit && pit_init(vm_fd, timer_hz) < 0) || uart_irq_init() < 0 || event_loop_start() < 0)
+    {
+        fprintf(stderr, "Warning: Host device backends unavailable. Device interrupts disabled.\n");
+        return -1;
+    }
+    // A restored UART may already have an interrupt pending
+    uart_update_irq();
+    return 0;
+}
+
+static void stop_host_devices(void)
+{
+    event_loop_stop();
+    uart_irq_cleanup();
+    if (verbose && pit_ticks() > 0)
+    {
+        fprintf(stderr, "[PIT] %llu timer interrupt(s) delivered\n", (unsigned long long)pit_ticks());
+    }
+    pit_cleanup();
+}
+
+/*
+ * Copy-on-write cloning (--clone N)
+ *
+ * The clones are forked before the template VM exists. Each one creates its
+ * own VM and vCPUs up front (a KVM VM belongs to the mm of the process that
+ * created it) and blocks on a socketpair. When the template reaches the clone
+ * point it is paused for good, its memfds are passed over SCM_RIGHTS and a
+ * snapshot stream without page data follows. Clones map the memfds
+ * MAP_PRIVATE, so untouched pages stay shared with the template.
+ */
+typedef struct
+{
+    struct timespec frozen_at; // CLOCK_MONOTONIC time the template was frozen
+    uint32_t num_fds;          // Guest memfds attached (one per vCPU slot)
+    uint32_t reserved;
+} clone_handoff_t;
+
+static int clone_socks[CLONE_MAX];
+static pid_t clone_pids[CLONE_MAX];
+
+/*
+ * Create the VM and vCPUs a clone will restore into
+ */
+static int clone_prewarm(bool linux_boot)
+{
+    if (init_kvm(default_irqchip_mode(linux_boot)) < 0)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        vcpu_context_t *ctx = &vcpus[i];
+        memset(ctx, 0, sizeof(*ctx));
+        ctx->vcpu_id = i;
+        ctx->vcpu_fd = -1;
+        ctx->mem_fd = -1;
+        if (create_vcpu(ctx) < 0 || setup_cpuid(kvm_fd, ctx->vcpu_fd, (uint32_t)ctx->vcpu_id) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Receive the template memfds; returns 1 if the template never froze
+ */
+static int clone_receive(int sock, struct timespec *frozen_at)
+{
+    clone_handoff_t handoff;
+    char cbuf[CMSG_SPACE(sizeof(int) * MAX_VCPUS)];
+    struct iovec iov = {.iov_base = &handoff, .iov_len = sizeof(handoff)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf),
+    };
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n == 0)
+    {
+        return 1;
+    }
+    if (n != (ssize_t)sizeof(handoff))
+    {
+        perror("recvmsg clone handoff");
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        handoff.num_fds != (uint32_t)num_vcpus ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * handoff.num_fds))
+    {
+        fprintf(stderr, "Clone handoff does not carry %d memfd(s)\n", num_vcpus);
+        return -1;
+    }
+
+    int *fds = (int *)CMSG_DATA(cmsg);
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        vcpus[i].mem_fd = fds[i];
+    }
+    *frozen_at = handoff.frozen_at;
+    return 0;
+}
+
+/*
+ * Clone process body (never returns)
+ */
+static void clone_main(int index, int sock, bool linux_boot)
+{
+    struct timespec frozen_at, start;
+    snapshot_reader_t reader;
+    uint32_t flags = 0;
+    int ret;
+
+    // Clones never clone again and leave the terminal to the template
+    clone_count = 0;
+    clone_marker = NULL;
+    termios_saved = false;
+
+    // Keep warm-up chatter off the shared console
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (!verbose)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0)
+        {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+    }
+    ret = clone_prewarm(linux_boot);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (ret < 0)
+    {
+        exit(1);
+    }
+
+    ret = clone_receive(sock, &frozen_at);
+    if (ret != 0)
+    {
+        exit(ret < 0 ? 1 : 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snapshot_reader_init_fd(&reader, sock);
+    if (read_vm_snapshot(&reader, NULL, &flags) < 0)
+    {
+        fprintf(stderr, "[clone %d] Failed to restore template state\n", index);
+        exit(1);
+    }
+    close(sock);
+    double restore_ms = elapsed_ms(&start);
+
+    // Only the first clone takes console input
+    if (index == 0 && (flags & SNAP_CFG_INTERACTIVE))
+    {
+        stdin_thread_running = true;
+        linux_serial_input_enabled = (flags & SNAP_CFG_LINUX_SERIAL) != 0;
+        if (pthread_create(&stdin_thread, NULL, stdin_monitor_thread_func, NULL) != 0)
+        {
+            stdin_thread_running = false;
+            linux_serial_input_enabled = false;
+        }
+    }
+
+    init_vcpu_colors(num_vcpus);
+    start_host_devices();
+    double resume_ms = elapsed_ms(&frozen_at);
+    vcpus_active = num_vcpus;
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        if (pthread_create(&vcpus[i].thread, NULL, vcpu_thread, &vcpus[i]) != 0)
+        {
+            fprintf(stderr, "[clone %d] Failed to create thread for vCPU %d\n", index, i);
+            exit(1);
+        }
+    }
+
+    if (verbose)
+    {
+        fprintf(stderr, "[clone %d] resumed %.3f ms after the template froze (restore %.3f ms)\n",
+                index, resume_ms, restore_ms);
+    }
+
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        pthread_join(vcpus[i].thread, NULL);
+    }
+
+    if (stdin_thread_running)
+    {
+        stdin_thread_running = false;
+        pthread_join(stdin_thread, NULL);
+    }
+    stop_host_devices();
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        cleanup_vcpu(&vcpus[i]);
+    }
+    exit(0);
+}
+
+/*
+ * Fork the clone processes (before the template VM is created)
+ */
+static int spawn_clones(bool linux_boot)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int k = 0; k < clone_count; k++)
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        {
+            perror("socketpair");
+            clone_count = k;
+            return -1;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork clone");
+            close(sv[0]);
+            close(sv[1]);
+            clone_count = k;
+            return -1;
+        }
+        if (pid == 0)
+        {
+            close(sv[0]);
+            for (int j = 0; j < k; j++)
+            {
+                close(clone_socks[j]);
+            }
+            clone_main(k, sv[1], linux_boot);
+        }
+
+        close(sv[1]);
+        clone_socks[k] = sv[0];
+        clone_pids[k] = pid;
+    }
+
+    printf("Forked %d pre-warmed clone(s)\n", clone_count);
+    return 0;
+}
+
+static int clone_send(int sock, const struct timespec *frozen_at)
+{
+    clone_handoff_t handoff;
+    char cbuf[CMSG_SPACE(sizeof(int) * MAX_VCPUS)];
+    struct iovec iov = {.iov_base = &handoff, .iov_len = sizeof(handoff)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * num_vcpus),
+    };
+    snapshot_writer_t w;
+
+    memset(&handoff, 0, sizeof(handoff));
+    handoff.frozen_at = *frozen_at;
+    handoff.num_fds = num_vcpus;
+
+    memset(cbuf, 0, sizeof(cbuf));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_vcpus);
+    int *fds = (int *)CMSG_DATA(cmsg);
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        fds[i] = vcpus[i].mem_fd;
+    }
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(handoff))
+    {
+        perror("sendmsg clone handoff");
+        return -1;
+    }
+
+    snapshot_writer_init_fd(&w, sock);
+    return write_vm_snapshot(&w, MEM_IMAGE_SHARED, NULL, NULL);
+}
+
+/*
+ * Freeze the template at its clone point and hand it to every clone
+ */
+static void freeze_and_clone(void)
+{
+    struct timespec frozen_at;
+    int sent = 0;
+
+    pause_vcpus();
+    clock_gettime(CLOCK_MONOTONIC, &frozen_at);
+
+    for (int k = 0; k < clone_count; k++)
+    {
+        if (clone_socks[k] < 0)
+        {
+            continue;
+        }
+        if (clone_send(clone_socks[k], &frozen_at) == 0)
+        {
+            sent++;
+        }
+        else
+        {
+            fprintf(stderr, "[clone] Failed to hand off to clone %d\n", k);
+        }
+        close(clone_socks[k]);
+        clone_socks[k] = -1;
+    }
+
+    fprintf(stderr, "\n[clone] Template frozen; state sent to %d/%d clone(s) in %.3f ms\n",
+            sent, clone_count, elapsed_ms(&frozen_at));
+
+    // Clones map the template memory MAP_PRIVATE, so it must never change again
+    for (int i = 0; i < num_vcpus; i++)
+    {
+        vcpus[i].running = false;
+    }
+    resume_vcpus();
+}
+
+/*
+ * Release clones that never got a template and wait for all of them
+ */
+static int wait_for_clones(void)
+{
+    int failed = 0;
+
+    for (int k = 0; k < clone_count; k++)
+    {
+        if (clone_socks[k] >= 0)
+        {
+            close(clone_socks[k]);
+            clone_socks[k] = -1;
+        }
+    }
+    for (int k = 0; k < clone_count; k++)
+    {
+        int status = 0;
+        if (clone_pids[k] > 0 && waitpid(clone_pids[k], &status, 0) > 0 &&
+            (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+        {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/*
+ * Wait for the vCPU threads, saving a snapshot on each SIGUSR1, cloning
+ * the VM on SIGUSR2 (raised by request_clone_point()), writing periodic
+ * checkpoints and starting a migration
+ * Both signals must already be blocked in all threads.
+ */
+static void monitor_vcpus(const char *snapshot_path)
+{
+    sigset_t set;
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = 100 * 1000 * 1000};
+    struct timespec last_checkpoint, monitor_start;
+    bool migrated = false;
+
+    if (checkpoint_dir && checkpoint_interval_ms < 100)
+    {
+        timeout.tv_nsec = checkpoint_interval_ms * 1000L * 1000L;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+    monitor_start = last_checkpoint;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pause_lock);
+        int active = vcpus_active;
+        pthread_mutex_unlock(&pause_lock);
+        if (active == 0)
+        {
+            break;
+        }
+
+        int sig = sigtimedwait(&set, NULL, &timeout);
+        if (sig == SIGUSR1 && snapshot_path)
+        {
+            save_vm_snapshot(snapshot_path);
+        }
+        else if (sig == SIGUSR2)
+        {
+            freeze_and_clone();
+        }
+
+        if (checkpoint_dir && elapsed_ms(&last_checkpoint) >= checkpoint_interval_ms)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+            write_checkpoint();
+        }
+
+        if (migrate_path && !migrated && elapsed_ms(&monitor_start) >= migrate_delay_ms)
+        {
+            migrated = true;
+            migrate_vm(migrate_path);
+        }
+    }
+}
+
+#if 0  // OLD SINGLE-VCPU CLEANUP (disabled)
+/*
+ * Cleanup resources
+ */
+static void cleanup(void) {
+    if (kvm_run != NULL && kvm_run != MAP_FAILED) {
+        munmap(kvm_run, sizeof(*kvm_run));
+    }
+    if (guest_mem != NULL && guest_mem != MAP_FAILED) {
+        munmap(guest_mem, GUEST_MEM_SIZE);
+    }
+    if (vcpu_fd >= 0) close(vcpu_fd);
+    if (vm_fd >= 0) close(vm_fd);
+    if (kvm_fd >= 0) close(kvm_fd);
+}
+#endif // OLD SINGLE-VCPU CLEANUP
+
+/*
+ * Extract guest name from binary filename
+ */
+static const char *extract_guest_name(const char *filename)
+{
+    const char *name = strrchr(filename, '/');
+    if (name)
+    {
+        name++; // Skip '/'
+    }
+    else
+    {
+        name = filename;
+    }
+
+    // Remove .bin extension if present
+    static char name_buf[256];
+    snprintf(name_buf, sizeof(name_buf), "%s", name);
+
+    char *dot = strrchr(name_buf, '.');
+    if (dot && strcmp(dot, ".bin") == 0)
+    {
+        *dot = '\0';
+    }
+
+    return name_buf;
+}
+
+/*
+ * Pre-warmed VM pool (server mode)
+ *
+ * Every pool worker is a forked child that opens /dev/kvm, creates the VM and
+ * TSS, allocates guest memory and creates a fully configured vCPU, then blocks
+ * in accept() on the shared listening socket. A KVM VM is tied to the mm of
+ * the process that created it, so the warm-up must happen inside the worker;
+ * the parent only keeps the pool topped up.
+ *
+ * Protocol: the client sends one line with the guest binary path. The worker
+ * loads it, attaches the connection as the guest console (stdin/stdout) and
+ * enters KVM_RUN immediately. A worker serves exactly one job and exits.
+ */
+static volatile sig_atomic_t pool_stop = 0;
+
+static void pool_signal_handler(int sig)
+{
+    (void)sig;
+    pool_stop = 1;
+}
+
+static int pool_read_request(int fd, char *path, size_t path_size)
+{
+    size_t len = 0;
+
+    while (len + 1 < path_size)
+    {
+        char ch;
+        ssize_t n = read(fd, &ch, 1);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        if (ch == '\n')
+        {
+            break;
+        }
+        path[len++] = ch;
+    }
+    path[len] = '\0';
+
+    return (len > 0) ? 0 : -1;
+}
+
+static void pool_reply_error(int fd, const char *fmt, ...)
+{
+    char buf[512];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (len > 0)
+    {
+        ssize_t ignored = write(fd, buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+        (void)ignored;
+    }
+}
+
+static int pool_worker(int worker_id, int listen_fd, bool enable_paging, bool enable_long_mode,
+                       uint32_t entry_point, uint32_t load_offset)
+{
+    vcpu_context_t *ctx = &vcpus[0];
+    char path[4096];
+    struct timespec t_accept;
+
+    // Warm-up chatter (API version, GDT setup, ...) is only useful with --verbose
+    if (!verbose)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0)
+        {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+    }
+
+    if (init_kvm(default_irqchip_mode(false)) < 0)
+    {
+        return 1;
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->vcpu_id = 0;
+    ctx->vcpu_fd = -1;
+    ctx->mem_fd = -1;
+    ctx->use_paging = enable_paging;
+    ctx->hlt_policy = default_hlt_policy();
+    ctx->long_mode = enable_long_mode;
+    ctx->entry_point = entry_point;
+    ctx->load_offset = enable_paging ? load_offset : 0;
+    snprintf(ctx->name, sizeof(ctx->name), "pool%d", worker_id);
+    num_vcpus = 1;
+
+    if (setup_vcpu_memory(ctx) < 0 || setup_vcpu_context(ctx) < 0)
+    {
+        cleanup_vcpu(ctx);
+        return 1;
+    }
+
+    // Warm: wait for a job (drop buffered warm-up output before the
+    // connection takes over stdout)
+    fflush(stdout);
+    int client_fd;
+    do
+    {
+        client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (client_fd < 0 && errno == EINTR && !pool_stop);
+
+    if (client_fd < 0)
+    {
+        cleanup_vcpu(ctx);
+        return pool_stop ? 0 : 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_accept);
+
+    if (pool_read_request(client_fd, path, sizeof(path)) < 0)
+    {
+        close(client_fd);
+        cleanup_vcpu(ctx);
+        return 1;
+    }
+
+    if (load_guest_binary(path, ctx->guest_mem, ctx->mem_size, ctx->load_offset) < 0)
+    {
+        pool_reply_error(client_fd, "kvm-vmm: failed to load '%s'\n", path);
+        close(client_fd);
+        cleanup_vcpu(ctx);
+        return 1;
+    }
+    // An image past 4 KB covers the tables the warm-up built (long mode
+    // keeps them at 0x2000-0x5000): build them again on top, as main()
+    // does by setting the context up after the load
+    if (setup_guest_mode(ctx) < 0)
+    {
+        pool_reply_error(client_fd, "kvm-vmm: failed to set up the vCPU for '%s'\n", path);
+        close(client_fd);
+        cleanup_vcpu(ctx);
+        return 1;
+    }
+    snprintf(ctx->name, sizeof(ctx->name), "%s", extract_guest_name(path));
+
+    // The connection becomes the guest console
+    dup2(client_fd, STDIN_FILENO);
+    dup2(client_fd, STDOUT_FILENO);
+    close(client_fd);
+
+    if (enable_paging)
+    {
+        stdin_thread_running = true;
+        if (pthread_create(&stdin_thread, NULL, stdin_monitor_thread_func, NULL) != 0)
+        {
+            stdin_thread_running = false;
+        }
+    }
+
+    if (verbose)
+    {
+        fprintf(stderr, "[pool] worker %d: '%s' launched %.3f ms after accept\n",
+                worker_id, path, elapsed_ms(&t_accept));
+    }
+
+    vcpus_active = 1;
+    vcpu_thread(ctx);
+
+    if (stdin_thread_running)
+    {
+        stdin_thread_running = false;
+        pthread_join(stdin_thread, NULL);
+    }
+
+    if (verbose)
+    {
+        fprintf(stderr, "[pool] worker %d: '%s' finished after %.3f ms (%d exits)\n",
+                worker_id, path, elapsed_ms(&t_accept), ctx->exit_count);
+    }
+
+    fflush(stdout);
+    cleanup_vcpu(ctx);
+    return 0;
+}
+
+static pid_t pool_spawn_worker(int worker_id, int listen_fd, bool enable_paging, bool enable_long_mode,
+                               uint32_t entry_point, uint32_t load_offset)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        int rc = pool_worker(worker_id, listen_fd, enable_paging, enable_long_mode,
+                             entry_point, load_offset);
+        if (vm_fd >= 0)
+            close(vm_fd);
+        if (kvm_fd >= 0)
+            close(kvm_fd);
+        _exit(rc);
+    }
+    if (pid < 0)
+    {
+        perror("fork (pool worker)");
+    }
+    return pid;
+}
+
+static int run_pool_server(const char *socket_path, int pool_size, bool enable_paging,
+                           bool enable_long_mode, uint32_t entry_point, uint32_t load_offset)
+{
+    pid_t workers[POOL_MAX_SIZE];
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path too long: %s\n", socket_path);
+        return 1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    unlink_stale_socket(socket_path);
+
+    // A client names any host file as its guest binary, so only our own
+    // user may connect: create the socket 0600 rather than chmod it later
+    mode_t old_umask = umask(0077);
+    int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound < 0 || listen(listen_fd, POOL_MAX_SIZE) < 0)
+    {
+        perror("bind/listen");
+        close(listen_fd);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = pool_signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("=== VM pool server ===\n");
+    printf("Socket: %s\n", socket_path);
+    printf("Profile: %s\n", enable_long_mode ? "long mode" : (enable_paging ? "paging" : "real mode"));
+    printf("Pool size: %d warm VM(s)\n", pool_size);
+
+    for (int i = 0; i < pool_size; i++)
+    {
+        workers[i] = pool_spawn_worker(i, listen_fd, enable_paging, enable_long_mode,
+                                       entry_point, load_offset);
+    }
+
+    unsigned long jobs = 0;
+    while (!pool_stop)
+    {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < pool_size; i++)
+        {
+            if (workers[i] != pid)
+            {
+                continue;
+            }
+            jobs++;
+            if (verbose)
+            {
+                printf("[pool] worker %d (pid %d) done, status %d (%lu jobs)\n",
+                       i, pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1, jobs);
+            }
+            // Refill the pool so the next request finds a warm VM
+            workers[i] = pool_stop ? -1 : pool_spawn_worker(i, listen_fd, enable_paging, enable_long_mode,
+                                                            entry_point, load_offset);
+            break;
+        }
+    }
+
+    for (int i = 0; i < pool_size; i++)
+    {
+        if (workers[i] > 0)
+        {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR)
+    {
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    printf("\nPool server stopped (%lu jobs served)\n", jobs);
+    return 0;
+}
+
+/*
+ * Client side of the pool protocol: submit one guest binary and relay the
+ * guest console between the terminal and the worker until it exits.
+ */
+static int run_pool_client(const char *socket_path, const char *guest_path, bool raw_console)
+{
+    struct sockaddr_un addr;
+    char abs_path[4096];
+
+    if (!realpath(guest_path, abs_path))
+    {
+        perror(guest_path);
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        close(fd);
+        return 1;
+    }
+
+    size_t len = strlen(abs_path);
+    abs_path[len++] = '\n';
+    if (write(fd, abs_path, len) != (ssize_t)len)
+    {
+        perror("write request");
+        close(fd);
+        return 1;
+    }
+
+    if (raw_console)
+    {
+        set_raw_mode();
+    }
+
+    struct pollfd pfds[2] = {
+        {.fd = fd, .events = POLLIN},
+        {.fd = STDIN_FILENO, .events = POLLIN},
+    };
+    char buf[4096];
+
+    for (;;)
+    {
+        if (poll(pfds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP))
+        {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            fwrite(buf, 1, (size_t)n, stdout);
+            fflush(stdout);
+        }
+        if (pfds[1].revents & (POLLIN | POLLHUP))
+        {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0 || write(fd, buf, (size_t)n) != n)
+            {
+                pfds[1].fd = -1; // stdin closed, keep draining output
+            }
+        }
+    }
+
+    restore_terminal();
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 0;
+    bool enable_paging = false;
+    bool enable_long_mode = false;
+    bool linux_boot = false;
+    linux_entry_mode_t linux_entry = LINUX_ENTRY_CODE32;
+    linux_rsi_mode_t linux_rsi = LINUX_RSI_BASE;
+    const char *linux_cmdline = NULL;
+    int linux_smp = 1;
+    char cmdline_buf[COMMAND_LINE_MAX]; // --cmdline plus device parameters
+    const char *initrd_path = NULL;
+    const char *bzimage_path = NULL;
+    uint32_t entry_point = 0x80001000; // Default entry point for paging mode
+    uint32_t load_offset = 0x1000;     // Default load offset for paging mode
+    const char *serve_path = NULL;
+    const char *connect_path = NULL;
+    int pool_size = POOL_DEFAULT_SIZE;
+    const char *snapshot_path = NULL;
+    const char *restore_path = NULL;
+    const char *incoming_path = NULL;
+    uint32_t restore_flags = 0;
+    int guest_arg_start = 1;
+
+    // Parse command line arguments
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s [OPTIONS] <guest_binary> | --linux <bzImage> [--linux-entry setup|code32|boot64] [--linux-rsi base|hdr] [--cmdline \"...\"] [--initrd <file>]\n", argv[0]);
+        fprintf(stderr, "  Run 1-4 guests simultaneously in separate vCPUs or boot Linux kernel\n");
+        fprintf(stderr, "\nOptions:\n");
+        fprintf(stderr, "  --paging            Enable Protected Mode with paging\n");
+        fprintf(stderr, "  --long-mode         Enable 64-bit Long Mode\n");
+        fprintf(stderr, "  --linux <bzImage>   Boot Linux kernel (bzImage format)\n");
+        fprintf(stderr, "                      (guest poweroff exits with status 0, reboot with %d)\n",
+                GUEST_RESET_EXIT_STATUS);
+        fprintf(stderr, "  --linux-entry MODE  Linux entry (setup|code32|boot64, default: code32)\n");
+        fprintf(stderr, "  --linux-rsi MODE    Linux RSI base (base|hdr, default: base)\n");
+        fprintf(stderr, "  --cmdline \"...\"     Kernel command line (for --linux)\n");
+        fprintf(stderr, "  --initrd <file>     Initrd image to load (for --linux)\n");
+        fprintf(stderr, "  --smp N             vCPUs of the Linux guest (1-%d, default: 1)\n", MAX_VCPUS);
+        fprintf(stderr, "  --virtio-pci        Put virtio devices on an emulated PCI bus (MSI-X per queue) instead of virtio-mmio\n");
+        fprintf(stderr, "  --virtio-console    Add a virtio-mmio console for --linux (boot with console=hvc0)\n");
+        fprintf(stderr, "  --virtio-blk PATH[,ro] Add a virtio-mmio disk backed by a raw image (repeatable, max %d)\n",
+                VIRTIO_BLK_MAX_DISKS);
+        fprintf(stderr, "  --virtio-pmem PATH[,cow] Map an image into guest memory as /dev/pmemN for DAX (max %d)\n",
+                VIRTIO_PMEM_MAX_DEVICES);
+        fprintf(stderr, "  --virtiofs DIR      Share host directory DIR (guest: mount -t virtiofs TAG /mnt)\n");
+        fprintf(stderr, "  --virtiofs-tag TAG  Mount tag for --virtiofs (default: %s)\n", VIRTIO_FS_DEFAULT_TAG);
+        fprintf(stderr, "  --virtiofs-queues N Request queues for --virtiofs, one worker thread each (1-%d, default: 1)\n",
+                VIRTIO_FS_MAX_QUEUES);
+        fprintf(stderr, "  --virtiofs-dax MiB  DAX window for --virtiofs (guest: mount -o dax; default: none)\n");
+        fprintf(stderr, "  --virtio-net        Add a virtio-mmio NIC on the built-in L2 switch (repeatable, max %d)\n",
+                VIRTIO_NET_MAX_NICS);
+        fprintf(stderr, "  --net-listen SOCK   Let other kvm-vmm processes join this switch (AF_UNIX SEQPACKET)\n");
+        fprintf(stderr, "  --net-connect SOCK  Join the switch of the kvm-vmm listening on SOCK\n");
+        fprintf(stderr, "  --net-tap IFNAME    Attach host tap IFNAME to the switch (userspace datapath)\n");
+        fprintf(stderr, "  --vsock PATH        Add a virtio-vsock; guest ports map to AF_UNIX sockets PATH_<port>\n");
+        fprintf(stderr, "  --vsock-cid N       Guest CID for --vsock (default: %d)\n", VSOCK_DEFAULT_GUEST_CID);
+        fprintf(stderr, "  --virtio-rng        Add a virtio-mmio entropy source fed by getrandom()\n");
+        fprintf(stderr, "  --rng-rate BYTES    --virtio-rng bytes per second, 0 = unlimited (default: %d)\n",
+                VIRTIO_RNG_DEFAULT_RATE);
+        fprintf(stderr, "  --entry ADDR        Set entry point (default: 0x80001000)\n");
+        fprintf(stderr, "  --load OFFSET       Set load offset (default: 0x1000)\n");
+        fprintf(stderr, "  --pv-features LIST  KVM paravirtual CPUID profile (none|default|all|name,...)\n");
+        fprintf(stderr, "  --irqchip MODE      Interrupt controller (none|kernel|split, default: kernel for Linux, else none)\n");
+        fprintf(stderr, "  --hlt POLICY        Guest HLT: exit|idle (default: idle with an irqchip, else exit)\n");
+        fprintf(stderr, "  --halt-poll-ns NS   Max time KVM polls before sleeping a halted vCPU\n");
+        fprintf(stderr, "  --timer-hz HZ       Override the guest-programmed PIT tick rate (uses the userspace PIT)\n");
+        fprintf(stderr, "  --verbose, -v       Enable basic debug logging (VM exits, hypercalls)\n");
+        fprintf(stderr, "  --debug LEVEL       Set debug verbosity (0=none, 1=basic, 2=detailed, 3=all)\n");
+        fprintf(stderr, "  --dump-regs         Dump all registers on each VM exit\n");
+        fprintf(stderr, "  --dump-mem FILE     Dump guest memory to file on exit\n");
+        fprintf(stderr, "  --serve SOCKET      Serve guests from a pool of pre-warmed VMs\n");
+        fprintf(stderr, "  --pool N            Number of warm VMs for --serve (default: %d)\n", POOL_DEFAULT_SIZE);
+        fprintf(stderr, "  --connect SOCKET    Run <guest_binary> on a --serve pool\n");
+        fprintf(stderr, "  --snapshot FILE     Save a VM snapshot to FILE on SIGUSR1\n");
+        fprintf(stderr, "  --restore FILE      Resume a VM from a snapshot (no guest binary)\n");
+        fprintf(stderr, "  --lazy              With --restore: load RAM on demand via userfaultfd\n");
+        fprintf(stderr, "  --record-wss MS     With --restore: record pages touched in the first MS\n");
+        fprintf(stderr, "                      into FILE.wss (prefetch order of later --lazy restores)\n");
+        fprintf(stderr, "  --checkpoint DIR    Write incremental checkpoints (dirty pages only) to DIR\n");
+        fprintf(stderr, "  --checkpoint-interval MS  Time between checkpoints (default: %d)\n", CHECKPOINT_DEFAULT_INTERVAL_MS);
+        fprintf(stderr, "  --snapshot-compact OUT IN  Merge the checkpoint chain ending at IN into OUT\n");
+        fprintf(stderr, "  --migrate-to SOCK   Live-migrate the guest to an --incoming VMM on SOCK\n");
+        fprintf(stderr, "  --migrate-delay MS  Run locally for MS before migrating (default: %d)\n", MIGRATE_DEFAULT_DELAY_MS);
+        fprintf(stderr, "  --incoming SOCK     Receive a migrating guest on SOCK (no guest binary)\n");
+        fprintf(stderr, "  --clone N           Run N copy-on-write clones of the guest from its clone point\n");
+        fprintf(stderr, "  --clone-marker TEXT Clone point is the first console output of TEXT\n");
+        fprintf(stderr, "                      (default: guest OUT 0x%02x to port 0x%x)\n", HC_CLONE_POINT, HYPERCALL_PORT);
+        fprintf(stderr, "\nExamples:\n");
+        fprintf(stderr, "  %s guest/multiplication.bin guest/counter.bin\n", argv[0]);
+        fprintf(stderr, "  %s --paging --verbose os-1k/kernel.bin\n", argv[0]);
+        fprintf(stderr, "  %s --linux bzImage --cmdline \"console=ttyS0\"\n", argv[0]);
+        fprintf(stderr, "  %s --linux bzImage --virtio-console --cmdline \"console=hvc0\"\n", argv[0]);
+        fprintf(stderr, "  %s --linux bzImage --virtio-blk rootfs.img --cmdline \"console=ttyS0 root=/dev/vda\"\n",
+                argv[0]);
+        fprintf(stderr, "  %s --linux bzImage --virtio-pmem rootfs.img,cow --cmdline \"console=ttyS0 root=/dev/pmem0 rootflags=dax\"\n",
+                argv[0]);
+        fprintf(stderr, "  %s --linux bzImage --virtio-net --net-listen /tmp/lan.sock   (then --net-connect /tmp/lan.sock)\n",
+                argv[0]);
+        fprintf(stderr, "  %s --linux bzImage --virtiofs /srv/share --virtiofs-dax 256   (guest: mount -t virtiofs hostfs /mnt -o dax)\n",
+                argv[0]);
+        fprintf(stderr, "  %s --linux bzImage --vsock /tmp/vm.vsock   (guest port 52 -> /tmp/vm.vsock_52)\n", argv[0]);
+        fprintf(stderr, "  %s --serve /tmp/kvm.sock --pool 8 --paging\n", argv[0]);
+        fprintf(stderr, "  %s --connect /tmp/kvm.sock os-1k/kernel\n", argv[0]);
+        fprintf(stderr, "  %s --paging --snapshot vm.snap os-1k/kernel\n", argv[0]);
+        fprintf(stderr, "  %s --restore vm.snap\n", argv[0]);
+        fprintf(stderr, "  %s --restore vm.snap --lazy\n", argv[0]);
+        fprintf(stderr, "  %s --restore vm.snap --record-wss 200\n", argv[0]);
+        fprintf(stderr, "  %s --paging --checkpoint ckpt --checkpoint-interval 500 os-1k/kernel\n", argv[0]);
+        fprintf(stderr, "  %s --snapshot-compact vm.snap ckpt/ckpt-0004.snap\n", argv[0]);
+        fprintf(stderr, "  %s --incoming /tmp/mig.sock\n", argv[0]);
+        fprintf(stderr, "  %s --paging --migrate-to /tmp/mig.sock os-1k/kernel\n", argv[0]);
+        fprintf(stderr, "  %s --paging --clone 8 --clone-marker \"Select: \" os-1k/kernel\n", argv[0]);
+        return 1;
+    }
+
+    // Parse flags
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (strcmp(argv[i], "--paging") == 0)
+        {
+            enable_paging = true;
+        }
+        else if (strcmp(argv[i], "--long-mode") == 0)
+        {
+            enable_long_mode = true;
+            enable_paging = true; // Long mode requires paging
+        }
+        else if (strcmp(argv[i], "--linux") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --linux requires a bzImage path\n");
+                return 1;
+            }
+            bzimage_path = argv[i + 1];
+            linux_boot = true;
+            // Guest binary path will be used as bzImage path
+            i++;
+        }
+        else if (strcmp(argv[i], "--linux-entry") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --linux-entry requires an argument (setup|code32|boot64)\n");
+                return 1;
+            }
+            if (strcmp(argv[i + 1], "setup") == 0)
+            {
+                linux_entry = LINUX_ENTRY_SETUP;
+            }
+            else if (strcmp(argv[i + 1], "code32") == 0)
+            {
+                linux_entry = LINUX_ENTRY_CODE32;
+            }
+            else if (strcmp(argv[i + 1], "boot64") == 0)
+            {
+                linux_entry = LINUX_ENTRY_BOOT64;
+            }
+            else
+            {
+                fprintf(stderr, "Error: invalid --linux-entry '%s' (expected setup|code32|boot64)\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--linux-rsi") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --linux-rsi requires an argument (base|hdr)\n");
+                return 1;
+            }
+            if (strcmp(argv[i + 1], "base") == 0)
+            {
+                linux_rsi = LINUX_RSI_BASE;
+            }
+            else if (strcmp(argv[i + 1], "hdr") == 0)
+            {
+                linux_rsi = LINUX_RSI_HDR;
+            }
+            else
+            {
+                fprintf(stderr, "Error: invalid --linux-rsi '%s' (expected base|hdr)\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--cmdline") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --cmdline requires an argument\n");
+                return 1;
+            }
+            linux_cmdline = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--smp") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --smp requires a vCPU count\n");
+                return 1;
+            }
+            linux_smp = atoi(argv[i + 1]);
+            if (linux_smp < 1 || linux_smp > MAX_VCPUS)
+            {
+                fprintf(stderr, "Error: --smp must be between 1 and %d\n", MAX_VCPUS);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--initrd") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --initrd requires an argument\n");
+                return 1;
+            }
+            initrd_path = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--entry") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --entry requires an argument\n");
+                return 1;
+            }
+            entry_point = strtoul(argv[i + 1], NULL, 0);
+            i++;
+        }
+        else if (strcmp(argv[i], "--load") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --load requires an argument\n");
+                return 1;
+            }
+            load_offset = strtoul(argv[i + 1], NULL, 0);
+            i++;
+        }
+        else if (strcmp(argv[i], "--verbose") == 0 || strcmp(argv[i], "-v") == 0)
+        {
+            verbose = true;
+            debug_level = DEBUG_BASIC;
+        }
+        else if (strcmp(argv[i], "--debug") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --debug requires a level (0-3)\n");
+                return 1;
+            }
+            int level = atoi(argv[i + 1]);
+            if (level < 0 || level > 3)
+            {
+                fprintf(stderr, "Error: debug level must be 0-3\n");
+                return 1;
+            }
+            debug_level = (debug_level_t)level;
+            verbose = (level > 0);
+            i++;
+        }
+        else if (strcmp(argv[i], "--dump-regs") == 0)
+        {
+            // Flag will be checked in VM exit handler
+        }
+        else if (strcmp(argv[i], "--dump-mem") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --dump-mem requires a filename\n");
+                return 1;
+            }
+            // Store filename for later use
+            i++;
+        }
+        else if (strcmp(argv[i], "--serve") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --serve requires a socket path\n");
+                return 1;
+            }
+            serve_path = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--pool") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --pool requires a count\n");
+                return 1;
+            }
+            pool_size = atoi(argv[i + 1]);
+            if (pool_size < 1 || pool_size > POOL_MAX_SIZE)
+            {
+                fprintf(stderr, "Error: pool size must be 1-%d\n", POOL_MAX_SIZE);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--connect") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --connect requires a socket path\n");
+                return 1;
+            }
+            connect_path = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --snapshot requires a filename\n");
+                return 1;
+            }
+            snapshot_path = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --checkpoint requires a directory\n");
+                return 1;
+            }
+            checkpoint_dir = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --checkpoint-interval requires milliseconds\n");
+                return 1;
+            }
+            checkpoint_interval_ms = atoi(argv[i + 1]);
+            if (checkpoint_interval_ms < 1)
+            {
+                fprintf(stderr, "Error: checkpoint interval must be at least 1 ms\n");
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--snapshot-compact") == 0)
+        {
+            if (i + 2 >= argc)
+            {
+                fprintf(stderr, "Error: --snapshot-compact requires OUT and IN files\n");
+                return 1;
+            }
+            return snapshot_compact(argv[i + 1], argv[i + 2]) < 0 ? 1 : 0;
+        }
+        else if (strcmp(argv[i], "--migrate-to") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --migrate-to requires a socket path\n");
+                return 1;
+            }
+            migrate_path = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--migrate-delay") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --migrate-delay requires milliseconds\n");
+                return 1;
+            }
+            migrate_delay_ms = atoi(argv[i + 1]);
+            if (migrate_delay_ms < 0)
+            {
+                fprintf(stderr, "Error: migration delay must not be negative\n");
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--incoming") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --incoming requires a socket path\n");
+                return 1;
+            }
+            incoming_path = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--clone") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --clone requires a count\n");
+                return 1;
+            }
+            clone_count = atoi(argv[i + 1]);
+            if (clone_count < 1 || clone_count > CLONE_MAX)
+            {
+                fprintf(stderr, "Error: clone count must be 1-%d\n", CLONE_MAX);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--clone-marker") == 0)
+        {
+            if (i + 1 >= argc || argv[i + 1][0] == '\0')
+            {
+                fprintf(stderr, "Error: --clone-marker requires a non-empty string\n");
+                return 1;
+            }
+            clone_marker = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--restore") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --restore requires a filename\n");
+                return 1;
+            }
+            restore_path = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--pv-features") == 0)
+        {
+            uint32_t features;
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --pv-features requires a profile\n");
+                return 1;
+            }
+            if (cpuid_parse_pv_features(argv[i + 1], &features) < 0)
+            {
+                return 1;
+            }
+            cpuid_set_pv_features(features);
+            i++;
+        }
+        else if (strcmp(argv[i], "--hlt") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --hlt requires a policy\n");
+                return 1;
+            }
+            for (int p = HLT_EXIT; p <= HLT_IDLE; p++)
+            {
+                if (strcmp(argv[i + 1], hlt_names[p]) == 0)
+                {
+                    hlt_request = p;
+                }
+            }
+            if (hlt_request < 0)
+            {
+                fprintf(stderr, "Error: --hlt must be exit or idle\n");
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--halt-poll-ns") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --halt-poll-ns requires a value\n");
+                return 1;
+            }
+            halt_poll_ns = atol(argv[i + 1]);
+            if (halt_poll_ns < 0)
+            {
+                fprintf(stderr, "Error: --halt-poll-ns must be >= 0\n");
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--irqchip") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --irqchip requires a mode\n");
+                return 1;
+            }
+            for (int m = IRQCHIP_NONE; m <= IRQCHIP_SPLIT; m++)
+            {
+                if (strcmp(argv[i + 1], irqchip_names[m]) == 0)
+                {
+                    irqchip_request = m;
+                }
+            }
+            if (irqchip_request < 0)
+            {
+                fprintf(stderr, "Error: --irqchip must be none, kernel or split\n");
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--virtio-console") == 0)
+        {
+            virtio_console_enabled = true;
         }
-        else if (strcmp(argv[i], "--linux") == 0)
+        else if (strcmp(argv[i], "--virtio-blk") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --linux requires a bzImage path\n");
+                fprintf(stderr, "Error: --virtio-blk requires an image path\n");
                 return 1;
             }
-            bzimage_path = argv[i + 1];
-            linux_boot = true;
-            // Guest binary path will be used as bzImage path
+            if (virtio_blk_count >= VIRTIO_BLK_MAX_DISKS)
+            {
+                fprintf(stderr, "Error: At most %d --virtio-blk disks are supported\n", VIRTIO_BLK_MAX_DISKS);
+                return 1;
+            }
+            // PATH[,ro]
+            char *spec = argv[i + 1];
+            size_t len = strlen(spec);
+            if (len > 3 && strcmp(spec + len - 3, ",ro") == 0)
+            {
+                spec[len - 3] = '\0';
+                virtio_blk_read_only[virtio_blk_count] = true;
+            }
+            virtio_blk_paths[virtio_blk_count++] = spec;
             i++;
         }
-        else if (strcmp(argv[i], "--linux-entry") == 0)
+        else if (strcmp(argv[i], "--virtio-pmem") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --linux-entry requires an argument (setup|code32|boot64)\n");
+                fprintf(stderr, "Error: --virtio-pmem requires an image path\n");
                 return 1;
             }
-            if (strcmp(argv[i + 1], "setup") == 0)
-            {
-                linux_entry = LINUX_ENTRY_SETUP;
-            }
-            else if (strcmp(argv[i + 1], "code32") == 0)
+            if (virtio_pmem_count >= VIRTIO_PMEM_MAX_DEVICES)
             {
-                linux_entry = LINUX_ENTRY_CODE32;
+                fprintf(stderr, "Error: At most %d --virtio-pmem images are supported\n", VIRTIO_PMEM_MAX_DEVICES);
+                return 1;
             }
-            else if (strcmp(argv[i + 1], "boot64") == 0)
+            // PATH[,cow]
+            char *spec = argv[i + 1];
+            size_t len = strlen(spec);
+            if (len > 4 && strcmp(spec + len - 4, ",cow") == 0)
             {
-                linux_entry = LINUX_ENTRY_BOOT64;
+                spec[len - 4] = '\0';
+                virtio_pmem_cow[virtio_pmem_count] = true;
             }
-            else
+            virtio_pmem_paths[virtio_pmem_count++] = spec;
+            i++;
+        }
+        else if (strcmp(argv[i], "--virtiofs") == 0)
+        {
+            if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: invalid --linux-entry '%s' (expected setup|code32|boot64)\n", argv[i + 1]);
+                fprintf(stderr, "Error: --virtiofs requires a directory\n");
                 return 1;
             }
+            virtio_fs_dir = argv[i + 1];
             i++;
         }
-        else if (strcmp(argv[i], "--linux-rsi") == 0)
+        else if (strcmp(argv[i], "--virtiofs-tag") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --linux-rsi requires an argument (base|hdr)\n");
+                fprintf(stderr, "Error: --virtiofs-tag requires a tag\n");
                 return 1;
             }
-            if (strcmp(argv[i + 1], "base") == 0)
+            virtio_fs_tag = argv[i + 1];
+            if (strlen(virtio_fs_tag) == 0 || strlen(virtio_fs_tag) > VIRTIO_FS_TAG_MAX)
             {
-                linux_rsi = LINUX_RSI_BASE;
+                fprintf(stderr, "Error: virtio-fs tag must be 1-%d bytes\n", VIRTIO_FS_TAG_MAX);
+                return 1;
             }
-            else if (strcmp(argv[i + 1], "hdr") == 0)
+            i++;
+        }
+        else if (strcmp(argv[i], "--virtiofs-queues") == 0)
+        {
+            if (i + 1 >= argc)
             {
-                linux_rsi = LINUX_RSI_HDR;
+                fprintf(stderr, "Error: --virtiofs-queues requires a count\n");
+                return 1;
             }
-            else
+            int queues = atoi(argv[i + 1]);
+            if (queues < 1 || queues > VIRTIO_FS_MAX_QUEUES)
             {
-                fprintf(stderr, "Error: invalid --linux-rsi '%s' (expected base|hdr)\n", argv[i + 1]);
+                fprintf(stderr, "Error: virtio-fs request queues must be 1-%d\n", VIRTIO_FS_MAX_QUEUES);
                 return 1;
             }
+            virtio_fs_queues = (uint32_t)queues;
             i++;
         }
-        else if (strcmp(argv[i], "--cmdline") == 0)
+        else if (strcmp(argv[i], "--virtiofs-dax") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --cmdline requires an argument\n");
+                fprintf(stderr, "Error: --virtiofs-dax requires a size in MiB\n");
                 return 1;
             }
-            linux_cmdline = argv[i + 1];
+            virtio_fs_dax_mib = strtoull(argv[i + 1], NULL, 0);
             i++;
         }
-        else if (strcmp(argv[i], "--initrd") == 0)
+        else if (strcmp(argv[i], "--virtio-net") == 0)
+        {
+            if (virtio_net_count >= VIRTIO_NET_MAX_NICS)
+            {
+                fprintf(stderr, "Error: At most %d --virtio-net NICs are supported\n", VIRTIO_NET_MAX_NICS);
+                return 1;
+            }
+            virtio_net_count++;
+        }
+        else if (strcmp(argv[i], "--net-tap") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --initrd requires an argument\n");
+                fprintf(stderr, "Error: --net-tap requires a tap interface name\n");
                 return 1;
             }
-            initrd_path = argv[i + 1];
+            net_tap_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--net-listen") == 0 || strcmp(argv[i], "--net-connect") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: %s requires a socket path\n", argv[i]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--net-listen") == 0)
+            {
+                net_listen_path = argv[i + 1];
+            }
+            else
+            {
+                net_connect_path = argv[i + 1];
+            }
             i++;
         }
-        else if (strcmp(argv[i], "--entry") == 0)
+        else if (strcmp(argv[i], "--virtio-pci") == 0)
+        {
+            virtio_pci = true;
+        }
+        else if (strcmp(argv[i], "--virtio-rng") == 0)
+        {
+            virtio_rng_enabled = true;
+        }
+        else if (strcmp(argv[i], "--rng-rate") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --entry requires an argument\n");
+                fprintf(stderr, "Error: --rng-rate requires a byte rate\n");
                 return 1;
             }
-            entry_point = strtoul(argv[i + 1], NULL, 0);
+            virtio_rng_rate = strtoull(argv[i + 1], NULL, 0);
             i++;
         }
-        else if (strcmp(argv[i], "--load") == 0)
+        else if (strcmp(argv[i], "--vsock") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --load requires an argument\n");
+                fprintf(stderr, "Error: --vsock requires a socket path\n");
                 return 1;
             }
-            load_offset = strtoul(argv[i + 1], NULL, 0);
+            vsock_path = argv[i + 1];
             i++;
         }
-        else if (strcmp(argv[i], "--verbose") == 0 || strcmp(argv[i], "-v") == 0)
+        else if (strcmp(argv[i], "--vsock-cid") == 0)
         {
-            verbose = true;
-            debug_level = DEBUG_BASIC;
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --vsock-cid requires a CID\n");
+                return 1;
+            }
+            vsock_guest_cid = strtoull(argv[i + 1], NULL, 0);
+            i++;
         }
-        else if (strcmp(argv[i], "--debug") == 0)
+        else if (strcmp(argv[i], "--timer-hz") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --debug requires a level (0-3)\n");
+                fprintf(stderr, "Error: --timer-hz requires a rate\n");
                 return 1;
             }
-            int level = atoi(argv[i + 1]);
-            if (level < 0 || level > 3)
+            timer_hz = atoi(argv[i + 1]);
+            if (timer_hz <= 0 || timer_hz > 10000)
             {
-                fprintf(stderr, "Error: debug level must be 0-3\n");
+                fprintf(stderr, "Error: timer rate must be 1-10000 Hz\n");
                 return 1;
             }
-            debug_level = (debug_level_t)level;
-            verbose = (level > 0);
             i++;
         }
-        else if (strcmp(argv[i], "--dump-regs") == 0)
+        else if (strcmp(argv[i], "--lazy") == 0)
         {
-            // Flag will be checked in VM exit handler
+            lazy_restore = true;
         }
-        else if (strcmp(argv[i], "--dump-mem") == 0)
+        else if (strcmp(argv[i], "--record-wss") == 0)
         {
             if (i + 1 >= argc)
             {
-                fprintf(stderr, "Error: --dump-mem requires a filename\n");
+                fprintf(stderr, "Error: --record-wss requires milliseconds\n");
                 return 1;
             }
-            // Store filename for later use
+            record_wss_ms = atoi(argv[i + 1]);
+            if (record_wss_ms <= 0)
+            {
+                fprintf(stderr, "Error: recording window must be positive\n");
+                return 1;
+            }
+            // Recording observes userfaultfd faults
+            lazy_restore = true;
             i++;
         }
         else
@@ -2919,7 +6435,87 @@ int main(int argc, char **argv)
     }
     guest_arg_start = i;
 
-    if (linux_boot)
+    if (serve_path)
+    {
+        if (linux_boot)
+        {
+            fprintf(stderr, "Error: --serve does not support --linux\n");
+            return 1;
+        }
+        return run_pool_server(serve_path, pool_size, enable_paging, enable_long_mode,
+                               entry_point, load_offset);
+    }
+
+    if (connect_path)
+    {
+        if (argc - guest_arg_start != 1)
+        {
+            fprintf(stderr, "Error: --connect takes exactly one guest binary\n");
+            return 1;
+        }
+        return run_pool_client(connect_path, argv[guest_arg_start], isatty(STDIN_FILENO));
+    }
+
+    if (restore_path && incoming_path)
+    {
+        fprintf(stderr, "Error: --restore and --incoming are mutually exclusive\n");
+        return 1;
+    }
+    if (migrate_path && (incoming_path || clone_count > 0))
+    {
+        fprintf(stderr, "Error: --migrate-to cannot be combined with --incoming or --clone\n");
+        return 1;
+    }
+    bool restoring = restore_path || incoming_path;
+    bool virtio_devices = virtio_console_enabled || virtio_blk_count > 0 || virtio_pmem_count > 0 || virtio_fs_dir ||
+                          virtio_net_count > 0 || vsock_path || virtio_rng_enabled;
+    if ((net_listen_path || net_connect_path || net_tap_name) && virtio_net_count == 0)
+    {
+        fprintf(stderr, "Error: --net-listen, --net-connect and --net-tap require --virtio-net\n");
+        return 1;
+    }
+    if (virtio_devices && !linux_boot)
+    {
+        fprintf(stderr, "Error: virtio devices require --linux\n");
+        return 1;
+    }
+    if (virtio_devices && (snapshot_path || checkpoint_dir || migrate_path || clone_count > 0))
+    {
+        fprintf(stderr, "Error: VMs with virtio devices cannot be snapshotted, migrated or cloned\n");
+        return 1;
+    }
+    if (linux_smp > 1 && !linux_boot)
+    {
+        fprintf(stderr, "Error: --smp requires --linux\n");
+        return 1;
+    }
+    if (linux_smp > 1 && (snapshot_path || checkpoint_dir || migrate_path || clone_count > 0))
+    {
+        fprintf(stderr, "Error: SMP guests cannot be snapshotted, migrated or cloned\n");
+        return 1;
+    }
+    if (lazy_restore && !restore_path)
+    {
+        fprintf(stderr, "Error: --lazy and --record-wss require --restore\n");
+        return 1;
+    }
+
+    if (restoring)
+    {
+        if (linux_boot || argc != guest_arg_start)
+        {
+            fprintf(stderr, "Error: %s does not take a guest binary or --linux\n",
+                    restore_path ? "--restore" : "--incoming");
+            return 1;
+        }
+        if (clone_count > 0)
+        {
+            fprintf(stderr, "Error: --clone cannot be combined with %s\n",
+                    restore_path ? "--restore" : "--incoming");
+            return 1;
+        }
+    }
+    else if (linux_boot)
     {
         if (!bzimage_path)
         {
@@ -2937,15 +6533,24 @@ int main(int argc, char **argv)
             fprintf(stderr, "Error: No guest binaries specified\n");
             return 1;
         }
-        if (num_vcpus > MAX_VCPUS)
+        if (num_vcpus > MAX_GUESTS)
         {
-            fprintf(stderr, "Error: Too many guests (max %d)\n", MAX_VCPUS);
+            fprintf(stderr, "Error: Too many guests (max %d)\n", MAX_GUESTS);
             return 1;
         }
     }
 
     printf("=== Multi-vCPU KVM VMM (x86) ===\n");
-    if (linux_boot)
+    if (restore_path)
+    {
+        printf("Mode: Restore from snapshot\n");
+        printf("Snapshot: %s\n", restore_path);
+    }
+    else if (incoming_path)
+    {
+        printf("Mode: Incoming migration\n");
+    }
+    else if (linux_boot)
     {
         printf("Mode: Linux Boot Protocol\n");
         printf("bzImage: %s\n", bzimage_path);
@@ -2968,11 +6573,63 @@ int main(int argc, char **argv)
     {
         printf("Mode: Real Mode\n");
     }
-    if (!linux_boot)
+    if (!linux_boot && !restoring)
     {
         printf("Starting %d vCPU(s)\n\n", num_vcpus);
     }
 
+    if (migrate_path)
+    {
+        dirty_logging = true;
+    }
+    if (checkpoint_dir)
+    {
+        if (mkdir(checkpoint_dir, 0755) < 0 && errno != EEXIST)
+        {
+            perror("mkdir checkpoint directory");
+            return 1;
+        }
+        dirty_logging = true;
+    }
+
+    // SIGUSR1/SIGUSR2 are consumed by monitor_vcpus(); block them before any thread exists
+    if (snapshot_path || clone_count > 0)
+    {
+        sigset_t monitor_set;
+        sigemptyset(&monitor_set);
+        if (snapshot_path)
+        {
+            sigaddset(&monitor_set, SIGUSR1);
+        }
+        if (clone_count > 0)
+        {
+            sigaddset(&monitor_set, SIGUSR2);
+        }
+        pthread_sigmask(SIG_BLOCK, &monitor_set, NULL);
+    }
+    install_vcpu_kick_handler();
+
+    // Clones are forked first so each can build its own VM in parallel
+    if (clone_count > 0 && spawn_clones(linux_boot) < 0)
+    {
+        ret = 1;
+        goto cleanup_early;
+    }
+
+    // Step 0: Rebuild the VM from a snapshot (or migration stream) instead of loading guests
+    if (restoring)
+    {
+        int rc = restore_path ? restore_vm_snapshot(restore_path, &restore_flags)
+                              : incoming_vm_snapshot(incoming_path, &restore_flags);
+        if (rc < 0)
+        {
+            ret = 1;
+            goto cleanup_vcpus;
+        }
+        enable_paging = (restore_flags & SNAP_CFG_INTERACTIVE) != 0;
+        linux_boot = (restore_flags & SNAP_CFG_LINUX_SERIAL) != 0;
+    }
+
     // Set terminal to raw mode for character-by-character input (Paging guests + Linux console)
     if (enable_paging || linux_boot)
     {
@@ -2980,18 +6637,34 @@ int main(int argc, char **argv)
     }
 
     // Step 1: Initialize KVM and create VM
-    // Only create IRQCHIP for Protected Mode (paging enabled)
-    if (init_kvm(enable_paging, linux_boot) < 0)
+    // The interrupt controller follows the guest type unless --irqchip says otherwise
+    if (!restoring && init_kvm(default_irqchip_mode(linux_boot)) < 0)
     {
         ret = 1;
         goto cleanup_early;
     }
+    if (hlt_request == HLT_EXIT && irqchip_mode != IRQCHIP_NONE)
+    {
+        fprintf(stderr, "Warning: HLT is handled in the kernel with an irqchip; use HC_EXIT to stop the guest\n");
+    }
 
     // Step 1.5: Linux Boot Protocol Setup
-    if (linux_boot)
+    if (linux_boot && !restoring)
     {
         printf("\n=== Linux Boot Protocol Setup ===\n");
 
+        if (linux_smp > 1)
+        {
+            if (irqchip_mode == IRQCHIP_NONE)
+            {
+                fprintf(stderr, "Error: --smp needs local APICs (--irqchip kernel|split)\n");
+                ret = 1;
+                goto cleanup_vcpus;
+            }
+            // One package with linux_smp cores; leaf 1/4/0xB must agree with the MADT
+            cpuid_set_topology((uint32_t)linux_smp);
+        }
+
         // Setup single vCPU context for Linux kernel
         vcpu_context_t *ctx = &vcpus[0];
         memset(ctx, 0, sizeof(*ctx));
@@ -2999,11 +6672,13 @@ int main(int argc, char **argv)
         ctx->guest_binary = bzimage_path;
         snprintf(ctx->name, sizeof(ctx->name), "Linux");
         ctx->vcpu_fd = -1;
+        ctx->mem_fd = -1;
         ctx->use_paging = false;  // Enter protected mode (no paging) at code32_start
         ctx->long_mode = false;
         ctx->entry_point = 0;     // Will be set to code32_start after load
         ctx->load_offset = 0;
         ctx->linux_guest = true;
+        ctx->hlt_policy = default_hlt_policy();
         ctx->linux_entry = linux_entry;
         ctx->linux_rsi = linux_rsi;
 
@@ -3029,9 +6704,95 @@ int main(int argc, char **argv)
             goto cleanup_vcpus;
         }
 
+        // virtio-mmio devices: bound now, announced on the command line
+        if (virtio_devices)
+        {
+            if (irqchip_mode == IRQCHIP_NONE)
+            {
+                fprintf(stderr, "Error: virtio devices need an irqchip (--irqchip kernel|split)\n");
+                ret = 1;
+                goto cleanup_vcpus;
+            }
+            if (virtio_pci)
+            {
+                pci_init();
+            }
+            for (int d = 0; d < virtio_blk_count; d++)
+            {
+                if (virtio_blk_init(virtio_blk_paths[d], virtio_blk_read_only[d]) < 0)
+                {
+                    ret = 1;
+                    goto cleanup_vcpus;
+                }
+            }
+            for (int d = 0; d < virtio_pmem_count; d++)
+            {
+                if (virtio_pmem_init(vm_fd, virtio_pmem_paths[d], virtio_pmem_cow[d]) < 0)
+                {
+                    ret = 1;
+                    goto cleanup_vcpus;
+                }
+            }
+            if (virtio_fs_dir &&
+                virtio_fs_init(vm_fd, virtio_fs_dir, virtio_fs_tag, virtio_fs_queues, virtio_fs_dax_mib << 20) < 0)
+            {
+                ret = 1;
+                goto cleanup_vcpus;
+            }
+            for (int n = 0; n < virtio_net_count; n++)
+            {
+                if (virtio_net_init() < 0)
+                {
+                    ret = 1;
+                    goto cleanup_vcpus;
+                }
+            }
+            if ((net_listen_path && net_switch_listen(net_listen_path) < 0) ||
+                (net_connect_path && net_switch_connect(net_connect_path) < 0) ||
+                (net_tap_name && net_switch_add_tap(net_tap_name) < 0) ||
+                (vsock_path && virtio_vsock_init(vsock_guest_cid, vsock_path) < 0) ||
+                (virtio_rng_enabled && virtio_rng_init(virtio_rng_rate) < 0))
+            {
+                ret = 1;
+                goto cleanup_vcpus;
+            }
+            if ((virtio_console_enabled && virtio_console_init(STDOUT_FILENO) < 0) ||
+                virtio_mmio_start(vm_fd, ctx->guest_mem, ctx->mem_size, irqchip_mode == IRQCHIP_SPLIT) < 0 ||
+                (virtio_pci && pci_start(vm_fd) < 0))
+            {
+                ret = 1;
+                goto cleanup_vcpus;
+            }
+        }
+        snprintf(cmdline_buf, sizeof(cmdline_buf), "%s", linux_cmdline ? linux_cmdline : "");
+        if (virtio_mmio_cmdline(cmdline_buf, sizeof(cmdline_buf)) < 0)
+        {
+            fprintf(stderr, "Error: Command line too long for the virtio-mmio devices\n");
+            ret = 1;
+            goto cleanup_vcpus;
+        }
+        const char *cmdline = cmdline_buf[0] ? cmdline_buf : NULL;
+
         // Setup boot parameters (E820 memory map, etc.)
         printf("Setting up boot parameters...\n");
-        setup_linux_boot_params(boot_params, ctx->mem_size, linux_cmdline);
+        setup_linux_boot_params(boot_params, ctx->mem_size, cmdline);
+
+        // ACPI tables (RSDP/XSDT/MADT) list the CPUs and the interrupt wiring
+        if (irqchip_mode != IRQCHIP_NONE)
+        {
+            acpi_config_t acpi = {
+                .num_cpus = linux_smp,
+                .pic = irqchip_mode == IRQCHIP_KERNEL,
+                .level_irqs = (1u << UART_GSI) | virtio_mmio_irq_mask(),
+            };
+            uint32_t rsdp = acpi_build_tables(ctx->guest_mem, ctx->mem_size, &acpi);
+            if (rsdp == 0)
+            {
+                ret = 1;
+                goto cleanup_vcpus;
+            }
+            printf("ACPI tables at 0x%x (RSDP), %d CPU(s)\n", rsdp, linux_smp);
+        }
 
         // Load initrd if provided
         if (initrd_path)
@@ -3078,16 +6839,27 @@ int main(int argc, char **argv)
         printf("Real-mode setup: 0x%x:0x0200\n", (unsigned)(REAL_MODE_KERNEL_ADDR / 16));
 
         // Copy command line to guest memory if provided
-        if (linux_cmdline)
+        // Protocol 2.06+ kernels state their limit; older ones take 255 bytes
+        if (cmdline)
         {
-            size_t cmdline_len = strlen(linux_cmdline) + 1;
-            if (cmdline_len > 256)
+            size_t cmdline_max = 256;
+            if (boot_params->hdr.version >= BOOT_PROTOCOL_2_06 && boot_params->hdr.cmdline_size > 0)
+            {
+                cmdline_max = boot_params->hdr.cmdline_size + 1;
+            }
+            if (cmdline_max > COMMAND_LINE_MAX)
+            {
+                cmdline_max = COMMAND_LINE_MAX;
+            }
+            size_t cmdline_len = strlen(cmdline) + 1;
+            if (cmdline_len > cmdline_max)
             {
-                fprintf(stderr, "Warning: Command line truncated to 255 characters\n");
-                cmdline_len = 256;
+                fprintf(stderr, "Warning: Command line truncated to %zu characters\n", cmdline_max - 1);
+                cmdline_len = cmdline_max;
             }
-            memcpy(ctx->guest_mem + COMMAND_LINE_ADDR, linux_cmdline, cmdline_len);
-            printf("Command line copied to 0x%x\n", COMMAND_LINE_ADDR);
+            memcpy(ctx->guest_mem + COMMAND_LINE_ADDR, cmdline, cmdline_len);
+            ((char *)ctx->guest_mem)[COMMAND_LINE_ADDR + cmdline_len - 1] = '\0';
+            printf("Command line copied to 0x%x: %s\n", COMMAND_LINE_ADDR, cmdline);
         }
 
         // Create and initialize vCPU
@@ -3111,12 +6883,27 @@ int main(int argc, char **argv)
             }
         }
 
+        // Application processors (--smp): parked until the kernel wakes them
+        for (int i = 1; i < linux_smp; i++)
+        {
+            num_vcpus = i + 1;
+            if (setup_linux_ap(&vcpus[i], ctx, i) < 0)
+            {
+                ret = 1;
+                goto cleanup_vcpus;
+            }
+        }
+        if (linux_smp > 1)
+        {
+            printf("Created %d application processors (wait-for-SIPI)\n", linux_smp - 1);
+        }
+
         printf("Linux boot setup complete!\n\n");
-        num_vcpus = 1;  // Linux boot uses single vCPU
+        num_vcpus = linux_smp;
     }
 
     // Step 2: Setup each vCPU (skip if Linux boot mode - already set up)
-    if (!linux_boot)
+    if (!linux_boot && !restoring)
     {
         for (int i = 0; i < num_vcpus; i++)
         {
@@ -3128,9 +6915,11 @@ int main(int argc, char **argv)
             ctx->guest_binary = argv[guest_arg_start + i];
             snprintf(ctx->name, sizeof(ctx->name), "%s", extract_guest_name(ctx->guest_binary));
             ctx->vcpu_fd = -1;
+            ctx->mem_fd = -1;
 
             // Set paging mode settings
             ctx->use_paging = enable_paging;
+            ctx->hlt_policy = default_hlt_policy();
             ctx->long_mode = enable_long_mode;
             ctx->entry_point = entry_point;
             ctx->load_offset = enable_paging ? load_offset : 0;
@@ -3168,20 +6957,13 @@ int main(int argc, char **argv)
     // Initialize dynamic colors for vCPUs (maximum contrast based on count)
     init_vcpu_colors(num_vcpus);
 
-    // Step 3: Start stdin thread (Paging guests + Linux console)
-    // Real Mode guests don't use interactive input, so skip these threads
-    // NOTE: Timer thread is disabled - it injects IRQ0 that causes triple faults
-    // if guest IDT is not properly set up. stdin thread is safe (no interrupt injection).
+    // Step 3: Start the event loop devices (PIT timer) and the stdin thread
+    // The PIT only ticks once the guest programs it and its interrupt controller.
+    start_host_devices();
+
+    // Real Mode guests don't use interactive input, so skip the stdin thread
     if (enable_paging || linux_boot)
     {
-        // Timer thread disabled - causes triple faults before IDT setup
-        // timer_thread_running = true;
-        // if (pthread_create(&timer_thread, NULL, timer_thread_func, NULL) != 0)
-        // {
-        //     fprintf(stderr, "Warning: Failed to create timer thread. Timer interrupts disabled.\n");
-        //     timer_thread_running = false;
-        // }
-
         stdin_thread_running = true;
         linux_serial_input_enabled = linux_boot;
         if (pthread_create(&stdin_thread, NULL, stdin_monitor_thread_func, NULL) != 0)
@@ -3207,9 +6989,15 @@ int main(int argc, char **argv)
     }
     printf("\n");
 
+    if (snapshot_path)
+    {
+        printf("Snapshot: kill -USR1 %d saves the VM to %s\n\n", (int)getpid(), snapshot_path);
+    }
+
+    vcpus_active = num_vcpus;
     for (int i = 0; i < num_vcpus; i++)
     {
-        if (pthread_create(&threads[i], NULL, vcpu_thread, &vcpus[i]) != 0)
+        if (pthread_create(&vcpus[i].thread, NULL, vcpu_thread, &vcpus[i]) != 0)
         {
             fprintf(stderr, "Failed to create thread for vCPU %d\n", i);
             ret = 1;
@@ -3218,20 +7006,24 @@ int main(int argc, char **argv)
     }
 
     // Step 5: Wait for all vCPUs to finish
+    if (snapshot_path || clone_count > 0 || checkpoint_dir || migrate_path)
+    {
+        monitor_vcpus(snapshot_path);
+    }
     for (int i = 0; i < num_vcpus; i++)
     {
-        pthread_join(threads[i], NULL);
+        pthread_join(vcpus[i].thread, NULL);
     }
 
     printf("\n=== All vCPUs completed ===\n");
+    if (power_event == POWER_EVENT_RESET)
+    {
+        ret = GUEST_RESET_EXIT_STATUS;
+    }
 
 cleanup_stdin:
     // Stop monitoring threads immediately after vCPUs complete
-    if (timer_thread_running)
-    {
-        timer_thread_running = false;
-        pthread_join(timer_thread, NULL);
-    }
+    stop_host_devices();
 
     if (stdin_thread_running)
     {
@@ -3241,6 +7033,17 @@ cleanup_stdin:
     linux_serial_input_enabled = false;
 
 cleanup_vcpus:
+    // Page server threads go first: they write into guest memory
+    lazy_restore_close();
+    virtio_blk_cleanup();
+    net_switch_cleanup();
+    virtio_vsock_cleanup();
+    virtio_rng_cleanup();
+    virtio_fs_cleanup();
+    virtio_mmio_cleanup();
+    pci_cleanup();
+    virtio_pmem_cleanup();
+
     // Cleanup all vCPUs
     for (int i = 0; i < num_vcpus; i++)
     {
@@ -3248,6 +7051,12 @@ cleanup_vcpus:
     }
 
 cleanup_early:
+    // Clones still use the terminal until they exit
+    if (clone_count > 0 && wait_for_clones() > 0)
+    {
+        ret = 1;
+    }
+
     // Restore terminal settings
     restore_terminal();
 
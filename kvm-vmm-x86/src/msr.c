@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <linux/kvm.h>
+#include <asm/kvm_para.h>
 #include <sys/ioctl.h>
 #include <errno.h>
 
@@ -73,6 +74,78 @@ int setup_msrs_64bit(int vcpu_fd) {
     return msrs->nmsrs;
 }
 
+// Paravirtual MSRs: the feature that exposes each, its reset value and the
+// low bits that hold flags rather than the area's GPA
+static const struct {
+    uint32_t index;
+    int feature;
+    uint64_t reset;
+    uint64_t flag_bits;
+} pv_msrs[] = {
+    { MSR_KVM_SYSTEM_TIME_NEW, KVM_FEATURE_CLOCKSOURCE2, 0, 0x1 },
+    { MSR_KVM_SYSTEM_TIME,     KVM_FEATURE_CLOCKSOURCE,  0, 0x1 },
+    { MSR_KVM_STEAL_TIME,      KVM_FEATURE_STEAL_TIME,   0, 0x3f },
+    { MSR_KVM_PV_EOI_EN,       KVM_FEATURE_PV_EOI,       0, 0x3 },
+    { MSR_KVM_ASYNC_PF_EN,     KVM_FEATURE_ASYNC_PF,     0, 0x3f },
+    { MSR_KVM_POLL_CONTROL,    KVM_FEATURE_POLL_CONTROL, 1, 0x1 }, // Host halt polling allowed
+};
+
+#define PV_MSR_COUNT (sizeof(pv_msrs) / sizeof(pv_msrs[0]))
+
+// Reset the paravirtual MSRs for a cold boot
+int setup_pv_msrs(int vcpu_fd, uint32_t pv_features) {
+    struct {
+        struct kvm_msrs info;
+        struct kvm_msr_entry entries[PV_MSR_COUNT];
+    } msr_data;
+
+    memset(&msr_data, 0, sizeof(msr_data));
+    struct kvm_msrs *msrs = &msr_data.info;
+    for (size_t i = 0; i < PV_MSR_COUNT; i++) {
+        if (pv_features & (1u << pv_msrs[i].feature)) {
+            msrs->entries[msrs->nmsrs].index = pv_msrs[i].index;
+            msrs->entries[msrs->nmsrs].data = pv_msrs[i].reset;
+            msrs->nmsrs++;
+        }
+    }
+    if (msrs->nmsrs == 0) {
+        return 0;
+    }
+
+    // KVM_SET_MSRS returns how many entries it accepted
+    int ret = ioctl(vcpu_fd, KVM_SET_MSRS, msrs);
+    if (ret < 0) {
+        perror("KVM_SET_MSRS (paravirtual)");
+        return -1;
+    }
+    if ((uint32_t)ret < msrs->nmsrs) {
+        DEBUG_PRINT(DEBUG_BASIC, "PV MSR 0x%x not supported by KVM", msrs->entries[ret].index);
+    }
+
+    DEBUG_PRINT(DEBUG_BASIC, "Paravirtual MSRs reset (%d MSRs)", ret);
+    return ret;
+}
+
+// Dump the paravirtual areas the guest registered
+void dump_pv_msrs(int vcpu_fd) {
+    uint64_t value;
+
+    for (size_t i = 0; i < PV_MSR_COUNT; i++) {
+        if (read_msr(vcpu_fd, pv_msrs[i].index, &value) < 0) {
+            continue;
+        }
+        if (pv_msrs[i].index == MSR_KVM_POLL_CONTROL) {
+            fprintf(stderr, "%s (0x%x): halt polling %s\n", get_msr_name(pv_msrs[i].index),
+                    pv_msrs[i].index, (value & 1) ? "allowed" : "disabled by guest");
+        } else if (value & 1) {
+            fprintf(stderr, "%s (0x%x): enabled, area at GPA 0x%llx\n", get_msr_name(pv_msrs[i].index),
+                    pv_msrs[i].index, (unsigned long long)(value & ~pv_msrs[i].flag_bits));
+        } else {
+            fprintf(stderr, "%s (0x%x): disabled\n", get_msr_name(pv_msrs[i].index), pv_msrs[i].index);
+        }
+    }
+}
+
 // Read a single MSR value
 int read_msr(int vcpu_fd, uint32_t msr_index, uint64_t *value) {
     struct {
@@ -155,6 +228,8 @@ void dump_msrs(int vcpu_fd) {
                 (unsigned long long)value);
     }
     
+    dump_pv_msrs(vcpu_fd);
+    
     fprintf(stderr, "==============================\n\n");
 }
 
@@ -170,6 +245,13 @@ const char *get_msr_name(uint32_t msr_index) {
         case MSR_GS_BASE: return "GS_BASE";
         case MSR_KERNEL_GS_BASE: return "KERNEL_GS_BASE";
         case MSR_APIC_BASE: return "APIC_BASE";
+        case MSR_KVM_SYSTEM_TIME_NEW: return "KVM_SYSTEM_TIME";
+        case MSR_KVM_SYSTEM_TIME: return "KVM_SYSTEM_TIME_OLD";
+        case MSR_KVM_WALL_CLOCK_NEW: return "KVM_WALL_CLOCK";
+        case MSR_KVM_STEAL_TIME: return "KVM_STEAL_TIME";
+        case MSR_KVM_PV_EOI_EN: return "KVM_PV_EOI_EN";
+        case MSR_KVM_ASYNC_PF_EN: return "KVM_ASYNC_PF_EN";
+        case MSR_KVM_POLL_CONTROL: return "KVM_POLL_CONTROL";
         default:
             if (msr_index >= MSR_X2APIC_START && msr_index <= MSR_X2APIC_END) {
                 return "X2APIC";
@@ -11,6 +11,15 @@
 // Returns number of MSRs set, or -1 on error
 int setup_msrs_64bit(int vcpu_fd);
 
+// Put the KVM paravirtual MSRs (kvmclock, steal time, PV EOI, async PF,
+// poll control) of the features in pv_features into their reset state.
+// The guest enables them by writing the GPA of its per-vCPU area.
+// Returns number of MSRs set, or -1 on error
+int setup_pv_msrs(int vcpu_fd, uint32_t pv_features);
+
+// Print where the guest placed its paravirtual areas
+void dump_pv_msrs(int vcpu_fd);
+
 // Read/Write single MSR
 int read_msr(int vcpu_fd, uint32_t msr_index, uint64_t *value);
 int write_msr(int vcpu_fd, uint32_t msr_index, uint64_t value);
@@ -0,0 +1,391 @@
+/*
+ * In-process learning L2 switch for Mini-KVM guests
+ *
+ * Lock order: a NIC holds its device lock while it forwards, the switch
+ * lock is taken next, and delivery to another NIC takes that NIC's device
+ * lock last. Peer sockets enter the switch without holding a device lock.
+ */
+
+#define _GNU_SOURCE // recvmmsg/sendmmsg
+#include "net_switch.h"
+#include "event_loop.h"
+#include "tap.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define ETH_HEADER_LEN 14
+
+struct net_port {
+    bool used;
+    char name[32];
+    int fd;                 // Peer socket, -1 for a local NIC
+    net_deliver_t deliver;
+    void *opaque;
+};
+
+struct mac_entry {
+    uint8_t mac[6];
+    bool valid;
+    int port;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct net_port ports[NET_SWITCH_MAX_PORTS];
+    struct mac_entry macs[NET_SWITCH_MAC_TABLE];
+    int listen_fd;
+    char listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+    // Per-destination staging for one forwarded batch
+    struct net_frame out[NET_SWITCH_MAX_PORTS][NET_BATCH];
+    int out_count[NET_SWITCH_MAX_PORTS];
+
+    // Peer socket receive buffers (event loop thread only)
+    uint8_t rx_buf[NET_BATCH][NET_FRAME_MAX];
+} sw = { .lock = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1 };
+
+static unsigned mac_hash(const uint8_t *mac) {
+    unsigned h = 0;
+
+    for (int i = 0; i < 6; i++) {
+        h = h * 31 + mac[i];
+    }
+    return h % NET_SWITCH_MAC_TABLE;
+}
+
+// Remember which port src lives behind (direct-mapped: collisions just relearn)
+static void learn(const uint8_t *src, int port) {
+    struct mac_entry *entry = &sw.macs[mac_hash(src)];
+
+    if (src[0] & 1) {
+        return; // Multicast sources are bogus
+    }
+    if (!entry->valid || entry->port != port || memcmp(entry->mac, src, 6) != 0) {
+        memcpy(entry->mac, src, 6);
+        entry->port = port;
+        entry->valid = true;
+        DEBUG_PRINT(DEBUG_DETAILED, "net: %02x:%02x:%02x:%02x:%02x:%02x on port %s", src[0], src[1],
+                    src[2], src[3], src[4], src[5], sw.ports[port].name);
+    }
+}
+
+// Port a unicast MAC was learned on, or -1 to flood
+static int lookup(const uint8_t *dst) {
+    struct mac_entry *entry = &sw.macs[mac_hash(dst)];
+
+    if ((dst[0] & 1) || !entry->valid || memcmp(entry->mac, dst, 6) != 0) {
+        return -1;
+    }
+    return entry->port;
+}
+
+static int add_port_locked(const char *name, int fd, net_deliver_t deliver, void *opaque) {
+    for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++) {
+        struct net_port *port = &sw.ports[i];
+        if (!port->used) {
+            port->used = true;
+            snprintf(port->name, sizeof(port->name), "%s", name);
+            port->fd = fd;
+            port->deliver = deliver;
+            port->opaque = opaque;
+            return i;
+        }
+    }
+    fprintf(stderr, "net: switch is full (%d ports)\n", NET_SWITCH_MAX_PORTS);
+    return -1;
+}
+
+int net_switch_add_port(const char *name, net_deliver_t deliver, void *opaque) {
+    pthread_mutex_lock(&sw.lock);
+    int port = add_port_locked(name, -1, deliver, opaque);
+    pthread_mutex_unlock(&sw.lock);
+    return port;
+}
+
+void net_switch_forward(int port, const struct net_frame *frames, int count) {
+    pthread_mutex_lock(&sw.lock);
+    memset(sw.out_count, 0, sizeof(sw.out_count));
+    for (int i = 0; i < count; i++) {
+        const uint8_t *eth = frames[i].data;
+
+        if (frames[i].len < ETH_HEADER_LEN) {
+            continue;
+        }
+        learn(eth + 6, port);
+        int dst = lookup(eth);
+        if (dst == port) {
+            continue; // Both ends behind the same port
+        }
+        for (int p = 0; p < NET_SWITCH_MAX_PORTS; p++) {
+            if (sw.ports[p].used && p != port && (dst < 0 || dst == p)) {
+                sw.out[p][sw.out_count[p]++] = frames[i];
+            }
+        }
+    }
+    for (int p = 0; p < NET_SWITCH_MAX_PORTS; p++) {
+        if (sw.out_count[p] > 0) {
+            sw.ports[p].deliver(sw.ports[p].opaque, sw.out[p], sw.out_count[p]);
+        }
+    }
+    pthread_mutex_unlock(&sw.lock);
+}
+
+// Peer ports: one SEQPACKET message per frame, dropped if the peer lags
+static void peer_deliver(void *opaque, const struct net_frame *frames, int count) {
+    struct net_port *port = opaque;
+    struct mmsghdr msgs[NET_BATCH];
+    struct iovec iov[NET_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)frames[i].data;
+        iov[i].iov_len = frames[i].len;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(port->fd, msgs, (unsigned)count, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < count) {
+        DEBUG_PRINT(DEBUG_DETAILED, "net: %s dropped %d frame(s)", port->name, count - (sent < 0 ? 0 : sent));
+    }
+}
+
+static void remove_peer(int index) {
+    struct net_port *port = &sw.ports[index];
+    int fd = port->fd;
+
+    DEBUG_PRINT(DEBUG_BASIC, "net: %s disconnected", port->name);
+    // Unhook the port before closing so no forwarder sends on a stale fd
+    pthread_mutex_lock(&sw.lock);
+    for (int i = 0; i < NET_SWITCH_MAC_TABLE; i++) {
+        if (sw.macs[i].valid && sw.macs[i].port == index) {
+            sw.macs[i].valid = false;
+        }
+    }
+    port->used = false;
+    port->fd = -1;
+    pthread_mutex_unlock(&sw.lock);
+    event_loop_del(fd);
+    close(fd);
+}
+
+static void peer_event(int fd, uint32_t events, void *opaque) {
+    struct net_port *port = opaque;
+    int index = (int)(port - sw.ports);
+    struct mmsghdr msgs[NET_BATCH];
+    struct iovec iov[NET_BATCH];
+    struct net_frame frames[NET_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < NET_BATCH; i++) {
+        iov[i].iov_base = sw.rx_buf[i];
+        iov[i].iov_len = NET_FRAME_MAX;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(fd, msgs, NET_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR) && !(events & (EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    if (n <= 0) {
+        remove_peer(index);
+        return;
+    }
+
+    // Peers never send empty messages: a zero length is the end of the stream
+    int count = 0;
+    bool hangup = false;
+    for (int i = 0; i < n; i++) {
+        if (msgs[i].msg_len == 0) {
+            hangup = true;
+            break;
+        }
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            continue; // Oversized frame
+        }
+        frames[count].data = sw.rx_buf[i];
+        frames[count].len = msgs[i].msg_len;
+        count++;
+    }
+    net_switch_forward(index, frames, count);
+    if (hangup) {
+        remove_peer(index);
+    }
+}
+
+// Tap ports: one read()/write() per frame
+static void tap_deliver(void *opaque, const struct net_frame *frames, int count) {
+    struct net_port *port = opaque;
+
+    for (int i = 0; i < count; i++) {
+        if (write(port->fd, frames[i].data, frames[i].len) < 0) {
+            DEBUG_PRINT(DEBUG_DETAILED, "net: %s dropped a frame: %s", port->name, strerror(errno));
+        }
+    }
+}
+
+static void tap_event(int fd, uint32_t events, void *opaque) {
+    struct net_port *port = opaque;
+    struct net_frame frames[NET_BATCH];
+    int count = 0;
+
+    (void)events;
+    while (count < NET_BATCH) {
+        ssize_t n = read(fd, sw.rx_buf[count], NET_FRAME_MAX);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("read tap");
+            }
+            break;
+        }
+        frames[count].data = sw.rx_buf[count];
+        frames[count].len = (size_t)n;
+        count++;
+    }
+    if (count > 0) {
+        net_switch_forward((int)(port - sw.ports), frames, count);
+    }
+}
+
+static int add_fd_port(int fd, const char *name, net_deliver_t deliver, event_handler_t handler) {
+    pthread_mutex_lock(&sw.lock);
+    int index = add_port_locked(name, fd, deliver, NULL);
+    if (index >= 0) {
+        sw.ports[index].opaque = &sw.ports[index];
+    }
+    pthread_mutex_unlock(&sw.lock);
+    if (index < 0) {
+        close(fd);
+        return -1;
+    }
+    if (event_loop_add(fd, EPOLLIN, handler, &sw.ports[index]) < 0) {
+        pthread_mutex_lock(&sw.lock);
+        sw.ports[index].used = false;
+        pthread_mutex_unlock(&sw.lock);
+        close(fd);
+        return -1;
+    }
+    DEBUG_PRINT(DEBUG_BASIC, "net: %s joined the switch as port %d", name, index);
+    return 0;
+}
+
+static void accept_event(int fd, uint32_t events, void *opaque) {
+    static int peers = 0;
+    char name[32];
+
+    (void)events;
+    (void)opaque;
+    int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (conn < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("accept net peer");
+        }
+        return;
+    }
+    snprintf(name, sizeof(name), "peer%d", peers++);
+    add_fd_port(conn, name, peer_deliver, peer_event);
+}
+
+static int unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "net: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int net_switch_listen(const char *path) {
+    struct sockaddr_un addr;
+
+    if (unix_address(path, &addr) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, NET_SWITCH_MAX_PORTS) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (event_loop_add(fd, EPOLLIN, accept_event, NULL) < 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    sw.listen_fd = fd;
+    snprintf(sw.listen_path, sizeof(sw.listen_path), "%s", path);
+    printf("net: switch listening on %s\n", path);
+    return 0;
+}
+
+int net_switch_connect(const char *path) {
+    struct sockaddr_un addr;
+
+    if (unix_address(path, &addr) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    // Frames to a slow peer are dropped rather than stalling the loop
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        perror("fcntl");
+        close(fd);
+        return -1;
+    }
+    printf("net: connected to the switch at %s\n", path);
+    return add_fd_port(fd, "uplink", peer_deliver, peer_event);
+}
+
+int net_switch_add_tap(const char *ifname) {
+    int fd = tap_open(ifname);
+
+    if (fd < 0) {
+        return -1;
+    }
+    printf("net: tap %s on the switch\n", ifname);
+    return add_fd_port(fd, ifname, tap_deliver, tap_event);
+}
+
+void net_switch_cleanup(void) {
+    if (sw.listen_fd >= 0) {
+        event_loop_del(sw.listen_fd);
+        close(sw.listen_fd);
+        unlink(sw.listen_path);
+        sw.listen_fd = -1;
+    }
+    pthread_mutex_lock(&sw.lock);
+    for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++) {
+        struct net_port *port = &sw.ports[i];
+        if (port->used && port->fd >= 0) {
+            event_loop_del(port->fd);
+            close(port->fd);
+        }
+        port->used = false;
+        port->fd = -1;
+    }
+    memset(sw.macs, 0, sizeof(sw.macs));
+    pthread_mutex_unlock(&sw.lock);
+}
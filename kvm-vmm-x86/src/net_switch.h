@@ -0,0 +1,58 @@
+/*
+ * In-process learning L2 switch for Mini-KVM guests
+ *
+ * Every virtio-net NIC in the process is a switch port, and so is every
+ * AF_UNIX SOCK_SEQPACKET connection to another kvm-vmm: one process listens
+ * (--net-listen) and the others connect to it (--net-connect), giving a star
+ * of VMs that exchange Ethernet frames with no host network configuration.
+ * Each SEQPACKET message carries exactly one frame. A host tap interface
+ * can be attached as a port too (--net-tap), which bridges the switch to
+ * the host network stack.
+ *
+ * The switch learns source MACs per port; unicast frames to a known MAC go
+ * to that port only, everything else is flooded to all other ports. Frames
+ * move in batches: a NIC hands over everything its TX queue held, and peer
+ * sockets are read and written with recvmmsg()/sendmmsg(). Forwarding runs
+ * on the event loop thread. There is no spanning tree, so peers must not be
+ * connected in a loop.
+ */
+
+#ifndef NET_SWITCH_H
+#define NET_SWITCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define NET_SWITCH_MAX_PORTS 16
+#define NET_SWITCH_MAC_TABLE 256
+#define NET_FRAME_MAX        1536 // Ethernet frame without GSO (MTU 1500 + VLAN header)
+#define NET_BATCH            64   // Frames moved per batch
+
+struct net_frame {
+    const uint8_t *data;
+    size_t len;
+};
+
+// Deliver frames to a port; called with the switch lock held
+typedef void (*net_deliver_t)(void *opaque, const struct net_frame *frames, int count);
+
+// Attach a local port (a NIC); returns the port number or -1
+int net_switch_add_port(const char *name, net_deliver_t deliver, void *opaque);
+
+// Forward frames that arrived on port
+void net_switch_forward(int port, const struct net_frame *frames, int count);
+
+// Accept peer kvm-vmm processes on an AF_UNIX SOCK_SEQPACKET socket at path
+int net_switch_listen(const char *path);
+
+// Join the switch of the kvm-vmm listening at path
+int net_switch_connect(const char *path);
+
+// Attach host tap interface ifname as a port
+int net_switch_add_tap(const char *ifname);
+
+// Close peer sockets and forget every port (the event loop must be stopped)
+void net_switch_cleanup(void);
+
+#endif // NET_SWITCH_H
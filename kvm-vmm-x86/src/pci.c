@@ -0,0 +1,535 @@
+/*
+ * PCI host bridge and configuration space for Mini-KVM
+ *
+ * Configuration and BAR accesses arrive on vCPU threads and MSI-X signals
+ * on device threads; one mutex protects the bus. Device callbacks are
+ * never called with it held, since devices signal vectors while holding
+ * their own locks.
+ */
+
+#include "pci.h"
+#include "irq.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define CONFIG_ENABLE        0x80000000u
+
+#define MSIX_CONTROL         2       // Message control, relative to the capability
+#define MSIX_TABLE           4
+#define MSIX_PBA             8
+#define MSIX_CAP_SIZE        12
+#define MSIX_ENABLE          0x8000
+#define MSIX_FUNCTION_MASK   0x4000
+#define MSIX_ENTRY_SIZE      16
+#define MSIX_ENTRY_DATA      8
+#define MSIX_ENTRY_CONTROL   12
+#define MSIX_VECTOR_MASKED   1
+
+#define CAP_START            0x40
+
+struct pci_msix_vector {
+    uint32_t gsi;
+    int fd;                  // irqfd on gsi
+    bool routed;             // gsi carries the message below
+    uint64_t address;
+    uint32_t data;
+};
+
+struct pci_device {
+    const pci_device_ops_t *ops;
+    void *opaque;
+    uint8_t slot;
+    uint8_t config[PCI_CONFIG_SIZE];
+    uint8_t wmask[PCI_CONFIG_SIZE];  // Bits the guest may change
+    uint32_t bar_size[PCI_NUM_BARS]; // 0: no BAR
+    uint64_t bar_gpa[PCI_NUM_BARS];  // Where the BAR decodes, 0: nowhere
+    uint8_t cap_end;
+    uint8_t cap_last;
+
+    // MSI-X (msix_vectors 0: none)
+    uint16_t msix_vectors;
+    uint8_t msix_cap;
+    int msix_bar;
+    uint32_t msix_table_offset;
+    uint32_t msix_pba_offset;
+    uint8_t msix_table[PCI_MSIX_MAX_VECTORS * MSIX_ENTRY_SIZE];
+    uint64_t msix_pending;
+    struct pci_msix_vector vectors[PCI_MSIX_MAX_VECTORS];
+};
+
+// A BAR that moved while the bus lock was held, reported after dropping it
+struct pci_remap {
+    pci_device_t *pdev;
+    int bar;
+    uint64_t gpa;
+};
+
+static struct {
+    bool enabled;
+    pthread_mutex_t lock;
+    uint32_t config_address;
+    pci_device_t devs[PCI_MAX_DEVICES];
+    int count;
+    uint64_t next_bar;
+    uint32_t next_gsi;
+    int vm_fd;
+} pci = { .lock = PTHREAD_MUTEX_INITIALIZER, .next_bar = PCI_MMIO_BASE, .vm_fd = -1 };
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static void set16(uint8_t *p, uint16_t val) {
+    p[0] = (uint8_t)val;
+    p[1] = (uint8_t)(val >> 8);
+}
+
+static void set32(uint8_t *p, uint32_t val) {
+    set16(p, (uint16_t)val);
+    set16(p + 2, (uint16_t)(val >> 16));
+}
+
+static const pci_device_ops_t host_bridge_ops = {
+    .name = "host bridge",
+};
+
+void pci_init(void) {
+    static const pci_id_t host_bridge = {
+        .vendor = 0x1b36, // Red Hat: no chipset quirks in the guest
+        .device = 0x0008,
+        .class_code = 0x060000,
+    };
+
+    if (pci.enabled) {
+        return;
+    }
+    pci.enabled = true;
+    pci.next_gsi = IRQ_IOAPIC_PINS;
+    pci_add_device(&host_bridge_ops, NULL, &host_bridge);
+}
+
+bool pci_enabled(void) {
+    return pci.enabled;
+}
+
+pci_device_t *pci_add_device(const pci_device_ops_t *ops, void *opaque, const pci_id_t *id) {
+    if (pci.count >= PCI_MAX_DEVICES) {
+        fprintf(stderr, "pci: bus 0 is full (max %d devices)\n", PCI_MAX_DEVICES);
+        return NULL;
+    }
+
+    pci_device_t *pdev = &pci.devs[pci.count];
+    memset(pdev, 0, sizeof(*pdev));
+    pdev->ops = ops;
+    pdev->opaque = opaque;
+    pdev->slot = (uint8_t)pci.count;
+    pdev->cap_end = CAP_START;
+    for (int v = 0; v < PCI_MSIX_MAX_VECTORS; v++) {
+        pdev->vectors[v].fd = -1;
+    }
+
+    uint8_t *cfg = pdev->config;
+    set16(cfg + PCI_VENDOR_ID, id->vendor);
+    set16(cfg + PCI_DEVICE_ID, id->device);
+    cfg[PCI_REVISION_ID] = id->revision;
+    cfg[PCI_CLASS_PROG] = (uint8_t)id->class_code;
+    set16(cfg + PCI_CLASS_PROG + 1, (uint16_t)(id->class_code >> 8));
+    set16(cfg + PCI_SUBSYSTEM_VENDOR_ID, id->subsystem_vendor);
+    set16(cfg + PCI_SUBSYSTEM_ID, id->subsystem);
+    if (pci.count > 0) {
+        // Firmware would have enabled decoding of the BARs it assigned
+        set16(cfg + PCI_COMMAND, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+        set16(pdev->wmask + PCI_COMMAND, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+        pdev->wmask[PCI_INTERRUPT_LINE] = 0xff;
+    }
+    pci.count++;
+
+    DEBUG_PRINT(DEBUG_BASIC, "pci: 00:%02x.0 %04x:%04x %s", pdev->slot, id->vendor, id->device, ops->name);
+    return pdev;
+}
+
+int pci_add_bar(pci_device_t *pdev, int bar, uint32_t size) {
+    if (bar < 0 || bar >= PCI_NUM_BARS || size < 4096 || (size & (size - 1)) != 0) {
+        return -1;
+    }
+    uint64_t gpa = (pci.next_bar + size - 1) & ~(uint64_t)(size - 1);
+    if (gpa + size > PCI_MMIO_BASE + PCI_MMIO_SIZE) {
+        fprintf(stderr, "pci: no room for a %u-byte BAR of %s\n", size, pdev->ops->name);
+        return -1;
+    }
+    pci.next_bar = gpa + size;
+
+    pdev->bar_size[bar] = size;
+    pdev->bar_gpa[bar] = gpa;
+    set32(pdev->config + PCI_BAR0 + 4 * bar, (uint32_t)gpa);
+    set32(pdev->wmask + PCI_BAR0 + 4 * bar, ~(size - 1));
+    DEBUG_PRINT(DEBUG_BASIC, "pci: %s BAR%d at 0x%llx (%u bytes)", pdev->ops->name, bar,
+                (unsigned long long)gpa, size);
+    return 0;
+}
+
+uint64_t pci_bar_address(pci_device_t *pdev, int bar) {
+    pthread_mutex_lock(&pci.lock);
+    uint64_t gpa = pdev->bar_gpa[bar];
+    pthread_mutex_unlock(&pci.lock);
+    return gpa;
+}
+
+uint8_t pci_add_capability(pci_device_t *pdev, uint8_t id, const void *body, uint8_t len) {
+    uint8_t offset = pdev->cap_end;
+
+    if ((unsigned)offset + 2 + len > PCI_CONFIG_SIZE) {
+        fprintf(stderr, "pci: no room for capability 0x%02x of %s\n", id, pdev->ops->name);
+        return 0;
+    }
+    pdev->config[offset] = id;
+    pdev->config[offset + 1] = 0;
+    memcpy(pdev->config + offset + 2, body, len);
+    if (pdev->cap_last) {
+        pdev->config[pdev->cap_last + 1] = offset;
+    } else {
+        pdev->config[PCI_CAPABILITY_LIST] = offset;
+        set16(pdev->config + PCI_STATUS, get16(pdev->config + PCI_STATUS) | PCI_STATUS_CAP_LIST);
+    }
+    pdev->cap_last = offset;
+    pdev->cap_end = (uint8_t)((offset + 2 + len + 3) & ~3);
+    return offset;
+}
+
+void pci_set_intx(pci_device_t *pdev, uint8_t line) {
+    pdev->config[PCI_INTERRUPT_LINE] = line;
+    pdev->config[PCI_INTERRUPT_PIN] = 1; // INTA#
+}
+
+int pci_msix_init(pci_device_t *pdev, uint16_t vectors, int bar, uint32_t table_offset, uint32_t pba_offset) {
+    uint8_t body[MSIX_CAP_SIZE - 2];
+
+    if (vectors == 0 || vectors > PCI_MSIX_MAX_VECTORS || bar < 0 || bar >= PCI_NUM_BARS ||
+        table_offset + vectors * MSIX_ENTRY_SIZE > pdev->bar_size[bar] || pba_offset + 8 > pdev->bar_size[bar]) {
+        fprintf(stderr, "pci: bad MSI-X layout for %s\n", pdev->ops->name);
+        return -1;
+    }
+    set16(body, (uint16_t)(vectors - 1));
+    set32(body + 2, table_offset | (uint32_t)bar);
+    set32(body + 6, pba_offset | (uint32_t)bar);
+    pdev->msix_cap = pci_add_capability(pdev, PCI_CAP_ID_MSIX, body, sizeof(body));
+    if (!pdev->msix_cap) {
+        return -1;
+    }
+    pdev->wmask[pdev->msix_cap + MSIX_CONTROL + 1] = (MSIX_ENABLE | MSIX_FUNCTION_MASK) >> 8;
+
+    pdev->msix_vectors = vectors;
+    pdev->msix_bar = bar;
+    pdev->msix_table_offset = table_offset;
+    pdev->msix_pba_offset = pba_offset;
+    for (uint16_t v = 0; v < vectors; v++) {
+        pdev->msix_table[v * MSIX_ENTRY_SIZE + MSIX_ENTRY_CONTROL] = MSIX_VECTOR_MASKED;
+    }
+    return 0;
+}
+
+static uint16_t msix_control(pci_device_t *pdev) {
+    return pdev->msix_vectors ? get16(pdev->config + pdev->msix_cap + MSIX_CONTROL) : 0;
+}
+
+bool pci_msix_enabled(pci_device_t *pdev) {
+    pthread_mutex_lock(&pci.lock);
+    bool enabled = (msix_control(pdev) & MSIX_ENABLE) != 0;
+    pthread_mutex_unlock(&pci.lock);
+    return enabled;
+}
+
+static bool vector_masked(pci_device_t *pdev, uint16_t v) {
+    return (msix_control(pdev) & MSIX_FUNCTION_MASK) ||
+           (pdev->msix_table[v * MSIX_ENTRY_SIZE + MSIX_ENTRY_CONTROL] & MSIX_VECTOR_MASKED);
+}
+
+// Route an unmasked vector to its message and deliver what it latched
+// (lock held); returns true if the vector must fire
+static bool msix_update(pci_device_t *pdev, uint16_t v) {
+    struct pci_msix_vector *vec = &pdev->vectors[v];
+    const uint8_t *entry = pdev->msix_table + v * MSIX_ENTRY_SIZE;
+
+    if (!(msix_control(pdev) & MSIX_ENABLE) || vector_masked(pdev, v) || vec->fd < 0) {
+        return false;
+    }
+    uint64_t address = get32(entry) | ((uint64_t)get32(entry + 4) << 32);
+    uint32_t data = get32(entry + MSIX_ENTRY_DATA);
+    if (!vec->routed || vec->address != address || vec->data != data) {
+        irq_route_remove(vec->gsi);
+        if (irq_route_msi(vec->gsi, address, data) < 0 || irq_routing_commit(pci.vm_fd) < 0) {
+            vec->routed = false;
+            return false;
+        }
+        vec->routed = true;
+        vec->address = address;
+        vec->data = data;
+        DEBUG_PRINT(DEBUG_DETAILED, "pci: %s vector %u -> 0x%llx/0x%x (GSI %u)", pdev->ops->name, v,
+                    (unsigned long long)address, data, vec->gsi);
+    }
+    if (pdev->msix_pending & (1ULL << v)) {
+        pdev->msix_pending &= ~(1ULL << v);
+        return true;
+    }
+    return false;
+}
+
+void pci_msix_notify(pci_device_t *pdev, uint16_t vector) {
+    int fd = -1;
+
+    pthread_mutex_lock(&pci.lock);
+    if ((msix_control(pdev) & MSIX_ENABLE) && vector < pdev->msix_vectors) {
+        if (vector_masked(pdev, vector) || !pdev->vectors[vector].routed) {
+            pdev->msix_pending |= 1ULL << vector;
+        } else {
+            fd = pdev->vectors[vector].fd;
+        }
+    }
+    pthread_mutex_unlock(&pci.lock);
+    if (fd >= 0) {
+        irq_irqfd_raise(fd);
+    }
+}
+
+int pci_start(int vm_fd) {
+    pci.vm_fd = vm_fd;
+    for (int i = 0; i < pci.count; i++) {
+        pci_device_t *pdev = &pci.devs[i];
+        for (uint16_t v = 0; v < pdev->msix_vectors; v++) {
+            pdev->vectors[v].gsi = pci.next_gsi++;
+            pdev->vectors[v].fd = irq_irqfd_create(vm_fd, pdev->vectors[v].gsi);
+            if (pdev->vectors[v].fd < 0) {
+                fprintf(stderr, "pci: no irqfd for %s vector %u\n", pdev->ops->name, v);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static pci_device_t *find_function(uint32_t address) {
+    uint32_t bus = (address >> 16) & 0xff;
+    uint32_t slot = (address >> 11) & 0x1f;
+    uint32_t function = (address >> 8) & 0x7;
+
+    if (!(address & CONFIG_ENABLE) || bus != 0 || function != 0 || slot >= (uint32_t)pci.count) {
+        return NULL;
+    }
+    return &pci.devs[slot];
+}
+
+bool pci_is_port(uint16_t port) {
+    return pci.enabled && port >= PCI_CONFIG_ADDRESS && port < PCI_CONFIG_DATA + 4;
+}
+
+void pci_port_read(uint16_t port, uint8_t *data, uint32_t len) {
+    memset(data, 0xff, len);
+
+    pthread_mutex_lock(&pci.lock);
+    if (port < PCI_CONFIG_DATA) {
+        uint8_t address[4];
+        uint32_t offset = port - PCI_CONFIG_ADDRESS;
+        set32(address, pci.config_address);
+        memcpy(data, address + offset, len <= 4 - offset ? len : 4 - offset);
+    } else {
+        pci_device_t *pdev = find_function(pci.config_address);
+        uint32_t offset = (pci.config_address & 0xfc) + (port - PCI_CONFIG_DATA);
+        if (pdev && offset + len <= PCI_CONFIG_SIZE) {
+            memcpy(data, pdev->config + offset, len);
+        }
+    }
+    pthread_mutex_unlock(&pci.lock);
+}
+
+// Recompute where a BAR decodes (lock held); returns true if it moved
+static bool bar_update(pci_device_t *pdev, int bar, struct pci_remap *remap) {
+    uint64_t gpa = 0;
+
+    if (get16(pdev->config + PCI_COMMAND) & PCI_COMMAND_MEMORY) {
+        gpa = get32(pdev->config + PCI_BAR0 + 4 * bar) & ~0xfULL;
+        // Unassigned, or all ones while the guest sizes it
+        if (gpa == 0 || gpa + pdev->bar_size[bar] > 0x100000000ULL) {
+            gpa = 0;
+        }
+    }
+    if (gpa == pdev->bar_gpa[bar]) {
+        return false;
+    }
+    pdev->bar_gpa[bar] = gpa;
+    remap->pdev = pdev;
+    remap->bar = bar;
+    remap->gpa = gpa;
+    return true;
+}
+
+void pci_port_write(uint16_t port, const uint8_t *data, uint32_t len) {
+    struct pci_remap remaps[PCI_NUM_BARS];
+    int nremaps = 0;
+    bool fire[PCI_MSIX_MAX_VECTORS] = { false };
+    pci_device_t *pdev = NULL;
+
+    pthread_mutex_lock(&pci.lock);
+    if (port == PCI_CONFIG_ADDRESS && len == 4) {
+        pci.config_address = get32(data);
+    } else if (port >= PCI_CONFIG_DATA) {
+        pdev = find_function(pci.config_address);
+        uint32_t offset = (pci.config_address & 0xfc) + (port - PCI_CONFIG_DATA);
+        if (pdev && offset + len <= PCI_CONFIG_SIZE) {
+            uint16_t old_control = msix_control(pdev);
+            for (uint32_t i = 0; i < len; i++) {
+                uint8_t mask = pdev->wmask[offset + i];
+                pdev->config[offset + i] = (uint8_t)((pdev->config[offset + i] & ~mask) | (data[i] & mask));
+            }
+            for (int bar = 0; bar < PCI_NUM_BARS; bar++) {
+                if (pdev->bar_size[bar] && bar_update(pdev, bar, &remaps[nremaps])) {
+                    nremaps++;
+                }
+            }
+            if (msix_control(pdev) != old_control) {
+                for (uint16_t v = 0; v < pdev->msix_vectors; v++) {
+                    fire[v] = msix_update(pdev, v);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&pci.lock);
+
+    for (int i = 0; i < nremaps; i++) {
+        DEBUG_PRINT(DEBUG_DETAILED, "pci: %s BAR%d now at 0x%llx", remaps[i].pdev->ops->name, remaps[i].bar,
+                    (unsigned long long)remaps[i].gpa);
+        if (remaps[i].pdev->ops->bar_mapped) {
+            remaps[i].pdev->ops->bar_mapped(remaps[i].pdev->opaque, remaps[i].bar, remaps[i].gpa);
+        }
+    }
+    for (uint16_t v = 0; pdev && v < pdev->msix_vectors; v++) {
+        if (fire[v]) {
+            irq_irqfd_raise(pdev->vectors[v].fd);
+        }
+    }
+}
+
+// BAR holding gpa (lock held)
+static pci_device_t *find_bar(uint64_t gpa, int *bar, uint32_t *offset) {
+    for (int i = 1; i < pci.count; i++) {
+        pci_device_t *pdev = &pci.devs[i];
+        for (int b = 0; b < PCI_NUM_BARS; b++) {
+            if (pdev->bar_gpa[b] && gpa >= pdev->bar_gpa[b] && gpa < pdev->bar_gpa[b] + pdev->bar_size[b]) {
+                *bar = b;
+                *offset = (uint32_t)(gpa - pdev->bar_gpa[b]);
+                return pdev;
+            }
+        }
+    }
+    return NULL;
+}
+
+bool pci_is_mmio(uint64_t gpa) {
+    int bar;
+    uint32_t offset;
+
+    if (!pci.enabled) {
+        return false;
+    }
+    pthread_mutex_lock(&pci.lock);
+    bool found = find_bar(gpa, &bar, &offset) != NULL;
+    pthread_mutex_unlock(&pci.lock);
+    return found;
+}
+
+static bool in_table(pci_device_t *pdev, int bar, uint32_t offset, uint32_t len) {
+    return pdev->msix_vectors && bar == pdev->msix_bar && offset >= pdev->msix_table_offset &&
+           offset + len <= pdev->msix_table_offset + pdev->msix_vectors * MSIX_ENTRY_SIZE;
+}
+
+static bool in_pba(pci_device_t *pdev, int bar, uint32_t offset, uint32_t len) {
+    return pdev->msix_vectors && bar == pdev->msix_bar && offset >= pdev->msix_pba_offset &&
+           offset + len <= pdev->msix_pba_offset + 8;
+}
+
+void pci_mmio_read(uint64_t gpa, uint8_t *data, uint32_t len) {
+    int bar;
+    uint32_t offset;
+
+    memset(data, 0, len);
+    pthread_mutex_lock(&pci.lock);
+    pci_device_t *pdev = find_bar(gpa, &bar, &offset);
+    if (!pdev) {
+        pthread_mutex_unlock(&pci.lock);
+        return;
+    }
+    if (in_table(pdev, bar, offset, len)) {
+        memcpy(data, pdev->msix_table + (offset - pdev->msix_table_offset), len);
+        pthread_mutex_unlock(&pci.lock);
+        return;
+    }
+    if (in_pba(pdev, bar, offset, len)) {
+        uint8_t pba[8];
+        set32(pba, (uint32_t)pdev->msix_pending);
+        set32(pba + 4, (uint32_t)(pdev->msix_pending >> 32));
+        memcpy(data, pba + (offset - pdev->msix_pba_offset), len);
+        pthread_mutex_unlock(&pci.lock);
+        return;
+    }
+    pthread_mutex_unlock(&pci.lock);
+    if (pdev->ops->bar_read) {
+        pdev->ops->bar_read(pdev->opaque, bar, offset, data, len);
+    }
+}
+
+void pci_mmio_write(uint64_t gpa, const uint8_t *data, uint32_t len) {
+    int bar;
+    uint32_t offset;
+
+    pthread_mutex_lock(&pci.lock);
+    pci_device_t *pdev = find_bar(gpa, &bar, &offset);
+    if (!pdev) {
+        pthread_mutex_unlock(&pci.lock);
+        return;
+    }
+    if (in_table(pdev, bar, offset, len)) {
+        uint16_t v = (uint16_t)((offset - pdev->msix_table_offset) / MSIX_ENTRY_SIZE);
+        memcpy(pdev->msix_table + (offset - pdev->msix_table_offset), data, len);
+        bool fire = msix_update(pdev, v);
+        pthread_mutex_unlock(&pci.lock);
+        if (fire) {
+            irq_irqfd_raise(pdev->vectors[v].fd);
+        }
+        return;
+    }
+    pthread_mutex_unlock(&pci.lock);
+    if (in_pba(pdev, bar, offset, len)) {
+        return; // Read-only
+    }
+    if (pdev->ops->bar_write) {
+        pdev->ops->bar_write(pdev->opaque, bar, offset, data, len);
+    }
+}
+
+void pci_cleanup(void) {
+    pthread_mutex_lock(&pci.lock);
+    for (int i = 0; i < pci.count; i++) {
+        pci_device_t *pdev = &pci.devs[i];
+        for (uint16_t v = 0; v < pdev->msix_vectors; v++) {
+            struct pci_msix_vector *vec = &pdev->vectors[v];
+            if (vec->fd >= 0) {
+                irq_irqfd_release(pci.vm_fd, vec->fd, -1, vec->gsi);
+                vec->fd = -1;
+            }
+            if (vec->routed) {
+                irq_route_remove(vec->gsi);
+                vec->routed = false;
+            }
+        }
+    }
+    pci.count = 0;
+    pci.enabled = false;
+    pci.next_bar = PCI_MMIO_BASE;
+    pci.vm_fd = -1;
+    pthread_mutex_unlock(&pci.lock);
+}
@@ -0,0 +1,118 @@
+/*
+ * PCI host bridge and configuration space for Mini-KVM
+ *
+ * One bus (bus 0) reached through configuration mechanism #1 (ports
+ * 0xCF8/0xCFC), with a host bridge at 00:00.0 so the guest's probe finds
+ * it. Every function has a 256-byte configuration space and up to six
+ * 32-bit memory BARs. BARs are assigned at add time inside the 32-bit hole
+ * above guest RAM, the way firmware would, and the guest may move them.
+ *
+ * MSI-X is emulated here for every function that asks for it. Each vector
+ * gets its own GSI and irqfd; the GSI is routed to the vector's MSI message
+ * while the vector is enabled and unmasked, so signalling a vector is one
+ * eventfd write from any thread. A masked vector latches its pending bit
+ * and fires when it is unmasked.
+ */
+
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PCI_MMIO_BASE       0xE0000000ULL  // BAR window: above RAM, below the IOAPIC
+#define PCI_MMIO_SIZE       (256ULL << 20)
+#define PCI_MAX_DEVICES     32             // Slots on bus 0, the host bridge included
+#define PCI_NUM_BARS        6
+#define PCI_CONFIG_SIZE     256
+#define PCI_MSIX_MAX_VECTORS 32
+
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// Configuration space registers
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_STATUS          0x06
+#define PCI_REVISION_ID     0x08
+#define PCI_CLASS_PROG      0x09
+#define PCI_HEADER_TYPE     0x0e
+#define PCI_BAR0            0x10
+#define PCI_SUBSYSTEM_VENDOR_ID 0x2c
+#define PCI_SUBSYSTEM_ID    0x2e
+#define PCI_CAPABILITY_LIST 0x34
+#define PCI_INTERRUPT_LINE  0x3c
+#define PCI_INTERRUPT_PIN   0x3d
+
+#define PCI_COMMAND_MEMORY  0x0002
+#define PCI_COMMAND_MASTER  0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+#define PCI_STATUS_CAP_LIST 0x0010
+
+#define PCI_CAP_ID_MSIX     0x11
+#define PCI_CAP_ID_VNDR     0x09
+
+typedef struct pci_device pci_device_t;
+
+typedef struct {
+    uint16_t vendor;
+    uint16_t device;
+    uint16_t subsystem_vendor;
+    uint16_t subsystem;
+    uint32_t class_code;         // Class, subclass, programming interface
+    uint8_t revision;
+} pci_id_t;
+
+// Function callbacks; BAR accesses arrive on vCPU threads
+typedef struct {
+    const char *name;
+    void (*bar_read)(void *opaque, int bar, uint32_t offset, uint8_t *data, uint32_t len);
+    void (*bar_write)(void *opaque, int bar, uint32_t offset, const uint8_t *data, uint32_t len);
+    // The guest moved a BAR or toggled memory decoding; gpa is 0 while the
+    // BAR does not decode (optional)
+    void (*bar_mapped)(void *opaque, int bar, uint64_t gpa);
+} pci_device_ops_t;
+
+// Enable the bus (config ports and BAR decoding); devices can be added after
+void pci_init(void);
+bool pci_enabled(void);
+
+// Add a function in the next free slot
+pci_device_t *pci_add_device(const pci_device_ops_t *ops, void *opaque, const pci_id_t *id);
+
+// Give the function a 32-bit memory BAR (size a power of two, >= 4 KiB)
+int pci_add_bar(pci_device_t *pdev, int bar, uint32_t size);
+
+// Current address of a BAR, 0 while it does not decode
+uint64_t pci_bar_address(pci_device_t *pdev, int bar);
+
+// Append a capability (body excludes the ID and next bytes); returns its
+// offset in configuration space, or 0 when it does not fit
+uint8_t pci_add_capability(pci_device_t *pdev, uint8_t id, const void *body, uint8_t len);
+
+// Legacy INTA# on the given IRQ line
+void pci_set_intx(pci_device_t *pdev, uint8_t line);
+
+// MSI-X with the table and PBA at the given offsets of bar
+int pci_msix_init(pci_device_t *pdev, uint16_t vectors, int bar, uint32_t table_offset, uint32_t pba_offset);
+bool pci_msix_enabled(pci_device_t *pdev);
+
+// Signal a vector (any thread); ignored while MSI-X is disabled
+void pci_msix_notify(pci_device_t *pdev, uint16_t vector);
+
+// Bind the MSI-X irqfds (after every device is added)
+int pci_start(int vm_fd);
+
+bool pci_is_port(uint16_t port);
+void pci_port_read(uint16_t port, uint8_t *data, uint32_t len);
+void pci_port_write(uint16_t port, const uint8_t *data, uint32_t len);
+
+bool pci_is_mmio(uint64_t gpa);
+void pci_mmio_read(uint64_t gpa, uint8_t *data, uint32_t len);
+void pci_mmio_write(uint64_t gpa, const uint8_t *data, uint32_t len);
+
+// Release irqfds and routes (vCPUs must be stopped)
+void pci_cleanup(void);
+
+#endif // PCI_H
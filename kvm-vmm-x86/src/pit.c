@@ -0,0 +1,243 @@
+/*
+ * i8254 PIT (channel 0) for Mini-KVM
+ *
+ * Port accesses arrive on vCPU threads, expiries on the event loop thread;
+ * the register state is protected by one mutex. Several expiries that pile
+ * up before the loop runs are delivered as a single edge, like a real PIC
+ * that has not acknowledged the previous one.
+ */
+
+#include "pit.h"
+#include "irq.h"
+#include "event_loop.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+static struct {
+    pit_state_t st;
+    pthread_mutex_t lock;
+    int vm_fd;
+    int timer_fd;
+    int irq_fd;
+    int timer_hz;
+    bool guest_ready;
+    uint64_t ticks;
+    struct timespec loaded; // When the current count started
+} pit = { .lock = PTHREAD_MUTEX_INITIALIZER, .vm_fd = -1, .timer_fd = -1, .irq_fd = -1 };
+
+static bool pit_periodic(void) {
+    uint8_t mode = pit.st.mode > 5 ? pit.st.mode - 4 : pit.st.mode; // Modes 6/7 alias 2/3
+    return mode == 2 || mode == 3;
+}
+
+static uint64_t pit_period_ns(void) {
+    uint64_t count = pit.st.reload ? pit.st.reload : 65536;
+    if (pit_periodic() && pit.timer_hz > 0) {
+        return 1000000000ULL / (uint64_t)pit.timer_hz;
+    }
+    return count * 1000000000ULL / PIT_FREQ_HZ;
+}
+
+// Program the timerfd from the register state (lock held)
+static void pit_arm(void) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    clock_gettime(CLOCK_MONOTONIC, &pit.loaded);
+    if (pit.timer_fd < 0) {
+        return;
+    }
+    if (pit.st.armed) {
+        uint64_t ns = pit_period_ns();
+        its.it_value.tv_sec = (time_t)(ns / 1000000000ULL);
+        its.it_value.tv_nsec = (long)(ns % 1000000000ULL);
+        if (pit_periodic()) {
+            its.it_interval = its.it_value;
+        }
+    }
+    if (timerfd_settime(pit.timer_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+// Current counter value derived from the time since the count was loaded
+static uint16_t pit_current_count(void) {
+    struct timespec now;
+    uint64_t count = pit.st.reload ? pit.st.reload : 65536;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (uint64_t)(now.tv_sec - pit.loaded.tv_sec) * 1000000000ULL +
+                  (uint64_t)(now.tv_nsec - pit.loaded.tv_nsec);
+    uint64_t elapsed = ns * PIT_FREQ_HZ / 1000000000ULL;
+
+    if (pit_periodic()) {
+        return (uint16_t)(count - elapsed % count);
+    }
+    return elapsed >= count ? 0 : (uint16_t)(count - elapsed);
+}
+
+static void pit_timer_event(int fd, uint32_t events, void *opaque) {
+    (void)events;
+    (void)opaque;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    // Hold ticks back until the guest can take them
+    if (!pit.guest_ready) {
+        pit.guest_ready = irq_guest_ready(pit.vm_fd, 0);
+        if (!pit.guest_ready) {
+            return;
+        }
+        DEBUG_PRINT(DEBUG_BASIC, "PIT: guest interrupt controller ready, delivering IRQ0");
+    }
+    if (irq_irqfd_raise(pit.irq_fd) == 0) {
+        __atomic_add_fetch(&pit.ticks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int pit_init(int vm_fd, int timer_hz) {
+    pit.vm_fd = vm_fd;
+    pit.timer_hz = timer_hz;
+    pit.irq_fd = irq_irqfd_create(vm_fd, 0);
+    if (pit.irq_fd < 0) {
+        return -1;
+    }
+    pit.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (pit.timer_fd < 0) {
+        perror("timerfd_create");
+        pit_cleanup();
+        return -1;
+    }
+    if (event_loop_add(pit.timer_fd, EPOLLIN, pit_timer_event, NULL) < 0) {
+        pit_cleanup();
+        return -1;
+    }
+
+    // A restored PIT resumes ticking right away
+    pthread_mutex_lock(&pit.lock);
+    pit_arm();
+    pthread_mutex_unlock(&pit.lock);
+    return 0;
+}
+
+bool pit_is_port(uint16_t port) {
+    return port >= PIT_PORT_BASE && port <= PIT_PORT_CTRL;
+}
+
+void pit_port_out(uint16_t port, uint8_t value) {
+    pthread_mutex_lock(&pit.lock);
+    if (port == PIT_PORT_CTRL) {
+        uint8_t access = (value >> 4) & 3;
+        // Only channel 0 drives an interrupt; read-back (channel 3) is not modeled
+        if ((value >> 6) == 0) {
+            if (access == 0) {
+                pit.st.latch = pit_current_count();
+                pit.st.latched = 1;
+                pit.st.read_msb = 0;
+            } else {
+                pit.st.access = access;
+                pit.st.mode = (value >> 1) & 7;
+                pit.st.write_msb = 0;
+                pit.st.read_msb = 0;
+                // A new control word stops the counter until a count is written
+                pit.st.armed = 0;
+                pit_arm();
+                DEBUG_PRINT(DEBUG_DETAILED, "PIT: channel 0 mode %u access %u", pit.st.mode, access);
+            }
+        }
+    } else if (port == PIT_PORT_BASE) {
+        bool loaded = true;
+        switch (pit.st.access) {
+        case 1:
+            pit.st.reload = value;
+            break;
+        case 2:
+            pit.st.reload = (uint16_t)(value << 8);
+            break;
+        default:
+            if (!pit.st.write_msb) {
+                pit.st.reload = (pit.st.reload & 0xff00) | value;
+                pit.st.write_msb = 1;
+                loaded = false;
+            } else {
+                pit.st.reload = (uint16_t)((pit.st.reload & 0x00ff) | (value << 8));
+                pit.st.write_msb = 0;
+            }
+            break;
+        }
+        if (loaded) {
+            pit.st.armed = 1;
+            pit_arm();
+            DEBUG_PRINT(DEBUG_BASIC, "PIT: channel 0 count %u (%.3f ms%s)", pit.st.reload,
+                        pit_period_ns() / 1e6, pit_periodic() ? ", periodic" : "");
+        }
+    }
+    pthread_mutex_unlock(&pit.lock);
+}
+
+uint8_t pit_port_in(uint16_t port) {
+    uint8_t value = 0;
+
+    if (port != PIT_PORT_BASE) {
+        return 0;
+    }
+    pthread_mutex_lock(&pit.lock);
+    uint16_t count = pit.st.latched ? pit.st.latch : pit_current_count();
+    switch (pit.st.access) {
+    case 1:
+        value = (uint8_t)count;
+        pit.st.latched = 0;
+        break;
+    case 2:
+        value = (uint8_t)(count >> 8);
+        pit.st.latched = 0;
+        break;
+    default:
+        value = pit.st.read_msb ? (uint8_t)(count >> 8) : (uint8_t)count;
+        pit.st.read_msb ^= 1;
+        if (!pit.st.read_msb) {
+            pit.st.latched = 0;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&pit.lock);
+    return value;
+}
+
+void pit_get_state(pit_state_t *st) {
+    pthread_mutex_lock(&pit.lock);
+    *st = pit.st;
+    pthread_mutex_unlock(&pit.lock);
+}
+
+void pit_set_state(const pit_state_t *st) {
+    pthread_mutex_lock(&pit.lock);
+    pit.st = *st;
+    pit.guest_ready = false;
+    pit_arm();
+    pthread_mutex_unlock(&pit.lock);
+}
+
+uint64_t pit_ticks(void) {
+    return __atomic_load_n(&pit.ticks, __ATOMIC_RELAXED);
+}
+
+void pit_cleanup(void) {
+    if (pit.timer_fd >= 0) {
+        event_loop_del(pit.timer_fd);
+        close(pit.timer_fd);
+        pit.timer_fd = -1;
+    }
+    irq_irqfd_release(pit.vm_fd, pit.irq_fd, -1, 0);
+    pit.irq_fd = -1;
+    pit.guest_ready = false;
+}
@@ -0,0 +1,51 @@
+/*
+ * i8254 PIT (channel 0) for Mini-KVM
+ *
+ * The guest programs channel 0 through ports 0x40-0x43 as usual; the
+ * expiries come from a timerfd on the host event loop and reach the
+ * in-kernel irqchip through an irqfd on GSI 0. The timerfd is armed only
+ * once the guest has loaded a count, and ticks are only delivered after
+ * the guest has set up its interrupt controller, so guests whose IDT is not
+ * ready never see an interrupt.
+ */
+
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PIT_FREQ_HZ   1193182
+#define PIT_PORT_BASE 0x40
+#define PIT_PORT_CTRL 0x43
+
+// Channel 0 register state (saved in VM snapshots)
+typedef struct {
+    uint16_t reload;    // Count loaded by the guest (0 means 65536)
+    uint8_t mode;       // Operating mode (control word bits 3-1)
+    uint8_t access;     // 1 = LSB, 2 = MSB, 3 = LSB then MSB
+    uint8_t write_msb;  // Next data write is the MSB
+    uint8_t read_msb;   // Next data read is the MSB
+    uint8_t latched;    // Count latched by a latch command
+    uint8_t armed;      // Guest has loaded a count
+    uint16_t latch;
+    uint16_t reserved;
+} pit_state_t;
+
+// Bind GSI 0 and register the timerfd on the event loop
+// timer_hz > 0 replaces the guest-programmed periodic rate
+int pit_init(int vm_fd, int timer_hz);
+
+bool pit_is_port(uint16_t port);
+void pit_port_out(uint16_t port, uint8_t value);
+uint8_t pit_port_in(uint16_t port);
+
+void pit_get_state(pit_state_t *st);
+void pit_set_state(const pit_state_t *st); // Re-arms the timer if it was running
+
+// Interrupts delivered so far
+uint64_t pit_ticks(void);
+
+void pit_cleanup(void);
+
+#endif // PIT_H
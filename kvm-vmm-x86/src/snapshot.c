@@ -0,0 +1,943 @@
+/*
+ * VM snapshot format and KVM state capture for Mini-KVM
+ *
+ * Serializes vCPU/VM state obtained through the KVM_GET_* ioctls and guest
+ * memory slots into a sectioned stream (see snapshot.h).
+ */
+
+#include "snapshot.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+static const uint8_t zero_page[SNAPSHOT_PAGE_SIZE];
+
+static int write_all(snapshot_writer_t *w, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(w->fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("snapshot write");
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        w->offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int write_zeros(snapshot_writer_t *w, uint64_t len) {
+    if (w->seekable) {
+        if (lseek(w->fd, (off_t)len, SEEK_CUR) < 0) {
+            perror("snapshot lseek");
+            return -1;
+        }
+        w->offset += len;
+        return 0;
+    }
+    while (len > 0) {
+        size_t chunk = len < sizeof(zero_page) ? (size_t)len : sizeof(zero_page);
+        if (write_all(w, zero_page, chunk) < 0) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+static uint64_t page_align(uint64_t value) {
+    return (value + SNAPSHOT_PAGE_SIZE - 1) & ~(uint64_t)(SNAPSHOT_PAGE_SIZE - 1);
+}
+
+void snapshot_writer_init_fd(snapshot_writer_t *w, int fd) {
+    struct stat st;
+    w->fd = fd;
+    w->offset = 0;
+    w->seekable = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+int snapshot_writer_open(snapshot_writer_t *w, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create snapshot '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    snapshot_writer_init_fd(w, fd);
+    return 0;
+}
+
+int snapshot_write_header(snapshot_writer_t *w, uint32_t flags) {
+    struct snapshot_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.flags = flags;
+    return write_all(w, &hdr, sizeof(hdr));
+}
+
+int snapshot_write_section(snapshot_writer_t *w, uint32_t type, uint32_t id,
+                           const void *data, uint64_t size) {
+    struct snapshot_section sec = {
+        .type = type,
+        .id = id,
+        .size = size,
+    };
+    if (write_all(w, &sec, sizeof(sec)) < 0) {
+        return -1;
+    }
+    if (size > 0 && write_all(w, data, (size_t)size) < 0) {
+        return -1;
+    }
+    DEBUG_PRINT(DEBUG_DETAILED, "Snapshot section type=%u id=%u size=%llu",
+                type, id, (unsigned long long)size);
+    return 0;
+}
+
+// Memory payload: [desc][pad to page boundary][size bytes of guest pages]
+int snapshot_write_memory(snapshot_writer_t *w, uint32_t slot, uint64_t gpa,
+                          const void *hva, uint64_t size) {
+    struct snapshot_mem_desc desc;
+    uint64_t desc_end = w->offset + sizeof(struct snapshot_section) + sizeof(desc);
+    uint64_t data_offset = page_align(desc_end);
+
+    memset(&desc, 0, sizeof(desc));
+    desc.slot = slot;
+    desc.gpa = gpa;
+    desc.size = size;
+    desc.data_offset = data_offset;
+
+    struct snapshot_section sec = {
+        .type = SNAP_SEC_MEMORY,
+        .id = slot,
+        .size = (data_offset - desc_end) + sizeof(desc) + size,
+    };
+    if (write_all(w, &sec, sizeof(sec)) < 0 ||
+        write_all(w, &desc, sizeof(desc)) < 0 ||
+        write_zeros(w, data_offset - desc_end) < 0) {
+        return -1;
+    }
+
+    // All-zero pages are left as holes in regular files
+    const uint8_t *p = hva;
+    uint64_t written = 0, skipped = 0;
+    for (uint64_t off = 0; off < size; off += SNAPSHOT_PAGE_SIZE) {
+        size_t chunk = (size - off) < SNAPSHOT_PAGE_SIZE ? (size_t)(size - off) : SNAPSHOT_PAGE_SIZE;
+        if (w->seekable && memcmp(p + off, zero_page, chunk) == 0) {
+            if (write_zeros(w, chunk) < 0) {
+                return -1;
+            }
+            skipped++;
+            continue;
+        }
+        if (write_all(w, p + off, chunk) < 0) {
+            return -1;
+        }
+        written++;
+    }
+
+    DEBUG_PRINT(DEBUG_BASIC, "Snapshot slot %u: GPA 0x%llx, %llu KB (%llu pages written, %llu zero)",
+                slot, (unsigned long long)gpa, (unsigned long long)(size / 1024),
+                (unsigned long long)written, (unsigned long long)skipped);
+    return 0;
+}
+
+// Describe a slot whose pages the reader obtains out of band
+int snapshot_write_memory_ref(snapshot_writer_t *w, uint32_t slot, uint64_t gpa, uint64_t size) {
+    struct snapshot_mem_desc desc;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.slot = slot;
+    desc.flags = SNAP_MEM_EXTERNAL;
+    desc.gpa = gpa;
+    desc.size = size;
+    return snapshot_write_section(w, SNAP_SEC_MEMORY, slot, &desc, sizeof(desc));
+}
+
+size_t snapshot_bitmap_bytes(uint64_t mem_size) {
+    uint64_t npages = mem_size / SNAPSHOT_PAGE_SIZE;
+    return (size_t)((npages + 63) / 64) * sizeof(uint64_t);
+}
+
+static uint64_t bitmap_count(const uint64_t *bitmap, uint64_t npages) {
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < (npages + 63) / 64; i++) {
+        count += (uint64_t)__builtin_popcountll(bitmap[i]);
+    }
+    return count;
+}
+
+static bool bitmap_test(const uint64_t *bitmap, uint64_t page) {
+    return (bitmap[page / 64] >> (page % 64)) & 1;
+}
+
+// Delta payload: [desc][dirty bitmap][pad to page boundary][dirty pages in order]
+int snapshot_write_memory_delta(snapshot_writer_t *w, uint32_t slot, uint64_t gpa,
+                                const void *hva, uint64_t size, const uint64_t *bitmap) {
+    struct snapshot_mem_desc desc;
+    uint64_t npages = size / SNAPSHOT_PAGE_SIZE;
+    size_t bitmap_bytes = snapshot_bitmap_bytes(size);
+    uint64_t dirty = bitmap_count(bitmap, npages);
+    uint64_t desc_end = w->offset + sizeof(struct snapshot_section) + sizeof(desc);
+    uint64_t data_offset = page_align(desc_end + bitmap_bytes);
+
+    memset(&desc, 0, sizeof(desc));
+    desc.slot = slot;
+    desc.flags = SNAP_MEM_DELTA;
+    desc.gpa = gpa;
+    desc.size = size;
+    desc.data_offset = data_offset;
+
+    struct snapshot_section sec = {
+        .type = SNAP_SEC_MEMORY,
+        .id = slot,
+        .size = sizeof(desc) + (data_offset - desc_end) + dirty * SNAPSHOT_PAGE_SIZE,
+    };
+    if (write_all(w, &sec, sizeof(sec)) < 0 ||
+        write_all(w, &desc, sizeof(desc)) < 0 ||
+        write_all(w, bitmap, bitmap_bytes) < 0 ||
+        write_zeros(w, data_offset - desc_end - bitmap_bytes) < 0) {
+        return -1;
+    }
+
+    // Write runs of consecutive dirty pages with one call each
+    const uint8_t *p = hva;
+    uint64_t page = 0;
+    while (page < npages) {
+        if (!bitmap_test(bitmap, page)) {
+            page++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (page + run < npages && bitmap_test(bitmap, page + run)) {
+            run++;
+        }
+        if (write_all(w, p + page * SNAPSHOT_PAGE_SIZE, run * SNAPSHOT_PAGE_SIZE) < 0) {
+            return -1;
+        }
+        page += run;
+    }
+
+    DEBUG_PRINT(DEBUG_BASIC, "Snapshot slot %u (delta): %llu of %llu pages dirty",
+                slot, (unsigned long long)dirty, (unsigned long long)npages);
+    return 0;
+}
+
+int snapshot_write_parent(snapshot_writer_t *w, const char *parent) {
+    return snapshot_write_section(w, SNAP_SEC_PARENT, 0, parent, strlen(parent) + 1);
+}
+
+int snapshot_write_end(snapshot_writer_t *w) {
+    if (snapshot_write_section(w, SNAP_SEC_END, 0, NULL, 0) < 0) {
+        return -1;
+    }
+    // Trailing holes do not extend the file by themselves
+    if (w->seekable && ftruncate(w->fd, (off_t)w->offset) < 0) {
+        perror("snapshot ftruncate");
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_writer_close(snapshot_writer_t *w) {
+    int ret = 0;
+    if (w->fd >= 0) {
+        ret = close(w->fd);
+        w->fd = -1;
+    }
+    return ret;
+}
+
+static int read_all(snapshot_reader_t *r, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(r->fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("snapshot read");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Snapshot truncated at offset %llu\n", (unsigned long long)r->offset);
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        r->offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+void snapshot_reader_init_fd(snapshot_reader_t *r, int fd) {
+    struct stat st;
+    r->fd = fd;
+    r->offset = 0;
+    r->seekable = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+int snapshot_reader_open(snapshot_reader_t *r, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open snapshot '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    snapshot_reader_init_fd(r, fd);
+    return 0;
+}
+
+int snapshot_read_header(snapshot_reader_t *r, struct snapshot_header *hdr) {
+    if (read_all(r, hdr, sizeof(*hdr)) < 0) {
+        return -1;
+    }
+    if (hdr->magic != SNAPSHOT_MAGIC) {
+        fprintf(stderr, "Not a Mini-KVM snapshot (bad magic)\n");
+        return -1;
+    }
+    if (hdr->version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "Unsupported snapshot version %u (expected %u)\n",
+                hdr->version, SNAPSHOT_VERSION);
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_next_section(snapshot_reader_t *r, struct snapshot_section *sec) {
+    return read_all(r, sec, sizeof(*sec));
+}
+
+int snapshot_read_payload(snapshot_reader_t *r, void *buf, uint64_t size) {
+    return read_all(r, buf, (size_t)size);
+}
+
+int snapshot_skip(snapshot_reader_t *r, uint64_t size) {
+    if (r->seekable) {
+        if (lseek(r->fd, (off_t)size, SEEK_CUR) < 0) {
+            perror("snapshot lseek");
+            return -1;
+        }
+        r->offset += size;
+        return 0;
+    }
+    uint8_t buf[SNAPSHOT_PAGE_SIZE];
+    while (size > 0) {
+        size_t chunk = size < sizeof(buf) ? (size_t)size : sizeof(buf);
+        if (read_all(r, buf, chunk) < 0) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Reads the descriptor and padding; the reader is left at the page data
+// (external slots carry no page data, delta slots stop before the bitmap)
+int snapshot_read_memory_desc(snapshot_reader_t *r, const struct snapshot_section *sec,
+                              struct snapshot_mem_desc *desc) {
+    if (sec->size < sizeof(*desc) || read_all(r, desc, sizeof(*desc)) < 0) {
+        return -1;
+    }
+    if (desc->flags & SNAP_MEM_EXTERNAL) {
+        return sec->size == sizeof(*desc) ? 0 : -1;
+    }
+    if (desc->flags & SNAP_MEM_DELTA) {
+        return 0; // snapshot_read_memory_delta() consumes the rest
+    }
+    if (desc->data_offset < r->offset ||
+        desc->data_offset - r->offset + desc->size != sec->size - sizeof(*desc)) {
+        fprintf(stderr, "Snapshot memory section %u is malformed\n", desc->slot);
+        return -1;
+    }
+    return snapshot_skip(r, desc->data_offset - r->offset);
+}
+
+// Map the slot's pages copy-on-write straight from the snapshot file
+void *snapshot_map_memory(snapshot_reader_t *r, const struct snapshot_mem_desc *desc) {
+    if (!r->seekable) {
+        return MAP_FAILED;
+    }
+    void *mem = mmap(NULL, desc->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     r->fd, (off_t)desc->data_offset);
+    if (mem == MAP_FAILED) {
+        perror("mmap snapshot memory");
+        return MAP_FAILED;
+    }
+    if (snapshot_skip(r, desc->size) < 0) {
+        munmap(mem, desc->size);
+        return MAP_FAILED;
+    }
+    return mem;
+}
+
+int snapshot_read_memory(snapshot_reader_t *r, const struct snapshot_mem_desc *desc, void *hva) {
+    return read_all(r, hva, (size_t)desc->size);
+}
+
+// Apply a delta section (after snapshot_read_memory_desc) on top of hva
+int snapshot_read_memory_delta(snapshot_reader_t *r, const struct snapshot_section *sec,
+                               const struct snapshot_mem_desc *desc, void *hva) {
+    uint64_t npages = desc->size / SNAPSHOT_PAGE_SIZE;
+    size_t bitmap_bytes = snapshot_bitmap_bytes(desc->size);
+    uint64_t desc_end = r->offset;
+    uint64_t *bitmap;
+    int ret = -1;
+
+    if (desc->data_offset < desc_end + bitmap_bytes) {
+        fprintf(stderr, "Snapshot delta for slot %u is malformed\n", desc->slot);
+        return -1;
+    }
+    bitmap = malloc(bitmap_bytes);
+    if (!bitmap) {
+        return -1;
+    }
+    if (read_all(r, bitmap, bitmap_bytes) < 0) {
+        goto out;
+    }
+
+    uint64_t dirty = bitmap_count(bitmap, npages);
+    if (sec->size != sizeof(*desc) + (desc->data_offset - desc_end) + dirty * SNAPSHOT_PAGE_SIZE) {
+        fprintf(stderr, "Snapshot delta for slot %u has a bad size\n", desc->slot);
+        goto out;
+    }
+    if (snapshot_skip(r, desc->data_offset - r->offset) < 0) {
+        goto out;
+    }
+
+    uint8_t *p = hva;
+    uint64_t page = 0;
+    while (page < npages) {
+        if (!bitmap_test(bitmap, page)) {
+            page++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (page + run < npages && bitmap_test(bitmap, page + run)) {
+            run++;
+        }
+        if (read_all(r, p + page * SNAPSHOT_PAGE_SIZE, run * SNAPSHOT_PAGE_SIZE) < 0) {
+            goto out;
+        }
+        page += run;
+    }
+    DEBUG_PRINT(DEBUG_DETAILED, "Applied delta for slot %u: %llu pages",
+                desc->slot, (unsigned long long)dirty);
+    ret = 0;
+
+out:
+    free(bitmap);
+    return ret;
+}
+
+// Read a PARENT section; relative parents are resolved against the child's directory
+int snapshot_read_parent(snapshot_reader_t *r, const struct snapshot_section *sec,
+                         const char *child_path, char *parent, size_t parent_size) {
+    char name[PATH_MAX];
+
+    if (sec->size == 0 || sec->size > sizeof(name) ||
+        read_all(r, name, (size_t)sec->size) < 0 || name[sec->size - 1] != '\0') {
+        fprintf(stderr, "Snapshot has a malformed PARENT section\n");
+        return -1;
+    }
+
+    const char *slash = strrchr(child_path, '/');
+    int n;
+    if (name[0] == '/' || !slash) {
+        n = snprintf(parent, parent_size, "%s", name);
+    } else {
+        n = snprintf(parent, parent_size, "%.*s/%s", (int)(slash - child_path), child_path, name);
+    }
+    if (n < 0 || (size_t)n >= parent_size) {
+        fprintf(stderr, "Snapshot parent path too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_reader_close(snapshot_reader_t *r) {
+    if (r->fd >= 0) {
+        close(r->fd);
+        r->fd = -1;
+    }
+}
+
+/*
+ * Chain compaction: replay memory from the base to the head, then write the
+ * head's CPU/VM/device sections with full memory slots and no PARENT.
+ */
+struct compact_slot {
+    uint32_t slot;
+    uint64_t gpa;
+    uint64_t size;
+    uint8_t *mem;
+};
+
+static struct compact_slot *compact_find_slot(struct compact_slot *slots, int nslots, uint32_t slot) {
+    for (int i = 0; i < nslots; i++) {
+        if (slots[i].slot == slot) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Apply every MEMORY section of one chain element
+static int compact_apply(const char *path, struct compact_slot *slots, int *nslots) {
+    snapshot_reader_t r;
+    struct snapshot_header hdr;
+    struct snapshot_section sec;
+    struct snapshot_mem_desc desc;
+    int ret = -1;
+
+    if (snapshot_reader_open(&r, path) < 0) {
+        return -1;
+    }
+    if (snapshot_read_header(&r, &hdr) < 0) {
+        goto out;
+    }
+
+    for (;;) {
+        if (snapshot_next_section(&r, &sec) < 0) {
+            goto out;
+        }
+        if (sec.type == SNAP_SEC_END) {
+            break;
+        }
+        if (sec.type != SNAP_SEC_MEMORY) {
+            if (snapshot_skip(&r, sec.size) < 0) {
+                goto out;
+            }
+            continue;
+        }
+
+        if (snapshot_read_memory_desc(&r, &sec, &desc) < 0) {
+            goto out;
+        }
+        if (desc.flags & SNAP_MEM_EXTERNAL) {
+            fprintf(stderr, "%s: memory slot %u is not stored in the snapshot\n", path, desc.slot);
+            goto out;
+        }
+
+        struct compact_slot *cs = compact_find_slot(slots, *nslots, desc.slot);
+        if (!cs) {
+            if (*nslots >= SNAPSHOT_MAX_SLOTS) {
+                fprintf(stderr, "%s: too many memory slots\n", path);
+                goto out;
+            }
+            cs = &slots[(*nslots)++];
+            cs->slot = desc.slot;
+            cs->gpa = desc.gpa;
+            cs->size = desc.size;
+            cs->mem = mmap(NULL, desc.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (cs->mem == MAP_FAILED) {
+                perror("mmap compaction buffer");
+                cs->mem = NULL;
+                (*nslots)--;
+                goto out;
+            }
+        } else if (cs->size != desc.size || cs->gpa != desc.gpa) {
+            fprintf(stderr, "%s: memory slot %u changed layout within the chain\n", path, desc.slot);
+            goto out;
+        }
+
+        if (desc.flags & SNAP_MEM_DELTA) {
+            if (snapshot_read_memory_delta(&r, &sec, &desc, cs->mem) < 0) {
+                goto out;
+            }
+        } else if (snapshot_read_memory(&r, &desc, cs->mem) < 0) {
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    snapshot_reader_close(&r);
+    return ret;
+}
+
+// Fill chain[] head first; returns the chain length
+static int compact_resolve_chain(const char *head_path, char (*chain)[PATH_MAX]) {
+    int depth = 0;
+
+    snprintf(chain[0], PATH_MAX, "%s", head_path);
+    for (;;) {
+        snapshot_reader_t r;
+        struct snapshot_header hdr;
+        struct snapshot_section sec;
+        bool has_parent = false;
+
+        if (snapshot_reader_open(&r, chain[depth]) < 0) {
+            return -1;
+        }
+        if (snapshot_read_header(&r, &hdr) < 0) {
+            snapshot_reader_close(&r);
+            return -1;
+        }
+        // PARENT precedes the memory sections; stop looking at the first MEMORY
+        while (snapshot_next_section(&r, &sec) == 0 &&
+               sec.type != SNAP_SEC_END && sec.type != SNAP_SEC_MEMORY) {
+            if (sec.type == SNAP_SEC_PARENT) {
+                if (depth + 1 >= SNAPSHOT_MAX_CHAIN) {
+                    fprintf(stderr, "Snapshot chain longer than %d\n", SNAPSHOT_MAX_CHAIN);
+                    snapshot_reader_close(&r);
+                    return -1;
+                }
+                if (snapshot_read_parent(&r, &sec, chain[depth], chain[depth + 1], PATH_MAX) < 0) {
+                    snapshot_reader_close(&r);
+                    return -1;
+                }
+                has_parent = true;
+                break;
+            }
+            if (snapshot_skip(&r, sec.size) < 0) {
+                break;
+            }
+        }
+        snapshot_reader_close(&r);
+
+        depth++;
+        if (!has_parent) {
+            return depth;
+        }
+    }
+}
+
+int snapshot_compact(const char *out_path, const char *head_path) {
+    struct compact_slot slots[SNAPSHOT_MAX_SLOTS];
+    char (*chain)[PATH_MAX];
+    int nslots = 0, depth, ret = -1;
+    snapshot_reader_t r = { .fd = -1 };
+    snapshot_writer_t w = { .fd = -1 };
+    void *buf = NULL;
+
+    chain = malloc(sizeof(*chain) * SNAPSHOT_MAX_CHAIN);
+    if (!chain) {
+        return -1;
+    }
+    depth = compact_resolve_chain(head_path, chain);
+    if (depth < 0) {
+        goto out;
+    }
+
+    for (int i = depth - 1; i >= 0; i--) {
+        DEBUG_PRINT(DEBUG_BASIC, "Compact: applying %s", chain[i]);
+        if (compact_apply(chain[i], slots, &nslots) < 0) {
+            goto out;
+        }
+    }
+
+    // Copy the head's non-memory sections; memory comes from the replayed slots
+    struct snapshot_header hdr;
+    struct snapshot_section sec;
+    if (snapshot_reader_open(&r, head_path) < 0 || snapshot_read_header(&r, &hdr) < 0 ||
+        snapshot_writer_open(&w, out_path) < 0 || snapshot_write_header(&w, hdr.flags) < 0) {
+        goto out;
+    }
+    for (;;) {
+        if (snapshot_next_section(&r, &sec) < 0) {
+            goto out;
+        }
+        if (sec.type == SNAP_SEC_END) {
+            break;
+        }
+        if (sec.type == SNAP_SEC_PARENT) {
+            if (snapshot_skip(&r, sec.size) < 0) {
+                goto out;
+            }
+            continue;
+        }
+        if (sec.type == SNAP_SEC_MEMORY) {
+            struct snapshot_mem_desc desc;
+            if (sec.size < sizeof(desc) || snapshot_read_payload(&r, &desc, sizeof(desc)) < 0 ||
+                snapshot_skip(&r, sec.size - sizeof(desc)) < 0) {
+                goto out;
+            }
+            struct compact_slot *cs = compact_find_slot(slots, nslots, desc.slot);
+            if (!cs || snapshot_write_memory(&w, cs->slot, cs->gpa, cs->mem, cs->size) < 0) {
+                goto out;
+            }
+            continue;
+        }
+
+        free(buf);
+        buf = malloc(sec.size ? sec.size : 1);
+        if (!buf || snapshot_read_payload(&r, buf, sec.size) < 0 ||
+            snapshot_write_section(&w, sec.type, sec.id, buf, sec.size) < 0) {
+            goto out;
+        }
+    }
+    if (snapshot_write_end(&w) < 0) {
+        goto out;
+    }
+    ret = 0;
+    printf("Compacted %d snapshot(s) ending at %s into %s\n", depth, head_path, out_path);
+
+out:
+    free(buf);
+    snapshot_reader_close(&r);
+    if (w.fd >= 0 && snapshot_writer_close(&w) < 0) {
+        ret = -1;
+    }
+    for (int i = 0; i < nslots; i++) {
+        munmap(slots[i].mem, slots[i].size);
+    }
+    free(chain);
+    return ret;
+}
+
+/*
+ * MSRs: save everything KVM reports in KVM_GET_MSR_INDEX_LIST. KVM_GET_MSRS
+ * and KVM_SET_MSRS stop at the first MSR they refuse, so transfer in batches
+ * and step over refused indices.
+ */
+static uint32_t *msr_index_list;
+static uint32_t msr_index_count;
+
+static int load_msr_index_list(int kvm_fd) {
+    struct kvm_msr_list probe = { .nmsrs = 0 };
+
+    if (msr_index_list) {
+        return 0;
+    }
+    if (ioctl(kvm_fd, KVM_GET_MSR_INDEX_LIST, &probe) < 0 && errno != E2BIG) {
+        perror("KVM_GET_MSR_INDEX_LIST");
+        return -1;
+    }
+
+    struct kvm_msr_list *list = calloc(1, sizeof(*list) + probe.nmsrs * sizeof(uint32_t));
+    if (!list) {
+        return -1;
+    }
+    list->nmsrs = probe.nmsrs;
+    if (ioctl(kvm_fd, KVM_GET_MSR_INDEX_LIST, list) < 0) {
+        perror("KVM_GET_MSR_INDEX_LIST");
+        free(list);
+        return -1;
+    }
+
+    msr_index_count = list->nmsrs < SNAPSHOT_MAX_MSRS ? list->nmsrs : SNAPSHOT_MAX_MSRS;
+    msr_index_list = malloc(msr_index_count * sizeof(uint32_t));
+    if (!msr_index_list) {
+        free(list);
+        return -1;
+    }
+    memcpy(msr_index_list, list->indices, msr_index_count * sizeof(uint32_t));
+    free(list);
+
+    DEBUG_PRINT(DEBUG_DETAILED, "Snapshot: %u MSRs in KVM index list", msr_index_count);
+    return 0;
+}
+
+static int transfer_msrs(int vcpu_fd, unsigned long request, struct kvm_msr_entry *entries,
+                         uint32_t count, struct kvm_msr_entry *out) {
+    struct kvm_msrs *msrs = calloc(1, sizeof(*msrs) + count * sizeof(struct kvm_msr_entry));
+    uint32_t done = 0, i = 0;
+
+    if (!msrs) {
+        return -1;
+    }
+    while (i < count) {
+        msrs->nmsrs = count - i;
+        memcpy(msrs->entries, &entries[i], msrs->nmsrs * sizeof(struct kvm_msr_entry));
+        int ret = ioctl(vcpu_fd, request, msrs);
+        if (ret < 0) {
+            perror(request == KVM_GET_MSRS ? "KVM_GET_MSRS" : "KVM_SET_MSRS");
+            free(msrs);
+            return -1;
+        }
+        if (out) {
+            memcpy(&out[done], msrs->entries, (size_t)ret * sizeof(struct kvm_msr_entry));
+        }
+        done += (uint32_t)ret;
+        i += (uint32_t)ret;
+        if (i < count) {
+            DEBUG_PRINT(DEBUG_DETAILED, "Snapshot: skipping MSR 0x%x", entries[i].index);
+            i++;
+        }
+    }
+    free(msrs);
+    return (int)done;
+}
+
+int snapshot_save_vcpu(int kvm_fd, int vcpu_fd, struct snapshot_vcpu_state *st) {
+    memset(st, 0, sizeof(*st));
+
+    if (ioctl(vcpu_fd, KVM_GET_REGS, &st->regs) < 0) {
+        perror("KVM_GET_REGS (snapshot)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_SREGS, &st->sregs) < 0) {
+        perror("KVM_GET_SREGS (snapshot)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_FPU, &st->fpu) < 0) {
+        perror("KVM_GET_FPU (snapshot)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_MP_STATE, &st->mp_state) < 0) {
+        perror("KVM_GET_MP_STATE (snapshot)");
+        return -1;
+    }
+
+    // Optional state depends on host capabilities and on the in-kernel irqchip
+    if (ioctl(vcpu_fd, KVM_GET_XSAVE, &st->xsave) == 0) {
+        st->flags |= SNAP_VCPU_XSAVE;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_XCRS, &st->xcrs) == 0) {
+        st->flags |= SNAP_VCPU_XCRS;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_LAPIC, &st->lapic) == 0) {
+        st->flags |= SNAP_VCPU_LAPIC;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_VCPU_EVENTS, &st->events) == 0) {
+        st->flags |= SNAP_VCPU_EVENTS;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_DEBUGREGS, &st->debugregs) == 0) {
+        st->flags |= SNAP_VCPU_DEBUGREGS;
+    }
+
+    if (load_msr_index_list(kvm_fd) < 0) {
+        return -1;
+    }
+    struct kvm_msr_entry query[SNAPSHOT_MAX_MSRS];
+    memset(query, 0, sizeof(query));
+    for (uint32_t i = 0; i < msr_index_count; i++) {
+        query[i].index = msr_index_list[i];
+    }
+    int n = transfer_msrs(vcpu_fd, KVM_GET_MSRS, query, msr_index_count, st->msrs);
+    if (n < 0) {
+        return -1;
+    }
+    st->nmsrs = (uint32_t)n;
+
+    DEBUG_PRINT(DEBUG_DETAILED, "Snapshot vCPU: RIP=0x%llx flags=0x%x MSRs=%u",
+                (unsigned long long)st->regs.rip, st->flags, st->nmsrs);
+    return 0;
+}
+
+// Restore order follows what KVM expects: sregs before MSRs, LAPIC before events
+int snapshot_restore_vcpu(int vcpu_fd, const struct snapshot_vcpu_state *st) {
+    if (ioctl(vcpu_fd, KVM_SET_REGS, &st->regs) < 0) {
+        perror("KVM_SET_REGS (restore)");
+        return -1;
+    }
+    if (st->flags & SNAP_VCPU_XSAVE) {
+        if (ioctl(vcpu_fd, KVM_SET_XSAVE, &st->xsave) < 0) {
+            perror("KVM_SET_XSAVE (restore)");
+            return -1;
+        }
+    } else if (ioctl(vcpu_fd, KVM_SET_FPU, &st->fpu) < 0) {
+        perror("KVM_SET_FPU (restore)");
+        return -1;
+    }
+    if ((st->flags & SNAP_VCPU_XCRS) && ioctl(vcpu_fd, KVM_SET_XCRS, &st->xcrs) < 0) {
+        perror("KVM_SET_XCRS (restore)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_SREGS, &st->sregs) < 0) {
+        perror("KVM_SET_SREGS (restore)");
+        return -1;
+    }
+
+    struct kvm_msr_entry entries[SNAPSHOT_MAX_MSRS];
+    memcpy(entries, st->msrs, st->nmsrs * sizeof(struct kvm_msr_entry));
+    int n = transfer_msrs(vcpu_fd, KVM_SET_MSRS, entries, st->nmsrs, NULL);
+    if (n < 0) {
+        return -1;
+    }
+    if ((uint32_t)n != st->nmsrs) {
+        DEBUG_PRINT(DEBUG_BASIC, "Restore: %u of %u MSRs refused by KVM", st->nmsrs - n, st->nmsrs);
+    }
+
+    if (ioctl(vcpu_fd, KVM_SET_MP_STATE, &st->mp_state) < 0) {
+        perror("KVM_SET_MP_STATE (restore)");
+        return -1;
+    }
+    if ((st->flags & SNAP_VCPU_LAPIC) && ioctl(vcpu_fd, KVM_SET_LAPIC, &st->lapic) < 0) {
+        perror("KVM_SET_LAPIC (restore)");
+        return -1;
+    }
+    if (st->flags & SNAP_VCPU_EVENTS) {
+        struct kvm_vcpu_events events = st->events;
+        events.flags &= KVM_VCPUEVENT_VALID_NMI_PENDING | KVM_VCPUEVENT_VALID_SIPI_VECTOR |
+                        KVM_VCPUEVENT_VALID_SHADOW | KVM_VCPUEVENT_VALID_SMM;
+        if (ioctl(vcpu_fd, KVM_SET_VCPU_EVENTS, &events) < 0) {
+            perror("KVM_SET_VCPU_EVENTS (restore)");
+            return -1;
+        }
+    }
+    if ((st->flags & SNAP_VCPU_DEBUGREGS) && ioctl(vcpu_fd, KVM_SET_DEBUGREGS, &st->debugregs) < 0) {
+        perror("KVM_SET_DEBUGREGS (restore)");
+        return -1;
+    }
+
+    DEBUG_PRINT(DEBUG_DETAILED, "Restored vCPU: RIP=0x%llx", (unsigned long long)st->regs.rip);
+    return 0;
+}
+
+int snapshot_save_vm(int vm_fd, struct snapshot_vm_state *st) {
+    memset(st, 0, sizeof(*st));
+
+    st->pic_master.chip_id = KVM_IRQCHIP_PIC_MASTER;
+    st->pic_slave.chip_id = KVM_IRQCHIP_PIC_SLAVE;
+    st->ioapic.chip_id = KVM_IRQCHIP_IOAPIC;
+    if (ioctl(vm_fd, KVM_GET_IRQCHIP, &st->pic_master) == 0) {
+        if (ioctl(vm_fd, KVM_GET_IRQCHIP, &st->pic_slave) < 0 ||
+            ioctl(vm_fd, KVM_GET_IRQCHIP, &st->ioapic) < 0) {
+            perror("KVM_GET_IRQCHIP (snapshot)");
+            return -1;
+        }
+        st->flags |= SNAP_VM_IRQCHIP;
+    }
+    if (ioctl(vm_fd, KVM_GET_PIT2, &st->pit) == 0) {
+        st->flags |= SNAP_VM_PIT;
+    }
+    if (ioctl(vm_fd, KVM_GET_CLOCK, &st->clock) == 0) {
+        st->flags |= SNAP_VM_CLOCK;
+    }
+
+    DEBUG_PRINT(DEBUG_DETAILED, "Snapshot VM state flags=0x%x", st->flags);
+    return 0;
+}
+
+int snapshot_restore_vm(int vm_fd, const struct snapshot_vm_state *st) {
+    if (st->flags & SNAP_VM_IRQCHIP) {
+        if (ioctl(vm_fd, KVM_SET_IRQCHIP, &st->pic_master) < 0 ||
+            ioctl(vm_fd, KVM_SET_IRQCHIP, &st->pic_slave) < 0 ||
+            ioctl(vm_fd, KVM_SET_IRQCHIP, &st->ioapic) < 0) {
+            perror("KVM_SET_IRQCHIP (restore)");
+            return -1;
+        }
+    }
+    if (st->flags & SNAP_VM_PIT) {
+        if (ioctl(vm_fd, KVM_SET_PIT2, &st->pit) < 0) {
+            // The target VM may not have a PIT yet
+            struct kvm_pit_config pit_config = { .flags = KVM_PIT_SPEAKER_DUMMY };
+            if (ioctl(vm_fd, KVM_CREATE_PIT2, &pit_config) < 0 ||
+                ioctl(vm_fd, KVM_SET_PIT2, &st->pit) < 0) {
+                perror("KVM_SET_PIT2 (restore)");
+                return -1;
+            }
+        }
+    }
+    if (st->flags & SNAP_VM_CLOCK) {
+        struct kvm_clock_data clock = st->clock;
+        clock.flags = 0; // Resume kvmclock from the saved value
+        if (ioctl(vm_fd, KVM_SET_CLOCK, &clock) < 0) {
+            perror("KVM_SET_CLOCK (restore)");
+            return -1;
+        }
+    }
+    return 0;
+}
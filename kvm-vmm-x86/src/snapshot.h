@@ -0,0 +1,163 @@
+/*
+ * VM snapshot format and KVM state capture for Mini-KVM
+ *
+ * A snapshot is a stream of typed sections behind a small file header:
+ *
+ *   [header][section][section]...[END]
+ *
+ * Every section starts with struct snapshot_section followed by `size`
+ * payload bytes. Guest memory sections place the page data at a page-aligned
+ * stream offset so a file snapshot can be mmap'ed MAP_PRIVATE on restore
+ * (restore cost is then proportional to the pages the guest touches).
+ * The same writer/reader also works on non-seekable fds (pipes, sockets).
+ *
+ * Incremental snapshots carry a PARENT section naming the snapshot they are
+ * relative to (resolved against the child's directory) and store memory as
+ * DELTA sections: a dirty-page bitmap followed by the dirty pages only.
+ * Restoring or compacting such a snapshot walks the chain back to its base.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/kvm.h>
+
+#define SNAPSHOT_MAGIC      0x50414e534d564b4dULL // "MKVMSNAP"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_PAGE_SIZE  4096
+#define SNAPSHOT_MAX_MSRS   256
+#define SNAPSHOT_MAX_SLOTS  32
+#define SNAPSHOT_MAX_CHAIN  1024
+
+// Section types
+#define SNAP_SEC_END        0 // End of snapshot
+#define SNAP_SEC_CONFIG     1 // VMM guest configuration (opaque to this module)
+#define SNAP_SEC_MEMORY     2 // One guest memory slot (page-aligned data)
+#define SNAP_SEC_VM         3 // struct snapshot_vm_state
+#define SNAP_SEC_VCPU       4 // struct snapshot_vcpu_state (id = vCPU index)
+#define SNAP_SEC_DEVICES    5 // Device models (opaque to this module)
+#define SNAP_SEC_PARENT     6 // Parent snapshot path (NUL-terminated)
+#define SNAP_SEC_HINTS      7 // Lazy restore prefetch order (uint32_t page indices, id = slot)
+
+// snapshot_vcpu_state.flags
+#define SNAP_VCPU_XSAVE     (1 << 0)
+#define SNAP_VCPU_XCRS      (1 << 1)
+#define SNAP_VCPU_LAPIC     (1 << 2)
+#define SNAP_VCPU_EVENTS    (1 << 3)
+#define SNAP_VCPU_DEBUGREGS (1 << 4)
+
+// snapshot_mem_desc.flags
+#define SNAP_MEM_EXTERNAL   (1 << 0) // Pages not in the stream (shared out of band, e.g. memfd)
+#define SNAP_MEM_DELTA      (1 << 1) // Dirty bitmap + dirty pages, applied on top of the parent
+
+// snapshot_vm_state.flags
+#define SNAP_VM_IRQCHIP     (1 << 0)
+#define SNAP_VM_PIT         (1 << 1)
+#define SNAP_VM_CLOCK       (1 << 2)
+
+struct snapshot_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t reserved[2];
+};
+
+struct snapshot_section {
+    uint32_t type;
+    uint32_t id;
+    uint64_t size; // Payload bytes following this header
+};
+
+struct snapshot_mem_desc {
+    uint32_t slot;
+    uint32_t flags;
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t data_offset; // Stream offset of the page data (page aligned)
+};
+
+struct snapshot_vcpu_state {
+    uint32_t flags;
+    uint32_t nmsrs;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_lapic_state lapic;
+    struct kvm_vcpu_events events;
+    struct kvm_debugregs debugregs;
+    struct kvm_mp_state mp_state;
+    struct kvm_msr_entry msrs[SNAPSHOT_MAX_MSRS];
+};
+
+struct snapshot_vm_state {
+    uint32_t flags;
+    uint32_t reserved;
+    struct kvm_irqchip pic_master;
+    struct kvm_irqchip pic_slave;
+    struct kvm_irqchip ioapic;
+    struct kvm_pit_state2 pit;
+    struct kvm_clock_data clock;
+};
+
+typedef struct {
+    int fd;
+    uint64_t offset;  // Bytes written so far
+    bool seekable;    // Regular file: zero pages become holes
+} snapshot_writer_t;
+
+typedef struct {
+    int fd;
+    uint64_t offset;  // Bytes consumed so far
+    bool seekable;
+} snapshot_reader_t;
+
+// Writer
+int snapshot_writer_open(snapshot_writer_t *w, const char *path);
+void snapshot_writer_init_fd(snapshot_writer_t *w, int fd);
+int snapshot_write_header(snapshot_writer_t *w, uint32_t flags);
+int snapshot_write_section(snapshot_writer_t *w, uint32_t type, uint32_t id,
+                           const void *data, uint64_t size);
+int snapshot_write_memory(snapshot_writer_t *w, uint32_t slot, uint64_t gpa,
+                          const void *hva, uint64_t size);
+int snapshot_write_memory_ref(snapshot_writer_t *w, uint32_t slot, uint64_t gpa, uint64_t size);
+int snapshot_write_memory_delta(snapshot_writer_t *w, uint32_t slot, uint64_t gpa,
+                                const void *hva, uint64_t size, const uint64_t *bitmap);
+int snapshot_write_parent(snapshot_writer_t *w, const char *parent);
+int snapshot_write_end(snapshot_writer_t *w);
+int snapshot_writer_close(snapshot_writer_t *w);
+
+// Reader
+int snapshot_reader_open(snapshot_reader_t *r, const char *path);
+void snapshot_reader_init_fd(snapshot_reader_t *r, int fd);
+int snapshot_read_header(snapshot_reader_t *r, struct snapshot_header *hdr);
+int snapshot_next_section(snapshot_reader_t *r, struct snapshot_section *sec);
+int snapshot_read_payload(snapshot_reader_t *r, void *buf, uint64_t size);
+int snapshot_skip(snapshot_reader_t *r, uint64_t size);
+int snapshot_read_memory_desc(snapshot_reader_t *r, const struct snapshot_section *sec,
+                              struct snapshot_mem_desc *desc);
+void *snapshot_map_memory(snapshot_reader_t *r, const struct snapshot_mem_desc *desc);
+int snapshot_read_memory(snapshot_reader_t *r, const struct snapshot_mem_desc *desc, void *hva);
+int snapshot_read_memory_delta(snapshot_reader_t *r, const struct snapshot_section *sec,
+                               const struct snapshot_mem_desc *desc, void *hva);
+int snapshot_read_parent(snapshot_reader_t *r, const struct snapshot_section *sec,
+                         const char *child_path, char *parent, size_t parent_size);
+void snapshot_reader_close(snapshot_reader_t *r);
+
+// Dirty bitmap size in bytes for a slot (KVM_GET_DIRTY_LOG layout: 64-bit words)
+size_t snapshot_bitmap_bytes(uint64_t mem_size);
+
+// Merge an incremental chain ending at head_path into one full snapshot
+int snapshot_compact(const char *out_path, const char *head_path);
+
+// KVM state capture (vCPUs must not be running)
+int snapshot_save_vcpu(int kvm_fd, int vcpu_fd, struct snapshot_vcpu_state *st);
+int snapshot_restore_vcpu(int vcpu_fd, const struct snapshot_vcpu_state *st);
+int snapshot_save_vm(int vm_fd, struct snapshot_vm_state *st);
+int snapshot_restore_vm(int vm_fd, const struct snapshot_vm_state *st);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,39 @@
+/*
+ * Linux tap devices for Mini-KVM NICs
+ */
+
+#include "tap.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+int tap_open(const char *ifname) {
+    struct ifreq ifr;
+
+    if (strlen(ifname) >= IFNAMSIZ) {
+        fprintf(stderr, "tap: interface name too long: %s\n", ifname);
+        return -1;
+    }
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        perror("/dev/net/tun");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strcpy(ifr.ifr_name, ifname);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        perror("TUNSETIFF");
+        close(fd);
+        return -1;
+    }
+
+    DEBUG_PRINT(DEBUG_BASIC, "tap: opened %s", ifr.ifr_name);
+    return fd;
+}
@@ -0,0 +1,15 @@
+/*
+ * Linux tap devices for Mini-KVM NICs
+ *
+ * A tap interface is attached to the switch as a port with a userspace
+ * datapath (--net-tap). The interface is created if it does not exist;
+ * configuring its address and bringing it up is left to the host.
+ */
+
+#ifndef TAP_H
+#define TAP_H
+
+// Open (or create) tap ifname. Returns a non-blocking fd or -1.
+int tap_open(const char *ifname);
+
+#endif // TAP_H
@@ -0,0 +1,61 @@
+/*
+ * Minimal io_uring wrapper for Mini-KVM device backends
+ *
+ * Talks to the kernel through the raw io_uring_setup/io_uring_enter
+ * syscalls (no liburing). A ring is owned by one device and only touched
+ * under that device's lock: SQEs are queued with uring_get_sqe(), handed to
+ * the kernel in one uring_submit() per batch, and completions are signalled
+ * on an eventfd so the event loop can reap them with uring_peek_cqe().
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    int event_fd;             // Signalled for every completion
+
+    // Submission ring
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_entries;
+    unsigned sqe_tail;        // Local tail, published by uring_submit()
+    unsigned sqe_head;        // SQEs handed to the kernel so far
+
+    // Completion ring (shares sq_ptr with IORING_FEAT_SINGLE_MMAP)
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+// Set up a ring with room for entries SQEs and an eventfd for completions
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+
+// Next free SQE (zeroed), or NULL when the submission ring is full
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+// Hand all queued SQEs to the kernel; returns how many it accepted or -1
+int uring_submit(struct uring *ring);
+
+// Block until at least min completions are available
+int uring_wait(struct uring *ring, unsigned min);
+
+// Copy out and consume the oldest completion; false if there is none
+bool uring_peek_cqe(struct uring *ring, struct io_uring_cqe *cqe);
+
+#endif // URING_H
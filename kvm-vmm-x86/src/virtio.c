@@ -0,0 +1,258 @@
+/*
+ * Virtqueue core for Mini-KVM virtio devices
+ *
+ * The driver updates the rings from vCPU threads while devices consume them
+ * on the event loop, so ring indices are read and published with acquire/
+ * release ordering and a full fence separates "publish used entries" from
+ * "read the driver's suppression state".
+ */
+
+#include "virtio.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+
+static struct {
+    uint8_t *mem;
+    uint64_t size;
+    uint64_t devmem_next;  // Next free device memory GPA
+    uint32_t devmem_slots; // Device memory slots registered
+} guest = { .devmem_next = VIRTIO_DEVMEM_BASE };
+
+void virtio_set_guest_memory(void *mem, uint64_t size) {
+    guest.mem = mem;
+    guest.size = size;
+}
+
+int virtio_map_device_memory(int vm_fd, void *hva, uint64_t size, uint64_t *gpa) {
+    struct kvm_userspace_memory_region region;
+
+    region.slot = VIRTIO_DEVMEM_SLOT_BASE + guest.devmem_slots;
+    region.flags = 0;
+    region.guest_phys_addr = guest.devmem_next;
+    region.memory_size = size;
+    region.userspace_addr = (unsigned long)hva;
+    if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+        perror("KVM_SET_USER_MEMORY_REGION device memory");
+        return -1;
+    }
+    guest.devmem_slots++;
+    guest.devmem_next = (guest.devmem_next + size + VIRTIO_DEVMEM_ALIGN - 1) & ~(VIRTIO_DEVMEM_ALIGN - 1);
+    *gpa = region.guest_phys_addr;
+    return 0;
+}
+
+void *virtio_gpa_to_hva(uint64_t gpa, uint64_t len) {
+    if (!guest.mem || gpa > guest.size || len > guest.size - gpa) {
+        return NULL;
+    }
+    return guest.mem + gpa;
+}
+
+// Ring accessors (addresses were validated by virtq_valid)
+static volatile uint16_t *avail_flags(struct virtq *vq) {
+    return (volatile uint16_t *)(guest.mem + vq->avail_addr);
+}
+
+static volatile uint16_t *avail_idx(struct virtq *vq) {
+    return (volatile uint16_t *)(guest.mem + vq->avail_addr + 2);
+}
+
+static volatile uint16_t *avail_ring(struct virtq *vq, uint16_t i) {
+    return (volatile uint16_t *)(guest.mem + vq->avail_addr + 4 + 2 * (uint64_t)i);
+}
+
+static volatile uint16_t *used_event(struct virtq *vq) {
+    return avail_ring(vq, vq->num);
+}
+
+static volatile uint16_t *used_flags(struct virtq *vq) {
+    return (volatile uint16_t *)(guest.mem + vq->used_addr);
+}
+
+static volatile uint16_t *used_idx(struct virtq *vq) {
+    return (volatile uint16_t *)(guest.mem + vq->used_addr + 2);
+}
+
+static volatile uint32_t *used_ring(struct virtq *vq, uint16_t i) {
+    return (volatile uint32_t *)(guest.mem + vq->used_addr + 4 + 8 * (uint64_t)i);
+}
+
+static volatile uint16_t *avail_event(struct virtq *vq) {
+    return (volatile uint16_t *)(guest.mem + vq->used_addr + 4 + 8 * (uint64_t)vq->num);
+}
+
+void virtq_reset(struct virtq *vq, uint16_t num_max) {
+    memset(vq, 0, sizeof(*vq));
+    vq->num_max = num_max;
+    vq->num = num_max;
+}
+
+bool virtq_valid(const struct virtq *vq) {
+    uint64_t num = vq->num;
+
+    if (num == 0 || num > vq->num_max || (num & (num - 1)) != 0) {
+        return false;
+    }
+    return virtio_gpa_to_hva(vq->desc_addr, 16 * num) != NULL &&
+           virtio_gpa_to_hva(vq->avail_addr, 6 + 2 * num) != NULL &&
+           virtio_gpa_to_hva(vq->used_addr, 6 + 8 * num) != NULL;
+}
+
+bool virtq_has_avail(struct virtq *vq) {
+    return __atomic_load_n(avail_idx(vq), __ATOMIC_ACQUIRE) != vq->last_avail;
+}
+
+int virtq_pop(struct virtq *vq, struct virtq_elem *elem) {
+    uint16_t idx = __atomic_load_n(avail_idx(vq), __ATOMIC_ACQUIRE);
+
+    if (idx == vq->last_avail) {
+        return 0;
+    }
+    if ((uint16_t)(idx - vq->last_avail) > vq->num) {
+        fprintf(stderr, "virtio: avail index %u runs %u ahead of the device\n", idx,
+                (unsigned)(uint16_t)(idx - vq->last_avail));
+        return -1;
+    }
+
+    uint16_t head = *avail_ring(vq, vq->last_avail % vq->num);
+    vq->last_avail++;
+    if (head >= vq->num) {
+        fprintf(stderr, "virtio: descriptor head %u out of range\n", head);
+        return -1;
+    }
+
+    const struct virtq_desc *table = (const struct virtq_desc *)(guest.mem + vq->desc_addr);
+    uint16_t i = head;
+    unsigned n = 0;
+
+    elem->head = head;
+    elem->out_num = 0;
+    elem->in_num = 0;
+    for (;;) {
+        struct virtq_desc desc = table[i];
+
+        if (n >= VIRTQ_MAX_SEGS || n >= vq->num) {
+            fprintf(stderr, "virtio: descriptor chain too long\n");
+            return -1;
+        }
+        if (desc.flags & VIRTQ_DESC_F_INDIRECT) {
+            fprintf(stderr, "virtio: indirect descriptor not negotiated\n");
+            return -1;
+        }
+        void *hva = virtio_gpa_to_hva(desc.addr, desc.len);
+        if (!hva) {
+            fprintf(stderr, "virtio: descriptor buffer 0x%llx+%u outside guest RAM\n",
+                    (unsigned long long)desc.addr, desc.len);
+            return -1;
+        }
+        if (desc.flags & VIRTQ_DESC_F_WRITE) {
+            elem->in_num++;
+        } else if (elem->in_num > 0) {
+            fprintf(stderr, "virtio: readable descriptor after a writable one\n");
+            return -1;
+        } else {
+            elem->out_num++;
+        }
+        elem->iov[n].iov_base = hva;
+        elem->iov[n].iov_len = desc.len;
+        n++;
+
+        if (!(desc.flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+        i = desc.next;
+        if (i >= vq->num) {
+            fprintf(stderr, "virtio: descriptor next %u out of range\n", i);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+void virtq_push(struct virtq *vq, const struct virtq_elem *elem, uint32_t len) {
+    volatile uint32_t *slot = used_ring(vq, vq->used_idx % vq->num);
+
+    slot[0] = elem->head;
+    slot[1] = len;
+    vq->used_idx++;
+    __atomic_store_n(used_idx(vq), vq->used_idx, __ATOMIC_RELEASE);
+}
+
+bool virtq_set_notify(struct virtq *vq, bool enable) {
+    if (vq->event_idx) {
+        // Kick us when the entry after the last one we consumed shows up
+        if (enable) {
+            *avail_event(vq) = vq->last_avail;
+        }
+    } else {
+        *used_flags(vq) = enable ? 0 : VIRTQ_USED_F_NO_NOTIFY;
+    }
+    if (!enable) {
+        return false;
+    }
+    // The driver may have added buffers before it saw notifications enabled
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return virtq_has_avail(vq);
+}
+
+// True if new_idx has passed event since old (virtio spec vring_need_event)
+static bool need_event(uint16_t event, uint16_t new_idx, uint16_t old) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+bool virtq_should_interrupt(struct virtq *vq) {
+    uint16_t old = vq->signalled_used;
+    bool valid = vq->signalled_valid;
+
+    // Order the used->idx store before reading the driver's suppression state
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    vq->signalled_used = vq->used_idx;
+    vq->signalled_valid = true;
+    if (valid && old == vq->used_idx) {
+        return false;
+    }
+    if (!vq->event_idx) {
+        return !(*avail_flags(vq) & VIRTQ_AVAIL_F_NO_INTERRUPT);
+    }
+    return !valid || need_event(*used_event(vq), vq->used_idx, old);
+}
+
+size_t virtq_iov_to_buf(const struct iovec *iov, unsigned n, size_t offset, void *buf, size_t len) {
+    size_t done = 0;
+
+    for (unsigned i = 0; i < n && done < len; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t chunk = iov[i].iov_len - offset;
+        if (chunk > len - done) {
+            chunk = len - done;
+        }
+        memcpy((uint8_t *)buf + done, (const uint8_t *)iov[i].iov_base + offset, chunk);
+        done += chunk;
+        offset = 0;
+    }
+    return done;
+}
+
+size_t virtq_buf_to_iov(const struct iovec *iov, unsigned n, size_t offset, const void *buf, size_t len) {
+    size_t done = 0;
+
+    for (unsigned i = 0; i < n && done < len; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t chunk = iov[i].iov_len - offset;
+        if (chunk > len - done) {
+            chunk = len - done;
+        }
+        memcpy((uint8_t *)iov[i].iov_base + offset, (const uint8_t *)buf + done, chunk);
+        done += chunk;
+        offset = 0;
+    }
+    return done;
+}
@@ -0,0 +1,125 @@
+/*
+ * Virtqueue core for Mini-KVM virtio devices
+ *
+ * Split virtqueues (virtio 1.x) as laid out by the driver in guest RAM. The
+ * device side pops descriptor chains into host iovecs, returns them on the
+ * used ring and decides whether the driver needs an interrupt for a batch.
+ * With VIRTIO_RING_F_EVENT_IDX both directions are coalesced: the driver
+ * only kicks when the device asked for it and the device only interrupts
+ * once the driver's used_event has been passed, so a burst of requests
+ * costs one notification each way.
+ *
+ * Queues are transport independent; virtio_mmio.c owns their registers.
+ */
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Device IDs
+#define VIRTIO_ID_NET            1
+#define VIRTIO_ID_BLOCK          2
+#define VIRTIO_ID_CONSOLE        3
+#define VIRTIO_ID_RNG            4
+#define VIRTIO_ID_VSOCK          19
+#define VIRTIO_ID_FS             26
+#define VIRTIO_ID_PMEM           27
+
+// Device status
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER      2
+#define VIRTIO_STATUS_DRIVER_OK   4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_NEEDS_RESET 64
+#define VIRTIO_STATUS_FAILED      128
+
+// Transport feature bits offered for every device
+#define VIRTIO_RING_F_EVENT_IDX  29
+#define VIRTIO_F_VERSION_1       32
+
+#define VIRTQ_MAX_SIZE           256
+#define VIRTQ_MAX_SEGS           64  // Descriptors per chain
+
+// Device memory (pmem ranges, DAX windows) lives above 4 GiB in KVM slots of its own
+#define VIRTIO_DEVMEM_BASE       0x100000000ULL
+#define VIRTIO_DEVMEM_ALIGN      (128ULL << 20) // A sparsemem section
+#define VIRTIO_DEVMEM_SLOT_BASE  16
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT        1
+#define VIRTQ_DESC_F_WRITE       2
+#define VIRTQ_DESC_F_INDIRECT    4
+
+// Ring flags
+#define VIRTQ_USED_F_NO_NOTIFY   1
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq {
+    uint16_t num;            // Queue size chosen by the driver
+    uint16_t num_max;        // Largest size the device accepts
+    bool ready;
+    bool event_idx;          // VIRTIO_RING_F_EVENT_IDX negotiated
+    uint64_t desc_addr;      // Guest-physical ring addresses
+    uint64_t avail_addr;
+    uint64_t used_addr;
+    uint16_t last_avail;     // Next available entry to consume
+    uint16_t used_idx;       // Our copy of used->idx
+    uint16_t signalled_used; // used_idx when the driver was last interrupted
+    bool signalled_valid;
+};
+
+// One popped descriptor chain: readable segments first, then writable ones
+struct virtq_elem {
+    uint16_t head;
+    uint16_t out_num;        // Device-readable segments in iov[0..out_num)
+    uint16_t in_num;         // Device-writable segments following them
+    struct iovec iov[VIRTQ_MAX_SEGS];
+};
+
+// Guest RAM the rings and buffers live in (one contiguous range at GPA 0)
+void virtio_set_guest_memory(void *mem, uint64_t size);
+
+// Register [hva, hva + size) with KVM at the next free device memory address
+int virtio_map_device_memory(int vm_fd, void *hva, uint64_t size, uint64_t *gpa);
+
+// Host address of [gpa, gpa + len), or NULL if it is not guest RAM
+void *virtio_gpa_to_hva(uint64_t gpa, uint64_t len);
+
+void virtq_reset(struct virtq *vq, uint16_t num_max);
+
+// Ring addresses and size are sane (called when the driver sets QueueReady)
+bool virtq_valid(const struct virtq *vq);
+
+// Pop the next available chain; returns 1, 0 when empty, -1 on a bad chain
+int virtq_pop(struct virtq *vq, struct virtq_elem *elem);
+
+// Return a chain with len bytes written into its writable segments
+void virtq_push(struct virtq *vq, const struct virtq_elem *elem, uint32_t len);
+
+// Entries the driver has made available and we have not popped
+bool virtq_has_avail(struct virtq *vq);
+
+// Ask the driver not to kick while we are draining the queue (enable=false),
+// or to kick again. Returns true if buffers arrived in the meantime after
+// re-enabling, in which case the caller should keep draining.
+bool virtq_set_notify(struct virtq *vq, bool enable);
+
+// Whether the driver wants an interrupt for what was pushed since the last one
+bool virtq_should_interrupt(struct virtq *vq);
+
+// Copy between a chain's segments and a flat buffer
+size_t virtq_iov_to_buf(const struct iovec *iov, unsigned n, size_t offset, void *buf, size_t len);
+size_t virtq_buf_to_iov(const struct iovec *iov, unsigned n, size_t offset, const void *buf, size_t len);
+
+#endif // VIRTIO_H
@@ -0,0 +1,537 @@
+/*
+ * virtio-blk backed by a raw image file, for Linux guests
+ *
+ * Kicks and completions both run on the event loop thread under the device
+ * lock. Each disk has a fixed pool of requests as large as its queue, so a
+ * driver can never have more chains outstanding than there are slots. If
+ * io_uring is unavailable the same requests are executed synchronously on
+ * the event loop with preadv/pwritev.
+ */
+
+#define _GNU_SOURCE // fallocate
+#include "virtio_blk.h"
+#include "virtio_mmio.h"
+#include "uring.h"
+#include "event_loop.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+
+// Request types
+#define VIRTIO_BLK_T_IN           0
+#define VIRTIO_BLK_T_OUT          1
+#define VIRTIO_BLK_T_FLUSH        4
+#define VIRTIO_BLK_T_GET_ID       8
+#define VIRTIO_BLK_T_DISCARD      11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
+// Request status
+#define VIRTIO_BLK_S_OK           0
+#define VIRTIO_BLK_S_IOERR        1
+#define VIRTIO_BLK_S_UNSUPP       2
+
+#define VIRTIO_BLK_ID_BYTES       20
+#define VIRTIO_BLK_WZ_F_UNMAP     1
+
+#define MAX_DISCARD_SECTORS       (1U << 23) // 4 GiB per discard/write-zeroes
+
+struct virtio_blk_config {
+    uint64_t capacity; // In 512-byte sectors
+    uint32_t size_max;
+    uint32_t seg_max;
+    struct {
+        uint16_t cylinders;
+        uint8_t heads;
+        uint8_t sectors;
+    } geometry;
+    uint32_t blk_size;
+    struct {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
+} __attribute__((packed));
+
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+struct virtio_blk_discard_write_zeroes {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+struct blk_disk;
+
+struct blk_req {
+    struct blk_disk *disk;
+    struct virtq_elem elem;
+    struct iovec iov[VIRTQ_MAX_SEGS]; // Data segments (header and status stripped)
+    int niov;
+    uint8_t *status;
+    uint64_t expect;  // Result that means success
+    uint32_t in_len;  // Bytes written into the chain on success, status included
+};
+
+struct blk_disk {
+    virtio_dev_t *dev;
+    virtio_device_ops_t ops;
+    int fd;
+    bool read_only;
+    char serial[VIRTIO_BLK_ID_BYTES];
+    struct virtio_blk_config config;
+    struct uring ring;
+    bool use_uring;
+    unsigned inflight;
+    struct blk_req reqs[VIRTIO_BLK_QUEUE_SIZE];
+    struct blk_req *free[VIRTIO_BLK_QUEUE_SIZE];
+    int nfree;
+};
+
+static struct {
+    struct blk_disk disks[VIRTIO_BLK_MAX_DISKS];
+    int count;
+} blk;
+
+static size_t iov_size(const struct iovec *iov, unsigned n) {
+    size_t size = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
+// Describe [skip, skip + len) of src in dst; returns the segment count
+static int iov_slice(const struct iovec *src, unsigned n, size_t skip, size_t len, struct iovec *dst) {
+    int count = 0;
+
+    for (unsigned i = 0; i < n && len > 0; i++) {
+        if (skip >= src[i].iov_len) {
+            skip -= src[i].iov_len;
+            continue;
+        }
+        size_t chunk = src[i].iov_len - skip;
+        if (chunk > len) {
+            chunk = len;
+        }
+        dst[count].iov_base = (uint8_t *)src[i].iov_base + skip;
+        dst[count].iov_len = chunk;
+        count++;
+        len -= chunk;
+        skip = 0;
+    }
+    return count;
+}
+
+static bool in_range(struct blk_disk *disk, uint64_t sector, uint64_t bytes) {
+    uint64_t capacity = disk->config.capacity;
+
+    return bytes % VIRTIO_BLK_SECTOR_SIZE == 0 && sector <= capacity &&
+           bytes / VIRTIO_BLK_SECTOR_SIZE <= capacity - sector;
+}
+
+static void release(struct blk_disk *disk, struct blk_req *req) {
+    disk->free[disk->nfree++] = req;
+}
+
+// Report status and hand the chain back to the driver
+static void complete(struct blk_disk *disk, struct blk_req *req, uint8_t status) {
+    struct virtq *vq = virtio_dev_queue(disk->dev, 0);
+
+    // A queue the driver tore down has nowhere to return the chain to
+    if (vq->ready) {
+        *req->status = status;
+        virtq_push(vq, &req->elem, status == VIRTIO_BLK_S_OK ? req->in_len : 1);
+    }
+    release(disk, req);
+}
+
+static uint8_t result_status(struct blk_req *req, int64_t res) {
+    if (res == -EOPNOTSUPP) {
+        return VIRTIO_BLK_S_UNSUPP;
+    }
+    if (res < 0 || (uint64_t)res != req->expect) {
+        DEBUG_PRINT(DEBUG_BASIC, "virtio-blk: request failed (%lld, expected %llu)", (long long)res,
+                    (unsigned long long)req->expect);
+        return VIRTIO_BLK_S_IOERR;
+    }
+    return VIRTIO_BLK_S_OK;
+}
+
+// Synchronous fallback when there is no io_uring
+static int64_t execute_sync(struct blk_disk *disk, struct blk_req *req, uint8_t opcode, uint64_t offset,
+                            uint64_t len, int mode) {
+    ssize_t ret;
+
+    switch (opcode) {
+    case IORING_OP_READV:
+        ret = preadv(disk->fd, req->iov, req->niov, (off_t)offset);
+        break;
+    case IORING_OP_WRITEV:
+        ret = pwritev(disk->fd, req->iov, req->niov, (off_t)offset);
+        break;
+    case IORING_OP_FSYNC:
+        ret = fdatasync(disk->fd);
+        break;
+    default:
+        ret = fallocate(disk->fd, mode, (off_t)offset, (off_t)len);
+        break;
+    }
+    return ret < 0 ? -errno : ret;
+}
+
+// Queue the backend operation; returns true if the request already completed
+static bool submit(struct blk_disk *disk, struct blk_req *req, uint8_t opcode, uint64_t offset, uint64_t len,
+                   int mode) {
+    struct io_uring_sqe *sqe = disk->use_uring ? uring_get_sqe(&disk->ring) : NULL;
+
+    if (!sqe) {
+        complete(disk, req, result_status(req, execute_sync(disk, req, opcode, offset, len, mode)));
+        return true;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = disk->fd;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    switch (opcode) {
+    case IORING_OP_READV:
+    case IORING_OP_WRITEV:
+        sqe->addr = (uint64_t)(uintptr_t)req->iov;
+        sqe->len = (uint32_t)req->niov;
+        break;
+    case IORING_OP_FSYNC:
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    default: // IORING_OP_FALLOCATE: length in addr, mode in len
+        sqe->addr = len;
+        sqe->len = (uint32_t)mode;
+        break;
+    }
+    disk->inflight++;
+    return false;
+}
+
+// Discard and write-zeroes carry one segment descriptor after the header
+static bool start_range(struct blk_disk *disk, struct blk_req *req, uint32_t type) {
+    struct virtio_blk_discard_write_zeroes seg;
+    size_t data = iov_size(req->elem.iov, req->elem.out_num) - sizeof(struct virtio_blk_outhdr);
+
+    if (disk->read_only) {
+        complete(disk, req, VIRTIO_BLK_S_IOERR);
+        return true;
+    }
+    if (data != sizeof(seg)) {
+        complete(disk, req, VIRTIO_BLK_S_UNSUPP);
+        return true;
+    }
+    virtq_iov_to_buf(req->elem.iov, req->elem.out_num, sizeof(struct virtio_blk_outhdr), &seg, sizeof(seg));
+
+    uint64_t bytes = (uint64_t)seg.num_sectors * VIRTIO_BLK_SECTOR_SIZE;
+    bool unmap = seg.flags & VIRTIO_BLK_WZ_F_UNMAP;
+    if ((seg.flags & ~VIRTIO_BLK_WZ_F_UNMAP) || (unmap && type == VIRTIO_BLK_T_DISCARD)) {
+        complete(disk, req, VIRTIO_BLK_S_UNSUPP);
+        return true;
+    }
+    if (seg.num_sectors > MAX_DISCARD_SECTORS || !in_range(disk, seg.sector, bytes)) {
+        complete(disk, req, VIRTIO_BLK_S_IOERR);
+        return true;
+    }
+
+    int mode = FALLOC_FL_KEEP_SIZE;
+    mode |= (type == VIRTIO_BLK_T_DISCARD || unmap) ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE;
+    req->expect = 0;
+    req->in_len = 1;
+    return submit(disk, req, IORING_OP_FALLOCATE, seg.sector * VIRTIO_BLK_SECTOR_SIZE, bytes, mode);
+}
+
+// Parse a popped chain and start it; returns true if it already completed
+static bool start_request(struct blk_disk *disk, struct blk_req *req) {
+    struct virtq_elem *elem = &req->elem;
+    struct virtio_blk_outhdr hdr;
+    struct iovec *in = elem->iov + elem->out_num;
+
+    if (elem->in_num == 0 || in[elem->in_num - 1].iov_len == 0 ||
+        virtq_iov_to_buf(elem->iov, elem->out_num, 0, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        // Nowhere to put a status: return the chain untouched
+        fprintf(stderr, "virtio-blk: malformed request\n");
+        struct virtq *vq = virtio_dev_queue(disk->dev, 0);
+        virtq_push(vq, elem, 0);
+        release(disk, req);
+        return true;
+    }
+
+    struct iovec *last = &in[elem->in_num - 1];
+    req->status = (uint8_t *)last->iov_base + last->iov_len - 1;
+    size_t out_data = iov_size(elem->iov, elem->out_num) - sizeof(hdr);
+    size_t in_data = iov_size(in, elem->in_num) - 1;
+    uint64_t offset = hdr.sector * VIRTIO_BLK_SECTOR_SIZE;
+
+    switch (hdr.type) {
+    case VIRTIO_BLK_T_IN:
+        if (!in_range(disk, hdr.sector, in_data)) {
+            complete(disk, req, VIRTIO_BLK_S_IOERR);
+            return true;
+        }
+        req->niov = iov_slice(in, elem->in_num, 0, in_data, req->iov);
+        req->expect = in_data;
+        req->in_len = (uint32_t)in_data + 1;
+        return submit(disk, req, IORING_OP_READV, offset, 0, 0);
+
+    case VIRTIO_BLK_T_OUT:
+        if (disk->read_only || !in_range(disk, hdr.sector, out_data)) {
+            complete(disk, req, VIRTIO_BLK_S_IOERR);
+            return true;
+        }
+        req->niov = iov_slice(elem->iov, elem->out_num, sizeof(hdr), out_data, req->iov);
+        req->expect = out_data;
+        req->in_len = 1;
+        return submit(disk, req, IORING_OP_WRITEV, offset, 0, 0);
+
+    case VIRTIO_BLK_T_FLUSH:
+        req->expect = 0;
+        req->in_len = 1;
+        return submit(disk, req, IORING_OP_FSYNC, 0, 0, 0);
+
+    case VIRTIO_BLK_T_GET_ID: {
+        size_t n = virtq_buf_to_iov(in, elem->in_num, 0, disk->serial,
+                                    in_data < VIRTIO_BLK_ID_BYTES ? in_data : VIRTIO_BLK_ID_BYTES);
+        req->in_len = (uint32_t)n + 1;
+        complete(disk, req, VIRTIO_BLK_S_OK);
+        return true;
+    }
+
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        return start_range(disk, req, hdr.type);
+
+    default:
+        complete(disk, req, VIRTIO_BLK_S_UNSUPP);
+        return true;
+    }
+}
+
+// Start everything the driver queued; returns true if chains were used
+static bool process_queue(struct blk_disk *disk) {
+    struct virtq *vq = virtio_dev_queue(disk->dev, 0);
+    bool used = false;
+    int ret = 0;
+
+    if (!vq->ready || !virtio_dev_driver_ok(disk->dev)) {
+        return false;
+    }
+    do {
+        virtq_set_notify(vq, false);
+        while (disk->nfree > 0) {
+            struct blk_req *req = disk->free[--disk->nfree];
+            ret = virtq_pop(vq, &req->elem);
+            if (ret <= 0) {
+                release(disk, req);
+                break;
+            }
+            used |= start_request(disk, req);
+        }
+        if (disk->use_uring && uring_submit(&disk->ring) < 0) {
+            fprintf(stderr, "virtio-blk: submission failed\n");
+        }
+        // A broken ring stays quiet until the driver resets the device; with
+        // every slot busy, completions restart the queue instead
+    } while (ret >= 0 && disk->nfree > 0 && virtq_set_notify(vq, true));
+    return used;
+}
+
+// Consume completions; returns true if any chain went back to the driver
+static bool reap(struct blk_disk *disk, bool deliver) {
+    struct io_uring_cqe cqe;
+    bool used = false;
+
+    while (uring_peek_cqe(&disk->ring, &cqe)) {
+        struct blk_req *req = (struct blk_req *)(uintptr_t)cqe.user_data;
+
+        disk->inflight--;
+        if (deliver) {
+            complete(disk, req, result_status(req, cqe.res));
+            used = true;
+        } else {
+            release(disk, req);
+        }
+    }
+    return used;
+}
+
+static void completion_event(int fd, uint32_t events, void *opaque) {
+    struct blk_disk *disk = opaque;
+    uint64_t count;
+
+    (void)events;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read virtio-blk eventfd");
+    }
+
+    virtio_dev_lock(disk->dev);
+    bool used = reap(disk, true);
+    used |= process_queue(disk);
+    if (used) {
+        virtio_dev_notify_used(disk->dev, virtio_dev_queue(disk->dev, 0));
+    }
+    virtio_dev_unlock(disk->dev);
+}
+
+static void blk_queue_notify(virtio_dev_t *dev, uint32_t queue) {
+    struct blk_disk *disk = virtio_dev_opaque(dev);
+
+    (void)queue;
+    if (process_queue(disk)) {
+        virtio_dev_notify_used(dev, virtio_dev_queue(dev, 0));
+    }
+}
+
+// Let in-flight requests finish without returning them to anyone
+static void drain(struct blk_disk *disk) {
+    while (disk->inflight > 0) {
+        if (uring_wait(&disk->ring, 1) < 0) {
+            break;
+        }
+        reap(disk, false);
+    }
+}
+
+static void blk_reset(virtio_dev_t *dev) {
+    drain(virtio_dev_opaque(dev));
+}
+
+static void build_config(struct blk_disk *disk, uint64_t bytes) {
+    struct virtio_blk_config *config = &disk->config;
+
+    memset(config, 0, sizeof(*config));
+    config->capacity = bytes / VIRTIO_BLK_SECTOR_SIZE;
+    config->seg_max = VIRTQ_MAX_SEGS - 2; // Header and status take a descriptor each
+    config->blk_size = VIRTIO_BLK_SECTOR_SIZE;
+    config->num_queues = 1;
+    config->max_discard_sectors = MAX_DISCARD_SECTORS;
+    config->max_discard_seg = 1;
+    config->discard_sector_alignment = 1;
+    config->max_write_zeroes_sectors = MAX_DISCARD_SECTORS;
+    config->max_write_zeroes_seg = 1;
+    config->write_zeroes_may_unmap = 1;
+}
+
+int virtio_blk_init(const char *path, bool read_only) {
+    struct stat st;
+    uint64_t bytes;
+
+    if (blk.count >= VIRTIO_BLK_MAX_DISKS) {
+        fprintf(stderr, "virtio-blk: too many disks (max %d)\n", VIRTIO_BLK_MAX_DISKS);
+        return -1;
+    }
+    struct blk_disk *disk = &blk.disks[blk.count];
+    memset(disk, 0, sizeof(*disk));
+    disk->read_only = read_only;
+    disk->fd = open(path, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (disk->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(disk->fd, &st) < 0) {
+        perror("fstat");
+        close(disk->fd);
+        return -1;
+    }
+    bytes = (uint64_t)st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(disk->fd, BLKGETSIZE64, &bytes) < 0) {
+        perror("BLKGETSIZE64");
+        close(disk->fd);
+        return -1;
+    }
+    build_config(disk, bytes);
+
+    // The serial (GET_ID) is the image's file name
+    const char *name = strrchr(path, '/');
+    strncpy(disk->serial, name ? name + 1 : path, sizeof(disk->serial));
+
+    disk->use_uring = (uring_init(&disk->ring, VIRTIO_BLK_QUEUE_SIZE) == 0);
+    if (disk->use_uring &&
+        event_loop_add(disk->ring.event_fd, EPOLLIN, completion_event, disk) < 0) {
+        uring_exit(&disk->ring);
+        disk->use_uring = false;
+    }
+    if (!disk->use_uring) {
+        fprintf(stderr, "virtio-blk: io_uring unavailable, %s will use synchronous I/O\n", path);
+    }
+
+    for (int i = 0; i < VIRTIO_BLK_QUEUE_SIZE; i++) {
+        disk->reqs[i].disk = disk;
+        disk->free[i] = &disk->reqs[i];
+    }
+    disk->nfree = VIRTIO_BLK_QUEUE_SIZE;
+
+    disk->ops = (virtio_device_ops_t){
+        .name = "virtio-blk",
+        .device_id = VIRTIO_ID_BLOCK,
+        .num_queues = 1,
+        .queue_size = VIRTIO_BLK_QUEUE_SIZE,
+        .features = (1ULL << VIRTIO_BLK_F_SEG_MAX) | (1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+                    (1ULL << VIRTIO_BLK_F_FLUSH),
+        .config_size = sizeof(struct virtio_blk_config),
+        .queue_notify = blk_queue_notify,
+        .reset = blk_reset,
+    };
+    if (read_only) {
+        disk->ops.features |= 1ULL << VIRTIO_BLK_F_RO;
+    } else {
+        disk->ops.features |= (1ULL << VIRTIO_BLK_F_DISCARD) | (1ULL << VIRTIO_BLK_F_WRITE_ZEROES);
+    }
+
+    disk->dev = virtio_mmio_add(&disk->ops, &disk->config, disk);
+    if (!disk->dev) {
+        if (disk->use_uring) {
+            event_loop_del(disk->ring.event_fd);
+            uring_exit(&disk->ring);
+        }
+        close(disk->fd);
+        return -1;
+    }
+    blk.count++;
+
+    printf("virtio-blk: %s, %llu sectors%s%s\n", path, (unsigned long long)disk->config.capacity,
+           read_only ? ", read-only" : "", disk->use_uring ? ", io_uring" : "");
+    return 0;
+}
+
+void virtio_blk_cleanup(void) {
+    for (int i = 0; i < blk.count; i++) {
+        struct blk_disk *disk = &blk.disks[i];
+
+        if (disk->use_uring) {
+            event_loop_del(disk->ring.event_fd);
+            drain(disk);
+            uring_exit(&disk->ring);
+        }
+        close(disk->fd);
+    }
+    blk.count = 0;
+}
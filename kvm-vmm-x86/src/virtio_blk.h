@@ -0,0 +1,37 @@
+/*
+ * virtio-blk backed by a raw image file, for Linux guests
+ *
+ * Requests are turned into io_uring operations that read and write guest
+ * RAM in place: everything the driver queued before a kick goes to the
+ * kernel in one io_uring_enter(), any number of them stay in flight, and
+ * the ring's completion eventfd wakes the event loop, which returns the
+ * finished chains and raises at most one interrupt per batch. vCPU threads
+ * never wait for the disk.
+ *
+ * Supported requests: read, write, flush, get-id, discard (punch hole) and
+ * write-zeroes (zero range, or punch hole when the driver allows unmap).
+ */
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdbool.h>
+
+#define VIRTIO_BLK_F_SEG_MAX      2
+#define VIRTIO_BLK_F_RO           5
+#define VIRTIO_BLK_F_BLK_SIZE     6
+#define VIRTIO_BLK_F_FLUSH        9
+#define VIRTIO_BLK_F_DISCARD      13
+#define VIRTIO_BLK_F_WRITE_ZEROES 14
+
+#define VIRTIO_BLK_QUEUE_SIZE     128
+#define VIRTIO_BLK_MAX_DISKS      4
+#define VIRTIO_BLK_SECTOR_SIZE    512
+
+// Register a disk backed by path; returns 0 or -1
+int virtio_blk_init(const char *path, bool read_only);
+
+// Wait for in-flight requests and close every disk (vCPUs must be stopped)
+void virtio_blk_cleanup(void);
+
+#endif // VIRTIO_BLK_H
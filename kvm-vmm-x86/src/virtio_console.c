@@ -0,0 +1,211 @@
+/*
+ * virtio-console (hvc0) for Linux guests
+ *
+ * Output is processed on the event loop thread when the driver kicks the
+ * transmit queue. Input arrives from the stdin thread and is kept in a small
+ * ring until the driver posts receive buffers; a receive-queue kick then
+ * flushes whatever is still pending.
+ */
+
+#include "virtio_console.h"
+#include "virtio_mmio.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#define RXQ 0
+#define TXQ 1
+
+#define WRITEV_MAX 1024 // Segments one writev() accepts (UIO_MAXIOV)
+
+struct virtio_console_config {
+    uint16_t cols;
+    uint16_t rows;
+    uint32_t max_nr_ports;
+    uint32_t emerg_wr;
+} __attribute__((packed));
+
+static struct {
+    virtio_dev_t *dev;
+    int out_fd;
+    struct virtio_console_config config;
+    struct virtq_elem batch[VIRTIO_CONSOLE_TX_BATCH];
+    struct iovec iov[VIRTIO_CONSOLE_TX_BATCH * VIRTQ_MAX_SEGS];
+    char rx_buf[VIRTIO_CONSOLE_RX_BUFFER];
+    size_t rx_head; // Next byte to deliver
+    size_t rx_len;  // Bytes pending
+} con = { .out_fd = -1 };
+
+// Write a gathered batch completely; the console is best effort past errors
+static void write_iov(struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t done = writev(con.out_fd, iov, n > WRITEV_MAX ? WRITEV_MAX : n);
+        if (done < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            perror("virtio-console writev");
+            return;
+        }
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + done;
+            iov->iov_len -= (size_t)done;
+        }
+    }
+}
+
+static void console_tx(virtio_dev_t *dev) {
+    struct virtq *vq = virtio_dev_queue(dev, TXQ);
+    int ret = 0;
+
+    do {
+        virtq_set_notify(vq, false);
+        do {
+            int count = 0;
+            int niov = 0;
+
+            while (count < VIRTIO_CONSOLE_TX_BATCH && (ret = virtq_pop(vq, &con.batch[count])) > 0) {
+                struct virtq_elem *elem = &con.batch[count++];
+                memcpy(&con.iov[niov], elem->iov, elem->out_num * sizeof(struct iovec));
+                niov += elem->out_num;
+            }
+            if (count == 0) {
+                break;
+            }
+            write_iov(con.iov, niov);
+            for (int i = 0; i < count; i++) {
+                virtq_push(vq, &con.batch[i], 0);
+            }
+        } while (ret > 0);
+        if (ret < 0) {
+            return;
+        }
+    } while (virtq_set_notify(vq, true));
+
+    virtio_dev_notify_used(dev, vq);
+}
+
+static void console_rx(virtio_dev_t *dev) {
+    struct virtq *vq = virtio_dev_queue(dev, RXQ);
+    struct virtq_elem elem;
+    bool used = false;
+
+    if (!vq->ready || !virtio_dev_driver_ok(dev)) {
+        return;
+    }
+    while (con.rx_len > 0) {
+        int ret = virtq_pop(vq, &elem);
+        if (ret <= 0) {
+            // Out of buffers: the next receive-queue kick retries
+            if (ret == 0 && virtq_set_notify(vq, true)) {
+                continue;
+            }
+            break;
+        }
+
+        size_t written = 0;
+        while (con.rx_len > 0) {
+            size_t chunk = con.rx_len;
+            if (con.rx_head + chunk > sizeof(con.rx_buf)) {
+                chunk = sizeof(con.rx_buf) - con.rx_head;
+            }
+            size_t n = virtq_buf_to_iov(elem.iov + elem.out_num, elem.in_num, written,
+                                        con.rx_buf + con.rx_head, chunk);
+            if (n == 0) {
+                break;
+            }
+            written += n;
+            con.rx_head = (con.rx_head + n) % sizeof(con.rx_buf);
+            con.rx_len -= n;
+        }
+        virtq_push(vq, &elem, (uint32_t)written);
+        used = true;
+    }
+    if (used) {
+        virtio_dev_notify_used(dev, vq);
+    }
+}
+
+static void console_queue_notify(virtio_dev_t *dev, uint32_t queue) {
+    if (queue == TXQ) {
+        console_tx(dev);
+    } else {
+        console_rx(dev);
+    }
+}
+
+static void console_config_write(virtio_dev_t *dev, uint32_t offset, uint32_t len) {
+    (void)dev;
+    if (offset == offsetof(struct virtio_console_config, emerg_wr) && len >= 1) {
+        char ch = (char)con.config.emerg_wr;
+        if (write(con.out_fd, &ch, 1) < 0) {
+            perror("virtio-console emerg_wr");
+        }
+    }
+}
+
+static void console_driver_ok(virtio_dev_t *dev) {
+    // Input typed before the driver came up
+    console_rx(dev);
+}
+
+static const virtio_device_ops_t console_ops = {
+    .name = "virtio-console",
+    .device_id = VIRTIO_ID_CONSOLE,
+    .num_queues = 2,
+    .queue_size = VIRTIO_CONSOLE_QUEUE_SIZE,
+    .features = (1ULL << VIRTIO_CONSOLE_F_SIZE) | (1ULL << VIRTIO_CONSOLE_F_EMERG_WRITE),
+    .config_size = sizeof(struct virtio_console_config),
+    .queue_notify = console_queue_notify,
+    .config_write = console_config_write,
+    .driver_ok = console_driver_ok,
+};
+
+int virtio_console_init(int out_fd) {
+    struct winsize ws;
+
+    con.out_fd = out_fd;
+    con.config.cols = 80;
+    con.config.rows = 25;
+    con.config.max_nr_ports = 1;
+    if (ioctl(out_fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col && ws.ws_row) {
+        con.config.cols = ws.ws_col;
+        con.config.rows = ws.ws_row;
+    }
+
+    con.dev = virtio_mmio_add(&console_ops, &con.config, NULL);
+    return con.dev ? 0 : -1;
+}
+
+bool virtio_console_ready(void) {
+    bool ready;
+
+    if (!con.dev) {
+        return false;
+    }
+    virtio_dev_lock(con.dev);
+    ready = virtio_dev_driver_ok(con.dev) && virtio_dev_queue(con.dev, RXQ)->ready;
+    virtio_dev_unlock(con.dev);
+    return ready;
+}
+
+void virtio_console_input(const char *buf, size_t len) {
+    if (!con.dev) {
+        return;
+    }
+    virtio_dev_lock(con.dev);
+    for (size_t i = 0; i < len && con.rx_len < sizeof(con.rx_buf); i++) {
+        con.rx_buf[(con.rx_head + con.rx_len) % sizeof(con.rx_buf)] = buf[i];
+        con.rx_len++;
+    }
+    console_rx(con.dev);
+    virtio_dev_unlock(con.dev);
+}
@@ -0,0 +1,36 @@
+/*
+ * virtio-console (hvc0) for Linux guests
+ *
+ * A single-port console: receiveq0 carries host input to the guest and
+ * transmitq0 guest output to the host. The transmit queue is drained in
+ * batches of whole descriptor chains written with one writev(), and each
+ * batch raises at most one interrupt, so a burst of console output costs a
+ * handful of exits instead of one PIO exit and one IRQ per byte.
+ *
+ * Boot the guest with console=hvc0 to use it.
+ */
+
+#ifndef VIRTIO_CONSOLE_H
+#define VIRTIO_CONSOLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define VIRTIO_CONSOLE_F_SIZE        0 // cols/rows in config space
+#define VIRTIO_CONSOLE_F_EMERG_WRITE 2 // emerg_wr config register
+
+#define VIRTIO_CONSOLE_QUEUE_SIZE    256
+#define VIRTIO_CONSOLE_TX_BATCH      32   // Chains gathered into one writev()
+#define VIRTIO_CONSOLE_RX_BUFFER     4096 // Host input waiting for guest buffers
+
+// Register the device; guest output is written to out_fd
+int virtio_console_init(int out_fd);
+
+// The driver is up and has set up its receive queue
+bool virtio_console_ready(void);
+
+// Queue host input for the guest (dropped when the buffer is full)
+void virtio_console_input(const char *buf, size_t len);
+
+#endif // VIRTIO_CONSOLE_H
@@ -0,0 +1,1318 @@
+/*
+ * virtio-fs: a host directory shared with Linux guests
+ *
+ * Inodes are O_PATH descriptors found by (st_dev, st_ino), so one host
+ * file keeps one node ID however it was reached. Node IDs index the inode
+ * table; ID 1 is the shared directory itself. File handles index a second
+ * table. Both tables hold pointers to separately allocated entries, so an
+ * entry a request pinned stays put when another queue grows the table.
+ * Both are covered by fs.lock, held only to look entries up.
+ * Entries are reference counted, so a guest that forgets an inode or
+ * releases a handle while another queue is still using it cannot close a
+ * descriptor under that request.
+ *
+ * Workers take the device lock to pop and to push a chain and run the
+ * FUSE operation without it. A device reset bumps fs.generation, and
+ * chains popped before the reset are then dropped instead of pushed.
+ */
+
+#define _GNU_SOURCE // renameat2, fallocate
+#include "virtio_fs.h"
+#include "virtio_mmio.h"
+#include "event_loop.h"
+#include "debug.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <linux/fuse.h>
+
+#define HIPRIO_QUEUE 0
+
+#define FS_ARG_MAX      (2 * PATH_MAX + 64) // Largest request apart from WRITE data
+#define FS_REPLY_MAX    (64 * 1024)         // Largest reply apart from READ data
+#define FS_HASH_SIZE    4096
+#define FS_TIMEOUT_SEC  1                   // Guest caching of entries and attributes
+#define FS_NO_REPLY     INT_MIN             // FORGET, BATCH_FORGET and INTERRUPT
+
+struct virtio_fs_config {
+    char tag[VIRTIO_FS_TAG_MAX];
+    uint32_t num_request_queues;
+    uint32_t notify_buf_size;
+} __attribute__((packed));
+
+struct fs_inode {
+    int fd;            // O_PATH
+    dev_t dev;
+    ino_t ino;
+    uint64_t index;    // Slot in fs.inodes (node ID - 1)
+    uint64_t nlookup;  // References the guest holds
+    uint32_t refs;     // Requests using fd
+    int64_t next;      // Hash chain
+};
+
+struct fs_handle {
+    int fd;
+    DIR *dir;              // OPENDIR handles
+    pthread_mutex_t lock;  // Directory stream position
+    uint32_t refs;
+    bool released;
+};
+
+struct fs_worker {
+    uint32_t queue;
+    pthread_t thread;
+    bool running;
+    int wake_fd;
+    int kick_fd;           // Taken from the transport at DRIVER_OK
+    uint8_t *arg;          // Request arguments, NUL-terminated
+    uint8_t *reply;        // Out header followed by the reply
+    struct virtq_elem elem;
+};
+
+// One request being answered
+struct fs_req {
+    struct fs_worker *w;
+    const struct virtq_elem *elem;
+    struct fuse_in_header in;
+    const uint8_t *arg;
+    size_t arg_len;
+    uint8_t *out;          // Reply body
+    size_t out_size;       // Room the driver left for it
+    size_t out_direct;     // Body bytes already written into the chain (READ)
+};
+
+static struct {
+    virtio_dev_t *dev;
+    struct virtio_fs_config config;
+    pthread_mutex_t lock;
+    uint64_t generation;   // Bumped by device reset
+    bool stopping;
+
+    struct fs_inode **inodes;
+    uint64_t inode_count;  // Slots ever used
+    uint64_t inode_cap;
+    int64_t hash[FS_HASH_SIZE];
+
+    struct fs_handle **handles;
+    uint64_t handle_cap;
+
+    struct fs_worker workers[VIRTIO_FS_MAX_QUEUES + 1];
+
+    uint8_t *dax;          // DAX window (NULL without one)
+    uint64_t dax_size;
+} fs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t iov_size(const struct iovec *iov, unsigned n) {
+    size_t size = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
+// Describe [skip, skip + len) of src in dst; returns the segment count
+static int iov_slice(const struct iovec *src, unsigned n, size_t skip, size_t len, struct iovec *dst) {
+    int count = 0;
+
+    for (unsigned i = 0; i < n && len > 0; i++) {
+        if (skip >= src[i].iov_len) {
+            skip -= src[i].iov_len;
+            continue;
+        }
+        size_t chunk = src[i].iov_len - skip;
+        if (chunk > len) {
+            chunk = len;
+        }
+        dst[count].iov_base = (uint8_t *)src[i].iov_base + skip;
+        dst[count].iov_len = chunk;
+        count++;
+        len -= chunk;
+        skip = 0;
+    }
+    return count;
+}
+
+static void proc_path(int fd, char *buf, size_t size) {
+    snprintf(buf, size, "/proc/self/fd/%d", fd);
+}
+
+/* Inode table */
+
+static uint32_t inode_hash(dev_t dev, ino_t ino) {
+    return (uint32_t)((ino ^ (dev << 7)) * 0x9e3779b97f4a7c15ULL >> 52) % FS_HASH_SIZE;
+}
+
+// Look nodeid up and pin it for the request
+static struct fs_inode *inode_get(uint64_t nodeid) {
+    struct fs_inode *in = NULL;
+
+    pthread_mutex_lock(&fs.lock);
+    if (nodeid >= 1 && nodeid <= fs.inode_count && fs.inodes[nodeid - 1]) {
+        in = fs.inodes[nodeid - 1];
+        in->refs++;
+    }
+    pthread_mutex_unlock(&fs.lock);
+    return in;
+}
+
+// Close an inode nobody references any more (lock held)
+static void inode_maybe_free(struct fs_inode *in) {
+    if (in->nlookup > 0 || in->refs > 0 || in->index == 0) {
+        return;
+    }
+    int64_t *link = &fs.hash[inode_hash(in->dev, in->ino)];
+    while (*link >= 0 && *link != (int64_t)in->index) {
+        link = &fs.inodes[*link]->next;
+    }
+    if (*link >= 0) {
+        *link = in->next;
+    }
+    fs.inodes[in->index] = NULL;
+    close(in->fd);
+    free(in);
+}
+
+static void inode_put(struct fs_inode *in) {
+    pthread_mutex_lock(&fs.lock);
+    in->refs--;
+    inode_maybe_free(in);
+    pthread_mutex_unlock(&fs.lock);
+}
+
+static void inode_forget(uint64_t nodeid, uint64_t nlookup) {
+    pthread_mutex_lock(&fs.lock);
+    if (nodeid > 1 && nodeid <= fs.inode_count && fs.inodes[nodeid - 1]) {
+        struct fs_inode *in = fs.inodes[nodeid - 1];
+        in->nlookup = nlookup < in->nlookup ? in->nlookup - nlookup : 0;
+        inode_maybe_free(in);
+    }
+    pthread_mutex_unlock(&fs.lock);
+}
+
+// Add one guest reference to the inode of fd; takes ownership of fd
+static int64_t inode_lookup_add(int fd, const struct stat *st) {
+    uint32_t bucket = inode_hash(st->st_dev, st->st_ino);
+    int64_t index;
+
+    pthread_mutex_lock(&fs.lock);
+    for (index = fs.hash[bucket]; index >= 0; index = fs.inodes[index]->next) {
+        if (fs.inodes[index]->dev == st->st_dev && fs.inodes[index]->ino == st->st_ino) {
+            fs.inodes[index]->nlookup++;
+            pthread_mutex_unlock(&fs.lock);
+            close(fd);
+            return index + 1;
+        }
+    }
+
+    struct fs_inode *in = calloc(1, sizeof(*in));
+    if (!in) {
+        pthread_mutex_unlock(&fs.lock);
+        close(fd);
+        return -ENOMEM;
+    }
+    for (index = 0; index < (int64_t)fs.inode_count && fs.inodes[index]; index++) {
+    }
+    if (index == (int64_t)fs.inode_count) {
+        if (fs.inode_count == fs.inode_cap) {
+            uint64_t cap = fs.inode_cap ? fs.inode_cap * 2 : 1024;
+            struct fs_inode **grown = realloc(fs.inodes, cap * sizeof(*grown));
+            if (!grown) {
+                pthread_mutex_unlock(&fs.lock);
+                free(in);
+                close(fd);
+                return -ENOMEM;
+            }
+            fs.inodes = grown;
+            fs.inode_cap = cap;
+        }
+        fs.inode_count++;
+    }
+    fs.inodes[index] = in;
+    in->fd = fd;
+    in->dev = st->st_dev;
+    in->ino = st->st_ino;
+    in->index = (uint64_t)index;
+    in->nlookup = 1;
+    in->next = fs.hash[bucket];
+    fs.hash[bucket] = index;
+    pthread_mutex_unlock(&fs.lock);
+    return index + 1;
+}
+
+/* Handle table */
+
+static int64_t handle_new(int fd, DIR *dir) {
+    struct fs_handle *h = calloc(1, sizeof(*h));
+    uint64_t fh;
+
+    if (!h) {
+        return -ENOMEM;
+    }
+    h->fd = fd;
+    h->dir = dir;
+    pthread_mutex_init(&h->lock, NULL);
+
+    pthread_mutex_lock(&fs.lock);
+    for (fh = 0; fh < fs.handle_cap && fs.handles[fh]; fh++) {
+    }
+    if (fh == fs.handle_cap) {
+        uint64_t cap = fs.handle_cap ? fs.handle_cap * 2 : 256;
+        struct fs_handle **grown = realloc(fs.handles, cap * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&fs.lock);
+            free(h);
+            return -ENOMEM;
+        }
+        memset(grown + fs.handle_cap, 0, (cap - fs.handle_cap) * sizeof(*grown));
+        fs.handles = grown;
+        fs.handle_cap = cap;
+    }
+    fs.handles[fh] = h;
+    pthread_mutex_unlock(&fs.lock);
+    return (int64_t)fh;
+}
+
+static struct fs_handle *handle_get(uint64_t fh) {
+    struct fs_handle *h = NULL;
+
+    pthread_mutex_lock(&fs.lock);
+    if (fh < fs.handle_cap && fs.handles[fh] && !fs.handles[fh]->released) {
+        h = fs.handles[fh];
+        h->refs++;
+    }
+    pthread_mutex_unlock(&fs.lock);
+    return h;
+}
+
+static void handle_free(struct fs_handle *h) {
+    if (h->dir) {
+        closedir(h->dir);
+    } else {
+        close(h->fd);
+    }
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+static void handle_put(struct fs_handle *h) {
+    pthread_mutex_lock(&fs.lock);
+    bool last = --h->refs == 0 && h->released;
+    pthread_mutex_unlock(&fs.lock);
+    if (last) {
+        handle_free(h);
+    }
+}
+
+// Drop the guest's handle (lock held); closed once no request uses it
+static struct fs_handle *handle_release_locked(uint64_t fh) {
+    struct fs_handle *h = NULL;
+
+    if (fh < fs.handle_cap && fs.handles[fh]) {
+        h = fs.handles[fh];
+        fs.handles[fh] = NULL;
+        h->released = true;
+        if (h->refs > 0) {
+            h = NULL;
+        }
+    }
+    return h;
+}
+
+static void handle_release(uint64_t fh) {
+    pthread_mutex_lock(&fs.lock);
+    struct fs_handle *h = handle_release_locked(fh);
+    pthread_mutex_unlock(&fs.lock);
+    if (h) {
+        handle_free(h);
+    }
+}
+
+// Forget everything the guest knew (reset and FUSE_DESTROY)
+static void forget_all(void) {
+    pthread_mutex_lock(&fs.lock);
+    for (uint64_t fh = 0; fh < fs.handle_cap; fh++) {
+        struct fs_handle *h = handle_release_locked(fh);
+        if (h) {
+            handle_free(h);
+        }
+    }
+    for (uint64_t i = 1; i < fs.inode_count; i++) {
+        if (fs.inodes[i]) {
+            fs.inodes[i]->nlookup = 0;
+            inode_maybe_free(fs.inodes[i]);
+        }
+    }
+    pthread_mutex_unlock(&fs.lock);
+
+    if (fs.dax && mmap(fs.dax, fs.dax_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                       -1, 0) == MAP_FAILED) {
+        perror("mmap virtio-fs DAX window");
+    }
+}
+
+/* FUSE operations: return the reply length, or -errno */
+
+#define ARG(type, var)                            \
+    const type *var = (const type *)r->arg;       \
+    if (r->arg_len < sizeof(type)) {              \
+        return -EINVAL;                           \
+    }
+
+static void fill_attr(struct fuse_attr *attr, const struct stat *st) {
+    memset(attr, 0, sizeof(*attr));
+    attr->ino = st->st_ino;
+    attr->size = (uint64_t)st->st_size;
+    attr->blocks = (uint64_t)st->st_blocks;
+    attr->atime = (uint64_t)st->st_atim.tv_sec;
+    attr->mtime = (uint64_t)st->st_mtim.tv_sec;
+    attr->ctime = (uint64_t)st->st_ctim.tv_sec;
+    attr->atimensec = (uint32_t)st->st_atim.tv_nsec;
+    attr->mtimensec = (uint32_t)st->st_mtim.tv_nsec;
+    attr->ctimensec = (uint32_t)st->st_ctim.tv_nsec;
+    attr->mode = st->st_mode;
+    attr->nlink = (uint32_t)st->st_nlink;
+    attr->uid = st->st_uid;
+    attr->gid = st->st_gid;
+    attr->rdev = (uint32_t)st->st_rdev;
+    attr->blksize = (uint32_t)st->st_blksize;
+}
+
+static int stat_fd(int fd, struct stat *st) {
+    return fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0 ? -errno : 0;
+}
+
+static bool valid_name(const char *name) {
+    return name[0] && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && !strchr(name, '/');
+}
+
+// Look name up in parent and fill an entry reply; adds a guest reference
+static int do_lookup(int parent_fd, const char *name, struct fuse_entry_out *entry) {
+    struct stat st;
+
+    if (!valid_name(name)) {
+        return -EPERM;
+    }
+    int fd = openat(parent_fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    int err = stat_fd(fd, &st);
+    if (err < 0) {
+        close(fd);
+        return err;
+    }
+    int64_t nodeid = inode_lookup_add(fd, &st);
+    if (nodeid < 0) {
+        return (int)nodeid;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->nodeid = (uint64_t)nodeid;
+    entry->entry_valid = FS_TIMEOUT_SEC;
+    entry->attr_valid = FS_TIMEOUT_SEC;
+    fill_attr(&entry->attr, &st);
+    return sizeof(*entry);
+}
+
+static int fs_init(struct fs_req *r) {
+    const struct fuse_init_in *in = (const struct fuse_init_in *)r->arg;
+    struct fuse_init_out *out = (struct fuse_init_out *)r->out;
+    uint32_t wanted = FUSE_ASYNC_READ | FUSE_ATOMIC_O_TRUNC | FUSE_BIG_WRITES | FUSE_AUTO_INVAL_DATA |
+                      FUSE_PARALLEL_DIROPS;
+
+    // Drivers before 7.36 send only the first four fields
+    if (r->arg_len < offsetof(struct fuse_init_in, flags2)) {
+        return -EINVAL;
+    }
+    if (in->major != FUSE_KERNEL_VERSION || in->minor < 27) {
+        fprintf(stderr, "virtio-fs: unsupported FUSE protocol %u.%u\n", in->major, in->minor);
+        return -EPROTO;
+    }
+    if (fs.dax) {
+        wanted |= FUSE_MAP_ALIGNMENT;
+    }
+    forget_all();
+
+    memset(out, 0, sizeof(*out));
+    out->major = FUSE_KERNEL_VERSION;
+    out->minor = in->minor < FUSE_KERNEL_MINOR_VERSION ? in->minor : FUSE_KERNEL_MINOR_VERSION;
+    out->max_readahead = in->max_readahead;
+    out->flags = in->flags & wanted;
+    out->max_background = 64;
+    out->congestion_threshold = 48;
+    out->max_write = VIRTIO_FS_MAX_WRITE;
+    out->time_gran = 1;
+    out->map_alignment = 12; // DAX file offsets are page aligned
+    DEBUG_PRINT(DEBUG_BASIC, "virtio-fs: FUSE %u.%u, flags 0x%x", out->major, out->minor, out->flags);
+    return sizeof(*out);
+}
+
+static int fs_lookup(struct fs_req *r, struct fs_inode *in) {
+    return do_lookup(in->fd, (const char *)r->arg, (struct fuse_entry_out *)r->out);
+}
+
+static int fs_forget(struct fs_req *r) {
+    ARG(struct fuse_forget_in, in);
+    inode_forget(r->in.nodeid, in->nlookup);
+    return FS_NO_REPLY;
+}
+
+static int fs_batch_forget(struct fs_req *r) {
+    ARG(struct fuse_batch_forget_in, in);
+    const struct fuse_forget_one *one = (const struct fuse_forget_one *)(in + 1);
+
+    for (uint32_t i = 0; i < in->count && (const uint8_t *)(one + i + 1) <= r->arg + r->arg_len; i++) {
+        inode_forget(one[i].nodeid, one[i].nlookup);
+    }
+    return FS_NO_REPLY;
+}
+
+static int attr_reply(struct fs_req *r, int fd) {
+    struct fuse_attr_out *out = (struct fuse_attr_out *)r->out;
+    struct stat st;
+    int err = stat_fd(fd, &st);
+
+    if (err < 0) {
+        return err;
+    }
+    memset(out, 0, sizeof(*out));
+    out->attr_valid = FS_TIMEOUT_SEC;
+    fill_attr(&out->attr, &st);
+    return sizeof(*out);
+}
+
+static int fs_getattr(struct fs_req *r, struct fs_inode *in) {
+    return attr_reply(r, in->fd);
+}
+
+static int fs_setattr(struct fs_req *r, struct fs_inode *in) {
+    ARG(struct fuse_setattr_in, sa);
+    char path[64];
+    struct stat st;
+    int err = stat_fd(in->fd, &st);
+
+    if (err < 0) {
+        return err;
+    }
+    // Through /proc a symlink would be followed: only ownership applies to it
+    if (S_ISLNK(st.st_mode) && (sa->valid & (FATTR_MODE | FATTR_SIZE | FATTR_ATIME | FATTR_MTIME))) {
+        return -EPERM;
+    }
+    proc_path(in->fd, path, sizeof(path));
+
+    if ((sa->valid & FATTR_MODE) && chmod(path, sa->mode & 07777) < 0) {
+        return -errno;
+    }
+    if (sa->valid & (FATTR_UID | FATTR_GID)) {
+        uid_t uid = (sa->valid & FATTR_UID) ? sa->uid : (uid_t)-1;
+        gid_t gid = (sa->valid & FATTR_GID) ? sa->gid : (gid_t)-1;
+        if (fchownat(in->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+            return -errno;
+        }
+    }
+    if (sa->valid & FATTR_SIZE) {
+        struct fs_handle *h = (sa->valid & FATTR_FH) ? handle_get(sa->fh) : NULL;
+        int ret = h ? ftruncate(h->fd, (off_t)sa->size) : truncate(path, (off_t)sa->size);
+        if (h) {
+            handle_put(h);
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+    }
+    if (sa->valid & (FATTR_ATIME | FATTR_MTIME)) {
+        struct timespec ts[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_nsec = UTIME_OMIT } };
+        if (sa->valid & FATTR_ATIME) {
+            ts[0].tv_sec = (time_t)sa->atime;
+            ts[0].tv_nsec = (sa->valid & FATTR_ATIME_NOW) ? UTIME_NOW : sa->atimensec;
+        }
+        if (sa->valid & FATTR_MTIME) {
+            ts[1].tv_sec = (time_t)sa->mtime;
+            ts[1].tv_nsec = (sa->valid & FATTR_MTIME_NOW) ? UTIME_NOW : sa->mtimensec;
+        }
+        if (utimensat(AT_FDCWD, path, ts, 0) < 0) {
+            return -errno;
+        }
+    }
+    return attr_reply(r, in->fd);
+}
+
+static int fs_readlink(struct fs_req *r, struct fs_inode *in) {
+    ssize_t n = readlinkat(in->fd, "", (char *)r->out, r->out_size);
+    return n < 0 ? -errno : (int)n;
+}
+
+// Finish a create-style operation with a lookup of what it made
+static int created(struct fs_req *r, struct fs_inode *parent, const char *name, int ret) {
+    if (ret < 0) {
+        return -errno;
+    }
+    return do_lookup(parent->fd, name, (struct fuse_entry_out *)r->out);
+}
+
+static int fs_mknod(struct fs_req *r, struct fs_inode *in) {
+    ARG(struct fuse_mknod_in, mk);
+    const char *name = (const char *)(mk + 1);
+
+    if (!valid_name(name)) {
+        return -EPERM;
+    }
+    return created(r, in, name, mknodat(in->fd, name, mk->mode, mk->rdev));
+}
+
+static int fs_mkdir(struct fs_req *r, struct fs_inode *in) {
+    ARG(struct fuse_mkdir_in, mk);
+    const char *name = (const char *)(mk + 1);
+
+    if (!valid_name(name)) {
+        return -EPERM;
+    }
+    return created(r, in, name, mkdirat(in->fd, name, mk->mode));
+}
+
+static int fs_symlink(struct fs_req *r, struct fs_inode *in) {
+    const char *name = (const char *)r->arg;
+    const char *target = name + strlen(name) + 1;
+
+    if (!valid_name(name) || target >= (const char *)r->arg + r->arg_len) {
+        return -EINVAL;
+    }
+    return created(r, in, name, symlinkat(target, in->fd, name));
+}
+
+static int fs_link(struct fs_req *r, struct fs_inode *in) {
+    ARG(struct fuse_link_in, ln);
+    const char *name = (const char *)(ln + 1);
+    char path[64];
+
+    if (!valid_name(name)) {
+        return -EPERM;
+    }
+    struct fs_inode *old = inode_get(ln->oldnodeid);
+    if (!old) {
+        return -ESTALE;
+    }
+    proc_path(old->fd, path, sizeof(path));
+    int ret = linkat(AT_FDCWD, path, in->fd, name, AT_SYMLINK_FOLLOW);
+    inode_put(old);
+    return created(r, in, name, ret);
+}
+
+static int fs_unlink(struct fs_req *r, struct fs_inode *in, int flags) {
+    const char *name = (const char *)r->arg;
+
+    if (!valid_name(name)) {
+        return -EPERM;
+    }
+    return unlinkat(in->fd, name, flags) < 0 ? -errno : 0;
+}
+
+static int fs_rename(struct fs_req *r, struct fs_inode *in, uint64_t newdir, uint32_t flags, size_t skip) {
+    const char *oldname = (const char *)r->arg + skip;
+    const char *newname = oldname + strlen(oldname) + 1;
+
+    if (r->arg_len <= skip || newname >= (const char *)r->arg + r->arg_len || !valid_name(oldname) ||
+        !valid_name(newname)) {
+        return -EINVAL;
+    }
+    struct fs_inode *dst = inode_get(newdir);
+    if (!dst) {
+        return -ESTALE;
+    }
+    int ret = renameat2(in->fd, oldname, dst->fd, newname, flags) < 0 ? -errno : 0;
+    inode_put(dst);
+    return ret;
+}
+
+static int open_reply(struct fs_req *r, int fd, size_t offset) {
+    struct fuse_open_out *out = (struct fuse_open_out *)(r->out + offset);
+    int64_t fh = handle_new(fd, NULL);
+
+    if (fh < 0) {
+        close(fd);
+        return (int)fh;
+    }
+    memset(out, 0, sizeof(*out));
+    out->fh = (uint64_t)fh;
+    return (int)(offset + sizeof(*out));
+}
+
+static int fs_open(struct fs_req *r, struct fs_inode *in) {
+    ARG(struct fuse_open_in, op);
+    char path[64];
+    struct stat st;
+    int err = stat_fd(in->fd, &st);
+
+    if (err < 0) {
+        return err;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        return -ELOOP;
+    }
+    proc_path(in->fd, path, sizeof(path));
+    int fd = open(path, (int)(op->flags & ~(uint32_t)(O_CREAT | O_EXCL | O_NOCTTY)) | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    return open_reply(r, fd, 0);
+}
+
+static int fs_create(struct fs_req *r, struct fs_inode *in) {
+    ARG(struct fuse_create_in, cr);
+    const char *name = (const char *)(cr + 1);
+
+    if (!valid_name(name)) {
+        return -EPERM;
+    }
+    int fd = openat(in->fd, name, (int)cr->flags | O_CREAT | O_NOFOLLOW | O_CLOEXEC, cr->mode);
+    if (fd < 0) {
+        return -errno;
+    }
+    int ret = do_lookup(in->fd, name, (struct fuse_entry_out *)r->out);
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+    return open_reply(r, fd, sizeof(struct fuse_entry_out));
+}
+
+static int fs_read(struct fs_req *r) {
+    ARG(struct fuse_read_in, rd);
+    const struct virtq_elem *elem = r->elem;
+    struct iovec iov[VIRTQ_MAX_SEGS];
+    size_t len = rd->size < r->out_size ? rd->size : r->out_size;
+
+    struct fs_handle *h = handle_get(rd->fh);
+    if (!h) {
+        return -EBADF;
+    }
+    // Straight from the file into the guest's pages
+    int niov = iov_slice(elem->iov + elem->out_num, elem->in_num, sizeof(struct fuse_out_header), len, iov);
+    ssize_t n = preadv(h->fd, iov, niov, (off_t)rd->offset);
+    int err = n < 0 ? -errno : 0;
+    handle_put(h);
+    if (err < 0) {
+        return err;
+    }
+    r->out_direct = (size_t)n;
+    return 0;
+}
+
+static int fs_write(struct fs_req *r) {
+    ARG(struct fuse_write_in, wr);
+    const struct virtq_elem *elem = r->elem;
+    struct fuse_write_out *out = (struct fuse_write_out *)r->out;
+    struct iovec iov[VIRTQ_MAX_SEGS];
+    size_t skip = sizeof(struct fuse_in_header) + sizeof(*wr);
+    size_t avail = iov_size(elem->iov, elem->out_num) - skip;
+    size_t len = wr->size < avail ? wr->size : avail;
+
+    struct fs_handle *h = handle_get(wr->fh);
+    if (!h) {
+        return -EBADF;
+    }
+    int niov = iov_slice(elem->iov, elem->out_num, skip, len, iov);
+    ssize_t n = pwritev(h->fd, iov, niov, (off_t)wr->offset);
+    int err = n < 0 ? -errno : 0;
+    handle_put(h);
+    if (err < 0) {
+        return err;
+    }
+    memset(out, 0, sizeof(*out));
+    out->size = (uint32_t)n;
+    return sizeof(*out);
+}
+
+static int fs_statfs(struct fs_req *r, struct fs_inode *in) {
+    struct fuse_statfs_out *out = (struct fuse_statfs_out *)r->out;
+    struct statvfs sv;
+
+    if (fstatvfs(in->fd, &sv) < 0) {
+        return -errno;
+    }
+    memset(out, 0, sizeof(*out));
+    out->st.blocks = sv.f_blocks;
+    out->st.bfree = sv.f_bfree;
+    out->st.bavail = sv.f_bavail;
+    out->st.files = sv.f_files;
+    out->st.ffree = sv.f_ffree;
+    out->st.bsize = (uint32_t)sv.f_bsize;
+    out->st.namelen = (uint32_t)sv.f_namemax;
+    out->st.frsize = (uint32_t)sv.f_frsize;
+    return sizeof(*out);
+}
+
+static int fs_release(struct fs_req *r) {
+    ARG(struct fuse_release_in, rel);
+    handle_release(rel->fh);
+    return 0;
+}
+
+static int fs_fsync(struct fs_req *r) {
+    ARG(struct fuse_fsync_in, fsy);
+    struct fs_handle *h = handle_get(fsy->fh);
+
+    if (!h) {
+        return -EBADF;
+    }
+    int ret = ((fsy->fsync_flags & 1) ? fdatasync(h->fd) : fsync(h->fd)) < 0 ? -errno : 0;
+    handle_put(h);
+    return ret;
+}
+
+static int fs_opendir(struct fs_req *r, struct fs_inode *in) {
+    int fd = openat(in->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    int64_t fh = handle_new(fd, dir);
+    if (fh < 0) {
+        closedir(dir);
+        return (int)fh;
+    }
+    struct fuse_open_out *out = (struct fuse_open_out *)r->out;
+    memset(out, 0, sizeof(*out));
+    out->fh = (uint64_t)fh;
+    return sizeof(*out);
+}
+
+static int fs_readdir(struct fs_req *r) {
+    ARG(struct fuse_read_in, rd);
+    size_t size = rd->size < r->out_size ? rd->size : r->out_size;
+    size_t len = 0;
+
+    struct fs_handle *h = handle_get(rd->fh);
+    if (!h || !h->dir) {
+        if (h) {
+            handle_put(h);
+        }
+        return -EBADF;
+    }
+    pthread_mutex_lock(&h->lock);
+    if (rd->offset == 0) {
+        rewinddir(h->dir);
+    } else {
+        seekdir(h->dir, (long)rd->offset);
+    }
+    for (;;) {
+        long pos = telldir(h->dir);
+        errno = 0;
+        struct dirent *de = readdir(h->dir);
+        if (!de) {
+            break;
+        }
+        size_t namelen = strlen(de->d_name);
+        size_t reclen = FUSE_DIRENT_SIZE(&(struct fuse_dirent){ .namelen = (uint32_t)namelen });
+        if (len + reclen > size) {
+            seekdir(h->dir, pos); // Next call starts here
+            break;
+        }
+        struct fuse_dirent *fde = (struct fuse_dirent *)(r->out + len);
+        fde->ino = de->d_ino;
+        fde->off = (uint64_t)telldir(h->dir);
+        fde->namelen = (uint32_t)namelen;
+        fde->type = de->d_type;
+        memcpy(fde->name, de->d_name, namelen);
+        memset(fde->name + namelen, 0, reclen - FUSE_NAME_OFFSET - namelen);
+        len += reclen;
+    }
+    int err = errno;
+    pthread_mutex_unlock(&h->lock);
+    handle_put(h);
+    return len == 0 && err ? -err : (int)len;
+}
+
+static int fs_access(struct fs_req *r, struct fs_inode *in) {
+    ARG(struct fuse_access_in, ac);
+    char path[64];
+
+    proc_path(in->fd, path, sizeof(path));
+    return faccessat(AT_FDCWD, path, (int)ac->mask, 0) < 0 ? -errno : 0;
+}
+
+static int fs_fallocate(struct fs_req *r) {
+    ARG(struct fuse_fallocate_in, fa);
+    struct fs_handle *h = handle_get(fa->fh);
+
+    if (!h) {
+        return -EBADF;
+    }
+    int ret = fallocate(h->fd, (int)fa->mode, (off_t)fa->offset, (off_t)fa->length) < 0 ? -errno : 0;
+    handle_put(h);
+    return ret;
+}
+
+static int fs_lseek(struct fs_req *r) {
+    ARG(struct fuse_lseek_in, ls);
+    struct fuse_lseek_out *out = (struct fuse_lseek_out *)r->out;
+    struct fs_handle *h = handle_get(ls->fh);
+
+    if (!h) {
+        return -EBADF;
+    }
+    off_t off = lseek(h->fd, (off_t)ls->offset, (int)ls->whence);
+    int err = off < 0 ? -errno : 0;
+    handle_put(h);
+    if (err < 0) {
+        return err;
+    }
+    out->offset = (uint64_t)off;
+    return sizeof(*out);
+}
+
+// Map a file range into the DAX window
+static int fs_setupmapping(struct fs_req *r) {
+    ARG(struct fuse_setupmapping_in, map);
+    int prot = PROT_READ;
+
+    if (!fs.dax || map->moffset > fs.dax_size || map->len > fs.dax_size - map->moffset ||
+        (map->moffset | map->foffset | map->len) & ((uint64_t)getpagesize() - 1)) {
+        return -EINVAL;
+    }
+    if (map->flags & FUSE_SETUPMAPPING_FLAG_WRITE) {
+        prot |= PROT_WRITE;
+    }
+    struct fs_handle *h = handle_get(map->fh);
+    if (!h) {
+        return -EBADF;
+    }
+    void *addr = mmap(fs.dax + map->moffset, map->len, prot, MAP_SHARED | MAP_FIXED, h->fd, (off_t)map->foffset);
+    int err = addr == MAP_FAILED ? -errno : 0;
+    handle_put(h);
+    return err;
+}
+
+static int fs_removemapping(struct fs_req *r) {
+    ARG(struct fuse_removemapping_in, rm);
+    const struct fuse_removemapping_one *one = (const struct fuse_removemapping_one *)(rm + 1);
+
+    if (!fs.dax) {
+        return -EINVAL;
+    }
+    for (uint32_t i = 0; i < rm->count; i++) {
+        if ((const uint8_t *)(one + i + 1) > r->arg + r->arg_len) {
+            return -EINVAL;
+        }
+        if (one[i].moffset > fs.dax_size || one[i].len > fs.dax_size - one[i].moffset) {
+            return -EINVAL;
+        }
+        // Back to an inaccessible hole
+        if (mmap(fs.dax + one[i].moffset, one[i].len, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+// Operations on the inode named by the header
+static int dispatch_inode(struct fs_req *r, struct fs_inode *in) {
+    switch (r->in.opcode) {
+    case FUSE_LOOKUP:
+        return fs_lookup(r, in);
+    case FUSE_GETATTR:
+        return fs_getattr(r, in);
+    case FUSE_SETATTR:
+        return fs_setattr(r, in);
+    case FUSE_READLINK:
+        return fs_readlink(r, in);
+    case FUSE_SYMLINK:
+        return fs_symlink(r, in);
+    case FUSE_MKNOD:
+        return fs_mknod(r, in);
+    case FUSE_MKDIR:
+        return fs_mkdir(r, in);
+    case FUSE_UNLINK:
+        return fs_unlink(r, in, 0);
+    case FUSE_RMDIR:
+        return fs_unlink(r, in, AT_REMOVEDIR);
+    case FUSE_RENAME: {
+        ARG(struct fuse_rename_in, rn);
+        return fs_rename(r, in, rn->newdir, 0, sizeof(*rn));
+    }
+    case FUSE_RENAME2: {
+        ARG(struct fuse_rename2_in, rn);
+        return fs_rename(r, in, rn->newdir, rn->flags, sizeof(*rn));
+    }
+    case FUSE_LINK:
+        return fs_link(r, in);
+    case FUSE_OPEN:
+        return fs_open(r, in);
+    case FUSE_STATFS:
+        return fs_statfs(r, in);
+    case FUSE_OPENDIR:
+        return fs_opendir(r, in);
+    case FUSE_ACCESS:
+        return fs_access(r, in);
+    case FUSE_CREATE:
+        return fs_create(r, in);
+    default:
+        return -ENOSYS;
+    }
+}
+
+static int dispatch(struct fs_req *r) {
+    switch (r->in.opcode) {
+    case FUSE_INIT:
+        return fs_init(r);
+    case FUSE_DESTROY:
+        forget_all();
+        return 0;
+    case FUSE_FORGET:
+        return fs_forget(r);
+    case FUSE_BATCH_FORGET:
+        return fs_batch_forget(r);
+    case FUSE_INTERRUPT:
+        return FS_NO_REPLY; // Requests are never blocked on anything interruptible
+    case FUSE_READ:
+        return fs_read(r);
+    case FUSE_WRITE:
+        return fs_write(r);
+    case FUSE_RELEASE:
+    case FUSE_RELEASEDIR:
+        return fs_release(r);
+    case FUSE_FSYNC:
+    case FUSE_FSYNCDIR:
+        return fs_fsync(r);
+    case FUSE_FLUSH:
+        return 0;
+    case FUSE_READDIR:
+        return fs_readdir(r);
+    case FUSE_FALLOCATE:
+        return fs_fallocate(r);
+    case FUSE_LSEEK:
+        return fs_lseek(r);
+    case FUSE_SETUPMAPPING:
+        return fs_setupmapping(r);
+    case FUSE_REMOVEMAPPING:
+        return fs_removemapping(r);
+    default: {
+        struct fs_inode *in = inode_get(r->in.nodeid);
+        if (!in) {
+            return -ESTALE;
+        }
+        int ret = dispatch_inode(r, in);
+        inode_put(in);
+        return ret;
+    }
+    }
+}
+
+// Answer one chain; returns the bytes written into it
+static uint32_t handle_request(struct fs_worker *w, const struct virtq_elem *elem) {
+    struct fuse_out_header *out = (struct fuse_out_header *)w->reply;
+    struct fs_req r;
+
+    memset(&r, 0, sizeof(r));
+    r.w = w;
+    r.elem = elem;
+    size_t out_total = iov_size(elem->iov, elem->out_num);
+    size_t in_total = iov_size(elem->iov + elem->out_num, elem->in_num);
+    if (virtq_iov_to_buf(elem->iov, elem->out_num, 0, &r.in, sizeof(r.in)) != sizeof(r.in) ||
+        in_total < sizeof(*out)) {
+        return 0;
+    }
+
+    // WRITE data stays in the chain; everything else is small enough to copy
+    size_t arg_len = out_total - sizeof(r.in);
+    if (r.in.opcode == FUSE_WRITE && arg_len > sizeof(struct fuse_write_in)) {
+        arg_len = sizeof(struct fuse_write_in);
+    }
+    if (arg_len > FS_ARG_MAX) {
+        arg_len = FS_ARG_MAX;
+    }
+    r.arg_len = virtq_iov_to_buf(elem->iov, elem->out_num, sizeof(r.in), w->arg, arg_len);
+    w->arg[r.arg_len] = '\0';
+    r.arg = w->arg;
+    r.out = w->reply + sizeof(*out);
+    r.out_size = in_total - sizeof(*out);
+    if (r.in.opcode != FUSE_READ && r.out_size > FS_REPLY_MAX) {
+        r.out_size = FS_REPLY_MAX;
+    }
+
+    int ret = dispatch(&r);
+    if (ret == FS_NO_REPLY) {
+        return 0;
+    }
+    size_t body = ret > 0 ? (size_t)ret : 0;
+    out->len = (uint32_t)(sizeof(*out) + body + r.out_direct);
+    out->error = ret < 0 ? ret : 0;
+    out->unique = r.in.unique;
+    if (ret < 0) {
+        out->len = sizeof(*out);
+        r.out_direct = 0;
+    }
+    if (ret < 0 && ret != -ENOENT && ret != -ENOSYS) {
+        DEBUG_PRINT(DEBUG_DETAILED, "virtio-fs: opcode %u on node %llu failed: %s", r.in.opcode,
+                    (unsigned long long)r.in.nodeid, strerror(-ret));
+    }
+    virtq_buf_to_iov(elem->iov + elem->out_num, elem->in_num, 0, w->reply, sizeof(*out) + body);
+    return out->len;
+}
+
+/* Queues */
+
+// Drain one request queue on its worker thread
+static void drain_queue(struct fs_worker *w) {
+    struct virtq *vq = virtio_dev_queue(fs.dev, w->queue);
+
+    for (;;) {
+        virtio_dev_lock(fs.dev);
+        if (!virtio_dev_driver_ok(fs.dev) || !vq->ready) {
+            virtio_dev_unlock(fs.dev);
+            return;
+        }
+        virtq_set_notify(vq, false);
+        int ret = virtq_pop(vq, &w->elem);
+        if (ret == 0 && virtq_set_notify(vq, true)) {
+            ret = virtq_pop(vq, &w->elem);
+        }
+        uint64_t generation = fs.generation;
+        virtio_dev_unlock(fs.dev);
+        if (ret <= 0) {
+            return;
+        }
+
+        uint32_t len = handle_request(w, &w->elem);
+
+        virtio_dev_lock(fs.dev);
+        if (generation == fs.generation) {
+            virtq_push(vq, &w->elem, len);
+            virtio_dev_notify_used(fs.dev, vq);
+        }
+        virtio_dev_unlock(fs.dev);
+    }
+}
+
+static void *worker_main(void *opaque) {
+    struct fs_worker *w = opaque;
+    uint64_t count;
+
+    while (!__atomic_load_n(&fs.stopping, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd[2] = { { .fd = w->wake_fd, .events = POLLIN },
+                                 { .fd = __atomic_load_n(&w->kick_fd, __ATOMIC_ACQUIRE), .events = POLLIN } };
+
+        if (poll(pfd, pfd[1].fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll virtio-fs");
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (pfd[i].fd >= 0 && read(pfd[i].fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("read virtio-fs eventfd");
+            }
+        }
+        drain_queue(w);
+    }
+    return NULL;
+}
+
+static void wake(struct fs_worker *w) {
+    uint64_t one = 1;
+
+    if (write(w->wake_fd, &one, sizeof(one)) < 0) {
+        perror("write virtio-fs wake");
+    }
+}
+
+// High-priority queue: FORGETs, answered on the event loop
+static void hiprio_process(virtio_dev_t *dev) {
+    struct fs_worker *w = &fs.workers[HIPRIO_QUEUE];
+    struct virtq *vq = virtio_dev_queue(dev, HIPRIO_QUEUE);
+    int ret = 0;
+
+    do {
+        virtq_set_notify(vq, false);
+        while ((ret = virtq_pop(vq, &w->elem)) > 0) {
+            virtq_push(vq, &w->elem, handle_request(w, &w->elem));
+        }
+        if (ret < 0) {
+            return;
+        }
+    } while (virtq_set_notify(vq, true));
+    virtio_dev_notify_used(dev, vq);
+}
+
+static void fs_queue_notify(virtio_dev_t *dev, uint32_t queue) {
+    if (queue == HIPRIO_QUEUE) {
+        hiprio_process(dev);
+    } else {
+        wake(&fs.workers[queue]); // A kick that exited to userspace
+    }
+}
+
+static void fs_driver_ok(virtio_dev_t *dev) {
+    // Workers wait on the kicks themselves from now on
+    for (uint32_t q = 1; q <= fs.config.num_request_queues; q++) {
+        struct fs_worker *w = &fs.workers[q];
+        if (w->kick_fd < 0) {
+            __atomic_store_n(&w->kick_fd, virtio_dev_take_kick(dev, q), __ATOMIC_RELEASE);
+        }
+        wake(w);
+    }
+}
+
+static void fs_reset(virtio_dev_t *dev) {
+    (void)dev;
+    fs.generation++;
+    forget_all();
+}
+
+static virtio_device_ops_t fs_ops = {
+    .name = "virtio-fs",
+    .device_id = VIRTIO_ID_FS,
+    .queue_size = VIRTIO_FS_QUEUE_SIZE,
+    .features = 0,
+    .config_size = sizeof(struct virtio_fs_config),
+    .queue_notify = fs_queue_notify,
+    .driver_ok = fs_driver_ok,
+    .reset = fs_reset,
+};
+
+static int start_worker(struct fs_worker *w, uint32_t queue, bool thread) {
+    w->queue = queue;
+    w->kick_fd = -1;
+    w->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    w->arg = malloc(FS_ARG_MAX + 1);
+    w->reply = malloc(sizeof(struct fuse_out_header) + FS_REPLY_MAX);
+    if (w->wake_fd < 0 || !w->arg || !w->reply) {
+        perror("virtio-fs worker");
+        return -1;
+    }
+    if (thread) {
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            perror("pthread_create virtio-fs");
+            return -1;
+        }
+        w->running = true;
+    }
+    return 0;
+}
+
+int virtio_fs_init(int vm_fd, const char *dir, const char *tag, uint32_t num_queues, uint64_t dax_size) {
+    struct stat st;
+
+    if (num_queues < 1 || num_queues > VIRTIO_FS_MAX_QUEUES) {
+        fprintf(stderr, "virtio-fs: 1-%d request queues are supported\n", VIRTIO_FS_MAX_QUEUES);
+        return -1;
+    }
+    if (strlen(tag) == 0 || strlen(tag) > VIRTIO_FS_TAG_MAX) {
+        fprintf(stderr, "virtio-fs: the tag must be 1-%d bytes\n", VIRTIO_FS_TAG_MAX);
+        return -1;
+    }
+    for (int i = 0; i < FS_HASH_SIZE; i++) {
+        fs.hash[i] = -1;
+    }
+    for (uint32_t q = 0; q <= VIRTIO_FS_MAX_QUEUES; q++) {
+        fs.workers[q].wake_fd = -1;
+        fs.workers[q].kick_fd = -1;
+    }
+
+    // Node 1: the shared directory
+    int root = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root < 0 || stat_fd(root, &st) < 0) {
+        perror(dir);
+        if (root >= 0) {
+            close(root);
+        }
+        return -1;
+    }
+    if (inode_lookup_add(root, &st) != 1) {
+        return -1;
+    }
+
+    if (dax_size) {
+        fs.dax_size = (dax_size + (2 << 20) - 1) & ~(uint64_t)((2 << 20) - 1);
+        fs.dax = mmap(NULL, fs.dax_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (fs.dax == MAP_FAILED) {
+            perror("mmap virtio-fs DAX window");
+            fs.dax = NULL;
+            virtio_fs_cleanup();
+            return -1;
+        }
+    }
+
+    memcpy(fs.config.tag, tag, strlen(tag));
+    fs.config.num_request_queues = num_queues;
+    fs_ops.num_queues = num_queues + 1;
+    fs.dev = virtio_mmio_add(&fs_ops, &fs.config, NULL);
+    if (!fs.dev) {
+        virtio_fs_cleanup();
+        return -1;
+    }
+    if (fs.dax) {
+        uint64_t gpa;
+        if (virtio_map_device_memory(vm_fd, fs.dax, fs.dax_size, &gpa) < 0) {
+            virtio_fs_cleanup();
+            return -1;
+        }
+        virtio_dev_set_shm(fs.dev, VIRTIO_FS_SHM_CACHE, gpa, fs.dax_size);
+    }
+
+    for (uint32_t q = 0; q <= num_queues; q++) {
+        if (start_worker(&fs.workers[q], q, q != HIPRIO_QUEUE) < 0) {
+            virtio_fs_cleanup();
+            return -1;
+        }
+    }
+    printf("virtio-fs: %s as \"%s\" (%u request queues%s)\n", dir, tag, num_queues, fs.dax ? ", DAX" : "");
+    return 0;
+}
+
+void virtio_fs_cleanup(void) {
+    __atomic_store_n(&fs.stopping, true, __ATOMIC_RELEASE);
+    for (uint32_t q = 0; q <= VIRTIO_FS_MAX_QUEUES; q++) {
+        struct fs_worker *w = &fs.workers[q];
+        if (w->running) {
+            wake(w);
+            pthread_join(w->thread, NULL);
+            w->running = false;
+        }
+        if (w->wake_fd >= 0) {
+            close(w->wake_fd);
+            w->wake_fd = -1;
+        }
+        free(w->arg);
+        free(w->reply);
+        w->arg = NULL;
+        w->reply = NULL;
+    }
+
+    forget_all();
+    if (fs.inode_count > 0) {
+        close(fs.inodes[0]->fd);
+        free(fs.inodes[0]);
+    }
+    free(fs.inodes);
+    free(fs.handles);
+    fs.inodes = NULL;
+    fs.inode_count = 0;
+    fs.inode_cap = 0;
+    fs.handles = NULL;
+    fs.handle_cap = 0;
+    if (fs.dax) {
+        munmap(fs.dax, fs.dax_size);
+        fs.dax = NULL;
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * virtio-fs: a host directory shared with Linux guests
+ *
+ * The guest's virtiofs driver sends FUSE requests over virtqueues, and an
+ * in-process FUSE server answers them against the host directory. Guests
+ * mount it with "mount -t virtiofs <tag> /mnt", so there is no image to
+ * rebuild and no network filesystem to set up.
+ *
+ * Every request queue has a worker thread that waits on the queue's kick
+ * eventfd directly. Requests on different queues run in parallel, and the
+ * guest spreads them across queues by CPU. The high-priority queue only
+ * carries FORGET and INTERRUPT, and is served on the event loop. READ and
+ * WRITE payloads move between the file and guest RAM with one preadv() or
+ * pwritev() and are never copied.
+ *
+ * With a DAX window (--virtiofs-dax) the guest can also mount with -o dax.
+ * The window is a KVM memory slot that file ranges are mmap()ed into on
+ * FUSE_SETUPMAPPING. Guest reads and writes of those files then become
+ * plain loads and stores to the host page cache.
+ *
+ * Files are accessed with the VMM's own credentials: the guest's uid/gid
+ * are not applied. Symlinks are resolved by the guest, and lookups of "."
+ * and ".." are refused, so requests stay inside the shared directory.
+ */
+
+#ifndef VIRTIO_FS_H
+#define VIRTIO_FS_H
+
+#include <stdint.h>
+
+#define VIRTIO_FS_TAG_MAX        36
+#define VIRTIO_FS_DEFAULT_TAG    "hostfs"
+#define VIRTIO_FS_QUEUE_SIZE     128
+#define VIRTIO_FS_MAX_QUEUES     7     // Request queues (plus the high-priority one)
+#define VIRTIO_FS_MAX_WRITE      (128 * 1024) // 32 pages: one request fits VIRTQ_MAX_SEGS
+#define VIRTIO_FS_SHM_CACHE      0     // Shared memory region id of the DAX window
+
+// Share dir under tag with num_queues request queues; dax_size (bytes, 0 for
+// none) sizes the DAX window registered through vm_fd
+int virtio_fs_init(int vm_fd, const char *dir, const char *tag, uint32_t num_queues, uint64_t dax_size);
+
+// Stop the workers and close everything (vCPUs must be stopped)
+void virtio_fs_cleanup(void);
+
+#endif // VIRTIO_FS_H
@@ -0,0 +1,588 @@
+/*
+ * virtio-mmio transport (virtio 1.x, register layout version 2)
+ *
+ * Register accesses arrive on vCPU threads, queue kicks and interrupt
+ * resamples on the event loop, device input on whatever thread produces it;
+ * each device has one mutex that covers its transport state and its model.
+ */
+
+#include "virtio_transport.h"
+#include "irq.h"
+#include "ioapic.h"
+#include "event_loop.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+
+// Legacy IRQs nothing else in the VM uses (the PIT is 0, COM1 4, the ACPI
+// SCI 9), in the order devices are added. The fourth device had IRQ 9
+// until the SCI took it and now gets 15, the last free ISA line; the
+// others keep their lines so existing guest command lines stay valid.
+static const uint32_t virtio_gsis[VIRTIO_MMIO_MAX_DEVICES] = { 5, 10, 11, 15, 7, 6, 12, 3 };
+
+static struct {
+    virtio_dev_t devs[VIRTIO_MMIO_MAX_DEVICES];
+    int count;
+    int vm_fd;
+    bool split;
+} mmio = { .vm_fd = -1 };
+
+static uint64_t offered_features(virtio_dev_t *dev) {
+    return dev->ops->features | (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_RING_F_EVENT_IDX);
+}
+
+static void update_irq(virtio_dev_t *dev) {
+    if (dev->isr && !dev->irq_asserted && dev->irq_fd >= 0) {
+        dev->irq_asserted = (irq_irqfd_raise(dev->irq_fd) == 0);
+    }
+}
+
+// The guest EOI'd the device's IRQ: the line is low again
+static void irq_resampled(void *opaque) {
+    virtio_dev_t *dev = opaque;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->irq_asserted = false;
+    update_irq(dev);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static void resample_event(int fd, uint32_t events, void *opaque) {
+    uint64_t count;
+
+    (void)events;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read virtio resamplefd");
+    }
+    irq_resampled(opaque);
+}
+
+// Used-buffer notification for queue: its MSI-X vector, or the ISR bit and
+// the interrupt line
+static void vring_interrupt(virtio_dev_t *dev, uint32_t queue) {
+    if (dev->pdev && pci_msix_enabled(dev->pdev)) {
+        if (dev->queue_vector[queue] != VIRTIO_MSI_NO_VECTOR) {
+            pci_msix_notify(dev->pdev, dev->queue_vector[queue]);
+        }
+        return;
+    }
+    dev->isr |= VIRTIO_MMIO_INT_VRING;
+    update_irq(dev);
+}
+
+static void queue_kicked(virtio_dev_t *dev, uint32_t queue) {
+    if (queue >= dev->ops->num_queues || !dev->queues[queue].ready ||
+        !(dev->status & VIRTIO_STATUS_DRIVER_OK)) {
+        return;
+    }
+    dev->ops->queue_notify(dev, queue);
+}
+
+static void kick_event(int fd, uint32_t events, void *opaque) {
+    struct virtio_kick *kick = opaque;
+    uint64_t count;
+
+    (void)events;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read virtio ioeventfd");
+        return;
+    }
+    pthread_mutex_lock(&kick->dev->lock);
+    queue_kicked(kick->dev, kick->queue);
+    pthread_mutex_unlock(&kick->dev->lock);
+}
+
+static void device_reset(virtio_dev_t *dev) {
+    dev->status = 0;
+    dev->isr = 0;
+    dev->device_features_sel = 0;
+    dev->driver_features_sel = 0;
+    dev->driver_features = 0;
+    dev->queue_sel = 0;
+    dev->shm_sel = 0;
+    dev->msix_config = VIRTIO_MSI_NO_VECTOR;
+    for (uint32_t q = 0; q < VIRTIO_MMIO_MAX_QUEUES; q++) {
+        virtq_reset(&dev->queues[q], dev->ops->queue_size);
+        dev->queue_vector[q] = VIRTIO_MSI_NO_VECTOR;
+    }
+    if (dev->ops->reset) {
+        dev->ops->reset(dev);
+    }
+}
+
+virtio_dev_t *virtio_mmio_add(const virtio_device_ops_t *ops, void *config, void *opaque) {
+    if (mmio.count >= VIRTIO_MMIO_MAX_DEVICES) {
+        fprintf(stderr, "virtio-mmio: too many devices (max %d)\n", VIRTIO_MMIO_MAX_DEVICES);
+        return NULL;
+    }
+    if (ops->num_queues > VIRTIO_MMIO_MAX_QUEUES || ops->queue_size > VIRTQ_MAX_SIZE ||
+        ops->config_size > VIRTIO_MMIO_STRIDE - VIRTIO_MMIO_CONFIG) {
+        fprintf(stderr, "virtio-mmio: %s does not fit the transport\n", ops->name);
+        return NULL;
+    }
+
+    virtio_dev_t *dev = &mmio.devs[mmio.count];
+    memset(dev, 0, sizeof(*dev));
+    dev->ops = ops;
+    dev->config = config;
+    dev->opaque = opaque;
+    dev->gsi = virtio_gsis[mmio.count];
+    dev->irq_fd = -1;
+    dev->resample_fd = -1;
+    dev->msix_config = VIRTIO_MSI_NO_VECTOR;
+    for (uint32_t q = 0; q < VIRTIO_MMIO_MAX_QUEUES; q++) {
+        dev->kicks[q].fd = -1;
+        virtq_reset(&dev->queues[q], ops->queue_size);
+        dev->queue_vector[q] = VIRTIO_MSI_NO_VECTOR;
+    }
+    if (pci_enabled()) {
+        if (virtio_pci_attach(dev) < 0) {
+            return NULL;
+        }
+    } else {
+        dev->base = VIRTIO_MMIO_BASE + (uint64_t)mmio.count * VIRTIO_MMIO_STRIDE;
+        DEBUG_PRINT(DEBUG_BASIC, "virtio-mmio: %s at 0x%llx, IRQ %u", ops->name,
+                    (unsigned long long)dev->base, dev->gsi);
+    }
+    pthread_mutex_init(&dev->lock, NULL);
+    mmio.count++;
+    return dev;
+}
+
+static int kick_ioeventfd(virtio_dev_t *dev, uint32_t queue, uint64_t addr, bool assign) {
+    struct kvm_ioeventfd ioeventfd;
+
+    memset(&ioeventfd, 0, sizeof(ioeventfd));
+    ioeventfd.addr = addr;
+    ioeventfd.fd = dev->kicks[queue].fd;
+    if (dev->pdev) {
+        ioeventfd.len = 2; // Every queue has its own notify address
+    } else {
+        ioeventfd.len = 4;
+        ioeventfd.datamatch = queue;
+        ioeventfd.flags = KVM_IOEVENTFD_FLAG_DATAMATCH;
+    }
+    if (!assign) {
+        ioeventfd.flags |= KVM_IOEVENTFD_FLAG_DEASSIGN;
+    }
+    return ioctl(mmio.vm_fd, KVM_IOEVENTFD, &ioeventfd);
+}
+
+void virtio_transport_bind_kick(virtio_dev_t *dev, uint32_t queue, bool bind) {
+    struct virtio_kick *kick = &dev->kicks[queue];
+
+    if (kick->fd < 0) {
+        return;
+    }
+    if (kick->addr) {
+        kick_ioeventfd(dev, queue, kick->addr, false);
+        kick->addr = 0;
+    }
+    if (bind) {
+        uint64_t addr = dev->pdev ? virtio_pci_notify_addr(dev, queue) : dev->base + VIRTIO_MMIO_QUEUE_NOTIFY;
+        if (addr && kick_ioeventfd(dev, queue, addr, true) < 0) {
+            perror("KVM_IOEVENTFD");
+        } else {
+            kick->addr = addr;
+        }
+    }
+}
+
+static int bind_kick(virtio_dev_t *dev, uint32_t queue) {
+    struct virtio_kick *kick = &dev->kicks[queue];
+
+    kick->dev = dev;
+    kick->queue = queue;
+    kick->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (kick->fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    // A virtio-pci BAR that does not decode yet is bound when it moves
+    virtio_transport_bind_kick(dev, queue, true);
+    if ((!kick->addr && !dev->pdev) || event_loop_add(kick->fd, EPOLLIN, kick_event, kick) < 0) {
+        virtio_transport_bind_kick(dev, queue, false);
+        close(kick->fd);
+        kick->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int bind_irq(virtio_dev_t *dev) {
+    if (mmio.split) {
+        // Userspace IOAPIC: it reports the EOI, so a plain irqfd will do
+        dev->irq_fd = irq_irqfd_create(mmio.vm_fd, dev->gsi);
+        if (dev->irq_fd < 0) {
+            return -1;
+        }
+        ioapic_set_resample(irq_ioapic_pin(dev->gsi), irq_resampled, dev);
+        return 0;
+    }
+
+    dev->irq_fd = irq_irqfd_create_resample(mmio.vm_fd, dev->gsi, &dev->resample_fd);
+    if (dev->irq_fd < 0) {
+        return -1;
+    }
+    if (event_loop_add(dev->resample_fd, EPOLLIN, resample_event, dev) < 0) {
+        irq_irqfd_release(mmio.vm_fd, dev->irq_fd, dev->resample_fd, dev->gsi);
+        dev->irq_fd = -1;
+        dev->resample_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int virtio_mmio_start(int vm_fd, void *mem, uint64_t mem_size, bool split) {
+    mmio.vm_fd = vm_fd;
+    mmio.split = split;
+    virtio_set_guest_memory(mem, mem_size);
+
+    for (int i = 0; i < mmio.count; i++) {
+        virtio_dev_t *dev = &mmio.devs[i];
+
+        if (bind_irq(dev) < 0) {
+            fprintf(stderr, "virtio-mmio: no interrupt for %s\n", dev->ops->name);
+            return -1;
+        }
+        for (uint32_t q = 0; q < dev->ops->num_queues; q++) {
+            // Without an ioeventfd the kick is handled as an MMIO exit
+            if (bind_kick(dev, q) < 0) {
+                fprintf(stderr, "virtio-mmio: %s queue %u kicks will exit to userspace\n",
+                        dev->ops->name, q);
+            }
+        }
+    }
+    return 0;
+}
+
+int virtio_mmio_cmdline(char *buf, size_t size) {
+    size_t len = strlen(buf);
+
+    for (int i = 0; i < mmio.count; i++) {
+        if (mmio.devs[i].pdev) {
+            continue;
+        }
+        int n = snprintf(buf + len, size - len, "%svirtio_mmio.device=%u@0x%llx:%u",
+                         len ? " " : "", VIRTIO_MMIO_STRIDE,
+                         (unsigned long long)mmio.devs[i].base, mmio.devs[i].gsi);
+        if (n < 0 || (size_t)n >= size - len) {
+            return -1;
+        }
+        len += (size_t)n;
+    }
+    return (int)len;
+}
+
+int virtio_mmio_count(void) {
+    return mmio.count;
+}
+
+uint32_t virtio_mmio_irq_mask(void) {
+    uint32_t mask = 0;
+
+    for (int i = 0; i < mmio.count; i++) {
+        mask |= 1u << mmio.devs[i].gsi;
+    }
+    return mask;
+}
+
+static virtio_dev_t *find_dev(uint64_t gpa) {
+    if (gpa < VIRTIO_MMIO_BASE) {
+        return NULL;
+    }
+    uint64_t index = (gpa - VIRTIO_MMIO_BASE) / VIRTIO_MMIO_STRIDE;
+    return index < (uint64_t)mmio.count && !mmio.devs[index].pdev ? &mmio.devs[index] : NULL;
+}
+
+bool virtio_mmio_is_mmio(uint64_t gpa) {
+    return find_dev(gpa) != NULL;
+}
+
+uint32_t virtio_transport_read_reg(virtio_dev_t *dev, uint32_t offset) {
+    struct virtq *vq = &dev->queues[dev->queue_sel];
+    uint64_t features = offered_features(dev);
+
+    switch (offset) {
+    case VIRTIO_MMIO_MAGIC_VALUE:
+        return VIRTIO_MMIO_MAGIC;
+    case VIRTIO_MMIO_VERSION:
+        return 2;
+    case VIRTIO_MMIO_DEVICE_ID:
+        return dev->ops->device_id;
+    case VIRTIO_MMIO_VENDOR_ID:
+        return VIRTIO_MMIO_VENDOR;
+    case VIRTIO_MMIO_DEVICE_FEATURES:
+        return dev->device_features_sel < 2 ? (uint32_t)(features >> (32 * dev->device_features_sel)) : 0;
+    case VIRTIO_MMIO_QUEUE_NUM_MAX:
+        return dev->queue_sel < dev->ops->num_queues ? vq->num_max : 0;
+    case VIRTIO_MMIO_QUEUE_READY:
+        return vq->ready;
+    case VIRTIO_MMIO_INTERRUPT_STATUS:
+        return dev->isr;
+    case VIRTIO_MMIO_STATUS:
+        return dev->status;
+    case VIRTIO_MMIO_CONFIG_GENERATION:
+        return dev->config_generation;
+    case VIRTIO_MMIO_SHM_LEN_LOW:
+    case VIRTIO_MMIO_SHM_LEN_HIGH: {
+        // A region that does not exist has length ~0
+        uint64_t len = dev->shm_len && dev->shm_sel == dev->shm_id ? dev->shm_len : ~0ULL;
+        return (uint32_t)(offset == VIRTIO_MMIO_SHM_LEN_HIGH ? len >> 32 : len);
+    }
+    case VIRTIO_MMIO_SHM_BASE_LOW:
+    case VIRTIO_MMIO_SHM_BASE_HIGH: {
+        uint64_t base = dev->shm_len && dev->shm_sel == dev->shm_id ? dev->shm_base : ~0ULL;
+        return (uint32_t)(offset == VIRTIO_MMIO_SHM_BASE_HIGH ? base >> 32 : base);
+    }
+    default:
+        return 0;
+    }
+}
+
+static void set_addr_half(uint64_t *addr, bool high, uint32_t val) {
+    if (high) {
+        *addr = (*addr & 0xffffffffULL) | ((uint64_t)val << 32);
+    } else {
+        *addr = (*addr & ~0xffffffffULL) | val;
+    }
+}
+
+static void write_status(virtio_dev_t *dev, uint32_t val) {
+    if (val == 0) {
+        DEBUG_PRINT(DEBUG_DETAILED, "virtio-mmio: %s reset", dev->ops->name);
+        device_reset(dev);
+        update_irq(dev);
+        return;
+    }
+
+    if ((val & VIRTIO_STATUS_FEATURES_OK) && !(dev->status & VIRTIO_STATUS_FEATURES_OK)) {
+        // Only modern drivers, and only features we offered
+        if (!(dev->driver_features & (1ULL << VIRTIO_F_VERSION_1)) ||
+            (dev->driver_features & ~offered_features(dev))) {
+            fprintf(stderr, "virtio-mmio: %s rejected driver features 0x%llx\n", dev->ops->name,
+                    (unsigned long long)dev->driver_features);
+            val &= ~(uint32_t)VIRTIO_STATUS_FEATURES_OK;
+        }
+    }
+
+    bool driver_ok = (val & VIRTIO_STATUS_DRIVER_OK) && !(dev->status & VIRTIO_STATUS_DRIVER_OK);
+    dev->status = val;
+    if (driver_ok) {
+        DEBUG_PRINT(DEBUG_BASIC, "virtio-mmio: %s driver ready (features 0x%llx)", dev->ops->name,
+                    (unsigned long long)dev->driver_features);
+        if (dev->ops->driver_ok) {
+            dev->ops->driver_ok(dev);
+        }
+    }
+}
+
+void virtio_transport_write_reg(virtio_dev_t *dev, uint32_t offset, uint32_t val) {
+    struct virtq *vq = &dev->queues[dev->queue_sel];
+
+    switch (offset) {
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+        dev->device_features_sel = val;
+        break;
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+        if (dev->driver_features_sel < 2 && !(dev->status & VIRTIO_STATUS_FEATURES_OK)) {
+            uint32_t shift = 32 * dev->driver_features_sel;
+            dev->driver_features = (dev->driver_features & ~(0xffffffffULL << shift)) | ((uint64_t)val << shift);
+        }
+        break;
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+        dev->driver_features_sel = val;
+        break;
+    case VIRTIO_MMIO_QUEUE_SEL:
+        dev->queue_sel = val < VIRTIO_MMIO_MAX_QUEUES ? val : 0;
+        break;
+    case VIRTIO_MMIO_QUEUE_NUM:
+        vq->num = (uint16_t)val;
+        break;
+    case VIRTIO_MMIO_QUEUE_READY:
+        if (dev->queue_sel >= dev->ops->num_queues) {
+            break;
+        }
+        if (val & 1) {
+            if (!virtq_valid(vq)) {
+                fprintf(stderr, "virtio-mmio: %s queue %u has an invalid layout\n", dev->ops->name,
+                        dev->queue_sel);
+                dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+                break;
+            }
+            vq->event_idx = (dev->driver_features & (1ULL << VIRTIO_RING_F_EVENT_IDX)) != 0;
+            vq->ready = true;
+        } else {
+            virtq_reset(vq, dev->ops->queue_size);
+        }
+        break;
+    case VIRTIO_MMIO_QUEUE_NOTIFY:
+        queue_kicked(dev, val);
+        break;
+    case VIRTIO_MMIO_SHM_SEL:
+        dev->shm_sel = val;
+        break;
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+        dev->isr &= ~val;
+        break;
+    case VIRTIO_MMIO_STATUS:
+        write_status(dev, val);
+        break;
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+        set_addr_half(&vq->desc_addr, offset == VIRTIO_MMIO_QUEUE_DESC_HIGH, val);
+        break;
+    case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+    case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+        set_addr_half(&vq->avail_addr, offset == VIRTIO_MMIO_QUEUE_DRIVER_HIGH, val);
+        break;
+    case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+    case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+        set_addr_half(&vq->used_addr, offset == VIRTIO_MMIO_QUEUE_DEVICE_HIGH, val);
+        break;
+    default:
+        break;
+    }
+}
+
+void virtio_mmio_read(uint64_t gpa, uint8_t *data, uint32_t len) {
+    virtio_dev_t *dev = find_dev(gpa);
+    uint32_t offset = (uint32_t)((gpa - VIRTIO_MMIO_BASE) % VIRTIO_MMIO_STRIDE);
+
+    memset(data, 0, len);
+    if (!dev) {
+        return;
+    }
+    pthread_mutex_lock(&dev->lock);
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        uint32_t cfg = offset - VIRTIO_MMIO_CONFIG;
+        if (cfg < dev->ops->config_size && len <= dev->ops->config_size - cfg) {
+            memcpy(data, (uint8_t *)dev->config + cfg, len);
+        }
+    } else if (len == 4) {
+        uint32_t val = virtio_transport_read_reg(dev, offset);
+        memcpy(data, &val, sizeof(val));
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+void virtio_mmio_write(uint64_t gpa, const uint8_t *data, uint32_t len) {
+    virtio_dev_t *dev = find_dev(gpa);
+    uint32_t offset = (uint32_t)((gpa - VIRTIO_MMIO_BASE) % VIRTIO_MMIO_STRIDE);
+
+    if (!dev) {
+        return;
+    }
+    pthread_mutex_lock(&dev->lock);
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        uint32_t cfg = offset - VIRTIO_MMIO_CONFIG;
+        if (cfg < dev->ops->config_size && len <= dev->ops->config_size - cfg) {
+            memcpy((uint8_t *)dev->config + cfg, data, len);
+            if (dev->ops->config_write) {
+                dev->ops->config_write(dev, cfg, len);
+            }
+        }
+    } else if (len == 4) {
+        uint32_t val;
+        memcpy(&val, data, sizeof(val));
+        virtio_transport_write_reg(dev, offset, val);
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+void virtio_mmio_cleanup(void) {
+    for (int i = 0; i < mmio.count; i++) {
+        virtio_dev_t *dev = &mmio.devs[i];
+
+        for (uint32_t q = 0; q < VIRTIO_MMIO_MAX_QUEUES; q++) {
+            struct virtio_kick *kick = &dev->kicks[q];
+            if (kick->fd < 0) {
+                continue;
+            }
+            event_loop_del(kick->fd);
+            virtio_transport_bind_kick(dev, q, false);
+            close(kick->fd);
+            kick->fd = -1;
+        }
+        if (dev->irq_fd >= 0) {
+            if (mmio.split) {
+                ioapic_set_resample(irq_ioapic_pin(dev->gsi), NULL, NULL);
+            } else {
+                event_loop_del(dev->resample_fd);
+            }
+            irq_irqfd_release(mmio.vm_fd, dev->irq_fd, dev->resample_fd, dev->gsi);
+            dev->irq_fd = -1;
+            dev->resample_fd = -1;
+        }
+        pthread_mutex_destroy(&dev->lock);
+    }
+    mmio.count = 0;
+    mmio.vm_fd = -1;
+}
+
+void *virtio_dev_opaque(virtio_dev_t *dev) {
+    return dev->opaque;
+}
+
+struct virtq *virtio_dev_queue(virtio_dev_t *dev, uint32_t queue) {
+    return queue < dev->ops->num_queues ? &dev->queues[queue] : NULL;
+}
+
+bool virtio_dev_has_feature(virtio_dev_t *dev, unsigned bit) {
+    return (dev->driver_features & (1ULL << bit)) != 0;
+}
+
+bool virtio_dev_driver_ok(virtio_dev_t *dev) {
+    return (dev->status & VIRTIO_STATUS_DRIVER_OK) != 0;
+}
+
+void virtio_dev_lock(virtio_dev_t *dev) {
+    pthread_mutex_lock(&dev->lock);
+}
+
+void virtio_dev_unlock(virtio_dev_t *dev) {
+    pthread_mutex_unlock(&dev->lock);
+}
+
+int virtio_dev_take_kick(virtio_dev_t *dev, uint32_t queue) {
+    struct virtio_kick *kick = &dev->kicks[queue];
+
+    if (queue >= dev->ops->num_queues || kick->fd < 0) {
+        return -1;
+    }
+    event_loop_del(kick->fd);
+    return kick->fd;
+}
+
+void virtio_dev_notify_used(virtio_dev_t *dev, struct virtq *vq) {
+    if (virtq_should_interrupt(vq)) {
+        vring_interrupt(dev, (uint32_t)(vq - dev->queues));
+    }
+}
+
+void virtio_dev_set_shm(virtio_dev_t *dev, uint32_t id, uint64_t base, uint64_t len) {
+    dev->shm_id = id;
+    dev->shm_base = base;
+    dev->shm_len = len;
+}
+
+void virtio_dev_config_changed(virtio_dev_t *dev) {
+    dev->config_generation++;
+    if (dev->status & VIRTIO_STATUS_DRIVER_OK) {
+        dev->isr |= VIRTIO_MMIO_INT_CONFIG;
+        if (dev->pdev && pci_msix_enabled(dev->pdev)) {
+            if (dev->msix_config != VIRTIO_MSI_NO_VECTOR) {
+                pci_msix_notify(dev->pdev, dev->msix_config);
+            }
+        } else {
+            update_irq(dev);
+        }
+    }
+}
@@ -0,0 +1,136 @@
+/*
+ * virtio-mmio transport (virtio 1.x, register layout version 2)
+ *
+ * Each device gets a 512-byte register window starting at 0xD0000000 and
+ * its own legacy IRQ. Linux finds them through virtio_mmio.device=
+ * parameters that virtio_mmio_cmdline() appends to the kernel command line
+ * (CONFIG_VIRTIO_MMIO_CMDLINE_DEVICES), so no firmware tables are needed.
+ *
+ * Queue kicks never reach userspace as MMIO exits: every queue has an
+ * ioeventfd on the QueueNotify register (datamatch on the queue index) that
+ * the event loop turns into a queue_notify callback. The device interrupt
+ * is level-triggered on a resampling irqfd, like COM1: it is raised while
+ * InterruptStatus is non-zero and re-raised after the guest's EOI if the
+ * driver has not acknowledged everything.
+ *
+ * Once pci_init() has run, devices are added as virtio-pci functions
+ * instead (virtio_pci.c): same device models and register semantics, found
+ * by PCI enumeration, with an MSI-X vector per queue.
+ */
+
+#ifndef VIRTIO_MMIO_H
+#define VIRTIO_MMIO_H
+
+#include "virtio.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define VIRTIO_MMIO_BASE        0xD0000000ULL
+#define VIRTIO_MMIO_STRIDE      0x200
+#define VIRTIO_MMIO_MAX_DEVICES 8
+#define VIRTIO_MMIO_MAX_QUEUES  8
+
+// Register window
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000
+#define VIRTIO_MMIO_VERSION             0x004
+#define VIRTIO_MMIO_DEVICE_ID           0x008
+#define VIRTIO_MMIO_VENDOR_ID           0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW    0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH   0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW    0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH   0x0a4
+#define VIRTIO_MMIO_SHM_SEL             0x0ac
+#define VIRTIO_MMIO_SHM_LEN_LOW         0x0b0
+#define VIRTIO_MMIO_SHM_LEN_HIGH        0x0b4
+#define VIRTIO_MMIO_SHM_BASE_LOW        0x0b8
+#define VIRTIO_MMIO_SHM_BASE_HIGH       0x0bc
+#define VIRTIO_MMIO_CONFIG_GENERATION   0x0fc
+#define VIRTIO_MMIO_CONFIG              0x100
+
+#define VIRTIO_MMIO_MAGIC               0x74726976 // "virt"
+#define VIRTIO_MMIO_VENDOR              0x4d564b4d // "MKVM"
+
+// InterruptStatus bits
+#define VIRTIO_MMIO_INT_VRING           1
+#define VIRTIO_MMIO_INT_CONFIG          2
+
+typedef struct virtio_dev virtio_dev_t;
+
+// Device model callbacks; all of them run with the device lock held
+typedef struct {
+    const char *name;
+    uint32_t device_id;
+    uint32_t num_queues;
+    uint16_t queue_size;       // Largest queue the device accepts
+    uint64_t features;         // Device-specific feature bits
+    uint32_t config_size;      // Bytes of the config buffer passed to add()
+
+    // The driver kicked queue (event loop thread, or the vCPU without ioeventfd)
+    void (*queue_notify)(virtio_dev_t *dev, uint32_t queue);
+    // The driver wrote [offset, offset + len) of the config space (optional)
+    void (*config_write)(virtio_dev_t *dev, uint32_t offset, uint32_t len);
+    // DRIVER_OK was set: queues are live (optional)
+    void (*driver_ok)(virtio_dev_t *dev);
+    // The driver reset the device (optional)
+    void (*reset)(virtio_dev_t *dev);
+} virtio_device_ops_t;
+
+// Register a device; config (config_size bytes) stays owned by the caller
+virtio_dev_t *virtio_mmio_add(const virtio_device_ops_t *ops, void *config, void *opaque);
+
+// Bind irqfds and ioeventfds once the VM, its irqchip and guest RAM exist
+// (split: the IOAPIC is emulated in userspace)
+int virtio_mmio_start(int vm_fd, void *mem, uint64_t mem_size, bool split);
+
+// Append " virtio_mmio.device=..." for every device; returns the new length or -1
+int virtio_mmio_cmdline(char *buf, size_t size);
+
+int virtio_mmio_count(void);
+
+// Legacy IRQs of the devices added so far (bit n: IRQ n); all are level-triggered
+uint32_t virtio_mmio_irq_mask(void);
+
+bool virtio_mmio_is_mmio(uint64_t gpa);
+void virtio_mmio_read(uint64_t gpa, uint8_t *data, uint32_t len);
+void virtio_mmio_write(uint64_t gpa, const uint8_t *data, uint32_t len);
+
+// Unbind everything (vCPUs and the event loop must be stopped)
+void virtio_mmio_cleanup(void);
+
+// Device-side helpers
+void *virtio_dev_opaque(virtio_dev_t *dev);
+struct virtq *virtio_dev_queue(virtio_dev_t *dev, uint32_t queue);
+bool virtio_dev_has_feature(virtio_dev_t *dev, unsigned bit);
+bool virtio_dev_driver_ok(virtio_dev_t *dev);
+void virtio_dev_lock(virtio_dev_t *dev);
+void virtio_dev_unlock(virtio_dev_t *dev);
+
+// Interrupt the driver for buffers used on vq, unless it suppressed that
+void virtio_dev_notify_used(virtio_dev_t *dev, struct virtq *vq);
+
+// Hand a queue's kick eventfd to another consumer: the event loop stops
+// reading it. Returns -1 if kicks exit to userspace instead.
+int virtio_dev_take_kick(virtio_dev_t *dev, uint32_t queue);
+
+// Expose a shared memory region (e.g. a DAX window) to the driver as region id
+void virtio_dev_set_shm(virtio_dev_t *dev, uint32_t id, uint64_t base, uint64_t len);
+
+// The device changed its config space
+void virtio_dev_config_changed(virtio_dev_t *dev);
+
+#endif // VIRTIO_MMIO_H
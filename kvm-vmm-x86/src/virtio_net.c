@@ -0,0 +1,170 @@
+/*
+ * virtio-net NICs attached to the in-process L2 switch
+ *
+ * Transmit runs on the event loop under the NIC's device lock and forwards
+ * copies of the frames, so the guest gets its buffers back before the
+ * frames reach their destinations. Receive has no backlog: a frame that
+ * finds no posted buffer is dropped, as on a real wire.
+ */
+
+#include "virtio_net.h"
+#include "virtio_mmio.h"
+#include "net_switch.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RXQ 0
+#define TXQ 1
+
+#define VIRTIO_NET_S_LINK_UP 1
+
+struct virtio_net_config {
+    uint8_t mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+    uint16_t mtu;
+} __attribute__((packed));
+
+// Header in front of every frame (virtio 1.x layout, num_buffers included)
+struct virtio_net_hdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;
+};
+
+struct net_nic {
+    virtio_dev_t *dev;
+    int port;
+    char name[16];
+    struct virtio_net_config config;
+    struct virtq_elem elem;
+    uint8_t tx_buf[NET_BATCH][NET_FRAME_MAX];
+    struct net_frame frames[NET_BATCH];
+    uint64_t rx_dropped;
+};
+
+static struct {
+    struct net_nic nics[VIRTIO_NET_MAX_NICS];
+    int count;
+} net;
+
+static void net_tx(struct net_nic *nic) {
+    struct virtq *vq = virtio_dev_queue(nic->dev, TXQ);
+    int ret = 0;
+
+    do {
+        virtq_set_notify(vq, false);
+        do {
+            int count = 0;
+
+            while (count < NET_BATCH && (ret = virtq_pop(vq, &nic->elem)) > 0) {
+                size_t len = virtq_iov_to_buf(nic->elem.iov, nic->elem.out_num, sizeof(struct virtio_net_hdr),
+                                              nic->tx_buf[count], NET_FRAME_MAX);
+                virtq_push(vq, &nic->elem, 0);
+                if (len == 0) {
+                    continue;
+                }
+                nic->frames[count].data = nic->tx_buf[count];
+                nic->frames[count].len = len;
+                count++;
+            }
+            if (count > 0) {
+                net_switch_forward(nic->port, nic->frames, count);
+            }
+        } while (ret > 0);
+        if (ret < 0) {
+            return;
+        }
+    } while (virtq_set_notify(vq, true));
+
+    virtio_dev_notify_used(nic->dev, vq);
+}
+
+// Switch port delivery: copy frames into posted receive buffers
+static void net_deliver(void *opaque, const struct net_frame *frames, int count) {
+    struct net_nic *nic = opaque;
+    struct virtio_net_hdr hdr = { .num_buffers = 1 };
+    struct virtq_elem elem;
+    bool used = false;
+
+    virtio_dev_lock(nic->dev);
+    struct virtq *vq = virtio_dev_queue(nic->dev, RXQ);
+    if (!vq->ready || !virtio_dev_driver_ok(nic->dev)) {
+        virtio_dev_unlock(nic->dev);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        if (virtq_pop(vq, &elem) <= 0) {
+            nic->rx_dropped += (uint64_t)(count - i);
+            break;
+        }
+        struct iovec *in = elem.iov + elem.out_num;
+        size_t n = virtq_buf_to_iov(in, elem.in_num, 0, &hdr, sizeof(hdr));
+        n += virtq_buf_to_iov(in, elem.in_num, sizeof(hdr), frames[i].data, frames[i].len);
+        if (n != sizeof(hdr) + frames[i].len) {
+            nic->rx_dropped++;
+            n = 0; // Buffer too small for the frame
+        }
+        virtq_push(vq, &elem, (uint32_t)n);
+        used = true;
+    }
+    if (used) {
+        virtio_dev_notify_used(nic->dev, vq);
+    }
+    virtio_dev_unlock(nic->dev);
+}
+
+static void net_queue_notify(virtio_dev_t *dev, uint32_t queue) {
+    // Receive buffers are consumed as frames arrive; only transmit needs work
+    if (queue == TXQ) {
+        net_tx(virtio_dev_opaque(dev));
+    }
+}
+
+static const virtio_device_ops_t net_ops = {
+    .name = "virtio-net",
+    .device_id = VIRTIO_ID_NET,
+    .num_queues = 2,
+    .queue_size = VIRTIO_NET_QUEUE_SIZE,
+    .features = (1ULL << VIRTIO_NET_F_MTU) | (1ULL << VIRTIO_NET_F_MAC) | (1ULL << VIRTIO_NET_F_STATUS),
+    .config_size = sizeof(struct virtio_net_config),
+    .queue_notify = net_queue_notify,
+};
+
+int virtio_net_init(void) {
+    if (net.count >= VIRTIO_NET_MAX_NICS) {
+        fprintf(stderr, "virtio-net: too many NICs (max %d)\n", VIRTIO_NET_MAX_NICS);
+        return -1;
+    }
+    struct net_nic *nic = &net.nics[net.count];
+    pid_t pid = getpid();
+
+    memset(nic, 0, sizeof(*nic));
+    // Locally administered 52:54 prefix, then the PID and the NIC number
+    uint8_t mac[6] = { 0x52, 0x54, (uint8_t)(pid >> 16), (uint8_t)(pid >> 8), (uint8_t)pid, (uint8_t)net.count };
+    memcpy(nic->config.mac, mac, sizeof(mac));
+    nic->config.status = VIRTIO_NET_S_LINK_UP;
+    nic->config.max_virtqueue_pairs = 1;
+    nic->config.mtu = VIRTIO_NET_MTU;
+    snprintf(nic->name, sizeof(nic->name), "eth%d", net.count);
+
+    nic->port = net_switch_add_port(nic->name, net_deliver, nic);
+    if (nic->port < 0) {
+        return -1;
+    }
+    nic->dev = virtio_mmio_add(&net_ops, &nic->config, nic);
+    if (!nic->dev) {
+        return -1;
+    }
+    net.count++;
+
+    printf("virtio-net: %s %02x:%02x:%02x:%02x:%02x:%02x on switch port %d\n", nic->name, mac[0], mac[1], mac[2],
+           mac[3], mac[4], mac[5], nic->port);
+    return 0;
+}
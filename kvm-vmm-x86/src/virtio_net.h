@@ -0,0 +1,25 @@
+/*
+ * virtio-net NICs attached to the in-process L2 switch
+ *
+ * Each NIC is one switch port (see net_switch.h). The transmit queue is
+ * drained in batches of up to NET_BATCH frames that are forwarded together,
+ * and frames for a NIC are written into its posted receive buffers with one
+ * interrupt per batch. Only plain frames are exchanged: no checksum offload,
+ * GSO or mergeable buffers, so the MTU is 1500.
+ */
+
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+
+#define VIRTIO_NET_F_MTU     3
+#define VIRTIO_NET_F_MAC     5
+#define VIRTIO_NET_F_STATUS  16
+
+#define VIRTIO_NET_QUEUE_SIZE 256
+#define VIRTIO_NET_MAX_NICS   4
+#define VIRTIO_NET_MTU        1500
+
+// Add a NIC with a MAC derived from the process and NIC number
+int virtio_net_init(void);
+
+#endif // VIRTIO_NET_H
@@ -0,0 +1,290 @@
+/*
+ * virtio-pci transport (virtio 1.x "modern" layout, no legacy I/O BAR)
+ *
+ * Each device is one PCI function with a single 32 KiB memory BAR:
+ *
+ *   0x0000  common configuration
+ *   0x1000  ISR status (read to clear)
+ *   0x2000  device-specific configuration
+ *   0x3000  queue notify, 4 bytes per queue
+ *   0x4000  MSI-X table, 0x5000 MSI-X PBA
+ *
+ * MSI-X has one vector per queue plus one for configuration changes, so
+ * multiqueue drivers get a separate interrupt (and CPU affinity) for every
+ * queue. The registers share their semantics with virtio-mmio; only the
+ * layout, ISR read-to-clear and the vector registers are specific here.
+ */
+
+#include "virtio_transport.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+
+#define VIRTIO_PCI_VENDOR        0x1af4
+#define VIRTIO_PCI_DEVICE_BASE   0x1040 // Plus the virtio device ID
+#define VIRTIO_PCI_SUBSYSTEM     0x1100
+
+#define BAR_SIZE                 0x8000
+#define COMMON_OFFSET            0x0000
+#define ISR_OFFSET               0x1000
+#define DEVICE_OFFSET            0x2000
+#define NOTIFY_OFFSET            0x3000
+#define MSIX_TABLE_OFFSET        0x4000
+#define MSIX_PBA_OFFSET          0x5000
+#define NOTIFY_MULTIPLIER        4
+
+// Vendor capability types
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+// Common configuration
+#define COMMON_DFSELECT          0x00
+#define COMMON_DF                0x04
+#define COMMON_GFSELECT          0x08
+#define COMMON_GF                0x0c
+#define COMMON_MSIX              0x10
+#define COMMON_NUMQ              0x12
+#define COMMON_STATUS            0x14
+#define COMMON_CFGGENERATION     0x15
+#define COMMON_Q_SELECT          0x16
+#define COMMON_Q_SIZE            0x18
+#define COMMON_Q_MSIX            0x1a
+#define COMMON_Q_ENABLE          0x1c
+#define COMMON_Q_NOFF            0x1e
+#define COMMON_Q_DESCLO          0x20
+#define COMMON_Q_DESCHI          0x24
+#define COMMON_Q_AVAILLO         0x28
+#define COMMON_Q_AVAILHI         0x2c
+#define COMMON_Q_USEDLO          0x30
+#define COMMON_Q_USEDHI          0x34
+#define COMMON_SIZE              0x38
+
+// struct virtio_pci_cap after the ID and next bytes
+struct virtio_pci_cap_body {
+    uint8_t cap_len;
+    uint8_t cfg_type;
+    uint8_t bar;
+    uint8_t id;
+    uint8_t padding[2];
+    uint32_t offset;
+    uint32_t length;
+    uint32_t notify_off_multiplier; // Notify capability only
+} __attribute__((packed));
+
+static uint32_t class_code(uint32_t device_id) {
+    switch (device_id) {
+    case VIRTIO_ID_NET:
+        return 0x020000; // Ethernet controller
+    case VIRTIO_ID_BLOCK:
+        return 0x018000; // Other mass storage controller
+    case VIRTIO_ID_CONSOLE:
+        return 0x078000; // Other communication controller
+    default:
+        return 0x00ff00;
+    }
+}
+
+static void put(uint8_t *buf, uint32_t offset, uint32_t val, uint32_t len) {
+    memcpy(buf + offset, &val, len);
+}
+
+static void common_read(virtio_dev_t *dev, uint32_t offset, uint8_t *data, uint32_t len) {
+    uint8_t regs[COMMON_SIZE];
+    struct virtq *vq = &dev->queues[dev->queue_sel];
+    bool present = dev->queue_sel < dev->ops->num_queues;
+
+    memset(regs, 0, sizeof(regs));
+    put(regs, COMMON_DFSELECT, dev->device_features_sel, 4);
+    put(regs, COMMON_DF, virtio_transport_read_reg(dev, VIRTIO_MMIO_DEVICE_FEATURES), 4);
+    put(regs, COMMON_GFSELECT, dev->driver_features_sel, 4);
+    if (dev->driver_features_sel < 2) {
+        put(regs, COMMON_GF, (uint32_t)(dev->driver_features >> (32 * dev->driver_features_sel)), 4);
+    }
+    put(regs, COMMON_MSIX, dev->msix_config, 2);
+    put(regs, COMMON_NUMQ, dev->ops->num_queues, 2);
+    put(regs, COMMON_STATUS, dev->status, 1);
+    put(regs, COMMON_CFGGENERATION, dev->config_generation, 1);
+    put(regs, COMMON_Q_SELECT, dev->queue_sel, 2);
+    put(regs, COMMON_Q_SIZE, present ? vq->num : 0, 2);
+    put(regs, COMMON_Q_MSIX, present ? dev->queue_vector[dev->queue_sel] : VIRTIO_MSI_NO_VECTOR, 2);
+    put(regs, COMMON_Q_ENABLE, vq->ready, 2);
+    put(regs, COMMON_Q_NOFF, dev->queue_sel, 2);
+    put(regs, COMMON_Q_DESCLO, (uint32_t)vq->desc_addr, 4);
+    put(regs, COMMON_Q_DESCHI, (uint32_t)(vq->desc_addr >> 32), 4);
+    put(regs, COMMON_Q_AVAILLO, (uint32_t)vq->avail_addr, 4);
+    put(regs, COMMON_Q_AVAILHI, (uint32_t)(vq->avail_addr >> 32), 4);
+    put(regs, COMMON_Q_USEDLO, (uint32_t)vq->used_addr, 4);
+    put(regs, COMMON_Q_USEDHI, (uint32_t)(vq->used_addr >> 32), 4);
+
+    if (offset < COMMON_SIZE && len <= COMMON_SIZE - offset) {
+        memcpy(data, regs + offset, len);
+    }
+}
+
+// Vectors the driver may pick: one per queue and one for config changes
+static uint16_t valid_vector(virtio_dev_t *dev, uint32_t val) {
+    return val < dev->ops->num_queues + 1 ? (uint16_t)val : VIRTIO_MSI_NO_VECTOR;
+}
+
+static void common_write(virtio_dev_t *dev, uint32_t offset, uint32_t val) {
+    switch (offset) {
+    case COMMON_DFSELECT:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_DEVICE_FEATURES_SEL, val);
+        break;
+    case COMMON_GFSELECT:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_DRIVER_FEATURES_SEL, val);
+        break;
+    case COMMON_GF:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_DRIVER_FEATURES, val);
+        break;
+    case COMMON_MSIX:
+        dev->msix_config = valid_vector(dev, val);
+        break;
+    case COMMON_STATUS:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_STATUS, val & 0xff);
+        break;
+    case COMMON_Q_SELECT:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_QUEUE_SEL, val);
+        break;
+    case COMMON_Q_SIZE:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_QUEUE_NUM, val);
+        break;
+    case COMMON_Q_MSIX:
+        if (dev->queue_sel < dev->ops->num_queues) {
+            dev->queue_vector[dev->queue_sel] = valid_vector(dev, val);
+        }
+        break;
+    case COMMON_Q_ENABLE:
+        // Queues are disabled only by a device reset
+        if (val == 1) {
+            virtio_transport_write_reg(dev, VIRTIO_MMIO_QUEUE_READY, 1);
+        }
+        break;
+    case COMMON_Q_DESCLO:
+    case COMMON_Q_DESCHI:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_QUEUE_DESC_LOW + (offset - COMMON_Q_DESCLO), val);
+        break;
+    case COMMON_Q_AVAILLO:
+    case COMMON_Q_AVAILHI:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_QUEUE_DRIVER_LOW + (offset - COMMON_Q_AVAILLO), val);
+        break;
+    case COMMON_Q_USEDLO:
+    case COMMON_Q_USEDHI:
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_QUEUE_DEVICE_LOW + (offset - COMMON_Q_USEDLO), val);
+        break;
+    default:
+        break;
+    }
+}
+
+static void bar_read(void *opaque, int bar, uint32_t offset, uint8_t *data, uint32_t len) {
+    virtio_dev_t *dev = opaque;
+
+    (void)bar;
+    pthread_mutex_lock(&dev->lock);
+    if (offset < ISR_OFFSET) {
+        common_read(dev, offset - COMMON_OFFSET, data, len);
+    } else if (offset == ISR_OFFSET) {
+        // Reading acknowledges; the line drops at the next EOI
+        data[0] = (uint8_t)dev->isr;
+        dev->isr = 0;
+    } else if (offset >= DEVICE_OFFSET && offset < NOTIFY_OFFSET) {
+        uint32_t cfg = offset - DEVICE_OFFSET;
+        if (cfg < dev->ops->config_size && len <= dev->ops->config_size - cfg) {
+            memcpy(data, (uint8_t *)dev->config + cfg, len);
+        }
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static void bar_write(void *opaque, int bar, uint32_t offset, const uint8_t *data, uint32_t len) {
+    virtio_dev_t *dev = opaque;
+    uint32_t val = 0;
+
+    (void)bar;
+    memcpy(&val, data, len < sizeof(val) ? len : sizeof(val));
+    pthread_mutex_lock(&dev->lock);
+    if (offset < ISR_OFFSET) {
+        common_write(dev, offset - COMMON_OFFSET, val);
+    } else if (offset >= DEVICE_OFFSET && offset < NOTIFY_OFFSET) {
+        uint32_t cfg = offset - DEVICE_OFFSET;
+        if (cfg < dev->ops->config_size && len <= dev->ops->config_size - cfg) {
+            memcpy((uint8_t *)dev->config + cfg, data, len);
+            if (dev->ops->config_write) {
+                dev->ops->config_write(dev, cfg, len);
+            }
+        }
+    } else if (offset >= NOTIFY_OFFSET && offset < NOTIFY_OFFSET + VIRTIO_MMIO_MAX_QUEUES * NOTIFY_MULTIPLIER) {
+        // A kick without an ioeventfd behind it
+        virtio_transport_write_reg(dev, VIRTIO_MMIO_QUEUE_NOTIFY, (offset - NOTIFY_OFFSET) / NOTIFY_MULTIPLIER);
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+// The guest moved BAR0: the kicks' ioeventfds follow it
+static void bar_mapped(void *opaque, int bar, uint64_t gpa) {
+    virtio_dev_t *dev = opaque;
+
+    (void)bar;
+    pthread_mutex_lock(&dev->lock);
+    dev->notify_gpa = gpa ? gpa + NOTIFY_OFFSET : 0;
+    for (uint32_t q = 0; q < dev->ops->num_queues; q++) {
+        virtio_transport_bind_kick(dev, q, true);
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static const pci_device_ops_t virtio_pci_ops = {
+    .name = "virtio-pci",
+    .bar_read = bar_read,
+    .bar_write = bar_write,
+    .bar_mapped = bar_mapped,
+};
+
+static int add_cap(pci_device_t *pdev, uint8_t type, uint32_t offset, uint32_t length, bool notify) {
+    struct virtio_pci_cap_body cap;
+
+    memset(&cap, 0, sizeof(cap));
+    cap.cap_len = (uint8_t)(2 + (notify ? sizeof(cap) : sizeof(cap) - sizeof(cap.notify_off_multiplier)));
+    cap.cfg_type = type;
+    cap.bar = 0;
+    cap.offset = offset;
+    cap.length = length;
+    cap.notify_off_multiplier = NOTIFY_MULTIPLIER;
+    return pci_add_capability(pdev, PCI_CAP_ID_VNDR, &cap, (uint8_t)(cap.cap_len - 2)) ? 0 : -1;
+}
+
+int virtio_pci_attach(virtio_dev_t *dev) {
+    const virtio_device_ops_t *ops = dev->ops;
+    pci_id_t id = {
+        .vendor = VIRTIO_PCI_VENDOR,
+        .device = (uint16_t)(VIRTIO_PCI_DEVICE_BASE + ops->device_id),
+        .subsystem_vendor = VIRTIO_PCI_VENDOR,
+        .subsystem = VIRTIO_PCI_SUBSYSTEM,
+        .class_code = class_code(ops->device_id),
+        .revision = 1, // Modern-only device
+    };
+
+    pci_device_t *pdev = pci_add_device(&virtio_pci_ops, dev, &id);
+    if (!pdev || pci_add_bar(pdev, 0, BAR_SIZE) < 0 ||
+        pci_msix_init(pdev, (uint16_t)(ops->num_queues + 1), 0, MSIX_TABLE_OFFSET, MSIX_PBA_OFFSET) < 0 ||
+        add_cap(pdev, VIRTIO_PCI_CAP_COMMON_CFG, COMMON_OFFSET, COMMON_SIZE, false) < 0 ||
+        add_cap(pdev, VIRTIO_PCI_CAP_ISR_CFG, ISR_OFFSET, 1, false) < 0 ||
+        (ops->config_size && add_cap(pdev, VIRTIO_PCI_CAP_DEVICE_CFG, DEVICE_OFFSET, ops->config_size, false) < 0) ||
+        add_cap(pdev, VIRTIO_PCI_CAP_NOTIFY_CFG, NOTIFY_OFFSET, ops->num_queues * NOTIFY_MULTIPLIER, true) < 0) {
+        fprintf(stderr, "virtio-pci: cannot add %s\n", ops->name);
+        return -1;
+    }
+    pci_set_intx(pdev, (uint8_t)dev->gsi);
+    dev->pdev = pdev;
+    dev->notify_gpa = pci_bar_address(pdev, 0) + NOTIFY_OFFSET;
+    DEBUG_PRINT(DEBUG_BASIC, "virtio-pci: %s at 0x%llx, %u MSI-X vectors, INTx IRQ %u", ops->name,
+                (unsigned long long)pci_bar_address(pdev, 0), ops->num_queues + 1, dev->gsi);
+    return 0;
+}
+
+uint64_t virtio_pci_notify_addr(virtio_dev_t *dev, uint32_t queue) {
+    return dev->notify_gpa ? dev->notify_gpa + queue * NOTIFY_MULTIPLIER : 0;
+}
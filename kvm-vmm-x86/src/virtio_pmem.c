@@ -0,0 +1,150 @@
+/*
+ * virtio-pmem: a host image file mapped straight into guest memory
+ *
+ * Flush requests are answered on the event loop. fdatasync() blocks the
+ * loop while it runs, but the guest only flushes on fsync() and journal
+ * commits, so that cost is acceptable.
+ */
+
+#include "virtio_pmem.h"
+#include "virtio_mmio.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH 0
+
+struct virtio_pmem_config {
+    uint64_t start;
+    uint64_t size;
+} __attribute__((packed));
+
+struct pmem_dev {
+    virtio_dev_t *dev;
+    struct virtio_pmem_config config;
+    int fd;
+    bool cow;
+    void *mem;
+};
+
+static struct {
+    struct pmem_dev devs[VIRTIO_PMEM_MAX_DEVICES];
+    int count;
+} pmem;
+
+static void pmem_queue_notify(virtio_dev_t *dev, uint32_t queue) {
+    struct pmem_dev *pd = virtio_dev_opaque(dev);
+    struct virtq *vq = virtio_dev_queue(dev, queue);
+    struct virtq_elem elem;
+    int ret = 0;
+
+    do {
+        virtq_set_notify(vq, false);
+        while ((ret = virtq_pop(vq, &elem)) > 0) {
+            uint32_t type = UINT32_MAX;
+            uint32_t result = 0;
+
+            virtq_iov_to_buf(elem.iov, elem.out_num, 0, &type, sizeof(type));
+            if (type != VIRTIO_PMEM_REQ_TYPE_FLUSH) {
+                result = 1;
+            } else if (!pd->cow && fdatasync(pd->fd) < 0) {
+                perror("virtio-pmem fdatasync");
+                result = 1;
+            }
+            size_t n = virtq_buf_to_iov(elem.iov + elem.out_num, elem.in_num, 0, &result, sizeof(result));
+            virtq_push(vq, &elem, (uint32_t)n);
+        }
+        if (ret < 0) {
+            return;
+        }
+    } while (virtq_set_notify(vq, true));
+    virtio_dev_notify_used(dev, vq);
+}
+
+static const virtio_device_ops_t pmem_ops = {
+    .name = "virtio-pmem",
+    .device_id = VIRTIO_ID_PMEM,
+    .num_queues = 1,
+    .queue_size = VIRTIO_PMEM_QUEUE_SIZE,
+    .features = 0,
+    .config_size = sizeof(struct virtio_pmem_config),
+    .queue_notify = pmem_queue_notify,
+};
+
+int virtio_pmem_init(int vm_fd, const char *path, bool cow) {
+    struct stat st;
+
+    if (pmem.count >= VIRTIO_PMEM_MAX_DEVICES) {
+        fprintf(stderr, "virtio-pmem: too many devices (max %d)\n", VIRTIO_PMEM_MAX_DEVICES);
+        return -1;
+    }
+    struct pmem_dev *pd = &pmem.devs[pmem.count];
+    memset(pd, 0, sizeof(*pd));
+    pd->cow = cow;
+    pd->fd = open(path, (cow ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (pd->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(pd->fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "virtio-pmem: %s is empty or unreadable\n", path);
+        close(pd->fd);
+        return -1;
+    }
+    uint64_t file_size = (uint64_t)st.st_size;
+    uint64_t size = (file_size + VIRTIO_PMEM_SIZE_ALIGN - 1) & ~(VIRTIO_PMEM_SIZE_ALIGN - 1);
+
+    // A private mapping is writable without touching the file
+    pd->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, cow ? MAP_PRIVATE | MAP_NORESERVE : MAP_SHARED,
+                   pd->fd, 0);
+    if (pd->mem == MAP_FAILED) {
+        perror("mmap virtio-pmem");
+        close(pd->fd);
+        return -1;
+    }
+    // Past the end of the file: zero pages instead of SIGBUS
+    uint64_t file_end = (file_size + (uint64_t)getpagesize() - 1) & ~((uint64_t)getpagesize() - 1);
+    if (file_end < size &&
+        mmap((uint8_t *)pd->mem + file_end, size - file_end, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        perror("mmap virtio-pmem tail");
+        munmap(pd->mem, size);
+        close(pd->fd);
+        return -1;
+    }
+
+    uint64_t gpa;
+    if (virtio_map_device_memory(vm_fd, pd->mem, size, &gpa) < 0) {
+        munmap(pd->mem, size);
+        close(pd->fd);
+        return -1;
+    }
+    pd->config.start = gpa;
+    pd->config.size = size;
+
+    pd->dev = virtio_mmio_add(&pmem_ops, &pd->config, pd);
+    if (!pd->dev) {
+        // The slot stays until the VM is torn down, which follows directly
+        munmap(pd->mem, size);
+        close(pd->fd);
+        return -1;
+    }
+    pmem.count++;
+    printf("virtio-pmem: %s at GPA 0x%llx (%llu MiB, %s)\n", path, (unsigned long long)pd->config.start,
+           (unsigned long long)(size >> 20), cow ? "copy-on-write" : "shared");
+    return 0;
+}
+
+void virtio_pmem_cleanup(void) {
+    for (int i = 0; i < pmem.count; i++) {
+        struct pmem_dev *pd = &pmem.devs[i];
+        munmap(pd->mem, pd->config.size);
+        close(pd->fd);
+    }
+    pmem.count = 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * virtio-pmem: a host image file mapped straight into guest memory
+ *
+ * The file is mmap()ed and registered with KVM as its own memory slot above
+ * 4 GiB, and the device tells the guest where the range is. Linux exposes
+ * it as /dev/pmemN and can mount it with -o dax, so filesystem reads and
+ * writes are plain loads and stores to the host page cache. No block
+ * requests are made and nothing is copied into guest RAM at boot.
+ *
+ *   default  MAP_SHARED: guest writes land in the file. The only request
+ *            on the virtqueue is a flush, answered with fdatasync().
+ *   cow      MAP_PRIVATE: guest writes are copy-on-write and the file is
+ *            never modified. Many VMs can boot one rootfs this way, and
+ *            the pages they only read are shared through the page cache.
+ *
+ * The range is rounded up to 2 MiB (the guest maps it in 2 MiB sections).
+ * Bytes past the end of the file read as zero and are not written back.
+ */
+
+#ifndef VIRTIO_PMEM_H
+#define VIRTIO_PMEM_H
+
+#include <stdbool.h>
+
+#define VIRTIO_PMEM_QUEUE_SIZE   16
+#define VIRTIO_PMEM_MAX_DEVICES  4
+#define VIRTIO_PMEM_SIZE_ALIGN   (2ULL << 20)
+
+// Map path into the guest (copy-on-write with cow) and register the device
+int virtio_pmem_init(int vm_fd, const char *path, bool cow);
+
+// Unmap the images (vCPUs must be stopped)
+void virtio_pmem_cleanup(void);
+
+#endif // VIRTIO_PMEM_H
@@ -0,0 +1,215 @@
+/*
+ * virtio-rng (entropy source) for Linux guests
+ *
+ * Requests are served on the event loop when the driver kicks the queue.
+ * When the token bucket runs dry the remaining buffers stay on the avail
+ * ring and a timerfd, armed for when the bucket next holds a useful amount,
+ * resumes them.
+ */
+
+#include "virtio_rng.h"
+#include "virtio_mmio.h"
+#include "event_loop.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/timerfd.h>
+
+#define RQ 0
+
+#define RNG_MIN_GRANT 64 // Bytes the bucket refills before a throttled queue resumes
+
+static struct {
+    virtio_dev_t *dev;
+    uint8_t pool[VIRTIO_RNG_POOL];
+    size_t pool_left;       // Unused bytes at the end of pool
+    uint64_t rate;          // Bytes per second, 0 for unlimited
+    uint64_t tokens;
+    struct timespec refilled;
+    int timer_fd;
+    bool throttled;         // Timer armed, queue waits for tokens
+} rng = { .timer_fd = -1 };
+
+static void refill_tokens(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (uint64_t)(now.tv_sec - rng.refilled.tv_sec) * 1000000000ULL +
+                  (uint64_t)(now.tv_nsec - rng.refilled.tv_nsec);
+    if (ns > 1000000000ULL) {
+        ns = 1000000000ULL; // The bucket holds one second's worth
+    }
+    uint64_t add = ns * rng.rate / 1000000000ULL;
+    if (add == 0) {
+        return; // Keep the remainder accruing
+    }
+    rng.tokens += add;
+    if (rng.tokens > rng.rate) {
+        rng.tokens = rng.rate;
+    }
+    rng.refilled = now;
+}
+
+// Resume the queue once the bucket holds RNG_MIN_GRANT bytes
+static void throttle(void) {
+    struct itimerspec its;
+    uint64_t ns = (RNG_MIN_GRANT - rng.tokens) * 1000000000ULL / rng.rate + 1;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(ns / 1000000000ULL);
+    its.it_value.tv_nsec = (long)(ns % 1000000000ULL);
+    if (timerfd_settime(rng.timer_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+        return;
+    }
+    rng.throttled = true;
+}
+
+// Copy up to len random bytes into a chain's buffers; returns the count
+static size_t fill(const struct virtq_elem *elem, size_t len) {
+    size_t written = 0;
+
+    while (written < len) {
+        if (rng.pool_left == 0) {
+            ssize_t n = getrandom(rng.pool, sizeof(rng.pool), 0);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                perror("getrandom");
+                break;
+            }
+            rng.pool_left = (size_t)n;
+        }
+        size_t chunk = len - written;
+        if (chunk > rng.pool_left) {
+            chunk = rng.pool_left;
+        }
+        // Take from the end of what is left
+        rng.pool_left -= chunk;
+        size_t n = virtq_buf_to_iov(elem->iov + elem->out_num, elem->in_num, written,
+                                    rng.pool + rng.pool_left, chunk);
+        if (n == 0) {
+            break;
+        }
+        written += n;
+    }
+    return written;
+}
+
+static void rng_process(virtio_dev_t *dev) {
+    struct virtq *vq = virtio_dev_queue(dev, RQ);
+    struct virtq_elem elem;
+    bool used = false;
+    int ret = 0;
+
+    if (rng.throttled) {
+        return; // The timer resumes the queue
+    }
+    do {
+        virtq_set_notify(vq, false);
+        while (virtq_has_avail(vq)) {
+            size_t want = VIRTIO_RNG_POOL;
+            if (rng.rate) {
+                refill_tokens();
+                if (rng.tokens == 0) {
+                    throttle();
+                    goto out;
+                }
+                want = rng.tokens;
+            }
+            if ((ret = virtq_pop(vq, &elem)) <= 0) {
+                break;
+            }
+            size_t room = 0;
+            for (unsigned i = 0; i < elem.in_num; i++) {
+                room += elem.iov[elem.out_num + i].iov_len;
+            }
+            size_t n = fill(&elem, room < want ? room : want);
+            if (rng.rate) {
+                rng.tokens -= n;
+            }
+            virtq_push(vq, &elem, (uint32_t)n);
+            used = true;
+        }
+        if (ret < 0) {
+            break;
+        }
+    } while (virtq_set_notify(vq, true));
+out:
+    if (used) {
+        virtio_dev_notify_used(dev, vq);
+    }
+}
+
+static void rng_timer_event(int fd, uint32_t events, void *opaque) {
+    uint64_t expirations;
+
+    (void)events;
+    (void)opaque;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    virtio_dev_lock(rng.dev);
+    rng.throttled = false;
+    if (virtio_dev_driver_ok(rng.dev)) {
+        rng_process(rng.dev);
+    }
+    virtio_dev_unlock(rng.dev);
+}
+
+static void rng_queue_notify(virtio_dev_t *dev, uint32_t queue) {
+    (void)queue;
+    rng_process(dev);
+}
+
+static const virtio_device_ops_t rng_ops = {
+    .name = "virtio-rng",
+    .device_id = VIRTIO_ID_RNG,
+    .num_queues = 1,
+    .queue_size = VIRTIO_RNG_QUEUE_SIZE,
+    .features = 0,
+    .config_size = 0,
+    .queue_notify = rng_queue_notify,
+};
+
+int virtio_rng_init(uint64_t rate) {
+    rng.rate = rate;
+    rng.tokens = rate; // Full bucket: the boot-time seeding never waits
+    clock_gettime(CLOCK_MONOTONIC, &rng.refilled);
+
+    if (rate) {
+        rng.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (rng.timer_fd < 0) {
+            perror("timerfd_create");
+            return -1;
+        }
+        if (event_loop_add(rng.timer_fd, EPOLLIN, rng_timer_event, NULL) < 0) {
+            virtio_rng_cleanup();
+            return -1;
+        }
+    }
+
+    rng.dev = virtio_mmio_add(&rng_ops, NULL, NULL);
+    if (!rng.dev) {
+        virtio_rng_cleanup();
+        return -1;
+    }
+    DEBUG_PRINT(DEBUG_BASIC, "virtio-rng: %llu bytes/s", (unsigned long long)rate);
+    return 0;
+}
+
+void virtio_rng_cleanup(void) {
+    if (rng.timer_fd >= 0) {
+        event_loop_del(rng.timer_fd);
+        close(rng.timer_fd);
+        rng.timer_fd = -1;
+    }
+    explicit_bzero(rng.pool, sizeof(rng.pool));
+    rng.pool_left = 0;
+}
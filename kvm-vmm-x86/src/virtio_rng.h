@@ -0,0 +1,30 @@
+/*
+ * virtio-rng (entropy source) for Linux guests
+ *
+ * The guest's hwrng driver posts buffers that are filled from the host's
+ * getrandom(). The kernel credits that input to its pool, so crng init
+ * finishes as soon as the driver probes. Without a device it waits for
+ * jitter or interrupt entropy, which makes boot time unpredictable.
+ *
+ * Bytes are drawn from a host pool refilled with one getrandom() call at a
+ * time, and handed out through a token bucket. The bucket starts full, so
+ * the seeding at boot never waits. A guest that keeps reading past the
+ * burst is served at the configured rate.
+ */
+
+#ifndef VIRTIO_RNG_H
+#define VIRTIO_RNG_H
+
+#include <stdint.h>
+
+#define VIRTIO_RNG_QUEUE_SIZE   64
+#define VIRTIO_RNG_POOL         4096        // Bytes fetched per getrandom()
+#define VIRTIO_RNG_DEFAULT_RATE (64 * 1024) // Bytes per second (and burst)
+
+// Register the device; rate is bytes per second, 0 for unlimited
+int virtio_rng_init(uint64_t rate);
+
+// Release the rate-limit timer (the event loop must be stopped)
+void virtio_rng_cleanup(void);
+
+#endif // VIRTIO_RNG_H
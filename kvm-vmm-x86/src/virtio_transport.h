@@ -0,0 +1,76 @@
+/*
+ * Device state shared by the virtio-mmio and virtio-pci transports
+ *
+ * Device models only use virtio_mmio.h. virtio_mmio.c owns the devices and
+ * the register semantics; virtio_pci.c lays the same registers out in a
+ * PCI BAR and delivers interrupts through MSI-X.
+ */
+
+#ifndef VIRTIO_TRANSPORT_H
+#define VIRTIO_TRANSPORT_H
+
+#include "virtio_mmio.h"
+#include "pci.h"
+#include <pthread.h>
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+struct virtio_kick {
+    virtio_dev_t *dev;
+    uint32_t queue;
+    int fd;
+    uint64_t addr;         // Where the ioeventfd is bound (0: not bound)
+};
+
+struct virtio_dev {
+    const virtio_device_ops_t *ops;
+    void *config;
+    void *opaque;
+    uint64_t base;
+    uint32_t gsi;
+    pthread_mutex_t lock;
+
+    // Transport registers
+    uint32_t status;
+    uint32_t isr;
+    uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint64_t driver_features;
+    uint32_t queue_sel;
+    uint32_t config_generation;
+    uint32_t shm_sel;
+    struct virtq queues[VIRTIO_MMIO_MAX_QUEUES];
+
+    // Shared memory region (shm_len 0: none)
+    uint32_t shm_id;
+    uint64_t shm_base;
+    uint64_t shm_len;
+
+    // virtio-pci (pdev NULL: the device is on virtio-mmio)
+    pci_device_t *pdev;
+    uint64_t notify_gpa;   // Queue notify region, 0 while BAR0 does not decode
+    uint16_t msix_config;
+    uint16_t queue_vector[VIRTIO_MMIO_MAX_QUEUES];
+
+    // Host plumbing
+    int irq_fd;
+    int resample_fd;
+    bool irq_asserted;
+    struct virtio_kick kicks[VIRTIO_MMIO_MAX_QUEUES];
+};
+
+// Register semantics, by virtio-mmio offset (device lock held)
+uint32_t virtio_transport_read_reg(virtio_dev_t *dev, uint32_t offset);
+void virtio_transport_write_reg(virtio_dev_t *dev, uint32_t offset, uint32_t val);
+
+// Bind or unbind a queue's ioeventfd at its current notify address (device
+// lock held)
+void virtio_transport_bind_kick(virtio_dev_t *dev, uint32_t queue, bool bind);
+
+// Put a device on the PCI bus instead of the virtio-mmio window
+int virtio_pci_attach(virtio_dev_t *dev);
+
+// Where the driver kicks queue on a virtio-pci device (0: nowhere)
+uint64_t virtio_pci_notify_addr(virtio_dev_t *dev, uint32_t queue);
+
+#endif // VIRTIO_TRANSPORT_H
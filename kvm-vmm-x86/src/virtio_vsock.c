@@ -0,0 +1,773 @@
+/*
+ * virtio-vsock for Linux guests, bridged to host AF_UNIX sockets
+ *
+ * All state is covered by the device lock: queue kicks, host socket events
+ * and the listening socket are handled on the event loop with it held.
+ * Control packets (responses, resets, credit updates) wait in a small ring
+ * until the guest posts receive buffers; data is only read from a host
+ * socket once they have gone out, so a connection's packets stay in order.
+ *
+ * A connection's socket is polled only for what it can make progress on:
+ * readable while the guest has credit and buffers, writable while guest
+ * data is waiting for the host. A socket the peer hung up on is taken off
+ * the event loop while it cannot be read, since epoll reports the hangup
+ * regardless of the requested events.
+ */
+
+#define _GNU_SOURCE // accept4
+#include "virtio_vsock.h"
+#include "virtio_mmio.h"
+#include "event_loop.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define RXQ 0
+#define TXQ 1
+#define EVQ 2
+
+#define VSOCK_TYPE_STREAM 1
+
+// Packet operations
+#define VSOCK_OP_REQUEST        1
+#define VSOCK_OP_RESPONSE       2
+#define VSOCK_OP_RST            3
+#define VSOCK_OP_SHUTDOWN       4
+#define VSOCK_OP_RW             5
+#define VSOCK_OP_CREDIT_UPDATE  6
+#define VSOCK_OP_CREDIT_REQUEST 7
+
+// SHUTDOWN flags
+#define VSOCK_SHUTDOWN_RCV  1
+#define VSOCK_SHUTDOWN_SEND 2
+
+#define VSOCK_CTRL_MAX        64        // Control packets waiting for receive buffers
+#define VSOCK_RX_BUDGET       32        // Receive buffers one connection fills per wakeup
+#define VSOCK_LOCAL_PORT_BASE (1U << 30) // Host ports of host-initiated connections
+#define VSOCK_HANDSHAKE_MAX   64        // "CONNECT <port>\n"
+
+struct virtio_vsock_hdr {
+    uint64_t src_cid;
+    uint64_t dst_cid;
+    uint32_t src_port;
+    uint32_t dst_port;
+    uint32_t len;
+    uint16_t type;
+    uint16_t op;
+    uint32_t flags;
+    uint32_t buf_alloc;
+    uint32_t fwd_cnt;
+} __attribute__((packed));
+
+enum conn_state {
+    CONN_FREE,
+    CONN_HANDSHAKE,   // Host connected, waiting for its CONNECT line
+    CONN_CONNECTING,  // REQUEST sent to the guest
+    CONN_ESTABLISHED,
+    CONN_CLOSING,     // SHUTDOWN sent to the guest, waiting for its RST
+};
+
+struct vsock_conn {
+    enum conn_state state;
+    int fd;
+    bool registered;          // fd is on the event loop
+    uint32_t events;          // Events it is polled for
+    uint32_t host_port;
+    uint32_t guest_port;
+
+    // Host -> guest
+    uint32_t tx_cnt;          // Bytes sent to the guest
+    uint32_t peer_buf_alloc;
+    uint32_t peer_fwd_cnt;
+    bool credit_requested;
+    bool host_eof;
+
+    // Guest -> host
+    uint8_t *pending;         // Guest data the host socket has not taken yet
+    uint32_t pending_len;
+    uint32_t fwd_cnt;         // Bytes handed to the host socket
+    uint32_t fwd_cnt_sent;    // fwd_cnt the guest last heard about
+    bool guest_shut_send;     // Shut the socket for writing once pending drains
+};
+
+static struct {
+    virtio_dev_t *dev;
+    struct {
+        uint64_t guest_cid;
+    } __attribute__((packed)) config;
+    char uds_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int listen_fd;
+    struct vsock_conn conns[VSOCK_MAX_CONNS];
+    uint32_t next_local_port;
+
+    struct virtio_vsock_hdr ctrl[VSOCK_CTRL_MAX];
+    int ctrl_head;
+    int ctrl_len;
+
+    struct virtq_elem elem;
+    struct virtq_elem spare;  // Receive chain popped but not filled
+    bool have_spare;
+    bool rx_starved;          // Out of receive buffers until the next kick
+} vs = { .listen_fd = -1 };
+
+static void conn_event(int fd, uint32_t events, void *opaque);
+
+static size_t iov_size(const struct iovec *iov, unsigned n) {
+    size_t size = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
+// Describe [skip, skip + len) of src in dst; returns the segment count
+static int iov_slice(const struct iovec *src, unsigned n, size_t skip, size_t len, struct iovec *dst) {
+    int count = 0;
+
+    for (unsigned i = 0; i < n && len > 0; i++) {
+        if (skip >= src[i].iov_len) {
+            skip -= src[i].iov_len;
+            continue;
+        }
+        size_t chunk = src[i].iov_len - skip;
+        if (chunk > len) {
+            chunk = len;
+        }
+        dst[count].iov_base = (uint8_t *)src[i].iov_base + skip;
+        dst[count].iov_len = chunk;
+        count++;
+        len -= chunk;
+        skip = 0;
+    }
+    return count;
+}
+
+static uint32_t peer_credit(struct vsock_conn *c) {
+    return c->peer_buf_alloc - (c->tx_cnt - c->peer_fwd_cnt);
+}
+
+static struct vsock_conn *find_conn(uint32_t guest_port, uint32_t host_port) {
+    for (int i = 0; i < VSOCK_MAX_CONNS; i++) {
+        struct vsock_conn *c = &vs.conns[i];
+        if (c->state != CONN_FREE && c->state != CONN_HANDSHAKE && c->guest_port == guest_port &&
+            c->host_port == host_port) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static struct vsock_conn *alloc_conn(int fd) {
+    for (int i = 0; i < VSOCK_MAX_CONNS; i++) {
+        struct vsock_conn *c = &vs.conns[i];
+        if (c->state == CONN_FREE) {
+            memset(c, 0, sizeof(*c));
+            c->fd = fd;
+            return c;
+        }
+    }
+    fprintf(stderr, "virtio-vsock: too many connections (max %d)\n", VSOCK_MAX_CONNS);
+    return NULL;
+}
+
+static void conn_close(struct vsock_conn *c) {
+    if (c->registered) {
+        event_loop_del(c->fd);
+    }
+    close(c->fd);
+    free(c->pending);
+    DEBUG_PRINT(DEBUG_DETAILED, "virtio-vsock: closed guest port %u <-> host port %u", c->guest_port,
+                c->host_port);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+// Poll the socket for what the connection can make progress on
+static void update_events(struct vsock_conn *c) {
+    uint32_t events = 0;
+
+    if (c->state == CONN_HANDSHAKE) {
+        events = EPOLLIN;
+    } else if (c->state == CONN_ESTABLISHED) {
+        if (!c->host_eof && !vs.rx_starved && peer_credit(c) > 0) {
+            events |= EPOLLIN;
+        }
+        if (c->pending_len > 0) {
+            events |= EPOLLOUT;
+        }
+    }
+
+    if (!c->registered) {
+        if (events && event_loop_add(c->fd, events, conn_event, c) == 0) {
+            c->registered = true;
+            c->events = events;
+        }
+    } else if (events != c->events && event_loop_mod(c->fd, events) == 0) {
+        c->events = events;
+    }
+}
+
+static void fill_hdr(struct virtio_vsock_hdr *hdr, struct vsock_conn *c, uint16_t op, uint32_t len,
+                     uint32_t flags) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->src_cid = VSOCK_HOST_CID;
+    hdr->dst_cid = vs.config.guest_cid;
+    hdr->src_port = c->host_port;
+    hdr->dst_port = c->guest_port;
+    hdr->len = len;
+    hdr->type = VSOCK_TYPE_STREAM;
+    hdr->op = op;
+    hdr->flags = flags;
+    hdr->buf_alloc = VSOCK_BUF_ALLOC;
+    hdr->fwd_cnt = c->fwd_cnt;
+    c->fwd_cnt_sent = c->fwd_cnt;
+}
+
+// Next receive chain, or false (and starved) when the guest has none posted
+static bool get_rx_chain(struct virtq_elem *elem) {
+    if (vs.have_spare) {
+        *elem = vs.spare;
+        vs.have_spare = false;
+        return true;
+    }
+    if (virtq_pop(virtio_dev_queue(vs.dev, RXQ), elem) > 0) {
+        return true;
+    }
+    vs.rx_starved = true;
+    return false;
+}
+
+// Deliver queued control packets; returns true if chains were used
+static bool flush_ctrl(void) {
+    struct virtq *vq = virtio_dev_queue(vs.dev, RXQ);
+    bool used = false;
+
+    while (vs.ctrl_len > 0 && get_rx_chain(&vs.elem)) {
+        struct virtio_vsock_hdr *hdr = &vs.ctrl[vs.ctrl_head];
+        size_t n = virtq_buf_to_iov(vs.elem.iov + vs.elem.out_num, vs.elem.in_num, 0, hdr, sizeof(*hdr));
+
+        virtq_push(vq, &vs.elem, (uint32_t)n);
+        vs.ctrl_head = (vs.ctrl_head + 1) % VSOCK_CTRL_MAX;
+        vs.ctrl_len--;
+        used = true;
+    }
+    return used;
+}
+
+static void queue_ctrl(const struct virtio_vsock_hdr *hdr) {
+    if (vs.ctrl_len == VSOCK_CTRL_MAX) {
+        fprintf(stderr, "virtio-vsock: control queue full, dropping op %u\n", hdr->op);
+        return;
+    }
+    vs.ctrl[(vs.ctrl_head + vs.ctrl_len) % VSOCK_CTRL_MAX] = *hdr;
+    vs.ctrl_len++;
+}
+
+static void send_ctrl(struct vsock_conn *c, uint16_t op, uint32_t flags) {
+    struct virtio_vsock_hdr hdr;
+
+    fill_hdr(&hdr, c, op, 0, flags);
+    queue_ctrl(&hdr);
+}
+
+// Reset a connection the guest addressed that we do not (or no longer) have
+static void send_rst_reply(const struct virtio_vsock_hdr *req) {
+    struct virtio_vsock_hdr hdr;
+
+    if (req->op == VSOCK_OP_RST) {
+        return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.src_cid = VSOCK_HOST_CID;
+    hdr.dst_cid = vs.config.guest_cid;
+    hdr.src_port = req->dst_port;
+    hdr.dst_port = req->src_port;
+    hdr.type = req->type;
+    hdr.op = VSOCK_OP_RST;
+    queue_ctrl(&hdr);
+}
+
+static void conn_reset(struct vsock_conn *c) {
+    send_ctrl(c, VSOCK_OP_RST, 0);
+    conn_close(c);
+}
+
+static void maybe_credit_update(struct vsock_conn *c) {
+    if (c->state == CONN_ESTABLISHED && c->fwd_cnt - c->fwd_cnt_sent >= VSOCK_BUF_ALLOC / 4) {
+        send_ctrl(c, VSOCK_OP_CREDIT_UPDATE, 0);
+    }
+}
+
+// Read host data straight into receive buffers; returns true if chains were used
+static bool deliver_data(struct vsock_conn *c) {
+    struct virtq *vq = virtio_dev_queue(vs.dev, RXQ);
+    struct iovec iov[VIRTQ_MAX_SEGS];
+    bool used = flush_ctrl();
+
+    for (int budget = VSOCK_RX_BUDGET; budget > 0 && vs.ctrl_len == 0; budget--) {
+        uint32_t credit = peer_credit(c);
+        if (credit == 0) {
+            if (!c->credit_requested) {
+                send_ctrl(c, VSOCK_OP_CREDIT_REQUEST, 0);
+                c->credit_requested = true;
+            }
+            break;
+        }
+        if (!get_rx_chain(&vs.elem)) {
+            break;
+        }
+
+        struct iovec *in = vs.elem.iov + vs.elem.out_num;
+        size_t room = iov_size(in, vs.elem.in_num);
+        if (room <= sizeof(struct virtio_vsock_hdr)) {
+            virtq_push(vq, &vs.elem, 0); // Unusable buffer
+            used = true;
+            continue;
+        }
+        room -= sizeof(struct virtio_vsock_hdr);
+        int niov = iov_slice(in, vs.elem.in_num, sizeof(struct virtio_vsock_hdr),
+                             room < credit ? room : credit, iov);
+        ssize_t n = readv(c->fd, iov, niov);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            vs.spare = vs.elem;
+            vs.have_spare = true;
+            break;
+        }
+        if (n <= 0) {
+            // The host side closed: tell the guest, which answers with RST
+            vs.spare = vs.elem;
+            vs.have_spare = true;
+            c->host_eof = true;
+            c->state = CONN_CLOSING;
+            send_ctrl(c, VSOCK_OP_SHUTDOWN, VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND);
+            break;
+        }
+
+        struct virtio_vsock_hdr hdr;
+        fill_hdr(&hdr, c, VSOCK_OP_RW, (uint32_t)n, 0);
+        virtq_buf_to_iov(in, vs.elem.in_num, 0, &hdr, sizeof(hdr));
+        virtq_push(vq, &vs.elem, (uint32_t)(sizeof(hdr) + (size_t)n));
+        c->tx_cnt += (uint32_t)n;
+        used = true;
+    }
+    used |= flush_ctrl();
+    return used;
+}
+
+// Hand buffered guest data to the host socket
+static void flush_pending(struct vsock_conn *c) {
+    while (c->pending_len > 0) {
+        ssize_t n = send(c->fd, c->pending, c->pending_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            conn_reset(c);
+            return;
+        }
+        memmove(c->pending, c->pending + n, c->pending_len - (size_t)n);
+        c->pending_len -= (uint32_t)n;
+        c->fwd_cnt += (uint32_t)n;
+    }
+    if (c->pending_len == 0 && c->guest_shut_send) {
+        shutdown(c->fd, SHUT_WR);
+    }
+    maybe_credit_update(c);
+}
+
+// RW from the guest: write through to the host socket, buffer the rest
+static void guest_data(struct vsock_conn *c, const struct virtq_elem *elem, uint32_t len) {
+    struct iovec iov[VIRTQ_MAX_SEGS];
+    size_t skip = sizeof(struct virtio_vsock_hdr);
+    int niov = iov_slice(elem->iov, elem->out_num, skip, len, iov);
+    size_t written = 0;
+
+    if (len > VSOCK_BUF_ALLOC - c->pending_len) {
+        fprintf(stderr, "virtio-vsock: guest port %u overran its credit\n", c->guest_port);
+        conn_reset(c);
+        return;
+    }
+    if (c->pending_len == 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)niov };
+        ssize_t n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            conn_reset(c);
+            return;
+        }
+        written = n > 0 ? (size_t)n : 0;
+        c->fwd_cnt += (uint32_t)written;
+    }
+    if (written < len) {
+        virtq_iov_to_buf(elem->iov, elem->out_num, skip + written, c->pending + c->pending_len, len - written);
+        c->pending_len += (uint32_t)(len - written);
+    }
+    maybe_credit_update(c);
+}
+
+// Guest connect() to the host: dial "<uds>_<port>"
+static void guest_connect(const struct virtio_vsock_hdr *hdr) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", vs.uds_path, hdr->dst_port);
+    if (len < 0 || (size_t)len >= sizeof(addr.sun_path)) {
+        send_rst_reply(hdr);
+        return;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        DEBUG_PRINT(DEBUG_BASIC, "virtio-vsock: nothing listens on %s", addr.sun_path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        send_rst_reply(hdr);
+        return;
+    }
+
+    struct vsock_conn *c = alloc_conn(fd);
+    uint8_t *pending = malloc(VSOCK_BUF_ALLOC);
+    if (!c || !pending) {
+        free(pending);
+        close(fd);
+        send_rst_reply(hdr);
+        return;
+    }
+    c->state = CONN_ESTABLISHED;
+    c->guest_port = hdr->src_port;
+    c->host_port = hdr->dst_port;
+    c->peer_buf_alloc = hdr->buf_alloc;
+    c->peer_fwd_cnt = hdr->fwd_cnt;
+    c->pending = pending;
+    send_ctrl(c, VSOCK_OP_RESPONSE, 0);
+    update_events(c);
+    DEBUG_PRINT(DEBUG_BASIC, "virtio-vsock: guest port %u connected to %s", c->guest_port, addr.sun_path);
+}
+
+// The guest accepted a host-initiated connection
+static void guest_accepted(struct vsock_conn *c) {
+    char line[32];
+    int len = snprintf(line, sizeof(line), "OK %u\n", c->host_port);
+
+    c->pending = malloc(VSOCK_BUF_ALLOC);
+    if (!c->pending || send(c->fd, line, (size_t)len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+        conn_reset(c);
+        return;
+    }
+    c->state = CONN_ESTABLISHED;
+    update_events(c);
+}
+
+static void handle_packet(const struct virtio_vsock_hdr *hdr, const struct virtq_elem *elem) {
+    size_t avail = iov_size(elem->iov, elem->out_num) - sizeof(*hdr);
+    uint32_t len = hdr->len < avail ? hdr->len : (uint32_t)avail;
+
+    if (hdr->dst_cid != VSOCK_HOST_CID || hdr->src_cid != vs.config.guest_cid) {
+        return;
+    }
+    if (hdr->type != VSOCK_TYPE_STREAM) {
+        send_rst_reply(hdr);
+        return;
+    }
+
+    struct vsock_conn *c = find_conn(hdr->src_port, hdr->dst_port);
+    if (hdr->op == VSOCK_OP_REQUEST) {
+        if (c) {
+            send_rst_reply(hdr);
+        } else {
+            guest_connect(hdr);
+        }
+        return;
+    }
+    if (!c) {
+        send_rst_reply(hdr);
+        return;
+    }
+
+    // Every packet carries the guest's receive window
+    c->peer_buf_alloc = hdr->buf_alloc;
+    c->peer_fwd_cnt = hdr->fwd_cnt;
+
+    switch (hdr->op) {
+    case VSOCK_OP_RESPONSE:
+        if (c->state == CONN_CONNECTING) {
+            guest_accepted(c);
+        } else {
+            conn_reset(c);
+        }
+        return;
+    case VSOCK_OP_RW:
+        if (c->state == CONN_ESTABLISHED) {
+            guest_data(c, elem, len);
+        } else if (c->state != CONN_CLOSING) {
+            conn_reset(c);
+            return;
+        }
+        break;
+    case VSOCK_OP_CREDIT_UPDATE:
+        c->credit_requested = false;
+        break;
+    case VSOCK_OP_CREDIT_REQUEST:
+        send_ctrl(c, VSOCK_OP_CREDIT_UPDATE, 0);
+        break;
+    case VSOCK_OP_SHUTDOWN:
+        if ((hdr->flags & (VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND)) ==
+                (VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND) || c->host_eof) {
+            conn_reset(c);
+            return;
+        }
+        if (hdr->flags & VSOCK_SHUTDOWN_SEND) {
+            c->guest_shut_send = true;
+            if (c->pending_len == 0) {
+                shutdown(c->fd, SHUT_WR);
+            }
+        }
+        if (hdr->flags & VSOCK_SHUTDOWN_RCV) {
+            c->host_eof = true; // Nothing more for the guest
+        }
+        break;
+    case VSOCK_OP_RST:
+        conn_close(c);
+        return;
+    default:
+        conn_reset(c);
+        return;
+    }
+    update_events(c);
+}
+
+static void vsock_tx(void) {
+    struct virtq *vq = virtio_dev_queue(vs.dev, TXQ);
+    struct virtio_vsock_hdr hdr;
+    int ret = 0;
+
+    do {
+        virtq_set_notify(vq, false);
+        while ((ret = virtq_pop(vq, &vs.elem)) > 0) {
+            if (virtq_iov_to_buf(vs.elem.iov, vs.elem.out_num, 0, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+                handle_packet(&hdr, &vs.elem);
+            }
+            virtq_push(vq, &vs.elem, 0);
+        }
+        if (ret < 0) {
+            return;
+        }
+    } while (virtq_set_notify(vq, true));
+    virtio_dev_notify_used(vs.dev, vq);
+}
+
+// Receive buffers were posted: resume control packets and paused sockets
+static void vsock_rx_refill(void) {
+    vs.rx_starved = false;
+    if (flush_ctrl()) {
+        virtio_dev_notify_used(vs.dev, virtio_dev_queue(vs.dev, RXQ));
+    }
+    for (int i = 0; i < VSOCK_MAX_CONNS; i++) {
+        if (vs.conns[i].state != CONN_FREE) {
+            update_events(&vs.conns[i]);
+        }
+    }
+}
+
+static void vsock_queue_notify(virtio_dev_t *dev, uint32_t queue) {
+    (void)dev;
+    if (queue == TXQ) {
+        vsock_tx();
+        // Responses and credit updates produced by the batch
+        if (flush_ctrl()) {
+            virtio_dev_notify_used(vs.dev, virtio_dev_queue(vs.dev, RXQ));
+        }
+    } else if (queue == RXQ) {
+        vsock_rx_refill();
+    }
+    // Nothing is ever sent on the event queue
+}
+
+// A host agent connected to <uds>: read its "CONNECT <port>\n" line
+static void handshake(struct vsock_conn *c) {
+    char line[VSOCK_HANDSHAKE_MAX + 1];
+    unsigned port;
+
+    ssize_t n = recv(c->fd, line, VSOCK_HANDSHAKE_MAX, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        conn_close(c);
+        return;
+    }
+    line[n] = '\0';
+    char *newline = strchr(line, '\n');
+    if (!newline) {
+        if (n == VSOCK_HANDSHAKE_MAX) {
+            conn_close(c); // Not a CONNECT line
+        }
+        return;
+    }
+
+    // Consume just the line: anything after it is stream data
+    size_t len = (size_t)(newline - line) + 1;
+    if (recv(c->fd, line, len, MSG_DONTWAIT) != (ssize_t)len || sscanf(line, "CONNECT %u", &port) != 1) {
+        conn_close(c);
+        return;
+    }
+    c->guest_port = port;
+    do {
+        c->host_port = vs.next_local_port++;
+        if (vs.next_local_port < VSOCK_LOCAL_PORT_BASE) {
+            vs.next_local_port = VSOCK_LOCAL_PORT_BASE;
+        }
+    } while (find_conn(c->guest_port, c->host_port));
+    c->state = CONN_CONNECTING;
+    c->peer_buf_alloc = 0; // No credit until the guest's RESPONSE
+    send_ctrl(c, VSOCK_OP_REQUEST, 0);
+    update_events(c);
+    DEBUG_PRINT(DEBUG_BASIC, "virtio-vsock: host connecting to guest port %u", port);
+}
+
+static void conn_event(int fd, uint32_t events, void *opaque) {
+    struct vsock_conn *c = opaque;
+    bool used = false;
+
+    (void)fd;
+    virtio_dev_lock(vs.dev);
+    if (c->state == CONN_HANDSHAKE) {
+        handshake(c);
+    } else {
+        if ((events & EPOLLOUT) && c->state == CONN_ESTABLISHED) {
+            flush_pending(c);
+        }
+        if ((events & EPOLLIN) && c->state == CONN_ESTABLISHED) {
+            used = deliver_data(c);
+        } else if ((events & (EPOLLHUP | EPOLLERR)) && c->state != CONN_FREE && c->registered) {
+            // Hung up while we cannot read: stop polling until we can
+            event_loop_del(c->fd);
+            c->registered = false;
+        }
+        if (c->state != CONN_FREE) {
+            update_events(c);
+        }
+    }
+    used |= flush_ctrl();
+    if (used) {
+        virtio_dev_notify_used(vs.dev, virtio_dev_queue(vs.dev, RXQ));
+    }
+    virtio_dev_unlock(vs.dev);
+}
+
+static void accept_event(int fd, uint32_t events, void *opaque) {
+    (void)events;
+    (void)opaque;
+
+    int conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("accept vsock");
+        }
+        return;
+    }
+    virtio_dev_lock(vs.dev);
+    struct vsock_conn *c = virtio_dev_driver_ok(vs.dev) ? alloc_conn(conn) : NULL;
+    if (c) {
+        c->state = CONN_HANDSHAKE;
+        update_events(c);
+    }
+    if (!c || !c->registered) {
+        if (c) {
+            c->state = CONN_FREE;
+        }
+        close(conn);
+    }
+    virtio_dev_unlock(vs.dev);
+}
+
+static void close_all(void) {
+    for (int i = 0; i < VSOCK_MAX_CONNS; i++) {
+        if (vs.conns[i].state != CONN_FREE) {
+            conn_close(&vs.conns[i]);
+        }
+    }
+    vs.ctrl_head = 0;
+    vs.ctrl_len = 0;
+    vs.have_spare = false;
+    vs.rx_starved = false;
+}
+
+static void vsock_reset(virtio_dev_t *dev) {
+    (void)dev;
+    close_all();
+}
+
+static const virtio_device_ops_t vsock_ops = {
+    .name = "virtio-vsock",
+    .device_id = VIRTIO_ID_VSOCK,
+    .num_queues = 3,
+    .queue_size = VIRTIO_VSOCK_QUEUE_SIZE,
+    .features = 0,
+    .config_size = sizeof(vs.config),
+    .queue_notify = vsock_queue_notify,
+    .reset = vsock_reset,
+};
+
+int virtio_vsock_init(uint64_t guest_cid, const char *uds_path) {
+    struct sockaddr_un addr;
+
+    if (guest_cid <= VSOCK_HOST_CID || guest_cid >= 0xffffffffULL) {
+        fprintf(stderr, "virtio-vsock: invalid guest CID %llu\n", (unsigned long long)guest_cid);
+        return -1;
+    }
+    // Room for "_<port>" after the prefix
+    if (strlen(uds_path) + 12 > sizeof(addr.sun_path)) {
+        fprintf(stderr, "virtio-vsock: socket path too long: %s\n", uds_path);
+        return -1;
+    }
+    for (int i = 0; i < VSOCK_MAX_CONNS; i++) {
+        vs.conns[i].fd = -1;
+    }
+    vs.config.guest_cid = guest_cid;
+    vs.next_local_port = VSOCK_LOCAL_PORT_BASE;
+    snprintf(vs.uds_path, sizeof(vs.uds_path), "%s", uds_path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, uds_path);
+    vs.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (vs.listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(uds_path);
+    if (bind(vs.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(vs.listen_fd, 16) < 0 ||
+        event_loop_add(vs.listen_fd, EPOLLIN, accept_event, NULL) < 0) {
+        perror(uds_path);
+        close(vs.listen_fd);
+        vs.listen_fd = -1;
+        return -1;
+    }
+
+    vs.dev = virtio_mmio_add(&vsock_ops, &vs.config, NULL);
+    if (!vs.dev) {
+        virtio_vsock_cleanup();
+        return -1;
+    }
+    printf("virtio-vsock: guest CID %llu, host sockets %s[_<port>]\n", (unsigned long long)guest_cid, uds_path);
+    return 0;
+}
+
+void virtio_vsock_cleanup(void) {
+    close_all();
+    if (vs.listen_fd >= 0) {
+        event_loop_del(vs.listen_fd);
+        close(vs.listen_fd);
+        unlink(vs.uds_path);
+        vs.listen_fd = -1;
+    }
+}
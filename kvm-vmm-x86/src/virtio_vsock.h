@@ -0,0 +1,37 @@
+/*
+ * virtio-vsock for Linux guests, bridged to host AF_UNIX sockets
+ *
+ * Stream sockets between the guest (AF_VSOCK, CID --vsock-cid) and the host
+ * follow the Firecracker convention, so host agents need no vsock support:
+ *
+ *   guest connect(CID 2, port P)  -> the VMM connects to "<uds>_<P>"
+ *   host connect("<uds>") and writes "CONNECT <P>\n"
+ *                                 -> guest port P is connected, the host
+ *                                    reads back "OK <local port>\n"
+ *
+ * After that the AF_UNIX socket carries the raw byte stream. Data moves
+ * with vsock credit flow control in both directions: the guest never sends
+ * more than the VMM can buffer, and the VMM only reads from a host socket
+ * what the guest has room for, reading straight into posted receive
+ * buffers.
+ */
+
+#ifndef VIRTIO_VSOCK_H
+#define VIRTIO_VSOCK_H
+
+#include <stdint.h>
+
+#define VSOCK_HOST_CID          2
+#define VSOCK_DEFAULT_GUEST_CID 3
+
+#define VIRTIO_VSOCK_QUEUE_SIZE 256
+#define VSOCK_MAX_CONNS         32
+#define VSOCK_BUF_ALLOC         (256 * 1024) // Guest->host bytes buffered per connection
+
+// Register the device; uds_path is the host socket prefix
+int virtio_vsock_init(uint64_t guest_cid, const char *uds_path);
+
+// Close every connection and the listening socket (vCPUs must be stopped)
+void virtio_vsock_cleanup(void);
+
+#endif // VIRTIO_VSOCK_H
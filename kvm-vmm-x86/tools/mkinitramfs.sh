@@ -23,6 +23,7 @@ ln -sf miniutils "${tmp_root}/bin/cat"
 ln -sf miniutils "${tmp_root}/bin/uname"
 ln -sf miniutils "${tmp_root}/bin/halt"
 ln -sf miniutils "${tmp_root}/bin/poweroff"
+ln -sf miniutils "${tmp_root}/bin/netbench"
 
 bash_bin="$(command -v bash)"
 if [[ -z "${bash_bin}" ]]; then
@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+# Measure the virtio-net datapath (NIC -> switch -> tap) on a host tap
+# interface: UDP round-trip latency and echoed throughput between the host
+# and a Linux guest running `netbench serve`.
+#
+# Usage: sudo tools/net-bench.sh <bzImage> [seconds]
+#
+# Needs root (tap setup), a built ./kvm-vmm and a guest kernel with
+# CONFIG_VIRTIO_MMIO, CONFIG_VIRTIO_MMIO_CMDLINE_DEVICES and CONFIG_VIRTIO_NET.
+set -euo pipefail
+
+bzimage="${1:?usage: $0 <bzImage> [seconds]}"
+seconds="${2:-10}"
+script_dir="$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")" && pwd)"
+repo_root="$(cd -- "${script_dir}/.." && pwd)"
+
+tap="mkvm-bench0"
+host_ip="10.0.2.1"
+guest_ip="10.0.2.15"
+port=7777
+
+tmp="$(mktemp -d)"
+vmm_pid=""
+cleanup() {
+  if [[ -n "${vmm_pid}" ]]; then kill "${vmm_pid}" 2>/dev/null || true; fi
+  ip link del "${tap}" 2>/dev/null || true
+  rm -f -- "${repo_root}/netbench.cpio"
+  rm -rf -- "${tmp}"
+}
+trap cleanup EXIT
+
+if [[ ! -x "${repo_root}/kvm-vmm" ]]; then
+  echo "Error: build the VMM first (make vmm)" >&2
+  exit 1
+fi
+
+"${script_dir}/mkinitramfs.sh" netbench.cpio >/dev/null
+gcc -O2 "${repo_root}/initramfs/miniutils.c" -o "${tmp}/netbench"
+
+ip tuntap add "${tap}" mode tap
+ip addr add "${host_ip}/24" dev "${tap}"
+ip link set "${tap}" up
+
+# run_case NAME VMM-ARGS...: boot the guest, start the echo server, measure
+run_case() {
+  local name="$1"
+  shift
+  local log="${tmp}/${name}.log"
+
+  mkfifo "${tmp}/console"
+  "${repo_root}/kvm-vmm" --linux "${bzimage}" --initrd "${repo_root}/netbench.cpio" \
+    --cmdline "console=ttyS0 quiet" "$@" <"${tmp}/console" >"${log}" 2>&1 &
+  vmm_pid=$!
+  exec 3>"${tmp}/console"
+
+  for _ in $(seq 120); do
+    grep -q "starting /bin/sh" "${log}" && break
+    sleep 0.5
+  done
+  echo "netbench serve ${guest_ip} ${port}" >&3
+
+  for _ in $(seq 60); do
+    "${tmp}/netbench" ping "${guest_ip}" "${port}" 1 >/dev/null 2>&1 && break
+    sleep 0.5
+  done
+
+  echo "== ${name}"
+  "${tmp}/netbench" ping "${guest_ip}" "${port}" 10000
+  "${tmp}/netbench" stream "${guest_ip}" "${port}" "${seconds}"
+
+  exec 3>&-
+  kill "${vmm_pid}" 2>/dev/null || true
+  wait "${vmm_pid}" 2>/dev/null || true
+  vmm_pid=""
+  rm -f "${tmp}/console"
+}
+
+run_case "userspace (virtio-net -> switch -> tap)" --virtio-net --net-tap "${tap}"